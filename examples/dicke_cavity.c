@@ -0,0 +1,84 @@
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dicke.h"
+#include "dm_utilities.h"
+#include "output.h"
+#include "petsc.h"
+
+/*
+ * This example couples an ensemble of identical two-level emitters,
+ * all initially excited, to a lossy cavity (Tavis-Cummings), with local
+ * spontaneous emission and dephasing of each emitter. The ensemble is
+ * kept in the permutationally symmetric (Dicke) basis, so 50 emitters
+ * take O(50^3) elements instead of 4^50.
+ *
+ * Run with, for example,
+ *     mpiexec -np 8 ./dicke_cavity -num_emitters 50 -num_cavity 10
+ */
+
+operator a,ens;
+
+int main(int argc,char **args){
+  PetscInt num_emitters,num_cavity,steps_max;
+  double   wc,wa,g,kappa,gamma,gamma_phi,dt,time_max;
+  Vec      rho;
+
+  QuaC_initialize(argc,args);
+
+  num_emitters = 20;
+  num_cavity   = 10;
+  PetscOptionsGetInt(NULL,NULL,"-num_emitters",&num_emitters,NULL);
+  PetscOptionsGetInt(NULL,NULL,"-num_cavity",&num_cavity,NULL);
+
+  wc        = 1.0*2*M_PI;
+  wa        = 1.0*2*M_PI;
+  g         = 0.01*2*M_PI;
+  kappa     = 0.1;
+  gamma     = 0.001;
+  gamma_phi = 0.005;
+
+  create_op(num_cavity,&a);
+  create_dicke(num_emitters,&ens);
+
+  /* H = wc a^t a + wa (J_z + N/2) + g (a^t J_- + a J_+) */
+  add_to_ham(wc,a->n);
+  add_to_ham(wa,ens->n);
+  add_to_ham_p(g,2,a->dag,ens);
+  add_to_ham_p(g,2,a,ens->dag);
+
+  add_lin(kappa,a);
+  /* Each emitter decays and dephases on its own */
+  add_lin_local(gamma,ens);
+  add_lin_local(gamma_phi,ens->sig_z);
+
+  create_full_dm(&rho);
+  set_initial_pop(a,0);
+  set_initial_pop(ens,num_emitters);
+  set_dm_from_initial_pop(rho);
+
+  /*
+   * Record <a^t a>, <J_z + N/2> and <J_+ J_-> (the collective emission
+   * rate) at t = 0, 1, ..., 100 into dicke_cavity.bin;
+   * tools/output_to_text converts it to text
+   */
+  add_output_expectation("n_cavity",1,a->n);
+  add_output_expectation("n_ens",1,ens->n);
+  add_output_expectation("jp_jm",2,ens->dag,ens);
+  open_output("dicke_cavity.bin");
+  set_output_grid(0.0,1.0,101);
+  set_ts_monitor(ts_monitor_output);
+  time_max  = 100;
+  dt        = 0.01;
+  steps_max = 1000000;
+  time_step(rho,0.0,time_max,dt,steps_max);
+  close_output();
+
+  destroy_dm(rho);
+  destroy_op(&a);
+  destroy_op(&ens);
+  QuaC_finalize();
+  return 0;
+}
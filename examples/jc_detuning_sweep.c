@@ -0,0 +1,86 @@
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "petsc.h"
+
+/*
+ * This example computes the transmission spectrum of a weakly driven
+ * Jaynes-Cummings system: the steady state cavity population as the
+ * drive is swept across the cavity and emitter resonances, in the frame
+ * of the drive. The detuning is added as a "time" dependent term, whose
+ * coefficient steady_state_sweep evaluates at each detuning.
+ *
+ * Run with, for example,
+ *     mpiexec -np 4 ./jc_detuning_sweep -num_points 401 -sweep_pc_lag_factor 3
+ */
+
+double detuning(double);
+PetscErrorCode sweep_monitor(PetscInt,PetscReal,Vec,void*);
+operator a,sm;
+
+int main(int argc,char **args){
+  PetscInt  num_cavity,num_points,i;
+  PetscReal *detunings,max_detuning;
+  double    g,kappa,gamma,drive;
+  Vec       rho;
+
+  QuaC_initialize(argc,args);
+
+  num_cavity   = 10;
+  num_points   = 201;
+  max_detuning = 0.3;
+  PetscOptionsGetInt(NULL,NULL,"-num_cavity",&num_cavity,NULL);
+  PetscOptionsGetInt(NULL,NULL,"-num_points",&num_points,NULL);
+  PetscOptionsGetReal(NULL,NULL,"-max_detuning",&max_detuning,NULL);
+
+  g     = 0.1;
+  kappa = 0.02;
+  gamma = 0.005;
+  drive = 0.002;
+
+  create_op(num_cavity,&a);
+  create_op(2,&sm);
+
+  /* H = d (a^t a + sm^t sm) + g (a^t sm + a sm^t) + drive (a + a^t) */
+  add_to_ham_time_dep(detuning,1,a->n);
+  add_to_ham_time_dep(detuning,1,sm->n);
+  add_to_ham_mult2(g,a->dag,sm);
+  add_to_ham_mult2(g,a,sm->dag);
+  add_to_ham(drive,a);
+  add_to_ham(drive,a->dag);
+
+  add_lin(kappa,a);
+  add_lin(gamma,sm);
+
+  detunings = malloc(num_points*sizeof(PetscReal));
+  for (i=0;i<num_points;i++){
+    detunings[i] = -max_detuning + 2*max_detuning*i/PetscMax(num_points-1,1);
+  }
+
+  create_full_dm(&rho);
+  steady_state_sweep(rho,num_points,detunings,sweep_monitor,NULL);
+
+  free(detunings);
+  destroy_dm(rho);
+  destroy_op(&a);
+  destroy_op(&sm);
+  QuaC_finalize();
+  return 0;
+}
+
+double detuning(double d){
+  return d;
+}
+
+PetscErrorCode sweep_monitor(PetscInt k,PetscReal d,Vec rho,void *ctx){
+  PetscScalar n_cavity;
+
+  get_expectation_value(rho,&n_cavity,1,a->n);
+  if (nid==0){
+    printf("%e %e\n",d,PetscRealPart(n_cavity));
+  }
+  return 0;
+}
@@ -0,0 +1,175 @@
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "kron_pc.h"
+#include "petsc.h"
+
+/*
+ * This example compares the steady state solve with the default ASM
+ * preconditioner and with the Kronecker preconditioner
+ * (set_kron_preconditioner), on two models: the phonon cooling model of
+ * rpurcell.c, and the plasmon and quantum dots of qd_plasmon.c, with a
+ * constant drive instead of the pulse (which has no steady state).
+ * steady_state prints the GMRES iterations of each solve; the solve
+ * times and the difference in the populations are printed at the end.
+ * The Kronecker preconditioner runs on a single rank. The first column is
+ * the preconditioner of -pc_type (ASM by default); its numbers depend on
+ * the PETSc build and the number of ranks, so none are quoted here.
+ *
+ * Run with, for example,
+ *     ./kron_pc_benchmark -num_phonon 40 -num_plasmon 10
+ */
+
+void run_rpurcell(PetscInt,double**,int*,PetscLogDouble*);
+void run_qd_plasmon(PetscInt,double**,int*,PetscLogDouble*);
+
+int main(int argc,char **args){
+  PetscInt       num_phonon,num_plasmon;
+  PetscLogDouble solve_time[2][2];
+  double         *populations[2][2],max_diff[2];
+  int            num_pop[2],i,kron,model;
+  char           pc_type[32] = "asm";
+
+  QuaC_initialize(argc,args);
+
+  num_phonon  = 20;
+  num_plasmon = 6;
+  PetscOptionsGetInt(NULL,NULL,"-num_phonon",&num_phonon,NULL);
+  PetscOptionsGetInt(NULL,NULL,"-num_plasmon",&num_plasmon,NULL);
+  PetscOptionsGetString(NULL,NULL,"-pc_type",pc_type,32,NULL);
+
+  /* The preconditioner cannot be switched back, so ASM goes first */
+  for (kron=0;kron<2;kron++){
+    if (kron) {
+      set_kron_preconditioner();
+    }
+    run_rpurcell(num_phonon,&populations[0][kron],&num_pop[0],&solve_time[0][kron]);
+    run_qd_plasmon(num_plasmon,&populations[1][kron],&num_pop[1],&solve_time[1][kron]);
+  }
+
+  if (nid==0){
+    for (model=0;model<2;model++){
+      max_diff[model] = 0;
+      for (i=0;i<num_pop[model];i++){
+        if (fabs(populations[model][0][i]-populations[model][1][i])>max_diff[model]){
+          max_diff[model] = fabs(populations[model][0][i]-populations[model][1][i]);
+        }
+      }
+    }
+    printf("\n              %s solve (s)  Kronecker solve (s)  max population difference\n",pc_type);
+    printf("rpurcell      %e   %e         %e\n",solve_time[0][0],solve_time[0][1],max_diff[0]);
+    printf("qd_plasmon    %e   %e         %e\n",solve_time[1][0],solve_time[1][1],max_diff[1]);
+  }
+
+  for (model=0;model<2;model++){
+    free(populations[model][0]);
+    free(populations[model][1]);
+  }
+  QuaC_finalize();
+  return 0;
+}
+
+/*
+ * run_rpurcell solves for the steady state of the model of rpurcell.c
+ * (with its default parameters), and returns the populations and the
+ * time steady_state took.
+ */
+void run_rpurcell(PetscInt num_phonon,double **populations,int *num_pop,PetscLogDouble *solve_time){
+  operator       a,nv;
+  Vec            rho;
+  PetscLogDouble t0,t1;
+  double         MHz,w_m,lambda_s,gamma_eff,gamma_res,N_th;
+
+  MHz       = 1.0;
+  N_th      = 5;
+  w_m       = 175*MHz*2*M_PI;
+  lambda_s  = 0.1*MHz*2*M_PI;
+  gamma_eff = lambda_s;
+  gamma_res = lambda_s;
+
+  create_op(num_phonon,&a);
+  create_op(2,&nv);
+
+  add_to_ham(w_m,a->n);
+  add_to_ham(w_m,nv->n);
+  add_to_ham_mult2(lambda_s,nv->dag,a);
+  add_to_ham_mult2(lambda_s,nv,a->dag);
+
+  add_lin(gamma_eff,nv);
+  add_lin(gamma_res*(N_th+1),a);
+  add_lin(gamma_res*N_th,a->dag);
+
+  create_full_dm(&rho);
+  PetscTime(&t0);
+  steady_state(rho);
+  PetscTime(&t1);
+  *solve_time = t1 - t0;
+
+  *num_pop = get_num_populations();
+  (*populations) = malloc((*num_pop)*sizeof(double));
+  get_populations(rho,populations);
+
+  destroy_dm(rho);
+  destroy_op(&a);
+  destroy_op(&nv);
+  QuaC_clear();
+  return;
+}
+
+/*
+ * run_qd_plasmon solves for the steady state of the model of
+ * qd_plasmon.c, driven at a constant strength, and returns the
+ * populations and the time steady_state took.
+ */
+void run_qd_plasmon(PetscInt num_plasmon,double **populations,int *num_pop,PetscLogDouble *solve_time){
+  operator       a,qd[2];
+  Vec            rho;
+  PetscLogDouble t0,t1;
+  double         eV,omega,gamma_di,gamma_s,g_couple[2],drive;
+  int            i;
+
+  eV          = 1/27.21140;
+  omega       = 2.05*eV;
+  gamma_di    = 2.0e-3*eV;
+  gamma_s     = 186e-3*eV;
+  g_couple[0] = 12.8e-3*eV;
+  g_couple[1] = 24.9e-3*eV;
+  drive       = 10e-3*eV;
+
+  for (i=0;i<2;i++){
+    create_op(2,&qd[i]);
+  }
+  create_op(num_plasmon,&a);
+
+  add_to_ham(omega,a->n);
+  for (i=0;i<2;i++){
+    add_to_ham(omega,qd[i]->n);
+    add_to_ham_mult2(g_couple[i],qd[i]->dag,a);
+    add_to_ham_mult2(g_couple[i],qd[i],a->dag);
+    add_lin(gamma_di,qd[i]->n);
+  }
+  add_lin(gamma_s,a);
+  add_to_ham(drive,a);
+  add_to_ham(drive,a->dag);
+
+  create_full_dm(&rho);
+  PetscTime(&t0);
+  steady_state(rho);
+  PetscTime(&t1);
+  *solve_time = t1 - t0;
+
+  *num_pop = get_num_populations();
+  (*populations) = malloc((*num_pop)*sizeof(double));
+  get_populations(rho,populations);
+
+  destroy_dm(rho);
+  destroy_op(&a);
+  for (i=0;i<2;i++){
+    destroy_op(&qd[i]);
+  }
+  QuaC_clear();
+  return;
+}
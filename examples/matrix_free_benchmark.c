@@ -0,0 +1,130 @@
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "petsc.h"
+
+/*
+ * This example compares the assembled and matrix-free Lindblad solvers.
+ * The same Jaynes-Cummings-like model (a cavity coupled to several
+ * qubits, with cavity loss and qubit decay and dephasing) is time stepped
+ * twice; once with the assembled full_A and once with set_matrix_free.
+ * Setup time, solve time, memory, and the difference in the final
+ * populations are printed.
+ *
+ * Run with, for example,
+ *     mpiexec -np 4 ./matrix_free_benchmark -num_cavity 20 -num_qubits 3
+ */
+
+void run_model(int,PetscInt,PetscInt,double**,int*,PetscLogDouble*,PetscLogDouble*,PetscLogDouble*);
+
+int main(int argc,char **args){
+  PetscInt       num_cavity,num_qubits;
+  PetscLogDouble setup_time[2],solve_time[2],mem[2];
+  double         *populations[2],max_diff;
+  int            num_pop,i,matrix_free;
+
+  QuaC_initialize(argc,args);
+
+  num_cavity = 10;
+  num_qubits = 2;
+  PetscOptionsGetInt(NULL,NULL,"-num_cavity",&num_cavity,NULL);
+  PetscOptionsGetInt(NULL,NULL,"-num_qubits",&num_qubits,NULL);
+
+  for (matrix_free=0;matrix_free<2;matrix_free++){
+    run_model(matrix_free,num_cavity,num_qubits,&populations[matrix_free],&num_pop,
+              &setup_time[matrix_free],&solve_time[matrix_free],&mem[matrix_free]);
+  }
+
+  if (nid==0){
+    max_diff = 0;
+    for (i=0;i<num_pop;i++){
+      if (fabs(populations[0][i]-populations[1][i])>max_diff){
+        max_diff = fabs(populations[0][i]-populations[1][i]);
+      }
+    }
+    printf("\n              setup (s)    solve (s)    memory (MB, rank 0)\n");
+    printf("assembled     %e %e %e\n",setup_time[0],solve_time[0],mem[0]/1e6);
+    printf("matrix-free   %e %e %e\n",setup_time[1],solve_time[1],mem[1]/1e6);
+    printf("Max difference in final populations: %e\n",max_diff);
+  }
+
+  free(populations[0]);
+  free(populations[1]);
+  QuaC_finalize();
+  return 0;
+}
+
+/*
+ * run_model builds and time steps the model, in either assembled (0) or
+ * matrix-free (1) mode, and returns the final populations and timings.
+ */
+void run_model(int matrix_free,PetscInt num_cavity,PetscInt num_qubits,double **populations,
+               int *num_pop,PetscLogDouble *setup_time,PetscLogDouble *solve_time,PetscLogDouble *mem){
+  operator       a,*qubits;
+  Vec            rho;
+  PetscInt       i;
+  PetscLogDouble t0,t1,t2,mem0;
+  double         wc,wa,g,kappa,gamma,dep;
+
+  wc    = 1.0*2*M_PI;
+  wa    = 1.0*2*M_PI;
+  g     = 0.05*2*M_PI;
+  kappa = 0.005;
+  gamma = 0.05;
+  dep   = 0.01;
+
+  PetscMemoryGetCurrentUsage(&mem0);
+  PetscTime(&t0);
+
+  create_op(num_cavity,&a);
+  qubits = malloc(num_qubits*sizeof(operator));
+  for (i=0;i<num_qubits;i++){
+    create_op(2,&qubits[i]);
+  }
+  if (matrix_free) {
+    set_matrix_free();
+  }
+
+  add_to_ham(wc,a->n);
+  for (i=0;i<num_qubits;i++){
+    add_to_ham(wa,qubits[i]->n);
+    add_to_ham_mult2(g,qubits[i],a->dag);
+    add_to_ham_mult2(g,qubits[i]->dag,a);
+  }
+
+  add_lin(kappa,a);
+  for (i=0;i<num_qubits;i++){
+    add_lin(gamma,qubits[i]);
+    add_lin(dep,qubits[i]->n);
+  }
+
+  create_full_dm(&rho);
+  set_initial_pop(a,1);
+  set_initial_pop(qubits[0],1);
+  set_dm_from_initial_pop(rho);
+
+  PetscTime(&t1);
+  time_step(rho,0.0,10.0,0.01,1000);
+  PetscTime(&t2);
+
+  PetscMemoryGetCurrentUsage(mem);
+  *mem        = *mem - mem0;
+  *setup_time = t1 - t0;
+  *solve_time = t2 - t1;
+
+  *num_pop = get_num_populations();
+  (*populations) = malloc((*num_pop)*sizeof(double));
+  get_populations(rho,populations);
+
+  destroy_dm(rho);
+  destroy_op(&a);
+  for (i=0;i<num_qubits;i++){
+    destroy_op(&qubits[i]);
+  }
+  free(qubits);
+  QuaC_clear();
+  return;
+}
@@ -0,0 +1,84 @@
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "trajectory.h"
+#include "petsc.h"
+
+/*
+ * This example solves a damped Jaynes-Cummings model with the
+ * Monte Carlo wavefunction (quantum trajectory) solver and prints the
+ * trajectory averaged cavity and qubit populations.
+ *
+ * Run with, for example,
+ *     mpiexec -np 8 ./mcwf_jc -num_traj 400 -num_cavity 20
+ * Add -mcwf_ranks_per_traj 2 to spread each trajectory over two ranks.
+ */
+
+int main(int argc,char **args){
+  operator    a,qubit;
+  Vec         psi;
+  PetscInt    num_cavity,num_traj,num_out,i;
+  PetscScalar **observables;
+  double      wc,wa,g,kappa,gamma;
+
+  QuaC_initialize(argc,args);
+
+  num_cavity = 10;
+  num_traj   = 100;
+  num_out    = 20;
+  PetscOptionsGetInt(NULL,NULL,"-num_cavity",&num_cavity,NULL);
+  PetscOptionsGetInt(NULL,NULL,"-num_traj",&num_traj,NULL);
+  PetscOptionsGetInt(NULL,NULL,"-num_out",&num_out,NULL);
+
+  wc    = 1.0*2*M_PI;
+  wa    = 1.0*2*M_PI;
+  g     = 0.05*2*M_PI;
+  kappa = 0.005;
+  gamma = 0.05;
+
+  create_op(num_cavity,&a);
+  create_op(2,&qubit);
+  /* The trajectory solver uses the N x N operators of the matrix-free solver */
+  set_matrix_free();
+
+  add_to_ham(wc,a->n);
+  add_to_ham(wa,qubit->n);
+  add_to_ham_mult2(g,qubit,a->dag);
+  add_to_ham_mult2(g,qubit->dag,a);
+
+  add_lin(kappa,a);
+  add_lin(gamma,qubit);
+
+  add_mcwf_observable(1,a->n);
+  add_mcwf_observable(1,qubit->n);
+
+  create_psi(&psi);
+  set_initial_pop(a,1);
+  set_initial_pop(qubit,0);
+  set_psi_from_initial_pop(psi);
+
+  observables    = malloc(2*sizeof(PetscScalar*));
+  observables[0] = malloc(num_out*sizeof(PetscScalar));
+  observables[1] = malloc(num_out*sizeof(PetscScalar));
+
+  mcwf_time_step(psi,0.0,50.0,0.01,100000,num_traj,num_out,observables);
+
+  if (nid==0){
+    printf("time  <n_cavity>  <n_qubit>\n");
+    for (i=0;i<num_out;i++){
+      printf("%e %e %e\n",(i+1)*50.0/num_out,PetscRealPart(observables[0][i]),
+             PetscRealPart(observables[1][i]));
+    }
+  }
+
+  free(observables[0]);
+  free(observables[1]);
+  free(observables);
+  VecDestroy(&psi);
+  destroy_op(&a);
+  destroy_op(&qubit);
+  QuaC_finalize();
+  return 0;
+}
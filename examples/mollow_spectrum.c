@@ -0,0 +1,64 @@
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "petsc.h"
+
+/*
+ * This example computes the resonance fluorescence (Mollow triplet)
+ * spectrum of a strongly driven two level system, in the frame of the
+ * drive, directly in frequency space with correlation_spectrum.
+ *
+ * Run with, for example,
+ *     mpiexec -np 2 ./mollow_spectrum -num_omega 801 -spectrum_krylov_max 100
+ */
+
+int main(int argc,char **args){
+  PetscInt  num_omega,i;
+  PetscReal *omega,*spectrum,max_omega;
+  double    gamma,rabi;
+  operator  sm;
+  Vec       rho;
+
+  QuaC_initialize(argc,args);
+
+  num_omega = 401;
+  max_omega = 5.0;
+  PetscOptionsGetInt(NULL,NULL,"-num_omega",&num_omega,NULL);
+  PetscOptionsGetReal(NULL,NULL,"-max_omega",&max_omega,NULL);
+
+  gamma = 0.2;
+  rabi  = 2.0;
+
+  create_op(2,&sm);
+
+  /* H = rabi/2 (sm + sm^t) */
+  add_to_ham(rabi/2,sm);
+  add_to_ham(rabi/2,sm->dag);
+  add_lin(gamma,sm);
+
+  create_full_dm(&rho);
+  steady_state(rho);
+
+  omega = malloc(num_omega*sizeof(PetscReal));
+  for (i=0;i<num_omega;i++){
+    omega[i] = -max_omega + 2*max_omega*i/PetscMax(num_omega-1,1);
+  }
+
+  /* Emission spectrum: <sm^t(tau) sm(0)> */
+  correlation_spectrum(&spectrum,rho,num_omega,omega,1,&sm,1,&sm->dag);
+  if (nid==0){
+    for (i=0;i<num_omega;i++){
+      printf("%e %e\n",omega[i],spectrum[i]);
+    }
+  }
+
+  free(omega);
+  free(spectrum);
+  destroy_dm(rho);
+  destroy_op(&sm);
+  QuaC_finalize();
+  return 0;
+}
@@ -21,6 +21,7 @@ int main(int argc,char **args){
   PetscReal time_max,dt,*gamma_1,*gamma_2;
   PetscScalar mat_val;
   PetscInt  steps_max,num_qubits;
+  PetscLogDouble solve_start,solve_end;
   int i;
   Vec rho;
   circuit projectq_read;
@@ -73,8 +74,12 @@ int main(int argc,char **args){
   dt        = 0.01;
   steps_max = 1000;
 
-  /* Set the ts_monitor to print results at each time step, if desired */
-  set_ts_monitor(ts_monitor);
+  /*
+   * Set the ts_monitor to print results at each time step, if desired.
+   * It is off, as it prints nothing, and a ts_monitor makes
+   * -circuit_segments integrate between the gates even without noise.
+   */
+  /* set_ts_monitor(ts_monitor); */
   /* Open file that we will print to in ts_monitor */
   if (nid==0){
     f_pop = fopen("pop","w");
@@ -93,7 +98,14 @@ int main(int argc,char **args){
   //Start out circuit at time 0.0, first gate will be at 1.0
   start_circuit_at_time(&projectq_read,0.0);
   //Run the evolution, with error and with the circuit
+  /*
+   * Run with -circuit_segments to apply the gates with the segment
+   * scheduler instead of TS events, and compare the solve times
+   */
+  PetscTime(&solve_start);
   time_step(rho,0.0,time_max,dt,steps_max);
+  PetscTime(&solve_end);
+  if (nid==0) printf("Solve time: %e\n",solve_end-solve_start);
 
   //Clean up memory
   for (i=0;i<num_qubits;i++){
@@ -124,8 +124,12 @@ int main(int argc,char **args){
   dt        = 1;
   steps_max = 10000000;
 
-  /* Set the ts_monitor to print results at each time step */
-  set_ts_monitor(ts_monitor);
+  /*
+   * Set the ts_monitor to print results at each time step, if desired.
+   * It is off, as it prints nothing, and a ts_monitor makes
+   * -circuit_segments integrate between the gates even without noise.
+   */
+  /* set_ts_monitor(ts_monitor); */
   /* Open file that we will print to in ts_monitor */
   if (nid==0){
     f_pop = fopen("pop","w");
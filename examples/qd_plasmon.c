@@ -22,7 +22,7 @@ int main(int argc,char **args){
   double eV,debye,fluence=500,c_speed,eesu_per_au,tmp_doub,eps_med;
   PetscReal time_max,dt;
   PetscScalar val;
-  PetscInt  steps_max;
+  PetscInt  steps_max,num_output;
   PetscInt num_plasmon=2,num_qd=2,i;
   Vec      rho;
   /* Initialize QuaC */
@@ -125,6 +125,12 @@ int main(int argc,char **args){
 
   /* Set the ts_monitor to print results at each time step */
   set_ts_monitor(ts_monitor);
+  /* Or only at num_output evenly spaced times, if asked for */
+  num_output = 0;
+  PetscOptionsGetInt(NULL,NULL,"-num_output",&num_output,NULL);
+  if (num_output>1){
+    set_output_grid(0.0,time_max/(num_output-1),num_output);
+  }
   /* Open file that we will print to in ts_monitor */
   if (nid==0){
     f_fid = fopen("fid","w");
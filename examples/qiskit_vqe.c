@@ -25,6 +25,7 @@ int main(int argc,char **args){
   PetscReal gate_time_step,theta,fidelity,t1,t2;
   PetscScalar mat_val;
   PetscInt  steps_max,num_qubits;
+  PetscLogDouble solve_start,solve_end;
   Vec rho,rho_base,rho_base2,rho_base3;
   int i,j,h_dim,system,dm_place,logical_qubits,prev_qb,prev_qb2,num_qubits2;
   circuit qiskit_read;
@@ -84,8 +85,12 @@ int main(int argc,char **args){
   dt        = 1;
   steps_max = 10000000;
 
-  /* Set the ts_monitor to print results at each time step */
-  set_ts_monitor(ts_monitor);
+  /*
+   * Set the ts_monitor to print results at each time step, if desired.
+   * It is off, as it prints nothing, and a ts_monitor makes
+   * -circuit_segments integrate between the gates even without noise.
+   */
+  /* set_ts_monitor(ts_monitor); */
   /* Open file that we will print to in ts_monitor */
   if (nid==0){
     f_pop = fopen("pop","w");
@@ -103,7 +108,14 @@ int main(int argc,char **args){
 
   start_circuit_at_time(&qiskit_read,0.0);
 
+  /*
+   * Run with -circuit_segments to apply the gates with the segment
+   * scheduler instead of TS events, and compare the solve times
+   */
+  PetscTime(&solve_start);
   time_step(rho,0.0,time_max,dt,steps_max);
+  PetscTime(&solve_end);
+  if (nid==0) printf("Solve time: %e\n",solve_end-solve_start);
   /* get_expectation_value(rho,&mat_val,2,qubits[0]->sig_z,qubits[0]->sig_z); */
   qiskit_vqe_get_expectation(filename,rho,&mat_val);
 
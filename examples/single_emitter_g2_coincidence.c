@@ -22,7 +22,7 @@ PetscReal **g2_values_2d;
 int main(int argc,char **args){
   PetscReal gamma,dep,st_dt,st_max,previous_start_time,this_start_time;
   PetscReal dt,tau_t_max,tau_max,dt_tau,ave,ave2,total_pe;
-  PetscScalar val,pe_l;
+  PetscScalar val,pe_l,**g2_corr,**pe_corr;
   PetscInt  steps_max,n_st,n_tau,i;
   Vec dm0,init_dm;
   PetscBool run_fl = PETSC_FALSE,print_map = PETSC_FALSE;
@@ -108,40 +108,29 @@ int main(int argc,char **args){
     printf("fl: %e\n",total_pe/i_st);
 
   } else {
-    //Starting from 0, we time step to the next 'start time' to get the
-    //Initial dm for our tau sweep
-    st_dt = st_max/n_st;
-    previous_start_time = 0;
+    //All start times and taus are propagated together by
+    //two_time_correlation. g2(t,tau) = <qd^t(t) n(t+tau) qd(t)>, which is
+    //pe times <n> after forcing an emission at t
+    st_dt  = st_max/n_st;
+    dt_tau = tau_max/n_tau;
+    total_pe = 0;
+    two_time_correlation(&g2_corr,dm0,0,n_st,st_dt,st_dt,n_tau+1,dt_tau,1,&qd->dag,1,&qd->n,1,&qd);
+    //<n>(t) at each start time
+    two_time_correlation(&pe_corr,dm0,0,n_st,st_dt,st_dt,1,st_dt,0,NULL,1,&qd->n,0,NULL);
     i_st = 0;
     for (i_g2=0;i_g2<n_tau+1;i_g2++){
       g2_values_2d[i_st][i_g2] = 0.0;
     }
-    i_st = i_st + 1;
-    for (this_start_time=st_dt;this_start_time<=st_max;this_start_time+=st_dt){
-      //Go from previous start time to this_start_time
-      tau_evolve = 0;
-      dt = (this_start_time - previous_start_time)/2000;
-      time_step(dm0,previous_start_time,this_start_time,dt,steps_max);
-      //Copy the timestepped dm into our init_dm for tau sweep
-      VecCopy(dm0,init_dm);
-      //Get the expectation value of q->dag q for this init_dm
-      get_expectation_value(init_dm,&pe_l,1,qd->n);
-      pe = PetscRealPart(pe_l);
-      total_pe = total_pe + pe;
-      //Force an emission
-      measure_dm(init_dm,qd);
-      //Timestep through taus
-      tau_t_max = this_start_time + tau_max;
-      dt_tau = (tau_t_max - this_start_time)/n_tau;
-      tau_evolve = 1;
-      i_tau = 0;
-      time_step(init_dm,this_start_time,tau_t_max,dt_tau,steps_max);
-      previous_start_time = this_start_time;
-      i_st = i_st + 1;
-      /* if(i_g2>250){ */
-      /*   return 0; */
-      /* } */
+    for (i_st=1;i_st<n_st+1;i_st++){
+      total_pe = total_pe + PetscRealPart(pe_corr[i_st-1][0]);
+      for (i_tau=0;i_tau<n_tau+1;i_tau++){
+        g2_values_2d[i_st][i_tau] = PetscRealPart(g2_corr[i_st-1][i_tau]);
+      }
+      free(g2_corr[i_st-1]);
+      free(pe_corr[i_st-1]);
     }
+    free(g2_corr);
+    free(pe_corr);
     //Calculate average of g2
     ave2 = 0;
     for (i_st=0;i_st<(n_st+1);i_st++){
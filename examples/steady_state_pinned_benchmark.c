@@ -0,0 +1,104 @@
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "petsc.h"
+
+/*
+ * This example compares the steady state solve with the dense trace row
+ * (the default) and with the ground state pinned (set_steady_state_pinned),
+ * on the phonon cooling model of rpurcell.c. steady_state prints the GMRES
+ * iterations and the KSP solve time of each solve; the total times and
+ * the difference in the populations are printed at the end. The trace row
+ * is a hot spot on many ranks, so this is meant to be run on 16 or more,
+ * with a large cavity, for example
+ *     mpiexec -n 16 ./steady_state_pinned_benchmark -num_phonon 200
+ * -ksp_type and -pc_type switch the solver of both solves.
+ */
+
+void run_rpurcell(PetscInt,double**,int*,PetscLogDouble*);
+
+int main(int argc,char **args){
+  PetscInt       num_phonon;
+  PetscLogDouble solve_time[2];
+  double         *populations[2],max_diff;
+  int            num_pop,i,pinned;
+
+  QuaC_initialize(argc,args);
+
+  num_phonon = 20;
+  PetscOptionsGetInt(NULL,NULL,"-num_phonon",&num_phonon,NULL);
+
+  /* Pinning cannot be switched back, so the trace row goes first */
+  for (pinned=0;pinned<2;pinned++){
+    if (pinned) {
+      set_steady_state_pinned(0);
+    }
+    run_rpurcell(num_phonon,&populations[pinned],&num_pop,&solve_time[pinned]);
+  }
+
+  if (nid==0){
+    max_diff = 0;
+    for (i=0;i<num_pop;i++){
+      if (fabs(populations[0][i]-populations[1][i])>max_diff){
+        max_diff = fabs(populations[0][i]-populations[1][i]);
+      }
+    }
+    printf("\nranks %d  trace row (s) %e  pinned (s) %e  max population difference %e\n",
+           np,solve_time[0],solve_time[1],max_diff);
+  }
+
+  free(populations[0]);
+  free(populations[1]);
+  QuaC_finalize();
+  return 0;
+}
+
+/*
+ * run_rpurcell solves for the steady state of the model of rpurcell.c
+ * (with its default parameters), and returns the populations and the
+ * time steady_state took.
+ */
+void run_rpurcell(PetscInt num_phonon,double **populations,int *num_pop,PetscLogDouble *solve_time){
+  operator       a,nv;
+  Vec            rho;
+  PetscLogDouble t0,t1;
+  double         MHz,w_m,lambda_s,gamma_eff,gamma_res,N_th;
+
+  MHz       = 1.0;
+  N_th      = 5;
+  w_m       = 175*MHz*2*M_PI;
+  lambda_s  = 0.1*MHz*2*M_PI;
+  gamma_eff = lambda_s;
+  gamma_res = lambda_s;
+
+  create_op(num_phonon,&a);
+  create_op(2,&nv);
+
+  add_to_ham(w_m,a->n);
+  add_to_ham(w_m,nv->n);
+  add_to_ham_mult2(lambda_s,nv->dag,a);
+  add_to_ham_mult2(lambda_s,nv,a->dag);
+
+  add_lin(gamma_eff,nv);
+  add_lin(gamma_res*(N_th+1),a);
+  add_lin(gamma_res*N_th,a->dag);
+
+  create_full_dm(&rho);
+  PetscTime(&t0);
+  steady_state(rho);
+  PetscTime(&t1);
+  *solve_time = t1 - t0;
+
+  *num_pop = get_num_populations();
+  (*populations) = malloc((*num_pop)*sizeof(double));
+  get_populations(rho,populations);
+
+  destroy_dm(rho);
+  destroy_op(&a);
+  destroy_op(&nv);
+  QuaC_clear();
+  return;
+}
@@ -8,27 +8,20 @@
 #include "quantum_gates.h"
 #include "petsc.h"
 
-PetscErrorCode ts_monitor(TS,PetscInt,PetscReal,Vec,void*);
 double pulse1(double);
 double pulse2(double);
 
-/* Declared globally so that we can access this in ts_monitor */
-FILE *f_pop;
-operator qd1,qd2;
 double amp1,amp2,tp,td,u_qd,we1,we2,we_p,td2;
-PetscScalar pe;
-PetscInt i_g2,i_st,i_tau;
-int tau_evolve;
-PetscScalar **g2_values_2d_b,**g2_values_2d_1,**g2_values_2d_2;
 
 int main(int argc,char **args){
-  PetscReal gamma,dep,st_dt,st_max,previous_start_time,this_start_time;
-  PetscReal dt,tau_t_max,tau_max,dt_tau,ave,total_pe;
-  PetscScalar val,pe_l,ave1,ave2,aveb;
-  PetscInt  steps_max,n_st,n_tau,i,j;
-  Vec dm0,init_dm;
+  PetscReal gamma,dep,st_dt,st_max,tau_max,dt_tau,total_pe;
+  PetscScalar val,ave1,ave2,aveb;
+  PetscInt  n_st,n_tau,i,j,i_st,i_tau,x,y,b;
+  Vec dm0;
   PetscBool print_map = PETSC_FALSE;
   FILE *file1,*file2,*fileb;
+  operator qd1,qd2,qd[2],a_ops[1],b_ops[4][2],c_ops[1];
+  PetscScalar **corr,**pe,**g2_values_2d_b,**g2_values_2d_1,**g2_values_2d_2;
   /* Initialize QuaC */
   QuaC_initialize(argc,args);
 
@@ -40,6 +33,8 @@ int main(int argc,char **args){
   we1  = 0.0735;
   we2  = 0.0735;
   we_p = 0.0735;
+  n_tau = 4000; //was 2000
+  n_st = 4000; //was 2000
   PetscOptionsGetReal(NULL,NULL,"-td2",&td2,NULL);
   PetscOptionsGetReal(NULL,NULL,"-we1",&we1,NULL);
   PetscOptionsGetReal(NULL,NULL,"-we2",&we2,NULL);
@@ -47,6 +42,8 @@ int main(int argc,char **args){
   PetscOptionsGetReal(NULL,NULL,"-amp2",&amp2,NULL);
   PetscOptionsGetReal(NULL,NULL,"-gamma",&gamma,NULL);
   PetscOptionsGetReal(NULL,NULL,"-dep",&dep,NULL);
+  PetscOptionsGetInt(NULL,NULL,"-n_st",&n_st,NULL);
+  PetscOptionsGetInt(NULL,NULL,"-n_tau",&n_tau,NULL);
   PetscOptionsGetBool(NULL,NULL,"-map",&print_map,NULL);
 
   /* Define scalars to add to Ham */
@@ -54,9 +51,7 @@ int main(int argc,char **args){
   td = 1800;
   u_qd = 3.93;
 
-  n_tau = 4000; //was 2000
   tau_max = 7500;
-  n_st = 4000; //was 2000
   st_max = 7500;
 
   g2_values_2d_b = (PetscScalar **)malloc((n_st+1)*sizeof(PetscScalar *));
@@ -92,83 +87,60 @@ int main(int argc,char **args){
   add_lin(dep,qd2->n);
 
   create_full_dm(&dm0);
-  create_full_dm(&init_dm);
 
   val = 1.0;
   add_value_to_dm(dm0,0,0,val);
 
   assemble_dm(dm0);
-  assemble_dm(init_dm);
-
-  steps_max = 5100;
-  dt        = 0.025;
-
-  /* Set the ts_monitor to print results at each time step */
-  set_ts_monitor(ts_monitor);
-
-  //Starting from 0, we time step to the next 'start time' to get the
-  //Initial dm for our tau sweep
-  st_dt = st_max/n_st;
-  previous_start_time = 0;
-  i_st = 0;
-  i_st = i_st + 1;
-  for (this_start_time=st_dt;this_start_time<=st_max;this_start_time+=st_dt){
-    //Go from previous start time to this_start_time
-    tau_evolve = 0;
-    dt = (this_start_time - previous_start_time)/2000;
-    time_step(dm0,previous_start_time,this_start_time,dt,steps_max);
-
-    //Get the expectation value of q->dag q for this init_dm
-    get_expectation_value(dm0,&pe_l,1,qd1->n);
-    printf("pe_l1: %e %e\n",pe_l);
-    pe = pe_l;
-    get_expectation_value(dm0,&pe_l,1,qd2->n);
-    pe = pe + pe_l;
-    total_pe = total_pe + PetscRealPart(pe);
-
-    //Timestep through taus
-    tau_t_max = this_start_time + tau_max;
-    dt_tau = (tau_t_max - this_start_time)/n_tau;
-
-    /*
-     * Force an emission to get \sig_1 \rho \sig_1^\dag terms
-     */
-    tau_evolve = 1;
-    //Copy the timestepped dm into our init_dm for tau sweep
-    VecCopy(dm0,init_dm);
-    mult_dm_left_right(init_dm,qd1,qd1);
-    i_tau = 0;
-    time_step(init_dm,this_start_time,tau_t_max,dt_tau,steps_max);
-
-    /*
-     * Force an emission to get \sig_2 \rho \sig_2^\dag terms
-     */
-    tau_evolve = 2;
-    VecCopy(dm0,init_dm);
-    mult_dm_left_right(init_dm,qd2,qd2);
-    i_tau = 0;
-    time_step(init_dm,this_start_time,tau_t_max,dt_tau,steps_max);
 
-    /*
-     * Now get terms from \sig_1 \rho \sig_2^\dag
-     */
-    tau_evolve = 3;
-    VecCopy(dm0,init_dm);
-    mult_dm_left_right(init_dm,qd1,qd2);
-    i_tau = 0;
-    time_step(init_dm,this_start_time,tau_t_max,dt_tau,steps_max);
-
-    /*
-     * Now get terms from \sig_2 \rho \sig_1^\dag
-     */
-    tau_evolve = 3;
-    VecCopy(dm0,init_dm);
-    mult_dm_left_right(init_dm,qd2,qd1);
-    i_tau = 0;
-    time_step(init_dm,this_start_time,tau_t_max,dt_tau,steps_max);
+  /*
+   * The start times are st_dt, 2 st_dt, ..., st_max; row 0 of the maps
+   * is left at zero. B = (sig_1 + sig_2)^dag (sig_1 + sig_2) is the sum of
+   * n_1, n_2, sig_1^dag sig_2 and sig_2^dag sig_1.
+   */
+  st_dt  = st_max/n_st;
+  dt_tau = tau_max/n_tau;
+  qd[0] = qd1;
+  qd[1] = qd2;
+  b_ops[0][0] = qd1->n;
+  b_ops[1][0] = qd2->n;
+  b_ops[2][0] = qd1->dag;
+  b_ops[2][1] = qd2;
+  b_ops[3][0] = qd2->dag;
+  b_ops[3][1] = qd1;
+
+  //Get the expectation value of n_1 + n_2 at each start time
+  total_pe = 0;
+  for (b=0;b<2;b++){
+    two_time_correlation(&pe,dm0,0.0,n_st,st_dt,st_dt,1,dt_tau,0,NULL,1,b_ops[b],0,NULL);
+    for (i_st=0;i_st<n_st;i_st++){
+      total_pe = total_pe + PetscRealPart(pe[i_st][0]);
+      free(pe[i_st]);
+    }
+    free(pe);
+  }
 
-    previous_start_time = this_start_time;
-    i_st = i_st + 1;
+  /*
+   * Force an emission to get the \sig_x \rho \sig_y^\dag terms, and sweep
+   * each over tau with each term of B
+   */
+  for (x=0;x<2;x++){
+    for (y=0;y<2;y++){
+      c_ops[0] = qd[x];
+      a_ops[0] = qd[y]->dag;
+      for (b=0;b<4;b++){
+        two_time_correlation(&corr,dm0,0.0,n_st,st_dt,st_dt,n_tau+1,dt_tau,1,a_ops,(b<2)?1:2,b_ops[b],1,c_ops);
+        for (i_st=0;i_st<n_st;i_st++){
+          for (i_tau=0;i_tau<n_tau+1;i_tau++){
+            g2_values_2d_b[i_st+1][i_tau] += corr[i_st][i_tau];
+            if (x==0&&y==0&&b==0) g2_values_2d_1[i_st+1][i_tau] = corr[i_st][i_tau];
+            if (x==1&&y==1&&b==1) g2_values_2d_2[i_st+1][i_tau] = corr[i_st][i_tau];
+          }
+          free(corr[i_st]);
+        }
+        free(corr);
+      }
+    }
   }
   //Calculate average of g2
   ave2 = 0;
@@ -186,7 +158,7 @@ int main(int argc,char **args){
   aveb = aveb/((n_tau+1)*(n_st+1));
 
 
-  printf("ave1: %e %e ave2: %e %e aveb: %e %e pe: %e\n",ave1,ave2,aveb,total_pe/i_st);
+  printf("ave1: %e %e ave2: %e %e aveb: %e %e pe: %e\n",ave1,ave2,aveb,total_pe/n_st);
 
   if (print_map){
     file1 = fopen("map1.dat","w");
@@ -204,10 +176,17 @@ int main(int argc,char **args){
     fclose(fileb);
   }
 
+  for (i=0;i<n_st+1;i++){
+    free(g2_values_2d_b[i]);
+    free(g2_values_2d_1[i]);
+    free(g2_values_2d_2[i]);
+  }
+  free(g2_values_2d_b);
+  free(g2_values_2d_1);
+  free(g2_values_2d_2);
   destroy_op(&qd1);
   destroy_op(&qd2);
   destroy_dm(dm0);
-  destroy_dm(init_dm);
   QuaC_finalize();
   return 0;
 }
@@ -227,35 +206,3 @@ double pulse2(double t){
   pulse_value = -u_qd * pulse_value;
   return pulse_value;
 }
-
-PetscErrorCode ts_monitor(TS ts,PetscInt step,PetscReal time,Vec dm,void *ctx){
-  PetscScalar ev1,ev2,ev3,ev4,tmp;
-  if (tau_evolve==1){
-    get_expectation_value(dm,&ev1,1,qd1->n);
-    get_expectation_value(dm,&ev2,1,qd2->n);
-    get_expectation_value(dm,&ev3,2,qd1->dag,qd2);
-    get_expectation_value(dm,&ev4,2,qd2->dag,qd1);
-    tmp =(ev1 + ev2 + ev3 + ev4);
-    g2_values_2d_b[i_st][i_tau] += tmp;
-    g2_values_2d_1[i_st][i_tau] += ev1;
-    i_tau = i_tau + 1;
-  } else if (tau_evolve==2){
-    get_expectation_value(dm,&ev1,1,qd1->n);
-    get_expectation_value(dm,&ev2,1,qd2->n);
-    get_expectation_value(dm,&ev3,2,qd1->dag,qd2);
-    get_expectation_value(dm,&ev4,2,qd2->dag,qd1);
-    tmp =(ev1 + ev2 + ev3 + ev4);
-    g2_values_2d_b[i_st][i_tau] += tmp;
-    g2_values_2d_2[i_st][i_tau] += ev2;
-    i_tau = i_tau + 1;
-  } else if (tau_evolve==3){
-    get_expectation_value(dm,&ev1,1,qd1->n);
-    get_expectation_value(dm,&ev2,1,qd2->n);
-    get_expectation_value(dm,&ev3,2,qd1->dag,qd2);
-    get_expectation_value(dm,&ev4,2,qd2->dag,qd1);
-    tmp =(ev1 + ev2 + ev3 + ev4);
-    g2_values_2d_b[i_st][i_tau] += tmp;
-    i_tau = i_tau + 1;
-  }
-  PetscFunctionReturn(0);
-}
@@ -0,0 +1,313 @@
+#include "checkpoint.h"
+#include "checkpoint_p.h"
+#include "quac_p.h"
+#include "operators_p.h"
+#include "solver.h"
+#include "quantum_gates.h"
+#include "rotating_frame_p.h"
+#include "symmetry_p.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Checkpoints of time_step. At the requested interval (and at the end of
+ * time_step), rho is written with VecView to a PETSc binary file through
+ * MPI-IO, so that every rank writes its own part and no rank gathers the
+ * state. Together with rho go the time, the step size the integrator will
+ * try next, the step number and the progress through the gates and
+ * circuits. The time dependent terms are functions of t only, so the time
+ * is all of their state. The file is written to <file>.tmp and then
+ * renamed, so the last complete checkpoint survives a crash while writing.
+ *
+ * rho is stored as the integrator sees it (in the rotating frame, if there
+ * is one, but always the full vector, also for a sector solve), so that
+ * time_step_restart continues with exactly the same state and step size.
+ * The file is in PETSc's natural ordering, and can be read on any number
+ * of ranks.
+ *
+ * Layout: PetscInt header[CHECKPOINT_NUM_INT], PetscInt current_gate of
+ * each circuit, PetscReal {time,dt}, then the Vec (VecView).
+ */
+#define CHECKPOINT_ID      1211217
+#define CHECKPOINT_NUM_INT 7
+
+int _checkpoint = 0;
+static char      _checkpoint_file[PETSC_MAX_PATH_LEN];
+static PetscReal _checkpoint_dt    = -1;
+static PetscInt  _checkpoint_steps = -1;
+static PetscReal _next_checkpoint_time;
+static PetscInt  _last_checkpoint_step;
+static Vec       _checkpoint_full_x = NULL;
+static int       _checkpoint_active = 0;
+
+/* Set by time_step_restart, and used up by the next time_step */
+static int       _restart_pending = 0;
+static int       _restart_frame   = 0;
+static PetscInt  _restart_step;
+
+static void _checkpoint_write(TS,Vec);
+
+/*
+ * set_checkpoint makes time_step write a checkpoint every checkpoint_dt
+ * in time and/or every checkpoint_steps steps, and when it finishes. A
+ * value <= 0 turns that trigger off. A NULL filename turns checkpoints
+ * off, as does QuaC_clear. This can also be set with the command line
+ * options -checkpoint <file>, -checkpoint_dt <dt> and -checkpoint_steps
+ * <n>. Only the TS integrators write checkpoints: the Trotter propagator
+ * falls back to the TS, and the Krylov propagator warns that it writes none.
+ *
+ * Inputs:
+ *      const char *filename:  the checkpoint file (overwritten each time), or NULL
+ *      PetscReal  checkpoint_dt:    time between checkpoints
+ *      PetscInt   checkpoint_steps: steps between checkpoints
+ */
+void set_checkpoint(const char *filename,PetscReal checkpoint_dt,PetscInt checkpoint_steps){
+  if (filename==NULL){
+    _checkpoint = 0;
+    return;
+  }
+  _checkpoint       = 1;
+  _checkpoint_dt    = checkpoint_dt;
+  _checkpoint_steps = checkpoint_steps;
+  PetscStrncpy(_checkpoint_file,filename,sizeof(_checkpoint_file));
+  return;
+}
+
+/*
+ * time_step_restart reads a checkpoint written by time_step into x and
+ * continues the run from there to time_max, as time_step would have.
+ * The system (terms, circuits, rotating frame, sectors) must be set up as
+ * in the run that wrote it; the number of ranks can be different. steps_max
+ * counts from the start of the original run.
+ *
+ * Inputs:
+ *      Vec        x:         density matrix (or wavefunction) of the right size
+ *      const char *filename: the checkpoint
+ *      PetscReal  time_max:  the time to integrate to
+ *      PetscInt   steps_max: maximum number of steps
+ * Outputs:
+ *      Vec        x:         the state at the end, as with time_step
+ */
+void time_step_restart(Vec x,const char *filename,PetscReal time_max,PetscInt steps_max){
+  PetscViewer viewer;
+  PetscInt    header[CHECKPOINT_NUM_INT],*gates,size,count,i;
+  PetscReal   times[2];
+
+  PetscViewerCreate(PETSC_COMM_WORLD,&viewer);
+  PetscViewerSetType(viewer,PETSCVIEWERBINARY);
+  PetscViewerFileSetMode(viewer,FILE_MODE_READ);
+  PetscViewerBinarySetUseMPIIO(viewer,PETSC_TRUE);
+  PetscViewerBinarySetSkipInfo(viewer,PETSC_TRUE);
+  PetscViewerFileSetName(viewer,filename);
+
+  PetscViewerBinaryRead(viewer,header,CHECKPOINT_NUM_INT,&count,PETSC_INT);
+  if (count!=CHECKPOINT_NUM_INT||header[0]!=CHECKPOINT_ID){
+    if (nid==0){
+      printf("ERROR! %s is not a QuaC checkpoint!\n",filename);
+      exit(0);
+    }
+  }
+  VecGetSize(x,&size);
+  if (header[2]!=size||header[6]!=_num_circuits||header[3]!=_rotating_frame){
+    if (nid==0){
+      printf("ERROR! The checkpoint %s was written by a different system!\n",filename);
+      printf("       Its size, number of circuits and rotating frame must match.\n");
+      exit(0);
+    }
+  }
+  _current_gate    = header[4];
+  _current_circuit = header[5];
+  if (_num_circuits>0){
+    gates = malloc(_num_circuits*sizeof(PetscInt));
+    PetscViewerBinaryRead(viewer,gates,_num_circuits,&count,PETSC_INT);
+    for (i=0;i<_num_circuits;i++){
+      _circuit_list[i].current_gate = gates[i];
+    }
+    free(gates);
+  }
+  PetscViewerBinaryRead(viewer,times,2,&count,PETSC_REAL);
+  VecLoad(x,viewer);
+  PetscViewerDestroy(&viewer);
+
+  if (nid==0) printf("Restarting from %s at time %e, step %d\n",filename,times[0],(int)header[1]);
+  _restart_pending = 1;
+  _restart_frame   = header[3];
+  _restart_step    = header[1];
+  time_step(x,times[0],time_max,times[1],steps_max);
+  return;
+}
+
+/*
+ * _restart_in_frame is 1 if the state given to time_step is a restarted one
+ * that is already in the rotating frame
+ */
+int _restart_in_frame(){
+  return _restart_pending&&_restart_frame;
+}
+
+/*
+ * _restart_apply gives ts the step number of the checkpoint, if time_step
+ * was called by time_step_restart. ts is NULL for the propagators that do
+ * not use it.
+ */
+void _restart_apply(TS ts){
+  if (!_restart_pending) return;
+  if (ts!=NULL){
+    TSSetStepNumber(ts,_restart_step);
+  }
+  _restart_pending = 0;
+  return;
+}
+
+/*
+ * _checkpoint_requested reads the command line options and returns 1 if
+ * checkpoints are to be written
+ */
+int _checkpoint_requested(){
+  PetscBool flag;
+
+  PetscOptionsGetString(NULL,NULL,"-checkpoint",_checkpoint_file,sizeof(_checkpoint_file),&flag);
+  if (flag) _checkpoint = 1;
+  PetscOptionsGetReal(NULL,NULL,"-checkpoint_dt",&_checkpoint_dt,NULL);
+  PetscOptionsGetInt(NULL,NULL,"-checkpoint_steps",&_checkpoint_steps,NULL);
+  return _checkpoint;
+}
+
+/*
+ * _checkpoint_begin sets up checkpointing of the time_step using ts, if it
+ * was asked for.
+ *
+ * Inputs:
+ *      TS        ts:           the integrator, with its time and step set
+ *      Vec       x:            the full state (that time_step was given)
+ *      Vec       solve_x:      the state the TS integrates
+ *      int       sector_solve: 1 if solve_x is the sector part of x
+ *      PetscReal init_time:    the start time
+ *      int       krylov_solve: 1 if the Krylov propagator is used instead of ts
+ */
+void _checkpoint_begin(TS ts,Vec x,Vec solve_x,int sector_solve,PetscReal init_time,int krylov_solve){
+
+  if (!_checkpoint_requested()) return;
+  if (krylov_solve){
+    if (nid==0) printf("Warning! The Krylov propagator does not write checkpoints.\n");
+    return;
+  }
+
+  _checkpoint_active = 1;
+  _next_checkpoint_time = init_time + _checkpoint_dt;
+  TSGetStepNumber(ts,&_last_checkpoint_step);
+  if (sector_solve){
+    /* The elements outside of the sectors are zero, and stay zero */
+    VecDuplicate(x,&_checkpoint_full_x);
+    VecSet(_checkpoint_full_x,0.0);
+  }
+  TSSetPostStep(ts,_checkpoint_post_step);
+  return;
+}
+
+/*
+ * _checkpoint_end writes the final checkpoint of a time_step, unless the
+ * last step was just written, and cleans up. solve_x is the final state
+ * (the circuit segments may apply gates without stepping ts).
+ */
+void _checkpoint_end(TS ts,Vec solve_x){
+  PetscInt step;
+
+  if (!_checkpoint_active) return;
+  TSGetStepNumber(ts,&step);
+  if (step!=_last_checkpoint_step||_num_circuits>0){
+    _checkpoint_write(ts,solve_x);
+  }
+  if (_checkpoint_full_x!=NULL){
+    VecDestroy(&_checkpoint_full_x);
+  }
+  _checkpoint_full_x = NULL;
+  _checkpoint_active = 0;
+  return;
+}
+
+/*
+ * _checkpoint_post_step is the TS post step function; it writes a
+ * checkpoint when one is due
+ */
+PetscErrorCode _checkpoint_post_step(TS ts){
+  PetscReal t,eps;
+  PetscInt  step;
+  Vec       U;
+
+  TSGetTime(ts,&t);
+  TSGetStepNumber(ts,&step);
+  eps = PETSC_SMALL*PetscMax(1.0,PetscAbsReal(t));
+  if ((_checkpoint_dt>0&&t>=_next_checkpoint_time-eps)||
+      (_checkpoint_steps>0&&step-_last_checkpoint_step>=_checkpoint_steps)){
+    TSGetSolution(ts,&U);
+    _checkpoint_write(ts,U);
+    _last_checkpoint_step = step;
+    while (_checkpoint_dt>0&&_next_checkpoint_time<=t+eps){
+      _next_checkpoint_time = _next_checkpoint_time + _checkpoint_dt;
+    }
+  }
+  PetscFunctionReturn(0);
+}
+
+/*
+ * _checkpoint_write writes U, the state of ts, and the progress through the
+ * gates to the checkpoint file
+ */
+static void _checkpoint_write(TS ts,Vec U){
+  PetscViewer viewer;
+  PetscInt    header[CHECKPOINT_NUM_INT],*gates,i,size;
+  PetscReal   times[2];
+  Vec         full_U;
+  char        tmp_file[PETSC_MAX_PATH_LEN+4];
+
+  full_U = U;
+  if (_checkpoint_full_x!=NULL){
+    _sector_expand(U,_checkpoint_full_x);
+    full_U = _checkpoint_full_x;
+  }
+  VecGetSize(full_U,&size);
+  header[0] = CHECKPOINT_ID;
+  TSGetStepNumber(ts,&header[1]);
+  header[2] = size;
+  header[3] = _rotating_frame;
+  header[4] = _current_gate;
+  header[5] = _current_circuit;
+  header[6] = _num_circuits;
+  TSGetTime(ts,&times[0]);
+  /* The step size the integrator (and its adaptor) will try next */
+  TSGetTimeStep(ts,&times[1]);
+
+  snprintf(tmp_file,sizeof(tmp_file),"%s.tmp",_checkpoint_file);
+  PetscViewerCreate(PETSC_COMM_WORLD,&viewer);
+  PetscViewerSetType(viewer,PETSCVIEWERBINARY);
+  PetscViewerFileSetMode(viewer,FILE_MODE_WRITE);
+  PetscViewerBinarySetUseMPIIO(viewer,PETSC_TRUE);
+  PetscViewerBinarySetSkipInfo(viewer,PETSC_TRUE);
+  PetscViewerFileSetName(viewer,tmp_file);
+
+  PetscViewerBinaryWrite(viewer,header,CHECKPOINT_NUM_INT,PETSC_INT);
+  if (_num_circuits>0){
+    gates = malloc(_num_circuits*sizeof(PetscInt));
+    for (i=0;i<_num_circuits;i++){
+      gates[i] = _circuit_list[i].current_gate;
+    }
+    PetscViewerBinaryWrite(viewer,gates,_num_circuits,PETSC_INT);
+    free(gates);
+  }
+  PetscViewerBinaryWrite(viewer,times,2,PETSC_REAL);
+  VecView(full_U,viewer);
+  PetscViewerDestroy(&viewer);
+
+  /* Only replace the last checkpoint once this one is complete */
+  MPI_Barrier(PETSC_COMM_WORLD);
+  if (nid==0){
+    if (rename(tmp_file,_checkpoint_file)!=0){
+      printf("Warning! Could not rename %s to %s\n",tmp_file,_checkpoint_file);
+    }
+    printf("Checkpoint at time %e, step %d written to %s\n",times[0],(int)header[1],_checkpoint_file);
+  }
+  MPI_Barrier(PETSC_COMM_WORLD);
+  return;
+}
@@ -0,0 +1,9 @@
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <petsc.h>
+
+void set_checkpoint(const char*,PetscReal,PetscInt);
+void time_step_restart(Vec,const char*,PetscReal,PetscInt);
+
+#endif
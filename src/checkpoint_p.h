@@ -0,0 +1,15 @@
+#ifndef CHECKPOINT_P_H_
+#define CHECKPOINT_P_H_
+
+#include <petscts.h>
+
+int  _checkpoint_requested();
+void _checkpoint_begin(TS,Vec,Vec,int,PetscReal,int);
+void _checkpoint_end(TS,Vec);
+PetscErrorCode _checkpoint_post_step(TS);
+int  _restart_in_frame();
+void _restart_apply(TS);
+
+extern int _checkpoint;
+
+#endif
@@ -0,0 +1,403 @@
+#include "dicke.h"
+#include "dicke_p.h"
+#include "quac_p.h"
+#include "operators_p.h"
+#include "operators.h"
+#include "excitation_basis_p.h"
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+ * Ensembles of N identical two-level emitters in the permutationally
+ * symmetric (Dicke) basis. When every emitter has the same couplings and
+ * rates, rho stays invariant under permutations of the emitters and only
+ * depends on the collective states |j,m>, j = N/2, N/2-1, ... and
+ * m = -j..j, with the d_j degenerate copies of each j summed together
+ * (see Shammah et al., Phys. Rev. A 98, 063815). rho is then block diagonal
+ * in j, with O(N^3) elements instead of 4^N.
+ *
+ * The ensemble is one subsystem whose levels are the states |j,m>, block by
+ * block from j = N/2 down, and by m within a block. Level k <= N is then the
+ * symmetric state with k excitations, so set_initial_pop works as usual.
+ * The collective operators J_-, J_+, J_z + N/2 and 2 J_z have one nonzero
+ * per row, and work like any other operator (add_to_ham_p, add_lin,
+ * get_expectation_value, ...). The local processes, sum_n L(C_n) with C_n
+ * acting on emitter n alone, couple block j to blocks j-1 and j+1, and are
+ * added with add_lin_local.
+ *
+ * The elements of rho between two different blocks are always zero. The
+ * solvers generate only the rows of the elements within the blocks,
+ * O(N^3) of them, from the terms (see symmetry.c), and fall back to the
+ * block diagonal rows of full_A (which still has O(N^4) empty rows) for
+ * models that cannot be generated row by row.
+ */
+
+int _num_dicke = 0;
+
+typedef struct dicke_local_term{
+  PetscScalar a;
+  operator    op;
+} dicke_local_term;
+
+static operator _new_dicke_op(op_type,int,int);
+static double   _local_rate(operator,PetscInt);
+static double   _dicke_local_coeff(PetscInt,op_type,PetscInt,PetscInt,PetscInt,PetscInt,PetscInt,PetscInt);
+static double   _dicke_path(op_type,PetscInt,PetscInt,PetscInt,PetscInt,PetscInt);
+static double   _dicke_cg(PetscInt,PetscInt,PetscInt,PetscInt);
+static double   _dicke_log_degeneracy(PetscInt,PetscInt);
+static void     _replay_local_term(void*);
+static void     _local_term_row(void*,PetscInt,PetscInt*,PetscInt[],PetscScalar[]);
+static void     _destroy_local_term(void*);
+
+/*
+ * create_dicke creates the collective operators of an ensemble of identical
+ * two-level emitters, in the permutationally symmetric basis.
+ * Inputs:
+ *        int num_emitters: number of emitters, N
+ * Outputs:
+ *       operator *new_op: J_- (op), J_+ (op->dag), the number of excitations
+ *                         J_z + N/2 (op->n), sum_n sig_z = 2 J_z (op->sig_z)
+ *                         and the identity (op->eye). sig_x and sig_y are not
+ *                         made (they have two nonzeros per row); use
+ *                         op + op->dag instead.
+ */
+void create_dicke(int num_emitters,operator *new_op){
+  int num_levels,two_j;
+
+  _check_initialized_op();
+  if (num_emitters<1){
+    if (nid==0){
+      printf("ERROR! An ensemble needs at least one emitter!\n");
+      exit(0);
+    }
+  }
+
+  /* Sum of 2j+1 over the blocks */
+  num_levels = 0;
+  for (two_j=num_emitters;two_j>=0;two_j=two_j-2){
+    num_levels = num_levels + two_j + 1;
+  }
+
+  *new_op           = _new_dicke_op(DICKE_LOWER,num_levels,num_emitters);
+  (*new_op)->dag    = _new_dicke_op(DICKE_RAISE,num_levels,num_emitters);
+  (*new_op)->n      = _new_dicke_op(DICKE_NUMBER,num_levels,num_emitters);
+  (*new_op)->sig_z  = _new_dicke_op(DICKE_SIGMA_Z,num_levels,num_emitters);
+  (*new_op)->eye    = _new_dicke_op(IDENTITY,num_levels,num_emitters);
+  (*new_op)->dag->dag = *new_op; //Point dagger operator to DICKE_LOWER op
+
+  /* Increase total_levels */
+  total_levels = total_levels*num_levels;
+  _basis_dim   = total_levels;
+
+  /* Add to list */
+  subsystem_list[num_subsystems] = (*new_op);
+  num_subsystems++;
+  _num_dicke++;
+  return;
+}
+
+/*
+ * add_lin_local adds the Lindblad term sum_n L(C_n) of an ensemble, where
+ * C_n acts on emitter n alone and L(C) is as in add_lin. C_n is chosen by
+ * the operator of the ensemble that is passed:
+ *        ens:        C_n = sig_- (spontaneous emission)
+ *        ens->dag:   C_n = sig_+ (incoherent pumping)
+ *        ens->sig_z: C_n = sig_z (dephasing; coherences decay at 2a)
+ * Collective processes, L(J_-) and so on, are added with add_lin.
+ * Inputs:
+ *        PetscScalar a: rate of each emitter (note: Full term, not sqrt())
+ *        operator op:   ensemble operator, as above
+ * Outputs:
+ *        none
+ */
+void add_lin_local(PetscScalar a,operator op){
+  dicke_local_term *term;
+
+  PetscLogEventBegin(add_lin_event,0,0,0,0);
+  _check_initialized_A();
+  _lindblad_terms = 1;
+
+  if (op->my_op_type!=DICKE_LOWER&&op->my_op_type!=DICKE_RAISE&&op->my_op_type!=DICKE_SIGMA_Z){
+    if (nid==0){
+      printf("ERROR! add_lin_local takes J_-, J_+ or sig_z of an ensemble (see create_dicke)!\n");
+      exit(0);
+    }
+  }
+  if (_matrix_free){
+    if (nid==0){
+      printf("ERROR! add_lin_local is not supported with set_matrix_free!\n");
+      exit(0);
+    }
+  }
+
+  if (PetscAbsComplex(a)!=0){
+    /* Generated row by row later, by _build_A or the ensemble blocks */
+    term     = malloc(sizeof(dicke_local_term));
+    term->a  = a;
+    term->op = op;
+    _record_external_term(_replay_local_term,_destroy_local_term,term);
+    _set_external_term_rows(_local_term_row,4);
+  }
+  PetscLogEventEnd(add_lin_event,0,0,0,0);
+  return;
+}
+
+/*
+ * _dicke_level_jm gives 2j and 2m of a level of an ensemble
+ */
+void _dicke_level_jm(operator this_op,PetscInt level,PetscInt *two_j,PetscInt *two_m){
+  *two_j = this_op->num_emitters;
+  while (level>*two_j){
+    level  = level - (*two_j + 1);
+    *two_j = *two_j - 2;
+  }
+  *two_m = 2*level - *two_j;
+  return;
+}
+
+/*
+ * _dicke_level gives the level of |j,m> of an ensemble, from 2j and 2m
+ */
+PetscInt _dicke_level(operator this_op,PetscInt two_j,PetscInt two_m){
+  PetscInt level,k;
+
+  level = 0;
+  for (k=this_op->num_emitters;k>two_j;k=k-2){
+    level = level + k + 1;
+  }
+  return level + (two_m+two_j)/2;
+}
+
+/*
+ * _level_excitations gives the number of excitations of a level of a
+ * subsystem: the level itself, or m + N/2 for an ensemble
+ */
+PetscInt _level_excitations(operator this_op,PetscInt level){
+  PetscInt two_j,two_m;
+
+  if (this_op->my_op_type!=DICKE_LOWER&&this_op->my_op_type!=DICKE_RAISE&&
+      this_op->my_op_type!=DICKE_NUMBER&&this_op->my_op_type!=DICKE_SIGMA_Z){
+    return level;
+  }
+  _dicke_level_jm(this_op,level,&two_j,&two_m);
+  return (two_m+this_op->num_emitters)/2;
+}
+
+/*
+ * _dicke_block_diagonal returns 1 if element i = total_levels*C + R of rho
+ * is within one block (the same j) of every ensemble
+ */
+int _dicke_block_diagonal(PetscInt i){
+  PetscInt q,stride,two_jr,two_jc,two_m;
+  operator this_op;
+
+  for (q=0;q<num_subsystems;q++){
+    this_op = subsystem_list[q];
+    if (this_op->my_op_type!=DICKE_LOWER) continue;
+    stride = total_levels/(this_op->my_levels*this_op->n_before);
+    _dicke_level_jm(this_op,(i%total_levels/stride)%this_op->my_levels,&two_jr,&two_m);
+    _dicke_level_jm(this_op,(i/total_levels/stride)%this_op->my_levels,&two_jc,&two_m);
+    if (two_jr!=two_jc) return 0;
+  }
+  return 1;
+}
+
+/*
+ * _dicke_clear forgets the ensembles, for QuaC_clear
+ */
+void _dicke_clear(){
+  _num_dicke = 0;
+  return;
+}
+
+static operator _new_dicke_op(op_type my_op_type,int num_levels,int num_emitters){
+  operator temp;
+
+  temp               = malloc(sizeof(struct operator));
+  temp->initial_pop  = (double) 0.0;
+  temp->n_before     = total_levels;
+  temp->my_levels    = num_levels;
+  temp->my_op_type   = my_op_type;
+  temp->num_emitters = num_emitters;
+  /* Since this is a basic operator, not a vec, set positions to -1 */
+  temp->position     = -1;
+  temp->dag          = NULL;
+  temp->n            = NULL;
+  temp->sig_x        = NULL;
+  temp->sig_y        = NULL;
+  temp->sig_z        = NULL;
+  temp->eye          = NULL;
+  temp->vec_op_list  = NULL;
+  return temp;
+}
+
+/*
+ * _replay_local_term adds the rows of sum_n L(C_n) to full_A, for
+ * print_dense_ham; otherwise the rows come from _local_term_row.
+ */
+static void _replay_local_term(void *data){
+  PetscInt    i,Istart,Iend,num_cols;
+  PetscInt    cols[4];
+  PetscScalar vals[4];
+
+  MatGetOwnershipRange(full_A,&Istart,&Iend);
+  for (i=Istart;i<Iend;i++){
+    num_cols = 0;
+    _local_term_row(data,i,&num_cols,cols,vals);
+    MatSetValues(full_A,1,&i,num_cols,cols,vals,ADD_VALUES);
+  }
+  return;
+}
+
+/*
+ * _local_term_row appends row i = total_levels*C + R of sum_n L(C_n) to
+ * cols and vals (at most 4 entries). The row gets the diagonal
+ * -1/2 a (c(R) + c(C)), with c the eigenvalue of sum_n C_n^t C_n, and,
+ * when the ensemble is in the same block j in R and C, sum_n C_n rho C_n^t
+ * from the blocks j-1, j and j+1.
+ */
+static void _local_term_row(void *data,PetscInt i,PetscInt *num_cols,PetscInt cols[],PetscScalar vals[]){
+  dicke_local_term *term = (dicke_local_term*)data;
+  operator         op    = term->op;
+  PetscInt         R,C,lr,lc,stride,shift,two_j,two_m,two_m1,diag;
+  PetscInt         two_jr,two_mr,two_jc,two_mc,col;
+  double           coeff;
+
+  stride = total_levels/(op->my_levels*op->n_before);
+  /* C_n changes 2m by shift */
+  if (op->my_op_type==DICKE_LOWER){
+    shift = -2;
+  } else if (op->my_op_type==DICKE_RAISE){
+    shift = 2;
+  } else {
+    shift = 0;
+  }
+
+  R  = i%total_levels;
+  C  = i/total_levels;
+  lr = (R/stride)%op->my_levels;
+  lc = (C/stride)%op->my_levels;
+  _dicke_level_jm(op,lr,&two_jr,&two_mr);
+  _dicke_level_jm(op,lc,&two_jc,&two_mc);
+
+  diag       = *num_cols;
+  cols[diag] = i;
+  vals[diag] = -0.5*term->a*(_local_rate(op,two_mr)+_local_rate(op,two_mc));
+  *num_cols  = *num_cols + 1;
+
+  if (two_jr==two_jc){
+    two_m  = two_mr - shift;
+    two_m1 = two_mc - shift;
+    for (two_j=two_jr-2;two_j<=two_jr+2;two_j=two_j+2){
+      if (two_j<0||two_j>op->num_emitters) continue;
+      if (PetscAbsInt(two_m)>two_j||PetscAbsInt(two_m1)>two_j) continue;
+      coeff = _dicke_local_coeff(op->num_emitters,op->my_op_type,two_j,two_m,two_m1,two_jr,two_mr,two_mc);
+      if (coeff==0) continue;
+      col = total_levels*(C + (_dicke_level(op,two_j,two_m1)-lc)*stride)
+        + R + (_dicke_level(op,two_j,two_m)-lr)*stride;
+      if (col==i){
+        vals[diag] = vals[diag] + term->a*coeff;
+      } else {
+        cols[*num_cols] = col;
+        vals[*num_cols] = term->a*coeff;
+        *num_cols = *num_cols + 1;
+      }
+    }
+  }
+  return;
+}
+
+static void _destroy_local_term(void *data){
+  free(data);
+  return;
+}
+
+/*
+ * _local_rate gives the eigenvalue of sum_n C_n^t C_n on |j,m>: the number
+ * of excited emitters for sig_-, of unexcited ones for sig_+, and N for sig_z
+ */
+static double _local_rate(operator op,PetscInt two_m){
+  if (op->my_op_type==DICKE_LOWER){
+    return (op->num_emitters+two_m)/2.0;
+  } else if (op->my_op_type==DICKE_RAISE){
+    return (op->num_emitters-two_m)/2.0;
+  }
+  return (double)op->num_emitters;
+}
+
+/*
+ * _dicke_local_coeff gives element (J,M,M') of sum_n C_n rho C_n^t, for
+ * rho = |j,m><j,m'| summed over the degenerate copies of j. Emitter 1 is
+ * split off from the other N-1, which have total angular momentum
+ * j' = j +- 1/2 in d_j'(N-1) of the d_j(N) copies. C_1 only acts on
+ * emitter 1, so the element follows from the Clebsch-Gordan coefficients
+ * of coupling j' and 1/2 to j, and to J; the sum over n is N times that
+ * of emitter 1. All j and m are passed as 2j and 2m.
+ */
+static double _dicke_local_coeff(PetscInt N,op_type type,PetscInt two_j,PetscInt two_m,PetscInt two_m1,
+                                 PetscInt two_J,PetscInt two_M,PetscInt two_M1){
+  PetscInt two_jp;
+  double   coeff;
+
+  coeff = 0.0;
+  for (two_jp=two_j-1;two_jp<=two_j+1;two_jp=two_jp+2){
+    if (two_jp<0||two_jp>N-1||PetscAbsInt(two_J-two_jp)!=1) continue;
+    coeff = coeff + exp(_dicke_log_degeneracy(N-1,two_jp)-_dicke_log_degeneracy(N,two_j))
+      *_dicke_path(type,two_jp,two_j,two_m,two_J,two_M)
+      *_dicke_path(type,two_jp,two_j,two_m1,two_J,two_M1);
+  }
+  return N*coeff;
+}
+
+/*
+ * _dicke_path gives <J,M;j'| C_1 |j,m;j'>, where |j,m;j'> couples the
+ * other emitters, in j', with emitter 1. C_1 takes emitter 1 from s to
+ * t = s + M - m.
+ */
+static double _dicke_path(op_type type,PetscInt two_jp,PetscInt two_j,PetscInt two_m,PetscInt two_J,PetscInt two_M){
+  PetscInt two_s,two_t;
+  double   val,path;
+
+  path = 0.0;
+  for (two_s=-1;two_s<=1;two_s=two_s+2){
+    two_t = two_s + two_M - two_m;
+    if (type==DICKE_LOWER){
+      if (two_s!=1||two_t!=-1) continue;
+      val = 1.0;
+    } else if (type==DICKE_RAISE){
+      if (two_s!=-1||two_t!=1) continue;
+      val = 1.0;
+    } else {
+      if (two_t!=two_s) continue;
+      val = (double)two_s;
+    }
+    if (PetscAbsInt(two_m-two_s)>two_jp) continue;
+    path = path + _dicke_cg(two_jp,two_s,two_j,two_m)*val*_dicke_cg(two_jp,two_t,two_J,two_M);
+  }
+  return path;
+}
+
+/*
+ * _dicke_cg gives the Clebsch-Gordan coefficient <j',m-s;1/2,s|j,m>,
+ * with j = j' +- 1/2
+ */
+static double _dicke_cg(PetscInt two_jp,PetscInt two_s,PetscInt two_j,PetscInt two_m){
+  double plus,minus;
+
+  if (PetscAbsInt(two_m)>two_j) return 0.0;
+  plus  = sqrt((two_jp+two_m+1)/(2.0*(two_jp+1)));
+  minus = sqrt((two_jp-two_m+1)/(2.0*(two_jp+1)));
+  if (two_j==two_jp+1){
+    return (two_s==1) ? plus : minus;
+  }
+  return (two_s==1) ? -minus : plus;
+}
+
+/*
+ * _dicke_log_degeneracy gives the log of the number of copies of j among
+ * N emitters, d_j = (2j+1) N! / ((N/2+j+1)! (N/2-j)!)
+ */
+static double _dicke_log_degeneracy(PetscInt N,PetscInt two_j){
+  return log(two_j+1.0) + lgamma(N+1.0) - lgamma((N+two_j)/2+2.0) - lgamma((N-two_j)/2+1.0);
+}
@@ -0,0 +1,10 @@
+#ifndef DICKE_H_
+#define DICKE_H_
+
+#include <petsc.h>
+#include "operators.h"
+
+void create_dicke(int,operator*);
+void add_lin_local(PetscScalar,operator);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef DICKE_P_H_
+#define DICKE_P_H_
+
+#include <petscvec.h>
+#include "operators.h"
+
+void     _dicke_level_jm(operator,PetscInt,PetscInt*,PetscInt*);
+PetscInt _dicke_level(operator,PetscInt,PetscInt);
+PetscInt _level_excitations(operator,PetscInt);
+int      _dicke_block_diagonal(PetscInt);
+void     _dicke_clear();
+
+extern int _num_dicke;
+
+#endif
@@ -1,10 +1,22 @@
 #include "dm_utilities.h"
 #include "operators_p.h"
+#include "excitation_basis_p.h"
+#include "dicke_p.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <petscblaslapack.h>
 #include <string.h>
 
+/*
+ * get_expectation_values gathers psi with this scatter, which is kept
+ * between calls (it is called at every monitored step) and rebuilt only
+ * if psi's layout changes. Freed by _dm_utilities_clear.
+ */
+static VecScatter _expect_psi_scatter = NULL;
+static Vec        _expect_psi_all     = NULL;
+static PetscInt   _expect_psi_local_size = -1;
+static MPI_Comm   _expect_psi_comm    = MPI_COMM_NULL;
+
 /*
  * Print the DM as a matrix.
  * Not recommended for large matrices.
@@ -162,6 +174,20 @@ void partial_trace_over(Vec full_dm,Vec ptraced_dm,int number_of_ops,...){
 
   va_start(ap,number_of_ops);
 
+  if (_excitation_cap>=0){
+    /* The truncated dm is traced directly, from the basis states */
+    int traced[MAX_SUB] = {0};
+    for (i=0;i<number_of_ops;i++){
+      op = va_arg(ap,operator);
+      for (j=0;j<num_subsystems;j++){
+        if (subsystem_list[j]->n_before==op->n_before) traced[j] = 1;
+      }
+    }
+    va_end(ap);
+    _basis_partial_trace(full_dm,ptraced_dm,traced);
+    return;
+  }
+
   /* Check that the full_dm is of size total_levels */
 
   VecGetSize(full_dm,&dm_size);
@@ -481,6 +507,23 @@ void partial_trace_keep(Vec full_dm,Vec ptraced_dm,int number_of_ops,...){
 
   va_start(ap,number_of_ops);
 
+  if (_excitation_cap>=0){
+    /* The truncated dm is traced directly, from the basis states */
+    int traced[MAX_SUB];
+    for (j=0;j<num_subsystems;j++){
+      traced[j] = 1;
+    }
+    for (i=0;i<number_of_ops;i++){
+      op = va_arg(ap,operator);
+      for (j=0;j<num_subsystems;j++){
+        if (subsystem_list[j]->n_before==op->n_before) traced[j] = 0;
+      }
+    }
+    va_end(ap);
+    _basis_partial_trace(full_dm,ptraced_dm,traced);
+    return;
+  }
+
   /* Check that the full_dm is of size total_levels */
 
   VecGetSize(full_dm,&dm_size);
@@ -692,8 +735,14 @@ void set_dm_from_initial_pop(Vec x){
       //      init_row_op += ((int)subsystem_list[i]->initial_pop)*subsystem_list[i]->n_before;
     }
 
+    /* The state's index in the (possibly truncated) basis */
+    init_row_op = _basis_rank(init_row_op);
+    if (init_row_op<0){
+      printf("ERROR! The initial state has more excitations than the excitation cap!\n");
+      exit(0);
+    }
     if(_lindblad_terms) {
-      init_row_op = total_levels*init_row_op + init_row_op;
+      init_row_op = _basis_dim*init_row_op + init_row_op;
     } else {
       init_row_op = init_row_op;
     }
@@ -705,6 +754,11 @@ void set_dm_from_initial_pop(Vec x){
      * This more complicated initialization routine allows for the vec operator
      * to take distributed values (say, 1/3 1/3 1/3)
      */
+    if (_excitation_cap>=0){
+      printf("ERROR! Initial populations of VEC operators are not supported with the excitation cap!\n");
+      printf("       Set the initial state with add_value_to_dm instead.\n");
+      exit(0);
+    }
 
 
     /* Create temporary PETSc matrices */
@@ -734,8 +788,9 @@ void set_dm_from_initial_pop(Vec x){
        * If the subsystem is a ladder operator, the population will be just on a
        * diagonal element within the subspace.
        * LOWER is in the if because that is the op in the subsystem list for ladder operators
+       * (DICKE_LOWER for ensembles)
        */
-      if (subsystem_list[i]->my_op_type==LOWER){
+      if (subsystem_list[i]->my_op_type==LOWER||subsystem_list[i]->my_op_type==DICKE_LOWER){
 
         /* Zero out the subspace density matrix */
         MatZeroEntries(subspace_dm);
@@ -1157,13 +1212,13 @@ int get_num_populations() {
 void get_populations(Vec x,double **populations) {
   int               j,my_levels,n_after,cur_state,num_pop;
   int               *i_sub_to_i_pop;
-  PetscInt          x_low,x_high,i,dm_size,diag_index,dim;
+  PetscInt          x_low,x_high,i,dm_size,diag_index,dim,state;
   const PetscScalar *xa;
   PetscReal         tmp_real,tmp_imag;
   if(_lindblad_terms) {
-    dim = total_levels*total_levels;
+    dim = _basis_dim*_basis_dim;
   } else {
-    dim = total_levels;
+    dim = _basis_dim;
   }
   VecGetSize(x,&dm_size);
 
@@ -1201,9 +1256,9 @@ void get_populations(Vec x,double **populations) {
   }
 
 
-  for (i=0;i<total_levels;i++){
+  for (i=0;i<_basis_dim;i++){
     if (_lindblad_terms) {
-      diag_index = i*total_levels+i;
+      diag_index = i*_basis_dim+i;
     } else {
       /* If we are using the schrodinger solver, then i is the diag index */
       diag_index = i;
@@ -1212,6 +1267,8 @@ void get_populations(Vec x,double **populations) {
       /* Get the diagonal entry of rho */
       tmp_real = (double)PetscRealPart(xa[diag_index-x_low]);
       tmp_imag = (double)PetscImaginaryPart(xa[diag_index-x_low]);
+      /* The levels of the subsystems come from the tensor product state */
+      state    = _basis_state(i);
       //      printf("%e \n",(double)PetscRealPart(xa[i*(total_levels)+i-x_low]));
       for(j=0;j<num_subsystems;j++){
         /*
@@ -1231,7 +1288,7 @@ void get_populations(Vec x,double **populations) {
         if (subsystem_list[j]->my_op_type==VEC){
           my_levels = subsystem_list[j]->my_levels;
           n_after   = total_levels/(my_levels*subsystem_list[j]->n_before);
-          cur_state = ((int)floor(i/n_after)%(my_levels));
+          cur_state = ((int)floor(state/n_after)%(my_levels));
           if (_lindblad_terms) {
             (*populations)[i_sub_to_i_pop[j]+cur_state] += tmp_real;
           } else {
@@ -1242,7 +1299,9 @@ void get_populations(Vec x,double **populations) {
         } else {
           my_levels = subsystem_list[j]->my_levels;
           n_after   = total_levels/(my_levels*subsystem_list[j]->n_before);
-          cur_state = ((int)floor(i/n_after)%(my_levels));
+          cur_state = ((int)floor(state/n_after)%(my_levels));
+          /* An ensemble's population is its number of excitations */
+          cur_state = _level_excitations(subsystem_list[j],cur_state);
           if (_lindblad_terms) {
             (*populations)[i_sub_to_i_pop[j]] += tmp_real*cur_state;
           } else {
@@ -1364,6 +1423,13 @@ void get_expectation_value(Vec rho,PetscScalar *trace_val,int number_of_ops,...)
   }
   va_end(ap);
 
+  if (_excitation_cap>=0) {
+    /* get_expectation_values handles the truncated basis */
+    get_expectation_values(rho,1,&number_of_ops,&op,NULL,trace_val);
+    free(op);
+    return;
+  }
+
   if(_lindblad_terms) {
     dim = total_levels*total_levels;
   } else {
@@ -1468,6 +1534,173 @@ void get_expectation_value(Vec rho,PetscScalar *trace_val,int number_of_ops,...)
   return;
 }
 
+/*
+ * void get_expectation_values calculates many expectation values at once,
+ *              values[k] = coeffs[k] * Tr(O_k*rho)
+ * where each O_k is a product of operators, as in get_expectation_value.
+ * All products are evaluated in one sweep over the locally owned columns
+ * of rho and all values are summed with a single reduction, which is much
+ * cheaper than calling get_expectation_value once per observable (e.g.,
+ * in a ts_monitor). This also works for a wavefunction (Schrodinger
+ * solver), where values[k] = coeffs[k] * <psi|O_k|psi>.
+ *
+ * Inputs:
+ *         Vec rho              - full Hilbert space density matrix (or psi)
+ *         int num_values       - number of expectation values to calculate
+ *         int num_ops[]        - number of operators in each product
+ *         operator *ops[]      - ops[k] is the list of operators in product k
+ *         PetscScalar coeffs[] - coefficient of each product (NULL for all 1)
+ * Outputs:
+ *         PetscScalar values[] - the expectation values
+ *
+ * An example calling this function:
+ *      operator    n_ops[2][1] = {{a->n},{qubit->n}};
+ *      operator    *ops[2]     = {n_ops[0],n_ops[1]};
+ *      int         num_ops[2]  = {1,1};
+ *      get_expectation_values(rho,2,num_ops,ops,NULL,values);
+ */
+void get_expectation_values(Vec rho,int num_values,int num_ops[],operator *ops[],
+                            PetscScalar coeffs[],PetscScalar values[]){
+  PetscInt          i,k,this_i,my_start,my_end,my_j_start,my_j_end,dm_size,this_loc,dim;
+  PetscInt          local_size;
+  PetscScalar       op_val;
+  const PetscScalar *rho_array,*psi_array;
+  int               layout_changed;
+  MPI_Comm          comm;
+
+  VecGetSize(rho,&dm_size);
+  VecGetOwnershipRange(rho,&my_start,&my_end);
+  for (k=0;k<num_values;k++){
+    values[k] = 0.0;
+  }
+
+  /* With an excitation cap, i and this_i are indices of the truncated basis */
+  dim = _basis_dim;
+  if (dm_size==dim*dim){
+    /*
+     * Tr(O*rho) = sum_i sum_k O_ik rho_ki; each product O has at most
+     * one nonzero per row, so for each column i only the element of rho at
+     * row this_i is needed. Every element is owned by exactly one core,
+     * so each core checks all columns that have at least one local element.
+     */
+    VecGetArrayRead(rho,&rho_array);
+    my_j_start = my_start/dim;
+    my_j_end   = (my_end-1)/dim + 1;
+    for (i=my_j_start;i<my_j_end;i++){
+      for (k=0;k<num_values;k++){
+        _get_op_product_j(_basis_state(i),num_ops[k],ops[k],&this_i,&op_val);
+        if (this_i<0) continue;
+        this_i   = _basis_rank(this_i);
+        this_loc = dim*i + this_i;
+        if (this_loc>=my_start&&this_loc<my_end) {
+          values[k] = values[k] + op_val*rho_array[this_loc-my_start];
+        }
+      }
+    }
+    VecRestoreArrayRead(rho,&rho_array);
+  } else if (dm_size==dim){
+    /*
+     * <psi|O|psi> = sum_i conj(psi_i) O_ij psi_j; psi_j may not be local,
+     * so gather psi once for all of the observables
+     */
+    VecGetLocalSize(rho,&local_size);
+    comm = PetscObjectComm((PetscObject)rho);
+    layout_changed = (_expect_psi_all==NULL||_expect_psi_local_size!=local_size
+                      ||_expect_psi_comm!=comm);
+    MPI_Allreduce(MPI_IN_PLACE,&layout_changed,1,MPI_INT,MPI_MAX,comm);
+    if (layout_changed){
+      _dm_utilities_clear();
+      VecScatterCreateToAll(rho,&_expect_psi_scatter,&_expect_psi_all);
+      _expect_psi_local_size = local_size;
+      _expect_psi_comm       = comm;
+    }
+    VecScatterBegin(_expect_psi_scatter,rho,_expect_psi_all,INSERT_VALUES,SCATTER_FORWARD);
+    VecScatterEnd(_expect_psi_scatter,rho,_expect_psi_all,INSERT_VALUES,SCATTER_FORWARD);
+    VecGetArrayRead(_expect_psi_all,&psi_array);
+    for (i=my_start;i<my_end;i++){
+      for (k=0;k<num_values;k++){
+        _get_op_product_j(_basis_state(i),num_ops[k],ops[k],&this_i,&op_val);
+        if (this_i<0) continue;
+        this_i    = _basis_rank(this_i);
+        values[k] = values[k] + PetscConjComplex(psi_array[i])*op_val*psi_array[this_i];
+      }
+    }
+    VecRestoreArrayRead(_expect_psi_all,&psi_array);
+  } else {
+    if (nid==0){
+      printf("ERROR! The input vector is neither a full density matrix nor a wavefunction!\n");
+      printf("       Expectation values cannot be calculated.\n");
+      exit(0);
+    }
+  }
+
+  MPI_Allreduce(MPI_IN_PLACE,values,num_values,MPIU_SCALAR,MPI_SUM,PetscObjectComm((PetscObject)rho));
+
+  if (coeffs!=NULL){
+    for (k=0;k<num_values;k++){
+      values[k] = coeffs[k]*values[k];
+    }
+  }
+  return;
+}
+
+/*
+ * _dm_utilities_clear frees the scatter kept by get_expectation_values;
+ * called from QuaC_clear and QuaC_finalize
+ */
+void _dm_utilities_clear(){
+  if (_expect_psi_all!=NULL){
+    VecScatterDestroy(&_expect_psi_scatter);
+    VecDestroy(&_expect_psi_all);
+  }
+  _expect_psi_local_size = -1;
+  _expect_psi_comm       = MPI_COMM_NULL;
+  return;
+}
+
+/*
+ * _get_op_product_j finds the single nonzero j (and its value) in row i of
+ * the product of operators ops[0]*ops[1]*...; j=-1 if the row is empty.
+ * VEC operators must come in pairs, as in get_expectation_value.
+ * With an excitation cap, the product is projected onto the truncated
+ * basis (see _get_ops_row_j).
+ */
+void _get_op_product_j(PetscInt i,int number_of_ops,operator *ops,PetscInt *j,PetscScalar *op_val){
+  PetscInt    k,this_i,this_j;
+  PetscScalar val;
+
+  this_i  = i;
+  *op_val = 1.0;
+  for (k=0;k<number_of_ops;k++){
+    if(ops[k]->my_op_type==VEC){
+      if (k+1>=number_of_ops||ops[k+1]->my_op_type!=VEC){
+        if (nid==0){
+          printf("ERROR! VEC operators must come in pairs in get_expectation_values\n");
+          exit(0);
+        }
+      }
+      _get_val_j_from_global_i_vec_vec(this_i,ops[k],ops[k+1],&this_j,&val,-1);
+      k = k + 1;
+    } else {
+      _get_val_j_from_global_i(this_i,ops[k],&this_j,&val,-1);
+    }
+    if (this_j<0) {
+      *j      = -1;
+      *op_val = 0.0;
+      return;
+    }
+    this_i  = this_j;
+    *op_val = *op_val*val;
+  }
+  if (_excitation_cap>=0&&!_basis_allowed(this_i)) {
+    *j      = -1;
+    *op_val = 0.0;
+    return;
+  }
+  *j = this_i;
+  return;
+}
+
 /*
  * void get_bipartite_concurrence calculates the bipartite concurrence of a density matrix
  * bipartite concurrence is defined as:
@@ -1843,8 +2076,8 @@ void trace_dm(PetscScalar *trace_val,Vec dm){
   *trace_val = 0.0 + 0.0*PETSC_i;
   VecGetOwnershipRange(dm,&my_start,&my_end);
 
-  for (i=0;i<total_levels;i++){
-    this_loc = total_levels*i + i; //Diagonal component in vectorized form
+  for (i=0;i<_basis_dim;i++){
+    this_loc = _basis_dim*i + i; //Diagonal component in vectorized form
     if (this_loc>=my_start&&this_loc<my_end) {
       get_dm_element_local(dm,i,i,&dm_element);
         /*
@@ -21,6 +21,7 @@ void partial_trace_over(Vec,Vec,int,...);
 void partial_trace_keep(Vec,Vec,int,...);
 void get_populations(Vec,double**);
 void get_expectation_value(Vec,PetscScalar*,int,...);
+void get_expectation_values(Vec,int,int[],operator*[],PetscScalar[],PetscScalar[]);
 int get_num_populations();
 void get_bipartite_concurrence(Vec,double*);
 void sqrt_mat(Mat);
@@ -30,7 +31,10 @@ void print_dm(Vec,int);
 void print_dm_sparse(Vec,int);
 void print_dm_sparse_to_file(Vec,int,char[]);
 void _get_expectation_value_psi(Vec,PetscScalar*,int,operator*);
+void _dm_utilities_clear();
+void _get_op_product_j(PetscInt,int,operator*,PetscInt*,PetscScalar*);
 void measure_dm(Vec,operator);
+void mult_dm_left_right(Vec,operator,operator);
 void add_ops_to_mat(Mat,PetscInt,PetscInt,...);
 void print_mat_sparse_to_file(Mat,char[]);
 void vadd_ops_to_mat(Mat,PetscInt,PetscInt,va_list);
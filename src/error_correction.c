@@ -11,6 +11,8 @@
 Mat *_DQEC_mats;
 int _discrete_ec = 0;
 
+static void _record_recovery_term(PetscScalar,PetscInt,operator,char[],int,stabilizer[]);
+
 void build_recovery_lin(Mat *recovery_mat,operator error,char commutation_string[],int n_stabilizers,...){
 
   va_list ap;
@@ -125,7 +127,107 @@ void destroy_stabilizer(stabilizer *stab){
  */
 
 void add_lin_recovery(PetscScalar a,PetscInt same_rate,operator error,char commutation_string[],int n_stabilizers,...){
-  va_list ap;
+  va_list    ap;
+  PetscInt   i;
+  stabilizer *stabs;
+
+  PetscLogEventBegin(add_lin_recovery_event,0,0,0,0);
+  _check_initialized_A();
+  _lindblad_terms = 1;
+  if (_matrix_free){
+    if (nid==0){
+      printf("ERROR! add_lin_recovery is not supported with set_matrix_free!\n");
+      exit(0);
+    }
+  }
+
+  if (PetscAbsComplex(a)!=0) {
+    va_start(ap,n_stabilizers);
+    stabs = malloc(n_stabilizers*sizeof(struct stabilizer));
+    /* Loop through passed in ops and store in list */
+    for (i=0;i<n_stabilizers;i++){
+      stabs[i] = va_arg(ap,stabilizer);
+    }
+    va_end(ap);
+
+    if (_defer_terms()){
+      /* Inserted into full_A later, by _build_A */
+      _record_recovery_term(a,same_rate,error,commutation_string,n_stabilizers,stabs);
+    } else {
+      _add_lin_recovery_list(a,same_rate,error,commutation_string,n_stabilizers,stabs);
+    }
+    free(stabs);
+  }
+  PetscLogEventEnd(add_lin_recovery_event,0,0,0,0);
+  return;
+}
+
+/*
+ * The stabilizers passed to add_lin_recovery are usually destroyed right
+ * after the call, so a recorded recovery term keeps its own copies.
+ */
+typedef struct recovery_term{
+  PetscScalar a;
+  PetscInt    same_rate;
+  operator    error;
+  char        *commutation_string;
+  int         n_stabilizers;
+  stabilizer  *stabs;
+} recovery_term;
+
+static void _replay_recovery_term(void *data){
+  recovery_term *term = (recovery_term*)data;
+
+  _add_lin_recovery_list(term->a,term->same_rate,term->error,term->commutation_string,
+                         term->n_stabilizers,term->stabs);
+  return;
+}
+
+static void _destroy_recovery_term(void *data){
+  recovery_term *term = (recovery_term*)data;
+  int           i;
+
+  for (i=0;i<term->n_stabilizers;i++){
+    free(term->stabs[i].ops);
+  }
+  free(term->stabs);
+  free(term->commutation_string);
+  free(term);
+  return;
+}
+
+static void _record_recovery_term(PetscScalar a,PetscInt same_rate,operator error,char commutation_string[],
+                                  int n_stabilizers,stabilizer stabs[]){
+  recovery_term *term;
+  int           i,j;
+
+  term = malloc(sizeof(recovery_term));
+  term->a             = a;
+  term->same_rate     = same_rate;
+  term->error         = error;
+  term->n_stabilizers = n_stabilizers;
+  term->commutation_string = malloc((n_stabilizers+1)*sizeof(char));
+  for (i=0;i<n_stabilizers;i++){
+    term->commutation_string[i] = commutation_string[i];
+  }
+  term->commutation_string[n_stabilizers] = '\0';
+  term->stabs = malloc(n_stabilizers*sizeof(struct stabilizer));
+  for (i=0;i<n_stabilizers;i++){
+    term->stabs[i].n_ops = stabs[i].n_ops;
+    term->stabs[i].ops   = malloc(stabs[i].n_ops*sizeof(operator));
+    for (j=0;j<stabs[i].n_ops;j++){
+      term->stabs[i].ops[j] = stabs[i].ops[j];
+    }
+  }
+  _record_external_term(_replay_recovery_term,_destroy_recovery_term,term);
+  return;
+}
+
+/*
+ * _add_lin_recovery_list adds the L(C) recovery term of add_lin_recovery
+ * to full_A, with the stabilizers given as an array.
+ */
+void _add_lin_recovery_list(PetscScalar a,PetscInt same_rate,operator error,char commutation_string[],int n_stabilizers,stabilizer stabs[]){
   PetscScalar mat_scalar,add_to_mat,op_val;
   PetscInt   i,Istart,Iend,this_i,i_stab,j_stab,k_stab,l_stab;
   PetscInt i1,i2,j1,j2,num_nonzero1,num_nonzero2,i_comb,j_comb;
@@ -136,7 +238,6 @@ void add_lin_recovery(PetscScalar a,PetscInt same_rate,operator error,char commu
    */
   PetscScalar this_row1[total_levels],this_row2[total_levels];
   PetscInt row_nonzeros1[total_levels],row_nonzeros2[total_levels];
-  stabilizer     *stabs;
 
   /*
    * We are calculating the recovery operator, which is defined as:
@@ -148,21 +249,9 @@ void add_lin_recovery(PetscScalar a,PetscInt same_rate,operator error,char commu
    * full_A matrix, never explicitly building R, but rather,
    * building I cross R^t R + (R^t R)* cross I + R* cross R
    */
-  PetscLogEventBegin(add_lin_recovery_event,0,0,0,0);
-  _check_initialized_A();
-  _lindblad_terms = 1;
-
   if (PetscAbsComplex(a)!=0) {
     MatGetOwnershipRange(full_A,&Istart,&Iend);
 
-    va_start(ap,n_stabilizers);
-    stabs = malloc(n_stabilizers*sizeof(struct stabilizer));
-    /* Loop through passed in ops and store in list */
-    for (i=0;i<n_stabilizers;i++){
-      stabs[i] = va_arg(ap,stabilizer);
-    }
-    va_end(ap);
-
     /*
      * Construct R^t R. Due to interesting relations among the pauli operators
      * (sig_i * sig_i) = I and sig_i = sig_i^t, as well as the fact that
@@ -424,7 +513,6 @@ void add_lin_recovery(PetscScalar a,PetscInt same_rate,operator error,char commu
       }
     }
   }
-  PetscLogEventEnd(add_lin_recovery_event,0,0,0,0);
   return;
 }
 
@@ -888,6 +976,7 @@ void add_encoded_gate_to_circuit(circuit *circ,PetscReal time,gate_type my_gate_
   (*circ).gate_list[(*circ).num_gates].time = time;
   (*circ).gate_list[(*circ).num_gates].my_gate_type = my_gate_type;
   (*circ).gate_list[(*circ).num_gates]._get_val_j_from_global_i = _get_val_j_functions_gates[my_gate_type+_min_gate_enum];
+  (*circ).gate_list[(*circ).num_gates].unitary = NULL;
 
   // Loop through and store qubits
   for (i=0;i<num_qubits;i++){
@@ -22,6 +22,7 @@ typedef struct encoded_qubit{
 
 void build_recovery_lin(Mat*,operator,char[],int,...);
 void add_lin_recovery(PetscScalar,PetscInt,operator,char[],int,...);
+void _add_lin_recovery_list(PetscScalar,PetscInt,operator,char[],int,stabilizer[]);
 void create_stabilizer(stabilizer*,int,...);
 void destroy_stabilizer(stabilizer*);
 void _get_row_nonzeros(PetscScalar[],PetscInt[],PetscInt*,PetscInt,operator,char[],int,stabilizer[]);
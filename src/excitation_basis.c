@@ -0,0 +1,298 @@
+#include "excitation_basis.h"
+#include "excitation_basis_p.h"
+#include "dicke_p.h"
+#include "quac_p.h"
+#include "operators_p.h"
+#include "operators.h"
+#include "quantum_gates.h"
+#include "error_correction.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+ * Excitation number truncated basis. With a cap of K, only the tensor
+ * product states |l_0 l_1 ... > with sum_q l_q <= K are kept, where l_q
+ * is the level of subsystem q; every term (product of operators) is
+ * projected onto that space as a whole, so a product such as q a^dag
+ * may pass through states above the cap. The kept states are numbered
+ * (ranked) in the order of their tensor product index, so psi has
+ * _basis_dim elements and rho has _basis_dim^2, stored as usual (column
+ * major, in the compact numbering).
+ *
+ * _basis_count[q][k] is the number of states of subsystems q,q+1,...
+ * with at most k excitations, which ranks a state without a lookup table
+ * of the full tensor product size; _basis_states unranks.
+ *
+ * The operators themselves still work with tensor product indices
+ * (total_levels is unchanged), so the superoperator index
+ * total_levels*C + R of two kept states must fit in a PetscInt.
+ */
+
+PetscInt _excitation_cap = -1;
+PetscInt _basis_dim      = 1;
+
+static PetscInt *_basis_count  = NULL;
+static PetscInt *_basis_states = NULL;
+static PetscInt _basis_strides[MAX_SUB];
+
+static void _basis_enumerate(int,PetscInt,PetscInt,PetscInt*);
+
+/*
+ * set_excitation_cap keeps only the states with at most max_excitations
+ * excitations in total (the sum of the levels of all subsystems). It must
+ * be called after all operators are created and before any terms are added
+ * or density matrices are created. This can also be set with the command
+ * line option -excitation_cap <max_excitations>.
+ *
+ * Only terms that are products of operators (add_to_ham, add_to_ham_p,
+ * add_lin, add_lin_p, ...) are supported, and VEC operators must come in
+ * pairs (use add_to_ham_p(a,2,v[1],v[1]) for |1><1|).
+ *
+ * Inputs:
+ *      PetscInt max_excitations: the excitation cap K
+ */
+void set_excitation_cap(PetscInt max_excitations){
+  if (op_finalized){
+    if (nid==0){
+      printf("ERROR! set_excitation_cap must be called before any terms are added!\n");
+      exit(0);
+    }
+  }
+  if (max_excitations<0){
+    if (nid==0){
+      printf("ERROR! The excitation cap must be non-negative!\n");
+      exit(0);
+    }
+  }
+  _excitation_cap = max_excitations;
+  return;
+}
+
+/*
+ * _basis_setup builds the rank and unrank tables of the truncated basis
+ * and sets _basis_dim. It is called by _check_initialized_A, when the
+ * operators are finalized.
+ */
+void _basis_setup(){
+  PetscInt q,k,l,K,count;
+  operator this_op;
+
+  PetscOptionsGetInt(NULL,NULL,"-excitation_cap",&_excitation_cap,NULL);
+  _basis_dim = total_levels;
+  if (_excitation_cap<0) return;
+
+  if (_matrix_free||_print_dense_ham){
+    if (nid==0){
+      printf("ERROR! The excitation cap is not supported with set_matrix_free or print_dense_ham!\n");
+      exit(0);
+    }
+  }
+  if (_num_dicke>0){
+    if (nid==0){
+      printf("ERROR! The excitation cap is not supported with ensembles (create_dicke)!\n");
+      exit(0);
+    }
+  }
+
+  K = _excitation_cap;
+  for (q=0;q<num_subsystems;q++){
+    this_op = subsystem_list[q];
+    _basis_strides[q] = total_levels/(this_op->my_levels*this_op->n_before);
+  }
+
+  /* _basis_count[q*(K+1)+k], with q = num_subsystems as the empty tail */
+  _basis_count = malloc((num_subsystems+1)*(K+1)*sizeof(PetscInt));
+  for (k=0;k<=K;k++){
+    _basis_count[num_subsystems*(K+1)+k] = 1;
+  }
+  for (q=num_subsystems-1;q>=0;q--){
+    for (k=0;k<=K;k++){
+      count = 0;
+      for (l=0;l<subsystem_list[q]->my_levels&&l<=k;l++){
+        count = count + _basis_count[(q+1)*(K+1)+k-l];
+      }
+      _basis_count[q*(K+1)+k] = count;
+    }
+  }
+  _basis_dim = _basis_count[K];
+
+  _basis_states = malloc(_basis_dim*sizeof(PetscInt));
+  count = 0;
+  _basis_enumerate(0,K,0,&count);
+
+  if (nid==0){
+    printf("Excitation cap %d: basis size %d (full tensor product %d)\n",
+           (int)K,(int)_basis_dim,(int)total_levels);
+  }
+  return;
+}
+
+/*
+ * _basis_check stops if the model uses something that works on the full
+ * tensor product space. It is called by _build_A.
+ */
+void _basis_check(){
+  if (_excitation_cap<0) return;
+  if (_stiff_solver||_num_time_dep+_num_time_dep_lin){
+    if (nid==0){
+      printf("ERROR! Stiff and time dependent terms are not supported with the excitation cap!\n");
+      exit(0);
+    }
+  }
+  if (_num_quantum_gates>0||_num_circuits>0||_discrete_ec){
+    if (nid==0){
+      printf("ERROR! Gates and error correction are not supported with the excitation cap!\n");
+      exit(0);
+    }
+  }
+  return;
+}
+
+/*
+ * _basis_state gives the tensor product state of basis state i
+ */
+PetscInt _basis_state(PetscInt i){
+  if (_excitation_cap<0) return i;
+  return _basis_states[i];
+}
+
+/*
+ * _basis_rank gives the basis state of tensor product state s,
+ * or -1 if s has more than _excitation_cap excitations
+ */
+PetscInt _basis_rank(PetscInt s){
+  PetscInt q,k,l,m,K,rank;
+
+  if (_excitation_cap<0) return s;
+  K    = _excitation_cap;
+  k    = K;
+  rank = 0;
+  for (q=0;q<num_subsystems;q++){
+    l = (s/_basis_strides[q])%subsystem_list[q]->my_levels;
+    if (l>k) return -1;
+    for (m=0;m<l;m++){
+      rank = rank + _basis_count[(q+1)*(K+1)+k-m];
+    }
+    k = k - l;
+  }
+  return rank;
+}
+
+/*
+ * _basis_allowed returns 1 if the tensor product index full_i (of psi, or
+ * of rho, full_i = total_levels*C + R) only involves states within the cap
+ */
+int _basis_allowed(PetscInt full_i){
+  return (_basis_rank(full_i%total_levels)>=0&&_basis_rank(full_i/total_levels)>=0);
+}
+
+/*
+ * _basis_full_index converts an index of the truncated psi or rho
+ * (i = _basis_dim*c + r) into the tensor product index
+ */
+PetscInt _basis_full_index(PetscInt i){
+  if (_excitation_cap<0) return i;
+  return total_levels*_basis_states[i/_basis_dim] + _basis_states[i%_basis_dim];
+}
+
+/*
+ * _basis_index converts a tensor product index of psi or rho into the
+ * index of the truncated psi or rho, or -1 if it is outside of the cap
+ */
+PetscInt _basis_index(PetscInt full_i){
+  PetscInt r,c;
+
+  if (_excitation_cap<0) return full_i;
+  r = _basis_rank(full_i%total_levels);
+  c = _basis_rank(full_i/total_levels);
+  if (r<0||c<0) return -1;
+  return _basis_dim*c + r;
+}
+
+/*
+ * _basis_partial_trace traces the truncated full_dm over the subsystems
+ * with traced[q] = 1. ptraced_dm is over the other subsystems, in the
+ * full tensor product of their levels.
+ */
+void _basis_partial_trace(Vec full_dm,Vec ptraced_dm,int traced[]){
+  PetscInt          i,q,R,C,lr,lc,kr,kc,kept_dim,dm_size,my_start,my_end;
+  PetscInt          kept_strides[MAX_SUB];
+  const PetscScalar *xa;
+  int               same;
+
+  kept_dim = 1;
+  for (q=num_subsystems-1;q>=0;q--){
+    kept_strides[q] = kept_dim;
+    if (!traced[q]) kept_dim = kept_dim*subsystem_list[q]->my_levels;
+  }
+  VecGetSize(ptraced_dm,&dm_size);
+  if (dm_size!=kept_dim*kept_dim){
+    if (nid==0){
+      printf("ERROR! ptraced_dm is not the size of the traced over density matrix!\n");
+      exit(0);
+    }
+  }
+
+  VecSet(ptraced_dm,0.0);
+  VecGetOwnershipRange(full_dm,&my_start,&my_end);
+  VecGetArrayRead(full_dm,&xa);
+  for (i=my_start;i<my_end;i++){
+    if (xa[i-my_start]==0.0) continue;
+    R    = _basis_states[i%_basis_dim];
+    C    = _basis_states[i/_basis_dim];
+    kr   = 0;
+    kc   = 0;
+    same = 1;
+    for (q=0;q<num_subsystems;q++){
+      lr = (R/_basis_strides[q])%subsystem_list[q]->my_levels;
+      lc = (C/_basis_strides[q])%subsystem_list[q]->my_levels;
+      if (traced[q]){
+        if (lr!=lc){
+          same = 0;
+          break;
+        }
+      } else {
+        kr = kr + lr*kept_strides[q];
+        kc = kc + lc*kept_strides[q];
+      }
+    }
+    if (same){
+      VecSetValue(ptraced_dm,kept_dim*kc+kr,xa[i-my_start],ADD_VALUES);
+    }
+  }
+  VecRestoreArrayRead(full_dm,&xa);
+  VecAssemblyBegin(ptraced_dm);
+  VecAssemblyEnd(ptraced_dm);
+  return;
+}
+
+/*
+ * _basis_clear removes the excitation cap, for QuaC_clear
+ */
+void _basis_clear(){
+  free(_basis_count);
+  free(_basis_states);
+  _basis_count    = NULL;
+  _basis_states   = NULL;
+  _excitation_cap = -1;
+  _basis_dim      = 1;
+  return;
+}
+
+/*
+ * _basis_enumerate lists the states of subsystems q,q+1,... with at most
+ * k excitations in tensor product order, adding them to state
+ */
+static void _basis_enumerate(int q,PetscInt k,PetscInt state,PetscInt *count){
+  PetscInt l;
+
+  if (q==num_subsystems){
+    _basis_states[*count] = state;
+    *count = *count + 1;
+    return;
+  }
+  for (l=0;l<subsystem_list[q]->my_levels&&l<=k;l++){
+    _basis_enumerate(q+1,k-l,state+l*_basis_strides[q],count);
+  }
+  return;
+}
@@ -0,0 +1,8 @@
+#ifndef EXCITATION_BASIS_H_
+#define EXCITATION_BASIS_H_
+
+#include <petsc.h>
+
+void set_excitation_cap(PetscInt);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef EXCITATION_BASIS_P_H_
+#define EXCITATION_BASIS_P_H_
+
+#include <petscvec.h>
+
+void     _basis_setup();
+void     _basis_check();
+void     _basis_clear();
+PetscInt _basis_state(PetscInt);
+PetscInt _basis_rank(PetscInt);
+int      _basis_allowed(PetscInt);
+PetscInt _basis_full_index(PetscInt);
+PetscInt _basis_index(PetscInt);
+void     _basis_partial_trace(Vec,Vec,int[]);
+
+extern PetscInt _excitation_cap;
+extern PetscInt _basis_dim;
+
+#endif
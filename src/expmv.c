@@ -0,0 +1,491 @@
+#include "expmv_p.h"
+#include "quac_p.h"
+#include "operators_p.h"
+#include "operators.h"
+#include "solver_p.h"
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+ * Krylov propagation of a time independent (or piecewise constant)
+ * system, x(t) = exp(A t) x(0), following expv from Expokit
+ * (R. B. Sidje, ACM Trans. Math. Softw. 24, 130 (1998)).
+ *
+ * Each step builds an m dimensional Krylov basis of A with Arnoldi,
+ * x(t+t_step) = beta V exp(t_step H) e_1, and picks t_step as large
+ * as the a posteriori error estimate allows. Output times that fall
+ * inside an accepted step are evaluated from the same basis, so the
+ * number of MatMults does not depend on how often the output is wanted.
+ */
+
+#define EXPMV_BREAKDOWN_TOL 1e-7
+#define EXPMV_GAMMA         0.9
+#define EXPMV_DELTA         1.2
+#define EXPMV_MAX_REJECT    10
+#define EXPMV_PADE_DEGREE   6
+
+int       _krylov_expmv = 0;
+PetscInt  _krylov_dim   = 30;
+PetscReal _krylov_tol   = 1e-7;
+
+static expmv_ctx _expmv;
+
+static void      _dense_matmult(PetscInt,PetscScalar,PetscScalar*,PetscScalar*,PetscScalar*);
+static void      _dense_solve(PetscInt,PetscScalar*,PetscScalar*);
+static PetscReal _round_step(PetscReal);
+static void      _expmv_combine(Vec,PetscInt,PetscReal,PetscScalar*);
+static PetscReal _expmv_out_time(PetscInt);
+
+/*
+ * set_krylov_expmv tells time_step to propagate with exp(A dt) x, computed
+ * with an adaptive Krylov method, rather than with a Runge-Kutta TS.
+ * This is only used when there are no time dependent terms; circuits
+ * are applied between the (constant) segments. The dt passed to time_step
+ * sets the times at which the ts_monitor is called, not the step size.
+ * This can also be turned on with the command line option -krylov_expmv
+ * (with -krylov_dim and -krylov_tol). QuaC_clear turns it off.
+ *
+ * Inputs:
+ *      PetscInt  krylov_dim: dimension of the Krylov space (Expokit uses 30)
+ *      PetscReal tol:        requested local error tolerance per unit time
+ */
+void set_krylov_expmv(PetscInt krylov_dim,PetscReal tol){
+  if (krylov_dim<2){
+    if (nid==0){
+      printf("ERROR! The Krylov dimension must be at least 2!\n");
+      exit(0);
+    }
+  }
+  _krylov_expmv = 1;
+  _krylov_dim   = krylov_dim;
+  _krylov_tol   = tol;
+  return;
+}
+
+/*
+ * _expmv_out_time gives output time k, from the schedule or the grid
+ */
+static PetscReal _expmv_out_time(PetscInt k){
+  if (_expmv.num_out>0){
+    if (k>=_expmv.num_out) return PETSC_MAX_REAL;
+    return _expmv.t_out[k];
+  }
+  return _expmv.out_start + k*_expmv.dt_out;
+}
+
+/*
+ * _expmv_setup allocates the Krylov basis and sets the output grid. The
+ * output schedule of set_output_times, if there is one, replaces the grid.
+ * Inputs:
+ *      Mat       A:         the (assembled) matrix to exponentiate
+ *      Vec       x:         a vector of the right layout
+ *      int       mf_solve:  1 if A is the matrix-free MatShell (no MatNorm)
+ *      PetscReal out_start: time of the first output
+ *      PetscReal dt_out:    time between outputs
+ */
+void _expmv_setup(Mat A,Vec x,int mf_solve,PetscReal out_start,PetscReal dt_out){
+  PetscInt  m,mh;
+  PetscReal norm_x,norm_ax;
+  Vec       ax;
+
+  m  = _krylov_dim;
+  mh = m + 2;
+  _expmv.m         = m;
+  _expmv.tol       = _krylov_tol;
+  _expmv.out_start = out_start;
+  _expmv.dt_out    = dt_out;
+  _expmv.next_out  = 1;
+  _expmv.num_out   = _num_output_times;
+  _expmv.t_out     = _output_times;
+  if (_expmv.num_out>0){
+    _expmv.next_out = _first_output_index(out_start);
+  }
+  _expmv.t_new     = 0.0;
+  _expmv.num_steps    = 0;
+  _expmv.num_rejected = 0;
+  _expmv.num_mults    = 0;
+
+  VecDuplicateVecs(x,m+1,&_expmv.V);
+  VecDuplicate(x,&_expmv.w_out);
+  PetscMalloc1(mh*mh,&_expmv.H);
+  PetscMalloc1(mh*mh,&_expmv.F);
+  PetscMalloc1(6*mh*mh,&_expmv.work);
+
+  /* |A| is only used for the first step size and the roundoff estimate */
+  if (!mf_solve){
+    MatNorm(A,NORM_INFINITY,&_expmv.anorm);
+  } else {
+    VecDuplicate(x,&ax);
+    MatMult(A,x,ax);
+    VecNorm(x,NORM_2,&norm_x);
+    VecNorm(ax,NORM_2,&norm_ax);
+    VecDestroy(&ax);
+    _expmv.num_mults = 1;
+    _expmv.anorm = (norm_x>0) ? norm_ax/norm_x : 0.0;
+  }
+  if (nid==0) printf("Using Krylov expmv propagator, m = %d, tol = %e\n",(int)m,(double)_expmv.tol);
+  return;
+}
+
+/*
+ * _expmv_propagate sets x = exp(A (t1-t0)) x, calling the ts_monitor
+ * (if there is one) at every output time in (t0,t1].
+ * Inputs:
+ *      Mat       A:  the matrix to exponentiate
+ *      Vec       x:  on input, x(t0); on output, x(t1)
+ *      PetscReal t0: start time
+ *      PetscReal t1: end time
+ *      TS        ts: passed to the ts_monitor
+ */
+void _expmv_propagate(Mat A,Vec x,PetscReal t0,PetscReal t1,TS ts){
+  PetscInt    m,mh,mb,mx,i,j,k1,ireject;
+  PetscReal   t_now,t_out,t_step,t_next_out,beta,hj1j,avnorm,err_loc,xm,phi1,phi2,fact,s;
+  PetscScalar *H,*F;
+  Vec         *V,p;
+
+  m  = _expmv.m;
+  mh = m + 2;
+  V  = _expmv.V;
+  H  = _expmv.H;
+  F  = _expmv.F;
+  p  = _expmv.w_out;
+
+  t_out = t1 - t0;
+  t_now = 0.0;
+  VecNorm(x,NORM_2,&beta);
+  if (t_out<=0||beta==0) return;
+
+  if (_expmv.t_new<=0){
+    /* First step size from the a priori bound */
+    fact = pow((m+1)/exp(1.0),m+1)*sqrt(2*PETSC_PI*(m+1));
+    if (_expmv.anorm>0){
+      _expmv.t_new = (1.0/_expmv.anorm)*pow((fact*_expmv.tol)/(4*beta*_expmv.anorm),1.0/m);
+      _expmv.t_new = _round_step(_expmv.t_new);
+    } else {
+      _expmv.t_new = t_out;
+    }
+  }
+
+  xm = 1.0/m;
+  while (t_now<t_out){
+    _expmv.num_steps = _expmv.num_steps + 1;
+    t_step = PetscMin(t_out-t_now,_expmv.t_new);
+
+    /* Arnoldi */
+    for (i=0;i<mh*mh;i++) H[i] = 0.0;
+    VecCopy(x,V[0]);
+    VecScale(V[0],1.0/beta);
+    k1     = 2;
+    mb     = m;
+    avnorm = 0.0;
+    for (j=0;j<m;j++){
+      MatMult(A,V[j],p);
+      _expmv.num_mults = _expmv.num_mults + 1;
+      /* Classical Gram-Schmidt, done twice for stability */
+      VecMDot(p,j+1,V,_expmv.work);
+      for (i=0;i<=j;i++) _expmv.work[i] = -_expmv.work[i];
+      VecMAXPY(p,j+1,_expmv.work,V);
+      for (i=0;i<=j;i++) H[i*mh+j] = -_expmv.work[i];
+      VecMDot(p,j+1,V,_expmv.work);
+      for (i=0;i<=j;i++) _expmv.work[i] = -_expmv.work[i];
+      VecMAXPY(p,j+1,_expmv.work,V);
+      for (i=0;i<=j;i++) H[i*mh+j] = H[i*mh+j] - _expmv.work[i];
+
+      VecNorm(p,NORM_2,&hj1j);
+      if (hj1j<=EXPMV_BREAKDOWN_TOL){
+        /* Happy breakdown; the Krylov space is invariant, so the step is exact */
+        k1     = 0;
+        mb     = j + 1;
+        t_step = t_out - t_now;
+        break;
+      }
+      H[(j+1)*mh+j] = hj1j;
+      VecCopy(p,V[j+1]);
+      VecScale(V[j+1],1.0/hj1j);
+    }
+    if (k1!=0){
+      H[(m+1)*mh+m] = 1.0;
+      MatMult(A,V[m],p);
+      _expmv.num_mults = _expmv.num_mults + 1;
+      VecNorm(p,NORM_2,&avnorm);
+    }
+
+    /* Error estimate; shrink the step until it is accepted */
+    ireject = 0;
+    while (1){
+      mx = mb + k1;
+      _dense_expm(mx,mh,H,t_step,F,_expmv.work+2*mh*mh);
+      if (k1==0){
+        err_loc = EXPMV_BREAKDOWN_TOL;
+        break;
+      }
+      phi1 = PetscAbsComplex(beta*F[m*mh]);
+      phi2 = PetscAbsComplex(beta*F[(m+1)*mh]*avnorm);
+      if (phi1>10*phi2){
+        err_loc = phi2;
+        xm      = 1.0/m;
+      } else if (phi1>phi2){
+        err_loc = (phi1*phi2)/(phi1-phi2);
+        xm      = 1.0/m;
+      } else {
+        err_loc = phi1;
+        xm      = 1.0/(m-1);
+      }
+      if (err_loc<=EXPMV_DELTA*t_step*_expmv.tol) break;
+      if (ireject==EXPMV_MAX_REJECT){
+        if (nid==0){
+          printf("ERROR! The Krylov expmv step was rejected too many times!\n");
+          printf("       Try a larger -krylov_dim or -krylov_tol.\n");
+          exit(0);
+        }
+      }
+      t_step  = EXPMV_GAMMA*t_step*pow(t_step*_expmv.tol/err_loc,xm);
+      t_step  = _round_step(t_step);
+      ireject = ireject + 1;
+      _expmv.num_rejected = _expmv.num_rejected + 1;
+    }
+    mx = mb + PetscMax(0,k1-1);
+
+    /* Output times inside this step reuse the basis */
+    if (_ts_monitor!=NULL){
+      t_next_out = _expmv_out_time(_expmv.next_out) - t0;
+      while (t_next_out<=t_now+t_step*(1+PETSC_SMALL)&&t_next_out<=t_out*(1+PETSC_SMALL)){
+        s = t_next_out - t_now;
+        if (s>0){
+          _dense_expm(mb+k1,mh,H,s,_expmv.work+mh*mh,_expmv.work+2*mh*mh);
+          _expmv_combine(_expmv.w_out,mx,beta,_expmv.work+mh*mh);
+        } else {
+          VecCopy(x,_expmv.w_out);
+        }
+        TSSetTime(ts,t0+t_next_out);
+        _ts_monitor(ts,_expmv.next_out,t0+t_next_out,_expmv.w_out,_tsctx);
+        _expmv.next_out = _expmv.next_out + 1;
+        t_next_out = _expmv_out_time(_expmv.next_out) - t0;
+      }
+    }
+
+    /* x = beta V F e_1 */
+    _expmv_combine(x,mx,beta,F);
+    VecNorm(x,NORM_2,&beta);
+    t_now = t_now + t_step;
+
+    if (k1!=0){
+      _expmv.t_new = EXPMV_GAMMA*t_step*pow(t_step*_expmv.tol/err_loc,xm);
+      _expmv.t_new = _round_step(_expmv.t_new);
+    }
+  }
+  TSSetTime(ts,t1);
+  return;
+}
+
+/*
+ * _expmv_finish prints the propagator statistics and frees the basis.
+ */
+void _expmv_finish(){
+  if (nid==0) {
+    printf("Krylov expmv: %d steps, %d rejected, %d MatMults\n",(int)_expmv.num_steps,
+           (int)_expmv.num_rejected,(int)_expmv.num_mults);
+  }
+  VecDestroyVecs(_expmv.m+1,&_expmv.V);
+  VecDestroy(&_expmv.w_out);
+  PetscFree(_expmv.H);
+  PetscFree(_expmv.F);
+  PetscFree(_expmv.work);
+  return;
+}
+
+/*
+ * _expmv_combine sets y = beta * sum_{i<mx} F[i][0] V[i]
+ */
+static void _expmv_combine(Vec y,PetscInt mx,PetscReal beta,PetscScalar *F){
+  PetscInt    i,mh;
+  PetscScalar coeffs[mx];
+
+  mh = _expmv.m + 2;
+  for (i=0;i<mx;i++){
+    coeffs[i] = beta*F[i*mh];
+  }
+  VecSet(y,0.0);
+  VecMAXPY(y,mx,coeffs,_expmv.V);
+  return;
+}
+
+/*
+ * _dense_expm sets F = exp(t H) for the leading n x n block of the
+ * (row major, leading dimension ld) matrix H, using the irreducible
+ * rational Pade approximation with scaling and squaring (Expokit's zgpadm).
+ * work must hold 4*n*n scalars.
+ */
+void _dense_expm(PetscInt n,PetscInt ld,PetscScalar *H,PetscReal t,PetscScalar *F,PetscScalar *work){
+  PetscInt    i,j,k,ns,odd;
+  PetscReal   c[EXPMV_PADE_DEGREE+1],hnorm,row_sum,scale;
+  PetscScalar *H2,*P,*Q,*tmp,*A;
+
+  A   = work;
+  H2  = work + n*n;
+  tmp = work + 2*n*n;
+  Q   = work + 3*n*n;
+  P   = F;
+
+  /* Pade coefficients */
+  c[0] = 1.0;
+  for (k=1;k<=EXPMV_PADE_DEGREE;k++){
+    c[k] = c[k-1]*(EXPMV_PADE_DEGREE+1-k)/(k*(2.0*EXPMV_PADE_DEGREE+1-k));
+  }
+
+  /* Scaling: ns such that |t H / 2^ns| < 1/2 */
+  hnorm = 0.0;
+  for (i=0;i<n;i++){
+    row_sum = 0.0;
+    for (j=0;j<n;j++){
+      row_sum = row_sum + PetscAbsComplex(H[i*ld+j]);
+    }
+    hnorm = PetscMax(hnorm,row_sum);
+  }
+  hnorm = PetscAbsReal(t)*hnorm;
+  ns = 0;
+  if (hnorm>0){
+    ns = PetscMax(0,(PetscInt)(log(hnorm)/log(2.0))+2);
+  }
+  scale = t/pow(2.0,ns);
+
+  /* H2 = scale^2 H*H, with A holding the compact copy of H */
+  for (i=0;i<n;i++){
+    for (j=0;j<n;j++){
+      A[i*n+j] = H[i*ld+j];
+    }
+  }
+  _dense_matmult(n,scale*scale,A,A,H2);
+
+  /* Horner evaluation of the even and odd parts */
+  for (i=0;i<n*n;i++){
+    P[i] = 0.0;
+    tmp[i] = 0.0;
+  }
+  for (i=0;i<n;i++){
+    P[i*n+i]   = c[EXPMV_PADE_DEGREE-1];
+    tmp[i*n+i] = c[EXPMV_PADE_DEGREE];
+  }
+  /* tmp holds q, P holds p; alternate which one gets multiplied by H2 */
+  odd = 1;
+  for (k=EXPMV_PADE_DEGREE-1;k>0;k--){
+    if (odd){
+      _dense_matmult(n,1.0,tmp,H2,Q);
+      for (i=0;i<n;i++) Q[i*n+i] = Q[i*n+i] + c[k-1];
+      for (i=0;i<n*n;i++) tmp[i] = Q[i];
+    } else {
+      _dense_matmult(n,1.0,P,H2,Q);
+      for (i=0;i<n;i++) Q[i*n+i] = Q[i*n+i] + c[k-1];
+      for (i=0;i<n*n;i++) P[i] = Q[i];
+    }
+    odd = 1 - odd;
+  }
+  /* Multiply the odd part by scale*H; A still holds H */
+  if (odd){
+    _dense_matmult(n,scale,tmp,A,Q);
+    for (i=0;i<n*n;i++) tmp[i] = Q[i];
+  } else {
+    _dense_matmult(n,scale,P,A,Q);
+    for (i=0;i<n*n;i++) P[i] = Q[i];
+  }
+
+  /* exp(scale H) ~ +/- (I + 2 (q-p)^-1 p) */
+  for (i=0;i<n*n;i++) tmp[i] = tmp[i] - P[i];
+  _dense_solve(n,tmp,P);
+  for (i=0;i<n*n;i++) P[i] = 2.0*P[i];
+  for (i=0;i<n;i++) P[i*n+i] = P[i*n+i] + 1.0;
+  if (odd){
+    for (i=0;i<n*n;i++) P[i] = -P[i];
+  }
+
+  /* Squaring */
+  for (k=0;k<ns;k++){
+    _dense_matmult(n,1.0,P,P,Q);
+    for (i=0;i<n*n;i++) P[i] = Q[i];
+  }
+
+  /* Expand F from n x n to leading dimension ld, in place, back to front */
+  for (i=n-1;i>=0;i--){
+    for (j=n-1;j>=0;j--){
+      F[i*ld+j] = F[i*n+j];
+    }
+  }
+  for (i=0;i<ld;i++){
+    for (j=0;j<ld;j++){
+      if (i>=n||j>=n) F[i*ld+j] = 0.0;
+    }
+  }
+  return;
+}
+
+/*
+ * _dense_matmult sets C = alpha A B for n x n row major matrices
+ */
+static void _dense_matmult(PetscInt n,PetscScalar alpha,PetscScalar *A,PetscScalar *B,PetscScalar *C){
+  PetscInt    i,j,k;
+  PetscScalar sum;
+
+  for (i=0;i<n;i++){
+    for (j=0;j<n;j++){
+      sum = 0.0;
+      for (k=0;k<n;k++){
+        sum = sum + A[i*n+k]*B[k*n+j];
+      }
+      C[i*n+j] = alpha*sum;
+    }
+  }
+  return;
+}
+
+/*
+ * _dense_solve overwrites B with A^-1 B (n x n, row major), using
+ * Gaussian elimination with partial pivoting. A is destroyed.
+ */
+static void _dense_solve(PetscInt n,PetscScalar *A,PetscScalar *B){
+  PetscInt    i,j,k,piv;
+  PetscScalar tmp,factor;
+
+  for (k=0;k<n;k++){
+    piv = k;
+    for (i=k+1;i<n;i++){
+      if (PetscAbsComplex(A[i*n+k])>PetscAbsComplex(A[piv*n+k])) piv = i;
+    }
+    if (piv!=k){
+      for (j=0;j<n;j++){
+        tmp = A[k*n+j];   A[k*n+j] = A[piv*n+j];   A[piv*n+j] = tmp;
+        tmp = B[k*n+j];   B[k*n+j] = B[piv*n+j];   B[piv*n+j] = tmp;
+      }
+    }
+    for (i=k+1;i<n;i++){
+      factor = A[i*n+k]/A[k*n+k];
+      for (j=k;j<n;j++){
+        A[i*n+j] = A[i*n+j] - factor*A[k*n+j];
+      }
+      for (j=0;j<n;j++){
+        B[i*n+j] = B[i*n+j] - factor*B[k*n+j];
+      }
+    }
+  }
+  for (k=n-1;k>=0;k--){
+    for (j=0;j<n;j++){
+      tmp = B[k*n+j];
+      for (i=k+1;i<n;i++){
+        tmp = tmp - A[k*n+i]*B[i*n+j];
+      }
+      B[k*n+j] = tmp/A[k*n+k];
+    }
+  }
+  return;
+}
+
+/*
+ * _round_step rounds a step size up to two significant digits, as Expokit does
+ */
+static PetscReal _round_step(PetscReal t_step){
+  PetscReal s;
+
+  if (t_step<=0) return t_step;
+  s = pow(10.0,floor(log10(t_step))-1);
+  return ceil(t_step/s)*s;
+}
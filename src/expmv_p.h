@@ -0,0 +1,37 @@
+#ifndef EXPMV_P_H_
+#define EXPMV_P_H_
+
+#include <petscmat.h>
+#include <petscts.h>
+
+/*
+ * Context for the Krylov propagator. V holds the m+1 Arnoldi vectors,
+ * H the (m+2) x (m+2) augmented Hessenberg matrix and F = exp(t H).
+ * work holds the Gram-Schmidt coefficients, the exp(s H) used for
+ * output inside a step, and the scratch space of the dense exponential.
+ * Output times are out_start + k*dt_out, k = next_out, next_out+1, ...,
+ * or t_out[k] if an output schedule was set (num_out > 0).
+ */
+typedef struct expmv_ctx{
+  PetscInt    m;
+  PetscReal   tol,anorm,t_new;
+  Vec         *V,w_out;
+  PetscScalar *H,*F,*work;
+  PetscReal   out_start,dt_out;
+  PetscInt    next_out,num_out;
+  PetscReal   *t_out;
+  PetscInt    num_steps,num_rejected,num_mults;
+} expmv_ctx;
+
+void _expmv_setup(Mat,Vec,int,PetscReal,PetscReal);
+void _expmv_propagate(Mat,Vec,PetscReal,PetscReal,TS);
+void _expmv_finish();
+void _dense_expm(PetscInt,PetscInt,PetscScalar*,PetscReal,PetscScalar*,PetscScalar*);
+
+extern int       _krylov_expmv;
+extern PetscErrorCode (*_ts_monitor)(TS,PetscInt,PetscReal,Vec,void*);
+extern void      *_tsctx;
+extern PetscInt  _krylov_dim;
+extern PetscReal _krylov_tol;
+
+#endif
@@ -1,5 +1,7 @@
 #include "operators.h"
 #include "kron_p.h" //Includes operators_p.h
+#include "excitation_basis_p.h"
+#include "dicke_p.h"
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -41,6 +43,12 @@ long _get_loop_limit(op_type my_op_type,int my_levels){
     }
     /* Qubit Pauli Operators also need to loop through all my_levels */
     loop_limit = 0;
+  } else if (my_op_type==DICKE_LOWER||my_op_type==DICKE_RAISE||my_op_type==DICKE_NUMBER||my_op_type==DICKE_SIGMA_Z){
+    /* Ensemble operators are only built row by row (_get_val_j_from_global_i) */
+    if (nid==0){
+      printf("ERROR! Ensemble operators are not supported with print_dense_ham!\n");
+      exit(0);
+    }
   }
   return loop_limit;
 }
@@ -171,7 +179,7 @@ PetscScalar _get_val_in_subspace(long i,op_type my_op_type,int position,long *i_
   */
 
 void _get_val_j_from_global_i(PetscInt i,operator this_op,PetscInt *j,PetscScalar *val,PetscInt tensor_control){
-  PetscInt i_sub,n_after,tmp_int,k1,k2,extra_after,j_i1,j_i2,i1,i2;
+  PetscInt i_sub,n_after,tmp_int,k1,k2,extra_after,j_i1,j_i2,i1,i2,two_j,two_m,shift;
   PetscScalar val_i1,val_i2;
 
   /*
@@ -327,6 +335,42 @@ void _get_val_j_from_global_i(PetscInt i,operator this_op,PetscInt *j,PetscScala
           exit(0);
         }
       }
+    } else if (this_op->my_op_type==DICKE_LOWER||this_op->my_op_type==DICKE_RAISE){
+      /*
+       * Collective J_- (J_+) of an ensemble. Within the block j of
+       * level i_sub = |j,m>, row m has its nonzero in column m+1 (m-1),
+       * which is the next (previous) level:
+       *    J_-: val = sqrt((j-m)(j+m+1))
+       *    J_+: val = sqrt((j+m)(j-m+1))
+       */
+      _dicke_level_jm(this_op,i_sub,&two_j,&two_m);
+      if (this_op->my_op_type==DICKE_LOWER){
+        shift = 1;
+      } else {
+        shift = -1;
+      }
+      if (PetscAbsInt(two_m+2*shift)>two_j){
+        //There is no nonzero value for given global i; return -1 as flag
+        *j = -1;
+        *val = 0.0;
+      } else {
+        *j   = i + shift*n_after;
+        *val = sqrt((two_j-shift*two_m)*(two_j+shift*two_m+2)/4.0);
+      }
+    } else if (this_op->my_op_type==DICKE_NUMBER||this_op->my_op_type==DICKE_SIGMA_Z){
+      /* J_z + N/2 or 2 J_z of an ensemble; diagonal, even in global space */
+      _dicke_level_jm(this_op,i_sub,&two_j,&two_m);
+      if (this_op->my_op_type==DICKE_NUMBER){
+        *val = (two_m+this_op->num_emitters)/2.0;
+      } else {
+        *val = (double)two_m;
+      }
+      if (*val!=0.0){
+        *j = i;
+      } else {
+        //There is no nonzero value for given global i; return -1 as flag
+        *j = -1;
+      }
     } else {
 
       /* Vec operator */
@@ -564,6 +608,25 @@ void _add_ops_to_mat_ham(PetscScalar a,Mat A,PetscInt num_ops,operator *ops){
   return;
 }
 
+/*
+ * _add_ops_to_mat_ham_psi adds -i a G, with G = ops[0]*...*ops[n-1], to the
+ * total_levels x total_levels matrix A (ham_A, for the Schrodinger solver).
+ * _add_ops_to_mat_ham builds the superoperator instead, which only fits full_A.
+ */
+void _add_ops_to_mat_ham_psi(PetscScalar a,Mat A,PetscInt num_ops,operator *ops){
+  PetscInt    i,j,Istart,Iend;
+  PetscScalar val;
+
+  MatGetOwnershipRange(A,&Istart,&Iend);
+  for (i=Istart;i<Iend;i++){
+    _get_ops_row_j(i,num_ops,ops,&j,&val,-1,0);
+    if (j!=-1){
+      MatSetValue(A,i,j,-a*PETSC_i*val,ADD_VALUES);
+    }
+  }
+  return;
+}
+
 void _add_ops_to_mat_lin(PetscScalar a,Mat A,PetscInt num_ops,operator *ops){
   PetscInt i,j,j_ig,j_gi,j_gg,this_j_ig,this_j_gi,Istart,Iend,this_j_gg;
   PetscScalar    val_ig,val_gi,val_gg,tmp_val;
@@ -690,6 +753,149 @@ void _add_ops_to_mat_lin(PetscScalar a,Mat A,PetscInt num_ops,operator *ops){
   return;
 }
 
+/*
+ * _get_ops_row_j finds the single nonzero j (and its value) in row i of
+ * G = ops[0]*ops[1]*...*ops[n-1] (dag=0), or of G^t (dag=1), expanded
+ * according to tensor_control, as in _get_val_j_from_global_i.
+ * j is -1 if row i is zero. VEC operators must come in pairs.
+ * With an excitation cap, the product is projected onto the truncated
+ * basis, P G P; the states in between may have more excitations (a
+ * hopping term q a^dag acts on |a=1> through |a=1,q=1>).
+ */
+void _get_ops_row_j(PetscInt i,PetscInt num_ops,operator *ops,PetscInt *j,PetscScalar *val,
+                    PetscInt tensor_control,int dag){
+  PetscInt        k,this_i,this_j;
+  PetscScalar     this_val;
+  struct operator dag_op;
+
+  this_i = i;
+  *val   = 1.0;
+  if (!dag){
+    for (k=0;k<num_ops;k++){
+      if (ops[k]->my_op_type==VEC){
+        _get_val_j_from_global_i_vec_vec(this_i,ops[k],ops[k+1],&this_j,&this_val,tensor_control);
+        k = k + 1;
+      } else {
+        _get_val_j_from_global_i(this_i,ops[k],&this_j,&this_val,tensor_control);
+      }
+      if (this_j==-1){
+        *j   = -1;
+        *val = 0.0;
+        return;
+      }
+      this_i = this_j;
+      *val   = this_val * *val;
+    }
+  } else {
+    /* G^t = ops[n-1]^t ... ops[0]^t */
+    for (k=num_ops-1;k>=0;k--){
+      if (ops[k]->my_op_type==VEC){
+        /* (|1><2|)^t = |2><1|; the pair is ops[k-1],ops[k] */
+        _get_val_j_from_global_i_vec_vec(this_i,ops[k],ops[k-1],&this_j,&this_val,tensor_control);
+        k = k - 1;
+      } else if (ops[k]->my_op_type==LOWER||ops[k]->my_op_type==RAISE||
+                 ops[k]->my_op_type==DICKE_LOWER||ops[k]->my_op_type==DICKE_RAISE){
+        dag_op = *ops[k];
+        if (ops[k]->my_op_type==LOWER){
+          dag_op.my_op_type = RAISE;
+        } else if (ops[k]->my_op_type==RAISE){
+          dag_op.my_op_type = LOWER;
+        } else if (ops[k]->my_op_type==DICKE_LOWER){
+          dag_op.my_op_type = DICKE_RAISE;
+        } else {
+          dag_op.my_op_type = DICKE_LOWER;
+        }
+        _get_val_j_from_global_i(this_i,&dag_op,&this_j,&this_val,tensor_control);
+      } else {
+        /* All other operators are Hermitian */
+        _get_val_j_from_global_i(this_i,ops[k],&this_j,&this_val,tensor_control);
+      }
+      if (this_j==-1){
+        *j   = -1;
+        *val = 0.0;
+        return;
+      }
+      this_i = this_j;
+      *val   = this_val * *val;
+    }
+  }
+  if (_excitation_cap>=0&&!_basis_allowed(this_i)){
+    *j   = -1;
+    *val = 0.0;
+    return;
+  }
+  *j = this_i;
+  return;
+}
+
+/*
+ * _get_ops_row_ham appends the nonzeros of row i of the superoperator that
+ * _add_ops_to_mat_ham adds, -i a (I cross G) + i a (G^T cross I), to cols and vals.
+ * _add_ops_to_mat_ham adds G^T cross I by columns; here we take row i directly.
+ * _get_ops_row_j with dag=1 walks the rows of G^H = (G^T)*, and
+ * tensor_control=1 conjugates each value, so the result is a row of G^T
+ * (for sig_y, -sig_y rather than sig_y).
+ */
+void _get_ops_row_ham(PetscScalar a,PetscInt i,PetscInt num_ops,operator *ops,PetscInt *num_cols,
+                      PetscInt cols[],PetscScalar vals[]){
+  PetscInt    j;
+  PetscScalar val;
+
+  //Add -i * I cross G_1 G_2 ... G_n
+  _get_ops_row_j(i,num_ops,ops,&j,&val,-1,0);
+  if (j!=-1){
+    cols[*num_cols] = j;
+    vals[*num_cols] = -a*PETSC_i*val;
+    *num_cols = *num_cols + 1;
+  }
+
+  //Add i * G_1*T G_2*T ... G_n*T cross I
+  _get_ops_row_j(i,num_ops,ops,&j,&val,1,1);
+  if (j!=-1){
+    cols[*num_cols] = j;
+    vals[*num_cols] = a*PETSC_i*val;
+    *num_cols = *num_cols + 1;
+  }
+  return;
+}
+
+/*
+ * _get_ops_row_lin appends the nonzeros of row i of the superoperator that
+ * _add_ops_to_mat_lin adds, a (G* cross G - 1/2 (I cross G^t G) - 1/2 ((G^t G)* cross I)),
+ * to cols and vals. The G^t G parts are diagonal; the value in row i
+ * comes from the one nonzero in column i of G.
+ */
+void _get_ops_row_lin(PetscScalar a,PetscInt i,PetscInt num_ops,operator *ops,PetscInt *num_cols,
+                      PetscInt cols[],PetscScalar vals[]){
+  PetscInt    j;
+  PetscScalar val;
+
+  //Add (I cross G^t G)
+  _get_ops_row_j(i,num_ops,ops,&j,&val,-1,1);
+  if (j!=-1){
+    cols[*num_cols] = i;
+    vals[*num_cols] = -0.5*a*PetscConjComplex(val)*val;
+    *num_cols = *num_cols + 1;
+  }
+
+  //Add ((G^t G)* cross I)
+  _get_ops_row_j(i,num_ops,ops,&j,&val,1,1);
+  if (j!=-1){
+    cols[*num_cols] = i;
+    vals[*num_cols] = -0.5*a*PetscConjComplex(val)*val;
+    *num_cols = *num_cols + 1;
+  }
+
+  //Add (G* cross G)
+  _get_ops_row_j(i,num_ops,ops,&j,&val,0,0);
+  if (j!=-1){
+    cols[*num_cols] = j;
+    vals[*num_cols] = a*val;
+    *num_cols = *num_cols + 1;
+  }
+  return;
+}
+
 
 
 
@@ -12,7 +12,11 @@ void _get_val_j_from_global_i(PetscInt,operator,PetscInt*,PetscScalar*,PetscInt)
 void _get_val_j_from_global_i_vec_vec(PetscInt,operator,operator,PetscInt*,PetscScalar*,PetscInt);
 
 void _add_ops_to_mat_ham(PetscScalar,Mat,PetscInt,operator*);
+void _add_ops_to_mat_ham_psi(PetscScalar,Mat,PetscInt,operator*);
 void _add_ops_to_mat_lin(PetscScalar,Mat,PetscInt,operator*);
+void _get_ops_row_j(PetscInt,PetscInt,operator*,PetscInt*,PetscScalar*,PetscInt,int);
+void _get_ops_row_ham(PetscScalar,PetscInt,PetscInt,operator*,PetscInt*,PetscInt[],PetscScalar[]);
+void _get_ops_row_lin(PetscScalar,PetscInt,PetscInt,operator*,PetscInt*,PetscInt[],PetscScalar[]);
 
 void   _add_to_PETSc_kron(Mat,PetscScalar,int,int,op_type,int,int,int,int);
 void   _add_to_PETSc_kron_comb(Mat,PetscScalar,int,int,op_type,int,int,int,
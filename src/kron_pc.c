@@ -0,0 +1,317 @@
+#include "kron_pc.h"
+#include "kron_pc_p.h"
+#include "kron_p.h"
+#include "quac_p.h"
+#include "operators_p.h"
+#include "operators.h"
+#include "excitation_basis_p.h"
+#include <petscblaslapack.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+ * Kronecker structured preconditioner for steady_state. The Liouvillian
+ * is L = sum_q L_q + L_c, where L_q is made of the terms that act on
+ * subsystem q alone (a^t a, sm^t sm, L(a), ...) and L_c of the couplings
+ * between subsystems. The preconditioner inverts the separable part,
+ * P = sum_q I cross ... cross L_q cross ... cross I, by fast
+ * diagonalization: each small L_q (my_levels^2 square, acting on the
+ * row and column level of subsystem q) is diagonalized once,
+ * L_q = V_q D_q V_q^-1, and then
+ *     P^-1 x = (V_0 cross V_1 ...) (sum_q D_q)^-1 (V_0^-1 cross V_1^-1 ...) x
+ * which costs O(N^2 sum_q my_levels_q^2) rather than a factorization of
+ * the N^2 x N^2 matrix. Every L_q has a zero eigenvalue (the trace is
+ * conserved), so the modes with a (near) zero sum of eigenvalues, which
+ * the trace row of steady_state fixes, are passed through unchanged.
+ *
+ * The transform works on the full tensor product, so it needs the whole
+ * vector on one processor; on more than one, steady_state keeps ASM.
+ * Terms that are not products of operators (add_lin_mat, add_lin_local,
+ * ...) are left out of P.
+ */
+
+int _kron_pc = 0;
+
+typedef struct kron_pc_ctx{
+  PetscInt    num_sub;
+  PetscInt    levels[MAX_SUB],strides[MAX_SUB];
+  PetscScalar *V[MAX_SUB],*Vinv[MAX_SUB],*eigs[MAX_SUB];
+  PetscReal   tol,max_eig;
+  PetscScalar *work;              /* Two blocks of the largest my_levels^2 */
+} kron_pc_ctx;
+
+static void           _kron_pc_local_liouvillian(PetscInt,PetscScalar*);
+static void           _kron_pc_diagonalize(PetscInt,PetscScalar*,PetscScalar*,PetscScalar*,PetscScalar*);
+static void           _kron_pc_transform(kron_pc_ctx*,PetscScalar*,PetscScalar**);
+static PetscErrorCode _kron_pc_apply(PC,Vec,Vec);
+static PetscErrorCode _kron_pc_destroy(PC);
+
+/*
+ * set_kron_preconditioner tells steady_state to precondition with the
+ * inverse of the separable (single subsystem) part of the Liouvillian,
+ * instead of with ASM. This can also be set with the command line option
+ * -kron_pc (and -kron_pc_tol <tol>, the relative size below which a sum
+ * of eigenvalues is taken to be zero). It only runs on a single
+ * processor; on more, ASM is kept, with a warning. QuaC_clear turns it
+ * off.
+ */
+void set_kron_preconditioner(){
+  _kron_pc = 1;
+  return;
+}
+
+/*
+ * _kron_pc_setup makes pc the Kronecker preconditioner, if it was asked
+ * for, A is the full (not truncated or restricted) Liouvillian, and we
+ * run on a single processor. Returns 1 if it did.
+ *
+ * Inputs:
+ *      PC  pc: the preconditioner of the steady state KSP
+ *      Mat A:  the matrix being solved
+ */
+int _kron_pc_setup(PC pc,Mat A){
+  kron_pc_ctx *ctx;
+  PetscInt    q,m,n2,max_n2,dim;
+  PetscScalar *Lq;
+  PetscBool   flag;
+
+  PetscOptionsHasName(NULL,NULL,"-kron_pc",&flag);
+  if (flag) {
+    _kron_pc = 1;
+  }
+  if (!_kron_pc) return 0;
+
+  MatGetSize(A,&dim,NULL);
+  if (dim!=total_levels*total_levels||_excitation_cap>=0){
+    if (nid==0){
+      printf("Warning! The Kronecker preconditioner needs the full tensor product space. Using the default.\n");
+    }
+    return 0;
+  }
+  if (np>1){
+    if (nid==0){
+      printf("Warning! The Kronecker preconditioner only runs on a single rank. Using the default.\n");
+    }
+    return 0;
+  }
+
+  ctx = malloc(sizeof(kron_pc_ctx));
+  ctx->num_sub = num_subsystems;
+  ctx->tol     = 1e-8;
+  PetscOptionsGetReal(NULL,NULL,"-kron_pc_tol",&ctx->tol,NULL);
+  ctx->max_eig = 0;
+  max_n2       = 1;
+  for (q=0;q<num_subsystems;q++){
+    ctx->levels[q]  = subsystem_list[q]->my_levels;
+    ctx->strides[q] = total_levels/(subsystem_list[q]->my_levels*subsystem_list[q]->n_before);
+    n2     = ctx->levels[q]*ctx->levels[q];
+    max_n2 = PetscMax(max_n2,n2);
+    ctx->V[q]    = malloc(n2*n2*sizeof(PetscScalar));
+    ctx->Vinv[q] = malloc(n2*n2*sizeof(PetscScalar));
+    ctx->eigs[q] = malloc(n2*sizeof(PetscScalar));
+    Lq = calloc(n2*n2,sizeof(PetscScalar));
+    _kron_pc_local_liouvillian(q,Lq);
+    _kron_pc_diagonalize(n2,Lq,ctx->eigs[q],ctx->V[q],ctx->Vinv[q]);
+    free(Lq);
+    for (m=0;m<n2;m++){
+      ctx->max_eig = PetscMax(ctx->max_eig,PetscAbsComplex(ctx->eigs[q][m]));
+    }
+  }
+  ctx->work    = malloc(2*max_n2*sizeof(PetscScalar));
+
+  PCSetType(pc,PCSHELL);
+  PCShellSetContext(pc,ctx);
+  PCShellSetApply(pc,_kron_pc_apply);
+  PCShellSetDestroy(pc,_kron_pc_destroy);
+  PCShellSetName(pc,"Kronecker (fast diagonalization)");
+  if (nid==0){
+    printf("Using the Kronecker preconditioner.\n");
+  }
+  return 1;
+}
+
+/*
+ * _kron_pc_local_liouvillian builds L_q, the superoperator of the terms
+ * that only act on subsystem q, as a dense, column major
+ * my_levels^2 x my_levels^2 matrix. Element r + my_levels*c is rho_rc of
+ * subsystem q, as in the full rho. The rows are taken from the same
+ * routines that build full_A, at the rows of the full superoperator with
+ * every other subsystem in level 0.
+ */
+static void _kron_pc_local_liouvillian(PetscInt q,PetscScalar *Lq){
+  PetscInt    m,l,n,r,c,stride,n_before,full_i,num_cols;
+  PetscInt    cols[8];
+  PetscScalar vals[8];
+  model_term  *terms,*this_term;
+  int         k,num_terms,local;
+
+  n        = subsystem_list[q]->my_levels;
+  n_before = subsystem_list[q]->n_before;
+  stride   = total_levels/(n*n_before);
+  _get_terms(&num_terms,&terms);
+  for (k=0;k<num_terms;k++){
+    this_term = &terms[k];
+    if (!_term_is_op_product(this_term)||this_term->num_ops==0) continue;
+    local = 1;
+    for (m=0;m<this_term->num_ops;m++){
+      if (this_term->ops[m]->n_before!=n_before||this_term->ops[m]->my_levels!=n){
+        local = 0;
+        break;
+      }
+    }
+    if (!local) continue;
+
+    for (c=0;c<n;c++){
+      for (r=0;r<n;r++){
+        full_i   = total_levels*c*stride + r*stride;
+        num_cols = 0;
+        if (this_term->my_term_type<TERM_LIN){
+          _get_ops_row_ham(this_term->a,full_i,this_term->num_ops,this_term->ops,&num_cols,cols,vals);
+        } else {
+          _get_ops_row_lin(this_term->a,full_i,this_term->num_ops,this_term->ops,&num_cols,cols,vals);
+        }
+        for (l=0;l<num_cols;l++){
+          m = (cols[l]%total_levels/stride)%n + n*((cols[l]/total_levels/stride)%n);
+          Lq[(r+n*c) + n*n*m] = Lq[(r+n*c) + n*n*m] + vals[l];
+        }
+      }
+    }
+  }
+  return;
+}
+
+/*
+ * _kron_pc_diagonalize finds L = V diag(eigs) V^-1 for the dense, column
+ * major n x n matrix L (which is overwritten)
+ */
+static void _kron_pc_diagonalize(PetscInt n,PetscScalar *L,PetscScalar *eigs,PetscScalar *V,PetscScalar *Vinv){
+  PetscScalar  *work,*lu,sdummy;
+  PetscReal    *rwork;
+  PetscBLASInt nb,lwork,lierr,idummy,*ipiv;
+  PetscInt     i;
+
+  PetscBLASIntCast(n,&nb);
+  idummy = 1;
+  lwork  = 5*nb;
+  PetscMalloc1(5*n,&work);
+  PetscMalloc1(2*n,&rwork);
+  PetscMalloc1(n,&ipiv);
+  PetscMalloc1(n*n,&lu);
+
+  /* Call LAPACK through PETSc to ensure portability */
+  LAPACKgeev_("N","V",&nb,L,&nb,eigs,&sdummy,&idummy,V,&nb,work,&lwork,rwork,&lierr);
+  if (lierr!=0){
+    printf("ERROR! The local Liouvillian could not be diagonalized!\n");
+    exit(0);
+  }
+
+  /* V^-1 from the LU factors of V, solving against the identity */
+  for (i=0;i<n*n;i++){
+    lu[i]   = V[i];
+    Vinv[i] = 0.0;
+  }
+  for (i=0;i<n;i++){
+    Vinv[i+n*i] = 1.0;
+  }
+  LAPACKgetrf_(&nb,&nb,lu,&nb,ipiv,&lierr);
+  if (lierr!=0){
+    printf("ERROR! The local Liouvillian is not diagonalizable!\n");
+    exit(0);
+  }
+  LAPACKgetrs_("N",&nb,&nb,lu,&nb,ipiv,Vinv,&nb,&lierr);
+
+  PetscFree(work);
+  PetscFree(rwork);
+  PetscFree(ipiv);
+  PetscFree(lu);
+  return;
+}
+
+/*
+ * _kron_pc_transform applies M[0] cross M[1] cross ... (M[q] acting on
+ * the row and column level of subsystem q) to the full vectorized rho
+ * in, in place.
+ */
+static void _kron_pc_transform(kron_pc_ctx *ctx,PetscScalar *in,PetscScalar **M){
+  PetscInt    q,i,r,c,m,n,n2,stride,base,dim;
+  PetscScalar *gather,*out,sum;
+
+  dim    = total_levels*total_levels;
+  gather = ctx->work;
+  for (q=0;q<ctx->num_sub;q++){
+    n      = ctx->levels[q];
+    n2     = n*n;
+    stride = ctx->strides[q];
+    out    = gather + n2;
+    for (base=0;base<dim;base++){
+      /* base runs over the elements with subsystem q in rho_00 */
+      if ((base%total_levels/stride)%n!=0||(base/total_levels/stride)%n!=0) continue;
+      for (c=0;c<n;c++){
+        for (r=0;r<n;r++){
+          gather[r+n*c] = in[base + r*stride + total_levels*c*stride];
+        }
+      }
+      for (i=0;i<n2;i++){
+        sum = 0.0;
+        for (m=0;m<n2;m++){
+          sum = sum + M[q][i+n2*m]*gather[m];
+        }
+        out[i] = sum;
+      }
+      for (c=0;c<n;c++){
+        for (r=0;r<n;r++){
+          in[base + r*stride + total_levels*c*stride] = out[r+n*c];
+        }
+      }
+    }
+  }
+  return;
+}
+
+/*
+ * _kron_pc_apply is the PCApply of the shell, y = P^-1 x
+ */
+static PetscErrorCode _kron_pc_apply(PC pc,Vec x,Vec y){
+  kron_pc_ctx *ctx;
+  PetscScalar *y_array,lambda;
+  PetscInt    i,q,n,dim,m;
+
+  PCShellGetContext(pc,(void**)&ctx);
+  VecCopy(x,y);
+  dim = total_levels*total_levels;
+  VecGetArray(y,&y_array);
+  _kron_pc_transform(ctx,y_array,ctx->Vinv);
+  for (i=0;i<dim;i++){
+    lambda = 0.0;
+    for (q=0;q<ctx->num_sub;q++){
+      n = ctx->levels[q];
+      m = (i%total_levels/ctx->strides[q])%n + n*((i/total_levels/ctx->strides[q])%n);
+      lambda = lambda + ctx->eigs[q][m];
+    }
+    /* Modes in the null space of P are fixed by the trace row */
+    if (PetscAbsComplex(lambda)>ctx->tol*ctx->max_eig){
+      y_array[i] = y_array[i]/lambda;
+    }
+  }
+  _kron_pc_transform(ctx,y_array,ctx->V);
+  VecRestoreArray(y,&y_array);
+  PetscFunctionReturn(0);
+}
+
+/*
+ * _kron_pc_destroy frees the context of the shell
+ */
+static PetscErrorCode _kron_pc_destroy(PC pc){
+  kron_pc_ctx *ctx;
+  PetscInt    q;
+
+  PCShellGetContext(pc,(void**)&ctx);
+  for (q=0;q<ctx->num_sub;q++){
+    free(ctx->V[q]);
+    free(ctx->Vinv[q]);
+    free(ctx->eigs[q]);
+  }
+  free(ctx->work);
+  free(ctx);
+  PetscFunctionReturn(0);
+}
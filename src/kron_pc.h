@@ -0,0 +1,8 @@
+#ifndef KRON_PC_H_
+#define KRON_PC_H_
+
+#include <petsc.h>
+
+void set_kron_preconditioner();
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef KRON_PC_P_H_
+#define KRON_PC_P_H_
+
+#include <petscksp.h>
+
+int _kron_pc_setup(PC,Mat);
+
+extern int _kron_pc;
+
+#endif
@@ -0,0 +1,543 @@
+#include "kron_p.h" //Includes petscmat.h and operators_p.h
+#include "quac_p.h"
+#include "operators.h"
+#include "matrix_free_p.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+ * Matrix-free application of the Lindblad superoperator.
+ *
+ * Rather than assembling the N^2 x N^2 matrix full_A, we store the
+ * Hamiltonian and jump operators as N x N sparse matrices and apply
+ *     L(rho) = K_L rho + rho K_R + sum_k a_k C_k rho C_k^t
+ * with K_L = -iH - 1/2 sum_k a_k C_k^t C_k
+ * and  K_R =  iH - 1/2 sum_k a_k C_k^t C_k
+ * directly to the (column-major) vectorized rho. Each rank owns full
+ * columns of rho, so K_L rho is purely local. The right multiplications
+ * are done as local column operations on rho^T, using
+ *     (rho K_R)^T     = K_R^T rho^T
+ *     (C rho C^t)^T   = C* (C rho)^T
+ * and a single, precomputed, transpose scatter.
+ */
+
+#define MF_TERMS_CHUNK  100
+#define MF_NNZ_PER_ROW  10
+
+mf_ctx _mf_ctx;
+
+static void     _mf_create_seq_mat(Mat*,PetscInt);
+static PetscInt _mf_new_term(mf_term_type,Mat,PetscScalar,double (*)(double));
+static void     _mf_setup_superop();
+static void     _mf_local_cols_mult(Mat,Vec,Vec,PetscScalar,int);
+
+/*
+ * _mf_initialize creates the MatShell full_A and the (empty) list of
+ * N x N terms. It is called once, from _check_initialized_A,
+ * when the Hilbert space size is final. The N^2 sized work vectors are
+ * only created when the superoperator is first applied; see _mf_assemble.
+ */
+void _mf_initialize(){
+  PetscInt dim,local_size;
+  Mat      K;
+
+  /* Split whole columns of rho among the ranks */
+  _mf_ctx.n_cols_local = PETSC_DECIDE;
+  PetscSplitOwnership(PETSC_COMM_WORLD,&_mf_ctx.n_cols_local,&total_levels);
+  MPI_Scan(&_mf_ctx.n_cols_local,&_mf_ctx.col_start,1,MPIU_INT,MPI_SUM,PETSC_COMM_WORLD);
+  _mf_ctx.col_start = _mf_ctx.col_start - _mf_ctx.n_cols_local;
+
+  dim        = total_levels*total_levels;
+  local_size = _mf_ctx.n_cols_local*total_levels;
+
+  MatCreateShell(PETSC_COMM_WORLD,local_size,local_size,dim,dim,&_mf_ctx,&full_A);
+  MatShellSetOperation(full_A,MATOP_MULT,(void(*)(void))_mf_mult);
+  MatShellSetOperation(full_A,MATOP_GET_DIAGONAL,(void(*)(void))_mf_get_diagonal);
+
+  /* Terms 0 and 1 hold the time independent K_L and K_R */
+  _mf_ctx.num_terms  = 0;
+  _mf_ctx.terms_size = MF_TERMS_CHUNK;
+  _mf_ctx.terms      = malloc(_mf_ctx.terms_size*sizeof(struct mf_term));
+  _mf_create_seq_mat(&K,MF_NNZ_PER_ROW);
+  _mf_new_term(MF_LEFT,K,1.0,NULL);
+  _mf_create_seq_mat(&K,MF_NNZ_PER_ROW);
+  _mf_new_term(MF_RIGHT,K,1.0,NULL);
+  _mf_ctx.assembled = 0;
+  _mf_ctx.stab      = 0;
+  _mf_ctx.pin       = 0;
+
+  return;
+}
+
+/*
+ * _mf_setup_superop creates the work vectors and the transpose scatter
+ * needed to apply the N^2 x N^2 superoperator.
+ */
+static void _mf_setup_superop(){
+  PetscInt local_size,i,*from;
+  IS       is_from,is_to;
+
+  MatCreateVecs(full_A,&_mf_ctx.x_t,NULL);
+  VecDuplicate(_mf_ctx.x_t,&_mf_ctx.z);
+  VecDuplicate(_mf_ctx.x_t,&_mf_ctx.z_t);
+  VecDuplicate(_mf_ctx.x_t,&_mf_ctx.acc_t);
+  VecCreateSeqWithArray(PETSC_COMM_SELF,1,total_levels,NULL,&_mf_ctx.col_in);
+  VecCreateSeqWithArray(PETSC_COMM_SELF,1,total_levels,NULL,&_mf_ctx.col_out);
+  VecCreateSeq(PETSC_COMM_SELF,total_levels,&_mf_ctx.work);
+
+  /*
+   * Local entry i is rho(row,col), with row = i%N and col = col_start + i/N.
+   * The transposed vector gets rho(col,row) there, which lives at
+   * global index N*row + col.
+   */
+  local_size = _mf_ctx.n_cols_local*total_levels;
+  PetscMalloc1(local_size,&from);
+  for (i=0;i<local_size;i++){
+    from[i] = total_levels*(i%total_levels) + _mf_ctx.col_start + i/total_levels;
+  }
+  ISCreateGeneral(PETSC_COMM_SELF,local_size,from,PETSC_OWN_POINTER,&is_from);
+  ISCreateStride(PETSC_COMM_SELF,local_size,total_levels*_mf_ctx.col_start,1,&is_to);
+  VecScatterCreate(_mf_ctx.x_t,is_from,_mf_ctx.z_t,is_to,&_mf_ctx.transpose_scatter);
+  ISDestroy(&is_from);
+  ISDestroy(&is_to);
+
+  return;
+}
+
+/*
+ * _mf_add_ops_ham adds -i a [G,rho] to the matrix-free Liouvillian,
+ * where G = op1 op2 ... opn
+ * Inputs:
+ *        PetscScalar a:    scalar to multiply G
+ *        PetscInt num_ops: number of operators in the product
+ *        operator *ops:    the operators (VECs come in pairs)
+ */
+void _mf_add_ops_ham(PetscScalar a,PetscInt num_ops,operator *ops){
+  PetscInt    i,j;
+  PetscScalar val;
+
+  /* Every rank stores the full N x N operators */
+  for (i=0;i<total_levels;i++){
+    _mf_get_val_j_product(i,num_ops,ops,&j,&val);
+    if (j!=-1){
+      MatSetValue(_mf_ctx.terms[0].mat,i,j,-a*PETSC_i*val,ADD_VALUES);
+      MatSetValue(_mf_ctx.terms[1].mat,i,j,a*PETSC_i*val,ADD_VALUES);
+    }
+  }
+  _mf_ctx.assembled = 0;
+  return;
+}
+
+/*
+ * _mf_add_ops_lin adds a L(G) to the matrix-free Liouvillian,
+ * where G = op1 op2 ... opn. Since G has at most one nonzero
+ * per row, G^t G is diagonal and is folded directly into K_L and K_R.
+ * Inputs:
+ *        PetscScalar a:    rate (note: Full term, not sqrt())
+ *        PetscInt num_ops: number of operators in the product
+ *        operator *ops:    the operators (VECs come in pairs)
+ */
+void _mf_add_ops_lin(PetscScalar a,PetscInt num_ops,operator *ops){
+  PetscInt    i,j;
+  PetscScalar val,add_to_mat;
+  Mat         C;
+
+  _mf_create_seq_mat(&C,1);
+  for (i=0;i<total_levels;i++){
+    _mf_get_val_j_product(i,num_ops,ops,&j,&val);
+    if (j!=-1){
+      MatSetValue(C,i,j,val,ADD_VALUES);
+      add_to_mat = -0.5*a*PetscConjComplex(val)*val;
+      MatSetValue(_mf_ctx.terms[0].mat,j,j,add_to_mat,ADD_VALUES);
+      MatSetValue(_mf_ctx.terms[1].mat,j,j,add_to_mat,ADD_VALUES);
+    }
+  }
+  _mf_new_term(MF_JUMP,C,a,NULL);
+  _mf_ctx.assembled = 0;
+  return;
+}
+
+/*
+ * _mf_add_lin_mat adds a L(C) to the matrix-free Liouvillian, where
+ * C is an explicitly constructed (parallel) matrix.
+ * Inputs:
+ *        PetscScalar a:  rate (note: Full term, not sqrt())
+ *        Mat add_to_lin: C
+ */
+void _mf_add_lin_mat(PetscScalar a,Mat add_to_lin){
+  Mat      C,C_dag,CdC;
+  PetscInt k;
+
+  /* Get a full copy of C on every rank */
+  MatCreateRedundantMatrix(add_to_lin,np,MPI_COMM_NULL,MAT_INITIAL_MATRIX,&C);
+  MatHermitianTranspose(C,MAT_INITIAL_MATRIX,&C_dag);
+  MatMatMult(C_dag,C,MAT_INITIAL_MATRIX,PETSC_DEFAULT,&CdC);
+  MatDestroy(&C_dag);
+
+  for (k=0;k<2;k++){
+    MatAssemblyBegin(_mf_ctx.terms[k].mat,MAT_FINAL_ASSEMBLY);
+    MatAssemblyEnd(_mf_ctx.terms[k].mat,MAT_FINAL_ASSEMBLY);
+    MatAXPY(_mf_ctx.terms[k].mat,-0.5*a,CdC,DIFFERENT_NONZERO_PATTERN);
+  }
+  MatDestroy(&CdC);
+
+  _mf_new_term(MF_JUMP,C,a,NULL);
+  _mf_ctx.assembled = 0;
+  return;
+}
+
+/*
+ * _mf_add_time_dep adds a time dependent Hamiltonian, f(t) G, or
+ * Lindblad, f(t) L(G), term to the matrix-free Liouvillian.
+ * Inputs:
+ *        double (*time_dep_func)(double): f(t)
+ *        PetscInt num_ops: number of operators in the product
+ *        operator *ops:    the operators (VECs come in pairs)
+ *        int lin:          1 for a Lindblad term, 0 for a Hamiltonian term
+ */
+void _mf_add_time_dep(double (*time_dep_func)(double),PetscInt num_ops,operator *ops,int lin){
+  PetscInt    i,j;
+  PetscScalar val,add_to_mat;
+  Mat         M_left,M_right,C;
+
+  _mf_create_seq_mat(&M_left,1);
+  _mf_create_seq_mat(&M_right,1);
+  if (lin){
+    _mf_create_seq_mat(&C,1);
+  }
+
+  for (i=0;i<total_levels;i++){
+    _mf_get_val_j_product(i,num_ops,ops,&j,&val);
+    if (j!=-1){
+      if (lin){
+        MatSetValue(C,i,j,val,ADD_VALUES);
+        add_to_mat = -0.5*PetscConjComplex(val)*val;
+        MatSetValue(M_left,j,j,add_to_mat,ADD_VALUES);
+        MatSetValue(M_right,j,j,add_to_mat,ADD_VALUES);
+      } else {
+        MatSetValue(M_left,i,j,-PETSC_i*val,ADD_VALUES);
+        MatSetValue(M_right,i,j,PETSC_i*val,ADD_VALUES);
+      }
+    }
+  }
+
+  /* Coefficients are set in _RHS_time_dep_mf; start at 0, like the assembled path */
+  _mf_new_term(MF_LEFT,M_left,0.0,time_dep_func);
+  _mf_new_term(MF_RIGHT,M_right,0.0,time_dep_func);
+  if (lin){
+    _mf_new_term(MF_JUMP,C,0.0,time_dep_func);
+  }
+  _mf_ctx.assembled = 0;
+  return;
+}
+
+/*
+ * _mf_assemble_ops assembles all of the N x N matrices and builds the
+ * conjugated jump operators. Only does work if terms were added since
+ * the last call. This is all that the trajectory solver needs.
+ */
+void _mf_assemble_ops(){
+  PetscInt i;
+
+  if (_mf_ctx.assembled) return;
+
+  for (i=0;i<_mf_ctx.num_terms;i++){
+    MatAssemblyBegin(_mf_ctx.terms[i].mat,MAT_FINAL_ASSEMBLY);
+    MatAssemblyEnd(_mf_ctx.terms[i].mat,MAT_FINAL_ASSEMBLY);
+    if (_mf_ctx.terms[i].type==MF_JUMP){
+      MatDestroy(&_mf_ctx.terms[i].mat_conj);
+      MatDuplicate(_mf_ctx.terms[i].mat,MAT_COPY_VALUES,&_mf_ctx.terms[i].mat_conj);
+      MatConjugate(_mf_ctx.terms[i].mat_conj);
+    }
+  }
+  _mf_ctx.assembled = 1;
+  return;
+}
+
+/*
+ * _mf_assemble assembles the N x N matrices and, the first time
+ * it is called, sets up the superoperator work space.
+ */
+void _mf_assemble(){
+
+  _mf_assemble_ops();
+  if (_mf_ctx.x_t==NULL){
+    _mf_setup_superop();
+  }
+  return;
+}
+
+/*
+ * _mf_set_stabilization sets how steady_state fixes the trace of rho:
+ * 0 turns it off, 1 adds the trace of rho to row 0 (the matrix-free
+ * version of adding 1.0 to row 0 at every diagonal element of rho), and
+ * 2 replaces row pin with element pin of rho.
+ */
+void _mf_set_stabilization(int stab,PetscInt pin){
+  _mf_ctx.stab = stab;
+  _mf_ctx.pin  = pin;
+  return;
+}
+
+/*
+ * _mf_destroy frees all of the matrix-free data structures.
+ * full_A itself is destroyed by the caller.
+ */
+void _mf_destroy(){
+  PetscInt i;
+
+  for (i=0;i<_mf_ctx.num_terms;i++){
+    MatDestroy(&_mf_ctx.terms[i].mat);
+    MatDestroy(&_mf_ctx.terms[i].mat_conj);
+  }
+  free(_mf_ctx.terms);
+  _mf_ctx.num_terms  = 0;
+  _mf_ctx.terms_size = 0;
+
+  VecScatterDestroy(&_mf_ctx.transpose_scatter);
+  VecDestroy(&_mf_ctx.x_t);
+  VecDestroy(&_mf_ctx.z);
+  VecDestroy(&_mf_ctx.z_t);
+  VecDestroy(&_mf_ctx.acc_t);
+  VecDestroy(&_mf_ctx.col_in);
+  VecDestroy(&_mf_ctx.col_out);
+  VecDestroy(&_mf_ctx.work);
+  return;
+}
+
+/*
+ * _mf_mult is the MatMult of the MatShell full_A; y = L(x)
+ */
+PetscErrorCode _mf_mult(Mat A,Vec x,Vec y){
+  mf_ctx            *ctx;
+  mf_term           *term;
+  const PetscScalar *x_array;
+  PetscScalar       *y_array,trace_local=0.0,trace;
+  PetscInt          i,k,col;
+  int               need_transpose=0;
+
+  MatShellGetContext(A,(void**)&ctx);
+
+  VecSet(y,0.0);
+
+  /* K_L rho terms are local */
+  for (k=0;k<ctx->num_terms;k++){
+    term = &ctx->terms[k];
+    if (term->type==MF_LEFT){
+      if (PetscAbsComplex(term->coeff)!=0){
+        _mf_local_cols_mult(term->mat,x,y,term->coeff,0);
+      }
+    } else {
+      need_transpose = 1;
+    }
+  }
+
+  if (need_transpose){
+    /* Get rho^T */
+    VecScatterBegin(ctx->transpose_scatter,x,ctx->x_t,INSERT_VALUES,SCATTER_FORWARD);
+    VecScatterEnd(ctx->transpose_scatter,x,ctx->x_t,INSERT_VALUES,SCATTER_FORWARD);
+    VecSet(ctx->acc_t,0.0);
+
+    for (k=0;k<ctx->num_terms;k++){
+      term = &ctx->terms[k];
+      if (PetscAbsComplex(term->coeff)==0) continue;
+
+      if (term->type==MF_RIGHT){
+        /* (rho M)^T = M^T rho^T */
+        _mf_local_cols_mult(term->mat,ctx->x_t,ctx->acc_t,term->coeff,1);
+      } else if (term->type==MF_JUMP){
+        /* (C rho C^t)^T = C* (C rho)^T */
+        VecSet(ctx->z,0.0);
+        _mf_local_cols_mult(term->mat,x,ctx->z,1.0,0);
+        VecScatterBegin(ctx->transpose_scatter,ctx->z,ctx->z_t,INSERT_VALUES,SCATTER_FORWARD);
+        VecScatterEnd(ctx->transpose_scatter,ctx->z,ctx->z_t,INSERT_VALUES,SCATTER_FORWARD);
+        _mf_local_cols_mult(term->mat_conj,ctx->z_t,ctx->acc_t,term->coeff,0);
+      }
+    }
+    /* Transpose the accumulated terms back and add them to y */
+    VecScatterBegin(ctx->transpose_scatter,ctx->acc_t,y,ADD_VALUES,SCATTER_FORWARD);
+    VecScatterEnd(ctx->transpose_scatter,ctx->acc_t,y,ADD_VALUES,SCATTER_FORWARD);
+  }
+
+  if (ctx->stab==2){
+    /* Row pin is rho_pin itself; see steady_state */
+    col = ctx->pin/total_levels;
+    if (col>=ctx->col_start&&col<ctx->col_start+ctx->n_cols_local){
+      i = (col-ctx->col_start)*total_levels + ctx->pin%total_levels;
+      VecGetArrayRead(x,&x_array);
+      VecGetArray(y,&y_array);
+      y_array[i] = x_array[i];
+      VecRestoreArray(y,&y_array);
+      VecRestoreArrayRead(x,&x_array);
+    }
+  } else if (ctx->stab){
+    /* Add trace(rho) to y[0]; see steady_state */
+    VecGetArrayRead(x,&x_array);
+    for (i=0;i<ctx->n_cols_local;i++){
+      trace_local = trace_local + x_array[i*total_levels+ctx->col_start+i];
+    }
+    VecRestoreArrayRead(x,&x_array);
+    MPI_Allreduce(&trace_local,&trace,1,MPIU_SCALAR,MPIU_SUM,PETSC_COMM_WORLD);
+    if (ctx->col_start==0&&ctx->n_cols_local>0){
+      VecGetArray(y,&y_array);
+      y_array[0] = y_array[0] + trace;
+      VecRestoreArray(y,&y_array);
+    }
+  }
+
+  PetscFunctionReturn(0);
+}
+
+/*
+ * _mf_get_diagonal is the MatGetDiagonal of the MatShell full_A,
+ * so that PCJACOBI can be used with the matrix-free solver.
+ * The diagonal of L at (row,col) is
+ *     K_L(row,row) + K_R(col,col) + sum_k a_k C_k(row,row) C_k(col,col)*
+ */
+PetscErrorCode _mf_get_diagonal(Mat A,Vec d){
+  mf_ctx            *ctx;
+  mf_term           *term;
+  const PetscScalar *m_diag;
+  PetscScalar       *d_array;
+  PetscInt          i,k,row,col;
+
+  MatShellGetContext(A,(void**)&ctx);
+  VecSet(d,0.0);
+  VecGetArray(d,&d_array);
+
+  for (k=0;k<ctx->num_terms;k++){
+    term = &ctx->terms[k];
+    if (PetscAbsComplex(term->coeff)==0) continue;
+
+    MatGetDiagonal(term->mat,ctx->work);
+    VecGetArrayRead(ctx->work,&m_diag);
+    for (i=0;i<ctx->n_cols_local;i++){
+      col = ctx->col_start + i;
+      for (row=0;row<total_levels;row++){
+        if (term->type==MF_LEFT){
+          d_array[i*total_levels+row] += term->coeff*m_diag[row];
+        } else if (term->type==MF_RIGHT){
+          d_array[i*total_levels+row] += term->coeff*m_diag[col];
+        } else {
+          d_array[i*total_levels+row] += term->coeff*m_diag[row]*PetscConjComplex(m_diag[col]);
+        }
+      }
+    }
+    VecRestoreArrayRead(ctx->work,&m_diag);
+  }
+
+  if (ctx->stab==2){
+    col = ctx->pin/total_levels;
+    if (col>=ctx->col_start&&col<ctx->col_start+ctx->n_cols_local){
+      d_array[(col-ctx->col_start)*total_levels + ctx->pin%total_levels] = 1.0;
+    }
+  } else if (ctx->stab&&ctx->col_start==0&&ctx->n_cols_local>0){
+    d_array[0] = d_array[0] + 1.0;
+  }
+  VecRestoreArray(d,&d_array);
+
+  PetscFunctionReturn(0);
+}
+
+/*
+ * _RHS_time_dep_mf updates the coefficients of the time dependent terms
+ * of the matrix-free Liouvillian. Nothing is assembled.
+ */
+PetscErrorCode _RHS_time_dep_mf(TS ts,PetscReal t,Vec X,Mat AA,Mat BB,void *ctx){
+  PetscInt i;
+
+  for (i=0;i<_mf_ctx.num_terms;i++){
+    if (_mf_ctx.terms[i].time_dep_func!=NULL){
+      _mf_ctx.terms[i].coeff = _mf_ctx.terms[i].time_dep_func(t);
+    }
+  }
+
+  PetscFunctionReturn(0);
+}
+
+/*
+ * _mf_local_cols_mult computes out_c = out_c + a M in_c (or a M^T in_c)
+ * for each locally owned column c of the vectorized in and out.
+ */
+static void _mf_local_cols_mult(Mat M,Vec in,Vec out,PetscScalar a,int transpose){
+  const PetscScalar *in_array;
+  PetscScalar       *out_array;
+  PetscInt          i;
+
+  VecGetArrayRead(in,&in_array);
+  VecGetArray(out,&out_array);
+  for (i=0;i<_mf_ctx.n_cols_local;i++){
+    VecPlaceArray(_mf_ctx.col_in,(PetscScalar*)in_array+i*total_levels);
+    VecPlaceArray(_mf_ctx.col_out,out_array+i*total_levels);
+    if (transpose){
+      MatMultTranspose(M,_mf_ctx.col_in,_mf_ctx.work);
+    } else {
+      MatMult(M,_mf_ctx.col_in,_mf_ctx.work);
+    }
+    VecAXPY(_mf_ctx.col_out,a,_mf_ctx.work);
+    VecResetArray(_mf_ctx.col_in);
+    VecResetArray(_mf_ctx.col_out);
+  }
+  VecRestoreArray(out,&out_array);
+  VecRestoreArrayRead(in,&in_array);
+  return;
+}
+
+/*
+ * _mf_get_val_j_product returns j and val of row i of G = op1 op2 ... opn,
+ * in the N x N space. j is -1 if the row is empty. A single VEC
+ * is treated as |e><e|; otherwise VECs must come in pairs.
+ */
+void _mf_get_val_j_product(PetscInt i,PetscInt num_ops,operator *ops,PetscInt *j,PetscScalar *val){
+  PetscInt    k,this_j;
+  PetscScalar tmp_val;
+
+  *j   = i;
+  *val = 1.0;
+  for (k=0;k<num_ops&&*j!=-1;k++){
+    if (ops[k]->my_op_type==VEC){
+      if (k+1<num_ops&&ops[k+1]->my_op_type==VEC){
+        _get_val_j_from_global_i_vec_vec(*j,ops[k],ops[k+1],&this_j,&tmp_val,-1);
+        k = k+1;
+      } else {
+        _get_val_j_from_global_i_vec_vec(*j,ops[k],ops[k],&this_j,&tmp_val,-1);
+      }
+    } else {
+      _get_val_j_from_global_i(*j,ops[k],&this_j,&tmp_val,-1);
+    }
+    *j   = this_j;
+    *val = tmp_val * (*val);
+  }
+  return;
+}
+
+/*
+ * _mf_create_seq_mat creates a total_levels x total_levels MATSEQAIJ on
+ * every rank. New nonzeros are allowed past the preallocation.
+ */
+static void _mf_create_seq_mat(Mat *M,PetscInt nnz){
+  MatCreateSeqAIJ(PETSC_COMM_SELF,total_levels,total_levels,nnz,NULL,M);
+  MatSetOption(*M,MAT_NEW_NONZERO_ALLOCATION_ERR,PETSC_FALSE);
+  return;
+}
+
+/*
+ * _mf_new_term appends a term to the matrix-free Liouvillian
+ * and returns its index.
+ */
+static PetscInt _mf_new_term(mf_term_type type,Mat mat,PetscScalar coeff,double (*time_dep_func)(double)){
+  PetscInt i;
+
+  if (_mf_ctx.num_terms>=_mf_ctx.terms_size){
+    _mf_ctx.terms_size = _mf_ctx.terms_size + MF_TERMS_CHUNK;
+    _mf_ctx.terms      = realloc(_mf_ctx.terms,_mf_ctx.terms_size*sizeof(struct mf_term));
+  }
+  i = _mf_ctx.num_terms;
+  _mf_ctx.terms[i].type          = type;
+  _mf_ctx.terms[i].mat           = mat;
+  _mf_ctx.terms[i].mat_conj      = NULL;
+  _mf_ctx.terms[i].coeff         = coeff;
+  _mf_ctx.terms[i].time_dep_func = time_dep_func;
+  _mf_ctx.num_terms = _mf_ctx.num_terms + 1;
+  return i;
+}
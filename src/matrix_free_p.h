@@ -0,0 +1,61 @@
+#ifndef MATRIX_FREE_P_H_
+#define MATRIX_FREE_P_H_
+
+#include "operators_p.h"
+#include "operators.h"
+#include <petscmat.h>
+#include <petscts.h>
+
+typedef enum {
+  MF_LEFT  = 0, /* coeff * M rho      */
+  MF_RIGHT = 1, /* coeff * rho M      */
+  MF_JUMP  = 2  /* coeff * C rho C^t  */
+} mf_term_type;
+
+/*
+ * A single term of the matrix-free Liouvillian. Every matrix is
+ * total_levels by total_levels and is stored, in full, on every rank
+ * (MATSEQAIJ). mat_conj is only used for MF_JUMP terms.
+ * If time_dep_func is not NULL, coeff is reset to time_dep_func(t)
+ * at the start of every RHS evaluation.
+ */
+typedef struct mf_term{
+  mf_term_type type;
+  Mat          mat,mat_conj;
+  PetscScalar  coeff;
+  double       (*time_dep_func)(double);
+} mf_term;
+
+/*
+ * Context for the MatShell full_A. Each rank owns n_cols_local full
+ * columns of rho, starting at col_start, so that the local part of
+ * the vectorized rho is a dense, column-major, N x n_cols_local block.
+ */
+typedef struct mf_ctx{
+  PetscInt   n_cols_local,col_start;
+  PetscInt   num_terms,terms_size;
+  mf_term    *terms;
+  int        assembled,stab;
+  PetscInt   pin;                 /* Element of rho pinned by stab = 2     */
+  VecScatter transpose_scatter;
+  Vec        x_t,z,z_t,acc_t;     /* Work vectors in the full (N^2) layout */
+  Vec        col_in,col_out,work; /* Sequential, size N, work vectors      */
+} mf_ctx;
+
+void _mf_initialize();
+void _mf_add_ops_ham(PetscScalar,PetscInt,operator*);
+void _mf_add_ops_lin(PetscScalar,PetscInt,operator*);
+void _mf_add_lin_mat(PetscScalar,Mat);
+void _mf_add_time_dep(double (*)(double),PetscInt,operator*,int);
+void _mf_assemble_ops();
+void _mf_assemble();
+void _mf_set_stabilization(int,PetscInt);
+void _mf_destroy();
+void _mf_get_val_j_product(PetscInt,PetscInt,operator*,PetscInt*,PetscScalar*);
+PetscErrorCode _mf_mult(Mat,Vec,Vec);
+PetscErrorCode _mf_get_diagonal(Mat,Vec);
+PetscErrorCode _RHS_time_dep_mf(TS,PetscReal,Vec,Mat,Mat,void*);
+
+extern mf_ctx _mf_ctx;
+
+#endif
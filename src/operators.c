@@ -1,6 +1,11 @@
 #include "kron_p.h" //Includes petscmat.h and operators_p.h
 #include "quac_p.h"
 #include "operators.h"
+#include "rotating_frame_p.h"
+#include "excitation_basis_p.h"
+#include "dicke_p.h"
+#include "matrix_free_p.h"
+#include "solver_p.h"
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -27,11 +32,26 @@ PetscInt total_levels;
 int num_subsystems;
 operator subsystem_list[MAX_SUB];
 int _print_dense_ham = 0;
+int _matrix_free = 0;
 int _num_time_dep = 0;
 int _num_time_dep_lin = 0;
 time_dep_struct _time_dep_list[MAX_SUB];
 time_dep_struct _time_dep_list_lin[MAX_SUB];
 PetscScalar **_hamiltonian;
+term_pass_type _term_pass = TERMS_RECORD;
+
+/* Terms recorded by the add_* routines; see _record_term and _build_A */
+static model_term *_term_list = NULL;
+static int        _num_terms = 0,_max_terms = 0,_num_terms_built = 0,_A_preallocated = 0;
+static void       _replay_terms(int,int);
+static void       _add_terms_rowwise(int,int);
+static PetscInt   _terms_row_size(int,int);
+static void       _terms_row(int,int,PetscInt,int,PetscInt*,PetscInt[],PetscScalar[]);
+static void       _set_merged_row(Mat,PetscInt,PetscInt,PetscInt[],PetscScalar[]);
+static void       _basis_cols(PetscInt*,PetscInt[],PetscScalar[]);
+static void       _add_solver_entries(Mat,Mat);
+static PetscErrorCode _build_A_assembly_begin(Mat,MatAssemblyType);
+static PetscErrorCode (*_A_assembly_begin)(Mat,MatAssemblyType) = NULL;
 
 /*
  * print_dense_ham tells the program to print the dense hamiltonian when it is constructed.
@@ -47,6 +67,23 @@ void print_dense_ham(){
   _print_dense_ham = 1;
 }
 
+/*
+ * set_matrix_free tells the program to never assemble the Lindblad
+ * superoperator, full_A. Instead, the Hamiltonian and Lindblad terms are
+ * stored as N x N sparse matrices and the superoperator is applied
+ * directly to rho (see matrix_free.c). This can also be turned on with
+ * the command line option -matrix_free.
+ */
+void set_matrix_free(){
+  if (op_finalized) {
+    if (nid==0){
+      printf("ERROR! You need to call set_matrix_free before adding anything to the hamiltonian!\n");
+      exit(0);
+    }
+  }
+  _matrix_free = 1;
+}
+
 /*
  * create_op creates a basic set of operators, namely the creation, annihilation, and
  * number operator.
@@ -142,6 +179,7 @@ void create_op(int number_of_levels,operator *new_op) {
 
   /* Increase total_levels */
   total_levels = total_levels*number_of_levels;
+  _basis_dim   = total_levels;
 
   /* Add to list */
   subsystem_list[num_subsystems] = (*new_op);
@@ -183,6 +221,7 @@ void create_vec(int number_of_levels,vec_op *new_vec) {
 
   /* Increase total_levels */
   total_levels = total_levels*number_of_levels;
+  _basis_dim   = total_levels;
   /*
    * We store just the first VEC in the subsystem list, since it has
    * enough information to define all others
@@ -215,6 +254,8 @@ void add_to_ham_time_dep(double (*time_dep_func)(double),int num_ops,...){
 
   _time_dep_list[_num_time_dep].time_dep_func = time_dep_func;
   _time_dep_list[_num_time_dep].num_ops       = num_ops;
+  _time_dep_list[_num_time_dep].a             = 1.0;
+  _time_dep_list[_num_time_dep].omega         = 0.0;
   _time_dep_list[_num_time_dep].ops = malloc(num_ops*sizeof(operator));
 
   //Add the expanded op to the matrix
@@ -223,6 +264,10 @@ void add_to_ham_time_dep(double (*time_dep_func)(double),int num_ops,...){
     op = va_arg(ap,operator);
     _time_dep_list[_num_time_dep].ops[i] = op;
   }
+  va_end(ap);
+  if (_matrix_free){
+    _mf_add_time_dep(time_dep_func,num_ops,_time_dep_list[_num_time_dep].ops,0);
+  }
   _num_time_dep = _num_time_dep + 1;
   return;
 }
@@ -249,6 +294,8 @@ void add_to_ham_time_dep_p(double (*time_dep_func)(double),int num_ops,...){
 
   _time_dep_list[_num_time_dep].time_dep_func = time_dep_func;
   _time_dep_list[_num_time_dep].num_ops       = num_ops;
+  _time_dep_list[_num_time_dep].a             = 1.0;
+  _time_dep_list[_num_time_dep].omega         = 0.0;
   _time_dep_list[_num_time_dep].ops = malloc(num_ops*sizeof(operator));
 
   //Add the expanded op to the matrix
@@ -257,6 +304,10 @@ void add_to_ham_time_dep_p(double (*time_dep_func)(double),int num_ops,...){
     op = va_arg(ap,operator);
     _time_dep_list[_num_time_dep].ops[i] = op;
   }
+  va_end(ap);
+  if (_matrix_free){
+    _mf_add_time_dep(time_dep_func,num_ops,_time_dep_list[_num_time_dep].ops,0);
+  }
   _num_time_dep = _num_time_dep + 1;
   return;
 }
@@ -274,6 +325,8 @@ void add_lin_time_dep_p(double (*time_dep_func)(double),int num_ops,...){
 
   _time_dep_list_lin[_num_time_dep_lin].time_dep_func = time_dep_func;
   _time_dep_list_lin[_num_time_dep_lin].num_ops       = num_ops;
+  _time_dep_list_lin[_num_time_dep_lin].a             = 1.0;
+  _time_dep_list_lin[_num_time_dep_lin].omega         = 0.0;
   _time_dep_list_lin[_num_time_dep_lin].ops = malloc(num_ops*sizeof(operator));
 
   //Add the expanded op to the matrix
@@ -282,6 +335,10 @@ void add_lin_time_dep_p(double (*time_dep_func)(double),int num_ops,...){
     op = va_arg(ap,operator);
     _time_dep_list_lin[_num_time_dep_lin].ops[i] = op;
   }
+  va_end(ap);
+  if (_matrix_free){
+    _mf_add_time_dep(time_dep_func,num_ops,_time_dep_list_lin[_num_time_dep_lin].ops,1);
+  }
   _num_time_dep_lin = _num_time_dep_lin + 1;
   return;
 }
@@ -312,7 +369,13 @@ void add_to_ham_p(PetscScalar a,PetscInt num_ops,...){
     }
     va_end(ap);
 
-    _add_ops_to_mat_ham(a,full_A,num_ops,ops);
+    if (_matrix_free){
+      _mf_add_ops_ham(a,num_ops,ops);
+    } else if (_defer_terms()){
+      _record_term(TERM_HAM_P,a,num_ops,ops,NULL);
+    } else {
+      _add_ops_to_mat_ham(a,full_A,num_ops,ops);
+    }
     free(ops);
   }
   PetscLogEventEnd(add_to_ham_event,0,0,0,0);
@@ -334,12 +397,17 @@ void add_to_ham(PetscScalar a,operator op){
   PetscLogEventBegin(add_to_ham_event,0,0,0,0);
 
   _check_initialized_A();
+  if (_defer_terms()){
+    _record_term(TERM_HAM,a,1,&op,NULL);
+    PetscLogEventEnd(add_to_ham_event,0,0,0,0);
+    return;
+  }
   if (PetscAbsComplex(a)!=0) { //Don't add zero numbers to the hamiltonian
 
     /*
      * Construct the dense Hamiltonian only on the master node
      */
-    if (nid==0&&_print_dense_ham) {
+    if (nid==0&&_print_dense_ham&&_term_pass!=TERMS_SYMBOLIC) {
       mat_scalar = a;
       _add_to_dense_kron(mat_scalar,op->n_before,op->my_levels,op->my_op_type,op->position);
     }
@@ -351,6 +419,12 @@ void add_to_ham(PetscScalar a,operator op){
     mat_scalar = -a*PETSC_i;
     _add_to_PETSc_kron(ham_A,mat_scalar,op->n_before,op->my_levels,
                        op->my_op_type,op->position,1,1,0);
+
+    if (_matrix_free){
+      _mf_add_ops_ham(a,1,&op);
+      PetscLogEventEnd(add_to_ham_event,0,0,0,0);
+      return;
+    }
     /*
      * Add -i * (I cross H) to the superoperator matrix, A
      * Since this is an additional I before, we simply
@@ -391,7 +465,13 @@ void add_to_ham_stiff(PetscScalar a,operator op){
 
 
   _check_initialized_A();
-  _stiff_solver = 1;
+  if (_matrix_free){
+    if (nid==0){
+      printf("ERROR! Stiff terms are not supported with set_matrix_free!\n");
+      exit(0);
+    }
+  }
+  _check_initialized_stiff_A();
   /*
    * Construct the dense Hamiltonian only on the master node
    */
@@ -446,11 +526,18 @@ void add_to_ham_stiff(PetscScalar a,operator op){
 void add_to_ham_mult2(PetscScalar a,operator op1,operator op2){
   PetscScalar mat_scalar;
   int         multiply_vec,n_after;
+  operator    ops[2];
   _check_initialized_A();
   multiply_vec = _check_op_type2(op1,op2);
+  if (_defer_terms()){
+    ops[0] = op1;
+    ops[1] = op2;
+    _record_term(TERM_HAM_MULT2,a,2,ops,NULL);
+    return;
+  }
 
 
-  if (nid==0&&_print_dense_ham){
+  if (nid==0&&_print_dense_ham&&_term_pass!=TERMS_SYMBOLIC){
     /* Add the terms to the dense Hamiltonian */
     if (multiply_vec){
       /*
@@ -484,8 +571,10 @@ void add_to_ham_mult2(PetscScalar a,operator op1,operator op2){
     _add_to_PETSc_kron_ij(ham_A,mat_scalar,op1->position,op2->position,op1->n_before,
                           n_after,op1->my_levels);
     /* Add to the superoperator matrix, full_A */
-    _add_to_PETSc_kron_ij(full_A,mat_scalar,op1->position,op2->position,op1->n_before*total_levels,
-                          n_after,op1->my_levels);
+    if (!_matrix_free){
+      _add_to_PETSc_kron_ij(full_A,mat_scalar,op1->position,op2->position,op1->n_before*total_levels,
+                            n_after,op1->my_levels);
+    }
   } else {
     /* Add to the Hamiltonian matrix, -i*ham_A */
     _add_to_PETSc_kron_comb(ham_A,mat_scalar,op1->n_before,op1->my_levels,op1->my_op_type,op1->position,
@@ -494,9 +583,18 @@ void add_to_ham_mult2(PetscScalar a,operator op1,operator op2){
 
     /* We are multiplying two normal ops and have to do a little more work. */
     /* Add to the superoperator matrix, full_A */
-    _add_to_PETSc_kron_comb(full_A,mat_scalar,op1->n_before,op1->my_levels,op1->my_op_type,op1->position,
-                            op2->n_before,op2->my_levels,op2->my_op_type,op2->position,
-                            total_levels,1,1,0);
+    if (!_matrix_free){
+      _add_to_PETSc_kron_comb(full_A,mat_scalar,op1->n_before,op1->my_levels,op1->my_op_type,op1->position,
+                              op2->n_before,op2->my_levels,op2->my_op_type,op2->position,
+                              total_levels,1,1,0);
+    }
+  }
+
+  if (_matrix_free){
+    ops[0] = op1;
+    ops[1] = op2;
+    _mf_add_ops_ham(a,2,ops);
+    return;
   }
 
   /*
@@ -541,8 +639,13 @@ void add_to_ham_stiff_mult2(PetscScalar a,operator op1,operator op2){
   PetscScalar mat_scalar;
   int         multiply_vec,n_after;
   _check_initialized_A();
-
-  _stiff_solver = 1;
+  if (_matrix_free){
+    if (nid==0){
+      printf("ERROR! Stiff terms are not supported with set_matrix_free!\n");
+      exit(0);
+    }
+  }
+  _check_initialized_stiff_A();
 
   multiply_vec = _check_op_type2(op1,op2);
 
@@ -643,12 +746,20 @@ void add_to_ham_stiff_mult2(PetscScalar a,operator op1,operator op2){
 void add_to_ham_mult3(PetscScalar a,operator op1,operator op2,operator op3){
   PetscScalar mat_scalar;
   int         first_pair;
+  operator    ops[3];
   _check_initialized_A();
   first_pair = _check_op_type3(op1,op2,op3);
+  if (_defer_terms()){
+    ops[0] = op1;
+    ops[1] = op2;
+    ops[2] = op3;
+    _record_term(TERM_HAM_MULT3,a,3,ops,NULL);
+    return;
+  }
 
 
   /* Add to the dense hamiltonian */
-  if (nid==0&&_print_dense_ham){
+  if (nid==0&&_print_dense_ham&&_term_pass!=TERMS_SYMBOLIC){
     if (first_pair) {
       /* The first pair is the vec pair and op3 is the normal op*/
       _add_to_dense_kron_comb_vec(a,op3->n_before,op3->my_levels,
@@ -662,6 +773,14 @@ void add_to_ham_mult3(PetscScalar a,operator op1,operator op2,operator op3){
     }
   }
 
+  if (_matrix_free){
+    ops[0] = op1;
+    ops[1] = op2;
+    ops[2] = op3;
+    _mf_add_ops_ham(a,3,ops);
+    return;
+  }
+
   /*
    * Add -i * (I cross H) to the superoperator matrix, A
    * Since this is an additional I before, we simply
@@ -744,7 +863,13 @@ void add_lin_p(PetscScalar a,PetscInt num_ops,...){
     }
     va_end(ap);
 
-    _add_ops_to_mat_lin(a,full_A,num_ops,ops);
+    if (_matrix_free){
+      _mf_add_ops_lin(a,num_ops,ops);
+    } else if (_defer_terms()){
+      _record_term(TERM_LIN_P,a,num_ops,ops,NULL);
+    } else {
+      _add_ops_to_mat_lin(a,full_A,num_ops,ops);
+    }
     free(ops);
 
   }
@@ -772,8 +897,15 @@ void add_lin(PetscScalar a,operator op){
   PetscLogEventBegin(add_lin_event,0,0,0,0);
   _check_initialized_A();
   _lindblad_terms = 1;
+  if (_defer_terms()){
+    _record_term(TERM_LIN,a,1,&op,NULL);
+    PetscLogEventEnd(add_lin_event,0,0,0,0);
+    return;
+  }
 
-  if (PetscAbsComplex(a)!=0){
+  if (PetscAbsComplex(a)!=0&&_matrix_free){
+    _mf_add_ops_lin(a,1,&op);
+  } else if (PetscAbsComplex(a)!=0){
 
     /*
      * Add (I cross C^t C) to the superoperator matrix, A
@@ -834,10 +966,24 @@ void add_lin_mult2(PetscScalar a,operator op1,operator op2){
   PetscScalar mat_scalar;
   int         k3,i1,j1,i2,j2,i_comb,j_comb,comb_levels;
   int         multiply_vec,n_after;
+  operator    ops[2];
 
   _check_initialized_A();
   _lindblad_terms = 1;
   multiply_vec =  _check_op_type2(op1,op2);
+  if (_defer_terms()){
+    ops[0] = op1;
+    ops[1] = op2;
+    _record_term(TERM_LIN_MULT2,a,2,ops,NULL);
+    return;
+  }
+
+  if (_matrix_free){
+    ops[0] = op1;
+    ops[1] = op2;
+    _mf_add_ops_lin(a,2,ops);
+    return;
+  }
 
   if (multiply_vec){
     /*
@@ -937,6 +1083,15 @@ void add_lin_mat(PetscScalar a,Mat add_to_lin){
   _check_initialized_A();
   _lindblad_terms = 1;
 
+  if (_matrix_free){
+    _mf_add_lin_mat(a,add_to_lin);
+    return;
+  }
+  if (_defer_terms()){
+    _record_term(TERM_LIN_MAT,a,0,NULL,add_to_lin);
+    return;
+  }
+
   /* Construct C^t C */
   MatHermitianTranspose(add_to_lin,MAT_INITIAL_MATRIX,&work_mat2);
   MatMatMult(work_mat2,add_to_lin,MAT_INITIAL_MATRIX,fill,&work_mat1);
@@ -1099,6 +1254,7 @@ void _check_initialized_op(){
     _lindblad_terms = 0;
     _stiff_solver   = 0;
     total_levels   = 1;
+    _basis_dim     = 1;
     op_initialized = 1;
     num_subsystems = 0;
   }
@@ -1253,6 +1409,551 @@ int _check_op_type3(operator op1,operator op2,operator op3){
   return return_value;
 }
 
+/*
+ * _defer_terms returns 1 if the add_* routines should record their term
+ * (with _record_term) instead of inserting it into full_A and ham_A.
+ * This is true unless we are matrix free or _build_A is replaying the terms.
+ */
+int _defer_terms(){
+  return (!_matrix_free&&_term_pass==TERMS_RECORD);
+}
+
+/*
+ * _record_term stores a term to be inserted into full_A and ham_A
+ * later, by _build_A. The ops array is copied; the operators themselves
+ * must live until _build_A is called (they live until destroy_op).
+ * Inputs:
+ *        term_type   my_term_type: which add_* routine the term came from
+ *        PetscScalar a:            scalar to multiply the term
+ *        int         num_ops:      number of ops in the term
+ *        operator    *ops:         the ops of the term
+ *        Mat         mat:          matrix for add_lin_mat (or NULL)
+ * Outputs:
+ *        none
+ */
+void _record_term(term_type my_term_type,PetscScalar a,int num_ops,operator *ops,Mat mat){
+  model_term *this_term;
+  int        i;
+
+  if (_num_terms==_max_terms){
+    _max_terms = (_max_terms==0) ? 16 : 2*_max_terms;
+    _term_list = realloc(_term_list,_max_terms*sizeof(model_term));
+  }
+  this_term = &_term_list[_num_terms];
+  this_term->my_term_type = my_term_type;
+  this_term->a            = a;
+  this_term->num_ops      = num_ops;
+  this_term->ops          = NULL;
+  if (num_ops>0){
+    this_term->ops = malloc(num_ops*sizeof(operator));
+    for (i=0;i<num_ops;i++){
+      this_term->ops[i] = ops[i];
+    }
+  }
+  this_term->mat = mat;
+  if (mat!=NULL){
+    /* Keep the matrix alive until the term is inserted */
+    PetscObjectReference((PetscObject)mat);
+  }
+  this_term->data     = NULL;
+  this_term->replay   = NULL;
+  this_term->destroy  = NULL;
+  this_term->row      = NULL;
+  this_term->row_size = 0;
+  _num_terms = _num_terms + 1;
+  return;
+}
+
+/*
+ * _record_external_term stores a term that is added to full_A by
+ * another file (such as add_lin_recovery). replay(data) is called on
+ * both passes of _build_A and must insert the term into full_A;
+ * destroy(data) is called when the term list is cleared.
+ * Inputs:
+ *        void (*replay)(void*):  inserts the term into full_A
+ *        void (*destroy)(void*): frees data
+ *        void *data:             context for the term
+ * Outputs:
+ *        none
+ */
+void _record_external_term(void (*replay)(void*),void (*destroy)(void*),void *data){
+  _record_term(TERM_EXTERNAL,0.0,0,NULL,NULL);
+  _term_list[_num_terms-1].data    = data;
+  _term_list[_num_terms-1].replay  = replay;
+  _term_list[_num_terms-1].destroy = destroy;
+  return;
+}
+
+/*
+ * _set_external_term_rows lets the external term recorded last be
+ * generated row by row, like the products of ops: row(data,i,...)
+ * appends the entries of row i of full_A to cols and vals (at most
+ * row_size of them), and starts at cols[*num_cols]. Such terms are not
+ * replayed into full_A, and can be used without building it (see
+ * _get_terms_row).
+ */
+void _set_external_term_rows(void (*row)(void*,PetscInt,PetscInt*,PetscInt[],PetscScalar[]),PetscInt row_size){
+  _term_list[_num_terms-1].row      = row;
+  _term_list[_num_terms-1].row_size = row_size;
+  return;
+}
+
+/*
+ * build_operators inserts the terms added so far (with add_to_ham, add_lin,
+ * etc.) into full_A and ham_A. The solvers (time_step, steady_state, ...)
+ * do this themselves, and so does assembling full_A or ham_A; it is only
+ * needed to apply the rotating frame to the terms without assembling.
+ */
+void build_operators(){
+  _check_initialized_A();
+  _build_A();
+  return;
+}
+
+/*
+ * _build_A inserts the recorded terms into full_A and ham_A
+ * (see _add_terms_rowwise). The first time it is called, this is done twice:
+ * first into MATPREALLOCATOR matrices, which only record the nonzero
+ * structure, and then into full_A and ham_A, which are preallocated
+ * exactly from that structure. The entries that the solvers add later
+ * (the diagonal, time dependent terms, and the steady state stabilization)
+ * are included in the structure. Later calls (for terms added after a
+ * solve) insert only the new terms.
+ */
+void _build_A(){
+  Mat      pre_full_A,pre_ham_A,tmp_full_A,tmp_ham_A;
+  PetscInt m_full,n_full,m_ham,n_ham;
+  MatInfo  info;
+  double   nz_guess;
+
+  if (_matrix_free||!op_finalized) return;
+
+  /* Terms added since the last call go into the rotating frame first */
+  _apply_rotating_frame();
+  _basis_check();
+
+  if (!_A_preallocated){
+    MatGetLocalSize(full_A,&m_full,&n_full);
+    MatGetLocalSize(ham_A,&m_ham,&n_ham);
+
+    MatCreate(PETSC_COMM_WORLD,&pre_full_A);
+    MatSetType(pre_full_A,MATPREALLOCATOR);
+    MatSetSizes(pre_full_A,m_full,n_full,_basis_dim*_basis_dim,_basis_dim*_basis_dim);
+    MatSetUp(pre_full_A);
+
+    MatCreate(PETSC_COMM_WORLD,&pre_ham_A);
+    MatSetType(pre_ham_A,MATPREALLOCATOR);
+    MatSetSizes(pre_ham_A,m_ham,n_ham,_basis_dim,_basis_dim);
+    MatSetUp(pre_ham_A);
+
+    /* Symbolic pass; the add_* routines insert into whatever full_A and ham_A are */
+    tmp_full_A = full_A;
+    tmp_ham_A  = ham_A;
+    full_A     = pre_full_A;
+    ham_A      = pre_ham_A;
+    _term_pass = TERMS_SYMBOLIC;
+    _add_terms_rowwise(0,_num_terms);
+    _add_solver_entries(pre_full_A,pre_ham_A);
+    full_A     = tmp_full_A;
+    ham_A      = tmp_ham_A;
+
+    MatAssemblyBegin(pre_full_A,MAT_FINAL_ASSEMBLY);
+    MatAssemblyEnd(pre_full_A,MAT_FINAL_ASSEMBLY);
+    MatAssemblyBegin(pre_ham_A,MAT_FINAL_ASSEMBLY);
+    MatAssemblyEnd(pre_ham_A,MAT_FINAL_ASSEMBLY);
+
+    MatPreallocatorPreallocate(pre_full_A,PETSC_FALSE,full_A);
+    MatPreallocatorPreallocate(pre_ham_A,PETSC_FALSE,ham_A);
+    MatDestroy(&pre_full_A);
+    MatDestroy(&pre_ham_A);
+
+    /* Terms added after the first solve go in without preallocation */
+    MatSetOption(full_A,MAT_NEW_NONZERO_ALLOCATION_ERR,PETSC_FALSE);
+    MatSetOption(ham_A,MAT_NEW_NONZERO_ALLOCATION_ERR,PETSC_FALSE);
+
+    MatGetInfo(full_A,MAT_GLOBAL_SUM,&info);
+    nz_guess = (double)_basis_dim*_basis_dim*(MAX_NNZ_PER_ROW+(np-1)*MAX_NNZ_PER_ROW/np);
+    if (nid==0) {
+      printf("Preallocated %.0f nonzeros for full_A (previously %.0f).\n",info.nz_allocated,nz_guess);
+    }
+    _A_preallocated = 1;
+  }
+
+  /* Numeric pass */
+  _term_pass = TERMS_NUMERIC;
+  _add_terms_rowwise(_num_terms_built,_num_terms);
+  _term_pass = TERMS_RECORD;
+  _num_terms_built = _num_terms;
+  return;
+}
+
+/*
+ * _add_terms_rowwise inserts terms [start,end) of the term list into
+ * full_A and ham_A. Terms that are products of ops (everything but
+ * add_lin_mat, add_lin_recovery and single VEC ops), and add_lin_local,
+ * are assembled together, in one pass over the local rows: the entries of all terms in
+ * a row are merged and added with a single MatSetValues, rather than each
+ * term sweeping all of the rows with MatSetValue. The other terms are
+ * inserted one at a time with _replay_terms.
+ *
+ * With an excitation cap, row i of the truncated matrix is generated
+ * from the tensor product row of its state, and the columns outside of
+ * the cap are dropped (see _basis_index). With ensembles, only the rows
+ * of full_A within one block of every ensemble are generated; the
+ * elements of rho between blocks start and stay zero.
+ */
+static void _add_terms_rowwise(int start,int end){
+  PetscInt    i,k,Istart,Iend,num_cols,max_cols;
+  PetscInt    *cols;
+  PetscScalar *vals;
+  model_term  *this_term;
+
+  if (_print_dense_ham){
+    /* The dense Hamiltonian is built by the add_* routines */
+    _replay_terms(start,end);
+    return;
+  }
+
+  for (k=start;k<end;k++){
+    this_term = &_term_list[k];
+    if (!_term_has_rows(this_term)){
+      if (_excitation_cap>=0){
+        if (nid==0){
+          printf("ERROR! Only products of operators (with VEC operators in pairs) are\n");
+          printf("       supported with the excitation cap!\n");
+          exit(0);
+        }
+      }
+      _replay_terms(k,k+1);
+    }
+  }
+  max_cols = _terms_row_size(start,end);
+  PetscMalloc1(max_cols,&cols);
+  PetscMalloc1(max_cols,&vals);
+
+  MatGetOwnershipRange(full_A,&Istart,&Iend);
+  for (i=Istart;i<Iend;i++){
+    /* Elements of rho between two blocks of an ensemble stay zero */
+    if (_num_dicke>0&&!_dicke_block_diagonal(_basis_full_index(i))) continue;
+    _terms_row(start,end,i,0,&num_cols,cols,vals);
+    _set_merged_row(full_A,i,num_cols,cols,vals);
+  }
+
+  MatGetOwnershipRange(ham_A,&Istart,&Iend);
+  for (i=Istart;i<Iend;i++){
+    _terms_row(start,end,i,1,&num_cols,cols,vals);
+    _set_merged_row(ham_A,i,num_cols,cols,vals);
+  }
+
+  PetscFree(cols);
+  PetscFree(vals);
+  return;
+}
+
+/*
+ * _get_terms_row gives row i of full_A (psi=0) or ham_A (psi=1), as
+ * generated from all of the recorded products of ops, without building
+ * either matrix. Columns may repeat. cols and vals must hold
+ * _get_terms_row_size() entries.
+ */
+void _get_terms_row(PetscInt i,int psi,PetscInt *num_cols,PetscInt cols[],PetscScalar vals[]){
+  _terms_row(0,_num_terms,i,psi,num_cols,cols,vals);
+  return;
+}
+
+PetscInt _get_terms_row_size(){
+  return _terms_row_size(0,_num_terms);
+}
+
+/*
+ * _terms_row_size bounds the number of entries of a row of terms
+ * [start,end): two per Hamiltonian product, three per Lindblad product
+ */
+static PetscInt _terms_row_size(int start,int end){
+  PetscInt   max_cols;
+  int        k;
+  model_term *this_term;
+
+  max_cols = 1;
+  for (k=start;k<end;k++){
+    this_term = &_term_list[k];
+    if (!_term_has_rows(this_term)) continue;
+    if (this_term->my_term_type==TERM_EXTERNAL){
+      max_cols = max_cols + this_term->row_size;
+    } else if (this_term->my_term_type<TERM_LIN){
+      max_cols = max_cols + 2;
+    } else {
+      max_cols = max_cols + 3;
+    }
+  }
+  return max_cols;
+}
+
+/*
+ * _terms_row gives the entries of row i of full_A (psi=0) or ham_A
+ * (psi=1) from the products of ops among terms [start,end)
+ */
+static void _terms_row(int start,int end,PetscInt i,int psi,PetscInt *num_cols,PetscInt cols[],PetscScalar vals[]){
+  PetscInt    k,j,full_i;
+  PetscScalar val;
+  model_term  *this_term;
+
+  *num_cols = 0;
+  if (!psi){
+    full_i = _basis_full_index(i);
+    for (k=start;k<end;k++){
+      this_term = &_term_list[k];
+      if (this_term->my_term_type==TERM_EXTERNAL&&this_term->row!=NULL){
+        this_term->row(this_term->data,full_i,num_cols,cols,vals);
+        continue;
+      }
+      if (!_term_is_op_product(this_term)||PetscAbsComplex(this_term->a)==0) continue;
+      if (this_term->my_term_type<TERM_LIN){
+        _get_ops_row_ham(this_term->a,full_i,this_term->num_ops,this_term->ops,num_cols,cols,vals);
+      } else {
+        _get_ops_row_lin(this_term->a,full_i,this_term->num_ops,this_term->ops,num_cols,cols,vals);
+      }
+    }
+  } else {
+    /* Only add_to_ham and add_to_ham_mult2 add to ham_A */
+    full_i = _basis_state(i);
+    for (k=start;k<end;k++){
+      this_term = &_term_list[k];
+      if (this_term->my_term_type!=TERM_HAM&&this_term->my_term_type!=TERM_HAM_MULT2) continue;
+      if (!_term_is_op_product(this_term)||PetscAbsComplex(this_term->a)==0) continue;
+      _get_ops_row_j(full_i,this_term->num_ops,this_term->ops,&j,&val,-1,0);
+      if (j!=-1){
+        cols[*num_cols] = j;
+        vals[*num_cols] = -this_term->a*PETSC_i*val;
+        *num_cols = *num_cols + 1;
+      }
+    }
+  }
+  _basis_cols(num_cols,cols,vals);
+  return;
+}
+
+/*
+ * _term_is_op_product returns 1 if the term is a*G or L(G), with G a
+ * product of ops, so that _get_ops_row_ham or _get_ops_row_lin can
+ * generate its rows.
+ */
+int _term_is_op_product(model_term *this_term){
+  int k;
+
+  if (this_term->my_term_type>TERM_LIN_P) return 0;
+  for (k=0;k<this_term->num_ops;k++){
+    if (this_term->ops[k]->my_op_type==VEC){
+      /* A single VEC op means |e><e|; otherwise they must come in pairs */
+      if (k+1>=this_term->num_ops||this_term->ops[k+1]->my_op_type!=VEC) return 0;
+      k = k + 1;
+    }
+  }
+  return 1;
+}
+
+/*
+ * _term_has_rows returns 1 if the rows of the term can be generated one
+ * at a time, by _terms_row: a product of ops, or an external term with
+ * a row callback (see _set_external_term_rows).
+ */
+int _term_has_rows(model_term *this_term){
+  if (this_term->my_term_type==TERM_EXTERNAL) return (this_term->row!=NULL);
+  return _term_is_op_product(this_term);
+}
+
+/*
+ * _set_merged_row sorts the entries of a row by column, combines
+ * repeated columns, and adds the row to A with one MatSetValues.
+ */
+static void _set_merged_row(Mat A,PetscInt row,PetscInt num_cols,PetscInt cols[],PetscScalar vals[]){
+  if (num_cols==0) return;
+  _merge_row(&num_cols,cols,vals);
+  MatSetValues(A,1,&row,num_cols,cols,vals,ADD_VALUES);
+  return;
+}
+
+/*
+ * _merge_row sorts the entries of a row by column and combines
+ * repeated columns
+ */
+void _merge_row(PetscInt *num_cols,PetscInt cols[],PetscScalar vals[]){
+  PetscInt k,num_merged;
+
+  if (*num_cols==0) return;
+  PetscSortIntWithScalarArray(*num_cols,cols,vals);
+  num_merged = 0;
+  for (k=1;k<*num_cols;k++){
+    if (cols[k]==cols[num_merged]){
+      vals[num_merged] = vals[num_merged] + vals[k];
+    } else {
+      num_merged = num_merged + 1;
+      cols[num_merged] = cols[k];
+      vals[num_merged] = vals[k];
+    }
+  }
+  *num_cols = num_merged + 1;
+  return;
+}
+
+/*
+ * _basis_cols converts the tensor product columns of a row to columns of
+ * the truncated matrix, dropping the ones outside of the excitation cap.
+ */
+static void _basis_cols(PetscInt *num_cols,PetscInt cols[],PetscScalar vals[]){
+  PetscInt k,num_kept,col;
+
+  if (_excitation_cap<0) return;
+  num_kept = 0;
+  for (k=0;k<*num_cols;k++){
+    col = _basis_index(cols[k]);
+    if (col<0) continue;
+    cols[num_kept] = col;
+    vals[num_kept] = vals[k];
+    num_kept = num_kept + 1;
+  }
+  *num_cols = num_kept;
+  return;
+}
+
+/*
+ * _replay_terms inserts terms [start,end) of the term list by calling
+ * the add_* routine that recorded them again. Since _term_pass is not
+ * TERMS_RECORD, the routines insert the term instead of recording it.
+ */
+static void _replay_terms(int start,int end){
+  int        i;
+  model_term *this_term;
+
+  for (i=start;i<end;i++){
+    this_term = &_term_list[i];
+    switch (this_term->my_term_type){
+    case TERM_HAM:
+      add_to_ham(this_term->a,this_term->ops[0]);
+      break;
+    case TERM_HAM_MULT2:
+      add_to_ham_mult2(this_term->a,this_term->ops[0],this_term->ops[1]);
+      break;
+    case TERM_HAM_MULT3:
+      add_to_ham_mult3(this_term->a,this_term->ops[0],this_term->ops[1],this_term->ops[2]);
+      break;
+    case TERM_HAM_P:
+      _add_ops_to_mat_ham(this_term->a,full_A,this_term->num_ops,this_term->ops);
+      break;
+    case TERM_LIN:
+      add_lin(this_term->a,this_term->ops[0]);
+      break;
+    case TERM_LIN_MULT2:
+      add_lin_mult2(this_term->a,this_term->ops[0],this_term->ops[1]);
+      break;
+    case TERM_LIN_P:
+      _add_ops_to_mat_lin(this_term->a,full_A,this_term->num_ops,this_term->ops);
+      break;
+    case TERM_LIN_MAT:
+      add_lin_mat(this_term->a,this_term->mat);
+      break;
+    case TERM_EXTERNAL:
+      this_term->replay(this_term->data);
+      break;
+    }
+  }
+  return;
+}
+
+/*
+ * _add_solver_entries adds (zero) entries at every location the solvers
+ * set values in full_A and ham_A after _build_A, so that they are part of
+ * the preallocated structure: the diagonal, the time dependent terms,
+ * and the steady state stabilization row.
+ */
+static void _add_solver_entries(Mat pre_full_A,Mat pre_ham_A){
+  PetscInt    i,Istart,Iend;
+  PetscScalar zero = 0.0;
+  Mat         time_dep_A;
+
+  MatGetOwnershipRange(pre_full_A,&Istart,&Iend);
+  for (i=Istart;i<Iend;i++){
+    MatSetValue(pre_full_A,i,i,zero,ADD_VALUES);
+  }
+  MatGetOwnershipRange(pre_ham_A,&Istart,&Iend);
+  for (i=Istart;i<Iend;i++){
+    MatSetValue(pre_ham_A,i,i,zero,ADD_VALUES);
+  }
+
+  /* time_step adds the time dependent terms to the matrix it solves with */
+  if (_lindblad_terms){
+    time_dep_A = pre_full_A;
+  } else {
+    time_dep_A = pre_ham_A;
+  }
+  for (i=0;i<_num_time_dep;i++){
+    if (_lindblad_terms){
+      _add_ops_to_mat_ham(zero,time_dep_A,_time_dep_list[i].num_ops,_time_dep_list[i].ops);
+    } else {
+      _add_ops_to_mat_ham_psi(zero,time_dep_A,_time_dep_list[i].num_ops,_time_dep_list[i].ops);
+    }
+  }
+  for (i=0;i<_num_time_dep_lin;i++){
+    _add_ops_to_mat_lin(zero,time_dep_A,_time_dep_list_lin[i].num_ops,_time_dep_list_lin[i].ops);
+  }
+
+  /* steady_state adds 1.0 in the 0th spot and every n+1 after, unless pinned */
+  if (nid==0&&_lindblad_terms&&_steady_state_pin()<0){
+    for (i=0;i<_basis_dim;i++){
+      MatSetValue(pre_full_A,0,i*(_basis_dim+1),zero,ADD_VALUES);
+    }
+  }
+  return;
+}
+
+/*
+ * _get_terms gives (read only) access to the recorded terms, for
+ * propagators that work from the terms rather than from full_A.
+ */
+void _get_terms(int *num_terms,model_term **terms){
+  *num_terms = _num_terms;
+  *terms     = _term_list;
+  return;
+}
+
+/*
+ * _time_dep_coeff gives the coefficient, a f(t) exp(i omega t), of a
+ * time dependent term at time t
+ */
+PetscScalar _time_dep_coeff(time_dep_struct *time_dep,PetscReal t){
+  PetscScalar coeff;
+
+  coeff = time_dep->a;
+  if (time_dep->time_dep_func!=NULL){
+    coeff = coeff*time_dep->time_dep_func(t);
+  }
+  if (time_dep->omega!=0){
+    coeff = coeff*PetscExpComplex(PETSC_i*time_dep->omega*t);
+  }
+  return coeff;
+}
+
+/*
+ * _destroy_terms frees the recorded terms.
+ */
+void _destroy_terms(){
+  int i;
+
+  for (i=0;i<_num_terms;i++){
+    if (_term_list[i].ops!=NULL) free(_term_list[i].ops);
+    if (_term_list[i].mat!=NULL) MatDestroy(&_term_list[i].mat);
+    if (_term_list[i].destroy!=NULL) _term_list[i].destroy(_term_list[i].data);
+  }
+  if (_term_list!=NULL) free(_term_list);
+  _term_list       = NULL;
+  _num_terms       = 0;
+  _max_terms       = 0;
+  _num_terms_built = 0;
+  _A_preallocated  = 0;
+  _term_pass       = TERMS_RECORD;
+  return;
+}
+
 /*
  * _check_initialized_A checks to make sure petsc was initialized,
  * some ops were created, and, on first call, sets up the
@@ -1262,7 +1963,7 @@ int _check_op_type3(operator op1,operator op2,operator op3){
 void _check_initialized_A(){
   int            i;
   long           dim;
-  PetscInt       *d_nz,*o_nz,local;
+  PetscBool      mf_flag = PETSC_FALSE;
 
   /* Check to make sure petsc was initialize */
   if (!petsc_initialized){
@@ -1296,144 +1997,43 @@ void _check_initialized_A(){
       }
     }
 
-    dim = total_levels*total_levels;
-    /* Setup petsc matrix */
-
-    MatCreate(PETSC_COMM_WORLD,&full_A);
-    MatSetType(full_A,MATMPIAIJ);
-    MatSetSizes(full_A,PETSC_DECIDE,PETSC_DECIDE,dim,dim);
-    MatSetFromOptions(full_A);
-
+    PetscOptionsHasName(NULL,NULL,"-matrix_free",&mf_flag);
+    if (mf_flag) _matrix_free = 1;
 
-    if (nid==0){
-      /*
-       * Only the first row has extra nonzeros, from the stabilization.
-       * We want to allocate extra memory for that row, but not for any others.
-       * Since we put total_levels extra elements (spread evenly), we
-       * add a fraction to the diagonal part and the remaining to the
-       * off diagonal part. We assume that core 0 owns roughly dim/np
-       * rows.
-       */
+    /* With an excitation cap, psi and rho only hold the states within it */
+    _basis_setup();
+    dim = _basis_dim*_basis_dim;
+    /* Setup petsc matrix */
 
-      PetscMalloc1((dim/np)*5,&d_nz); /* malloc array of nnz diagonal elements*/
-      PetscMalloc1((dim/np)*5,&o_nz); /* malloc array of nnz off diagonal elements*/
+    if (_matrix_free) {
+      /* full_A is a MatShell; nothing of size N^2 x N^2 is stored */
+      if (nid==0) printf("Using matrix-free Lindblad superoperator.\n");
+      _mf_initialize();
+    } else {
 
       /*
-       * If the system is small enough, we can just allocate a lot of
-       * memory for it. Fixes a bug from PETSc when you try to preallocate bigger
-       * the row size
+       * full_A is only given a token preallocation here (so that its layout
+       * is set up for MatCreateVecs); the terms are recorded and
+       * _build_A preallocates it exactly before they are inserted.
        */
-      if (total_levels<MAX_NNZ_PER_ROW) {
-        d_nz[0] = total_levels*total_levels/np;
-        o_nz[0] = total_levels*total_levels/np;
-        for (i=1;i<(dim/np)*5;i++){
-          d_nz[i] = total_levels*total_levels/np;
-          o_nz[i] = total_levels*total_levels/np;
-        }
-      } else {
-        d_nz[0] = MAX_NNZ_PER_ROW + ceil(ceil(dim/np)/total_levels)+5;
-        o_nz[0] = MAX_NNZ_PER_ROW + (total_levels - floor(ceil(dim/np)/total_levels))+5;
-        for (i=1;i<(dim/np)*5;i++){
-          d_nz[i] = MAX_NNZ_PER_ROW;
-          o_nz[i] = MAX_NNZ_PER_ROW;
-        }
-
-      }
-
-      /* MatMPIAIJSetPreallocation(full_A,0,d_nz,0,o_nz); */
-      /* MatSeqAIJSetPreallocation(full_A,0,d_nz); */
-      local = 100;//*MAX_NNZ_PER_ROW/np;
-
-      MatMPIAIJSetPreallocation(full_A,local,NULL,(np-1)*MAX_NNZ_PER_ROW/np,NULL);
-    } else {
-        local = 100;//*MAX_NNZ_PER_ROW/np;
-
-      if (MAX_NNZ_PER_ROW>total_levels*total_levels) {
-        MatMPIAIJSetPreallocation(full_A,total_levels,NULL,total_levels,NULL);
-      } else {
-        //MatMPIAIJSetPreallocation(full_A,MAX_NNZ_PER_ROW,NULL,MAX_NNZ_PER_ROW,NULL);
-        MatMPIAIJSetPreallocation(full_A,local,NULL,(np-1)*MAX_NNZ_PER_ROW/np,NULL);
-      }
+      MatCreate(PETSC_COMM_WORLD,&full_A);
+      MatSetType(full_A,MATMPIAIJ);
+      MatSetSizes(full_A,PETSC_DECIDE,PETSC_DECIDE,dim,dim);
+      MatSetFromOptions(full_A);
+      MatMPIAIJSetPreallocation(full_A,1,NULL,0,NULL);
     }
 
-    /* if (nid==0){ */
-    /*   ierr = MatCreateAIJ(PETSC_COMM_WORLD,PETSC_DECIDE,PETSC_DECIDE,dim,dim, */
-    /*                       ,NULL,,NULL,&full_A);CHKERRQ(ierr); */
-    /* } else { */
-    /*   ierr = MatCreateAIJ(PETSC_COMM_WORLD,PETSC_DECIDE,PETSC_DECIDE,dim,dim, */
-    /*                       10,NULL,10,NULL,&full_A);CHKERRQ(ierr); */
-    /* } */
-
-    MatSetUp(full_A); // This might not be necessary?
-
-    /* MatCreate(PETSC_COMM_WORLD,&full_stiff_A); */
-    /* MatSetType(full_stiff_A,MATMPIAIJ); */
-    /* MatSetSizes(full_stiff_A,PETSC_DECIDE,PETSC_DECIDE,dim,dim); */
-    /* MatSetFromOptions(full_stiff_A); */
-
-
-    /* if (nid==0){ */
-    /*   /\* */
-    /*    * Only the first row has extra nonzeros, from the stabilization. */
-    /*    * We want to allocate extra memory for that row, but not for any others. */
-    /*    * Since we put total_levels extra elements (spread evenly), we */
-    /*    * add a fraction to the diagonal part and the remaining to the */
-    /*    * off diagonal part. We assume that core 0 owns roughly dim/np */
-    /*    * rows. */
-    /*    *\/ */
-    /*   /\* */
-    /*    * If the system is small enough, we can just allocate a lot of */
-    /*    * memory for it. Fixes a bug from PETSc when you try to preallocate bigger */
-    /*    * the row size */
-    /*    *\/ */
-    /*   if (total_levels<MAX_NNZ_PER_ROW) { */
-    /*     d_nz[0] = total_levels; */
-    /*     o_nz[0] = total_levels; */
-    /*     for (i=1;i<(dim/np)*5;i++){ */
-    /*       d_nz[i] = total_levels; */
-    /*       o_nz[i] = total_levels; */
-    /*     } */
-    /*   } else { */
-    /*     d_nz[0] = MAX_NNZ_PER_ROW + ceil(ceil(dim/np)/total_levels)+5; */
-    /*     o_nz[0] = MAX_NNZ_PER_ROW + (total_levels - floor(ceil(dim/np)/total_levels))+5; */
-    /*     for (i=1;i<(dim/np)*5;i++){ */
-    /*       d_nz[i] = MAX_NNZ_PER_ROW; */
-    /*       o_nz[i] = MAX_NNZ_PER_ROW; */
-    /*     } */
-    /*   } */
-
-    /*   /\* MatMPIAIJSetPreallocation(full_stiff_A,0,d_nz,0,o_nz); *\/ */
-    /*   /\* MatSeqAIJSetPreallocation(full_stiff_A,0,d_nz); *\/ */
-    /*   MatMPIAIJSetPreallocation(full_stiff_A,2*MAX_NNZ_PER_ROW/np,NULL,(np-1)*MAX_NNZ_PER_ROW/np,NULL); */
-    /*   PetscFree(d_nz); */
-    /*   PetscFree(o_nz); */
-
-    /* } else { */
-    /*   if (MAX_NNZ_PER_ROW>total_levels*total_levels) { */
-    /*     MatMPIAIJSetPreallocation(full_stiff_A,total_levels,NULL,total_levels,NULL); */
-    /*   } else { */
-    /*     //MatMPIAIJSetPreallocation(full_stiff_A,MAX_NNZ_PER_ROW,NULL,MAX_NNZ_PER_ROW,NULL); */
-    /*     MatMPIAIJSetPreallocation(full_stiff_A,2*MAX_NNZ_PER_ROW/np,NULL,(np-1)*MAX_NNZ_PER_ROW/np,NULL); */
-    /*   } */
-    /* } */
-
-    /* /\* if (nid==0){ *\/ */
-    /* /\*   ierr = MatCreateAIJ(PETSC_COMM_WORLD,PETSC_DECIDE,PETSC_DECIDE,dim,dim, *\/ */
-    /* /\*                       ,NULL,,NULL,&full_stiff_A);CHKERRQ(ierr); *\/ */
-    /* /\* } else { *\/ */
-    /* /\*   ierr = MatCreateAIJ(PETSC_COMM_WORLD,PETSC_DECIDE,PETSC_DECIDE,dim,dim, *\/ */
-    /* /\*                       10,NULL,10,NULL,&full_stiff_A);CHKERRQ(ierr); *\/ */
-    /* /\* } *\/ */
-
-    /* MatSetUp(full_stiff_A); // This might not be necessary? */
-
+    /* The stiff matrices are only created if stiff terms are added; see _check_initialized_stiff_A */
 
     /* Setup ham_A matrix */
     MatCreate(PETSC_COMM_WORLD,&ham_A);
     MatSetType(ham_A,MATMPIAIJ);
-    MatSetSizes(ham_A,PETSC_DECIDE,PETSC_DECIDE,total_levels,total_levels);
+    MatSetSizes(ham_A,PETSC_DECIDE,PETSC_DECIDE,_basis_dim,_basis_dim);
     MatSetFromOptions(ham_A);
-    if (MAX_NNZ_PER_ROW>total_levels/2) {
+    if (!_matrix_free) {
+      /* Preallocated exactly by _build_A, like full_A */
+      MatMPIAIJSetPreallocation(ham_A,1,NULL,0,NULL);
+    } else if (MAX_NNZ_PER_ROW>total_levels/2) {
       if (np==1){
         MatMPIAIJSetPreallocation(ham_A,total_levels,NULL,0,NULL);
       } else {
@@ -1444,20 +2044,67 @@ void _check_initialized_A(){
     }
     MatSetUp(ham_A); // This might not be necessary?
 
-    /* /\* Setup ham_stiff_A matrix *\/ */
-    /* MatCreate(PETSC_COMM_WORLD,&ham_stiff_A); */
-    /* MatSetType(ham_stiff_A,MATMPIAIJ); */
-    /* MatSetSizes(ham_stiff_A,PETSC_DECIDE,PETSC_DECIDE,total_levels,total_levels); */
-    /* MatSetFromOptions(ham_stiff_A); */
-    /* if (MAX_NNZ_PER_ROW>total_levels/2) { */
-    /*   MatMPIAIJSetPreallocation(ham_stiff_A,total_levels/2,NULL,total_levels/2,NULL); */
-    /* } else { */
-    /*   MatMPIAIJSetPreallocation(ham_stiff_A,MAX_NNZ_PER_ROW,NULL,MAX_NNZ_PER_ROW,NULL); */
-    /* } */
-    /* MatSetUp(ham_stiff_A); // This might not be necessary? */
+    if (!_matrix_free) {
+      /*
+       * Assembling full_A or ham_A directly (to view or test them, before
+       * a solver has run) inserts the recorded terms first, so that code
+       * outside of QuaC sees the matrices as if the terms went in directly
+       */
+      MatGetOperation(full_A,MATOP_ASSEMBLY_BEGIN,(void(**)(void))&_A_assembly_begin);
+      MatSetOperation(full_A,MATOP_ASSEMBLY_BEGIN,(void(*)(void))_build_A_assembly_begin);
+      MatSetOperation(ham_A,MATOP_ASSEMBLY_BEGIN,(void(*)(void))_build_A_assembly_begin);
+    }
+  }
+
+  return;
+}
 
+/*
+ * _build_A_assembly_begin is the MatAssemblyBegin of full_A and ham_A
+ * (and of their duplicates). It inserts the terms recorded since the
+ * last _build_A, then assembles as the matrix type does.
+ */
+static PetscErrorCode _build_A_assembly_begin(Mat A,MatAssemblyType type){
+  if ((A==full_A||A==ham_A)&&_term_pass==TERMS_RECORD&&
+      (!_A_preallocated||_num_terms_built<_num_terms)){
+    _build_A();
   }
+  if (_A_assembly_begin!=NULL) {
+    return (*_A_assembly_begin)(A,type);
+  }
+  return(0);
+}
 
+/*
+ * _check_initialized_stiff_A creates ham_stiff_A and full_stiff_A, with
+ * the same layout as ham_A and full_A, the first time a stiff term is
+ * added. Stiff terms are few (typically fast, diagonal, frequencies), so
+ * they are added directly, with a small preallocation that may grow.
+ */
+void _check_initialized_stiff_A(){
+  PetscInt m,n;
+  long     dim;
+
+  if (_stiff_solver) return;
+  _stiff_solver = 1;
+  _basis_check();
+  dim = total_levels*total_levels;
+
+  MatGetLocalSize(full_A,&m,&n);
+  MatCreate(PETSC_COMM_WORLD,&full_stiff_A);
+  MatSetType(full_stiff_A,MATMPIAIJ);
+  MatSetSizes(full_stiff_A,m,n,dim,dim);
+  MatSetFromOptions(full_stiff_A);
+  MatMPIAIJSetPreallocation(full_stiff_A,8,NULL,8,NULL);
+  MatSetOption(full_stiff_A,MAT_NEW_NONZERO_ALLOCATION_ERR,PETSC_FALSE);
+
+  MatGetLocalSize(ham_A,&m,&n);
+  MatCreate(PETSC_COMM_WORLD,&ham_stiff_A);
+  MatSetType(ham_stiff_A,MATMPIAIJ);
+  MatSetSizes(ham_stiff_A,m,n,total_levels,total_levels);
+  MatSetFromOptions(ham_stiff_A);
+  MatMPIAIJSetPreallocation(ham_stiff_A,4,NULL,4,NULL);
+  MatSetOption(ham_stiff_A,MAT_NEW_NONZERO_ALLOCATION_ERR,PETSC_FALSE);
   return;
 }
 
@@ -1477,6 +2124,12 @@ void set_initial_pop(operator op1,double initial_pop){
       exit(0);
     }
   }
+  if (op1->my_op_type==DICKE_LOWER&&initial_pop>op1->num_emitters){
+    if (nid==0){
+      printf("ERROR! The initial population of an ensemble cannot be greater than the number of emitters!\n");
+      exit(0);
+    }
+  }
 
   op1->initial_pop = (double)initial_pop;
 
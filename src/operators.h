@@ -20,19 +20,27 @@ typedef struct operator{
   int     position;
   /* Stores a pointer to the top of the list. Used in vec[0] only*/
   struct operator **vec_op_list;
+  /* For ensemble (Dicke) operators only */
+  int     num_emitters;
 
 } *operator;
 
 typedef operator *vec_op; /* Treat vec_op as an array of operators  */
 
+/*
+ * A time dependent term, a f(t) exp(i omega t) G, with G the product of ops.
+ * time_dep_func may be NULL (f = 1); a = 1 and omega = 0 unless the term
+ * was moved there by the rotating frame (see rotating_frame.c).
+ */
 typedef struct time_dep_struct{
   double (*time_dep_func)(double);
   operator *ops;
   int num_ops;
   Mat mat;
+  PetscScalar a;
+  PetscReal omega;
 } time_dep_struct;
 
-
 void create_op(int,operator*);
 void create_vec(int,vec_op*);
 
@@ -54,8 +62,10 @@ void add_lin(PetscScalar,operator);
 void add_lin_mat(PetscScalar,Mat);
 void add_lin_mult2(PetscScalar,operator,operator);
 void print_dense_ham();
+void set_matrix_free();
 void set_initial_pop(operator,double);
 void combine_ops_to_mat(Mat*,int,...);
+void build_operators();
 
 extern int nid; /* a ranks id */
 extern int np; /* number of processors */
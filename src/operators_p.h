@@ -11,12 +11,71 @@ typedef enum {
     SIGMA_X = 3,
     SIGMA_Y = 4,
     SIGMA_Z = 5,
-    IDENTITY = 6
+    IDENTITY = 6,
+    /* Collective operators of an ensemble of emitters (see dicke.c) */
+    DICKE_LOWER   = 7,
+    DICKE_RAISE   = 8,
+    DICKE_NUMBER  = 9,
+    DICKE_SIGMA_Z = 10
   } op_type;
 
 
+struct operator;
+struct time_dep_struct;
+
+/*
+ * Terms added with add_to_ham, add_lin, etc. are recorded, rather than
+ * inserted into full_A and ham_A immediately, so that the matrices can be
+ * preallocated exactly (see _build_A and _build_A_assembly_begin).
+ */
+typedef enum {
+  TERM_HAM       = 0,
+  TERM_HAM_MULT2 = 1,
+  TERM_HAM_MULT3 = 2,
+  TERM_HAM_P     = 3,
+  TERM_LIN       = 4,
+  TERM_LIN_MULT2 = 5,
+  TERM_LIN_P     = 6,
+  TERM_LIN_MAT   = 7,
+  TERM_EXTERNAL  = 8 // Recorded by another file; replayed through a callback
+} term_type;
+
+typedef enum {
+  TERMS_RECORD   = 0, // add_* routines record their term
+  TERMS_SYMBOLIC = 1, // replaying into MATPREALLOCATOR matrices
+  TERMS_NUMERIC  = 2  // replaying into the preallocated full_A and ham_A
+} term_pass_type;
+
+typedef struct model_term{
+  term_type   my_term_type;
+  PetscScalar a;
+  int         num_ops;
+  struct operator **ops;
+  Mat         mat;
+  void        *data;
+  void        (*replay)(void*);
+  void        (*destroy)(void*);
+  void        (*row)(void*,PetscInt,PetscInt*,PetscInt[],PetscScalar[]);
+  PetscInt    row_size;
+} model_term;
+
+
 void _check_initialized_A();
+void _check_initialized_stiff_A();
 void _check_initialized_op();
+int  _defer_terms();
+void _record_term(term_type,PetscScalar,int,struct operator**,Mat);
+void _record_external_term(void (*)(void*),void (*)(void*),void*);
+void _set_external_term_rows(void (*)(void*,PetscInt,PetscInt*,PetscInt[],PetscScalar[]),PetscInt);
+void _build_A();
+void _destroy_terms();
+int  _term_is_op_product(model_term*);
+int  _term_has_rows(model_term*);
+void _get_terms(int*,model_term**);
+void _get_terms_row(PetscInt,int,PetscInt*,PetscInt[],PetscScalar[]);
+PetscInt _get_terms_row_size();
+void _merge_row(PetscInt*,PetscInt[],PetscScalar[]);
+PetscScalar _time_dep_coeff(struct time_dep_struct*,PetscReal);
 
 extern int  _num_time_dep;
 extern int  _num_time_dep_lin;
@@ -30,4 +89,6 @@ extern int  num_subsystems;
 extern int  op_initialized;
 extern PetscScalar **_hamiltonian;
 extern int _print_dense_ham;
+extern int _matrix_free;
+extern term_pass_type _term_pass;
 #endif
@@ -0,0 +1,495 @@
+#include "output.h"
+#include "output_p.h"
+#include "quac_p.h"
+#include "operators_p.h"
+#include "operators.h"
+#include "dm_utilities.h"
+#include "excitation_basis_p.h"
+#include "dicke_p.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+ * Buffered, binary output of observables. The observables are registered
+ * once (add_output_populations, add_output_expectation), and the first
+ * time they are needed, the elements of rho they depend on are listed,
+ * with <O> = sum of w rho over the list. A product of operators needs at
+ * most one element per column of rho, and the populations only the
+ * diagonal, so the list is O(N) long for an N x N rho. Recording all of
+ * them (record_output, or ts_monitor_output as the ts_monitor) is then one
+ * sweep over the list and one reduction, and nothing is allocated per
+ * call. Rank 0 appends the values to an in memory buffer; when it is
+ * full, it is handed to a writer thread that writes it to the file while
+ * the solver goes on with the other buffer. The file format is described
+ * in output_p.h; tools/output_to_text.c converts it to text.
+ *
+ * An example, in place of a ts_monitor that prints populations:
+ *      add_output_populations();
+ *      add_output_expectation("n_a",2,a->dag,a);
+ *      open_output("obs.bin");
+ *      set_ts_monitor(ts_monitor_output);
+ *      time_step(rho,0.0,time_max,dt,steps_max);
+ *      close_output();
+ */
+
+typedef struct output_obs{
+  char     name[64];
+  int      populations; /* 1 for all populations (several columns) */
+  int      num_ops;
+  operator *ops;
+} output_obs;
+
+static output_obs  *_obs          = NULL;
+static int         _num_obs       = 0;
+static int         _num_columns   = 0;
+static char        **_column_names = NULL;
+static PetscInt    _weights_size  = -1;
+static PetscInt    _weights_start = -1;
+static PetscInt    _num_weights   = 0;
+static PetscInt    _max_weights   = 0;
+static PetscInt    *_weight_loc   = NULL; /* local index in rho */
+static int         *_weight_col   = NULL; /* column of the observable */
+static PetscScalar *_weight_val   = NULL;
+static PetscScalar *_values       = NULL;
+static double      *_pop_work     = NULL;
+static int         _output_is_open = 0;
+
+/* Writer thread state; only used on rank 0 */
+static FILE            *_fp;
+static double          *_buffers[2];
+static PetscInt        _buffer_records = 4096;
+static PetscInt        _num_in_buffer,_num_pending;
+static int             _current_buffer,_pending_buffer,_writer_done;
+static pthread_t       _writer;
+static pthread_mutex_t _writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  _writer_cond = PTHREAD_COND_INITIALIZER;
+
+static void  _output_build_weights(Vec);
+static void  _output_add_weight(PetscInt,int,PetscScalar);
+static void  _output_free_weights();
+static void  _output_hand_off();
+static void *_output_writer(void*);
+
+/*
+ * add_output_populations adds the populations of all subsystems (as in
+ * get_populations) to the observables of record_output
+ */
+void add_output_populations(){
+  if (_output_is_open){
+    if (nid==0){
+      printf("ERROR! Observables must be added before open_output!\n");
+      exit(0);
+    }
+  }
+  _obs = realloc(_obs,(_num_obs+1)*sizeof(output_obs));
+  snprintf(_obs[_num_obs].name,sizeof(_obs[_num_obs].name),"pop");
+  _obs[_num_obs].populations = 1;
+  _obs[_num_obs].num_ops     = 0;
+  _obs[_num_obs].ops         = NULL;
+  _num_obs = _num_obs + 1;
+  return;
+}
+
+/*
+ * add_output_expectation adds the (real part of the) expectation value of
+ * a product of operators to the observables of record_output
+ *
+ * Inputs:
+ *      const char *name:  column name in the output file
+ *      int number_of_ops: number of operators in the product
+ *      ...:               the operators, as in get_expectation_value
+ */
+void add_output_expectation(const char *name,int number_of_ops,...){
+  va_list ap;
+  int     i;
+
+  if (_output_is_open){
+    if (nid==0){
+      printf("ERROR! Observables must be added before open_output!\n");
+      exit(0);
+    }
+  }
+  _obs = realloc(_obs,(_num_obs+1)*sizeof(output_obs));
+  snprintf(_obs[_num_obs].name,sizeof(_obs[_num_obs].name),"%s",name);
+  _obs[_num_obs].populations = 0;
+  _obs[_num_obs].num_ops     = number_of_ops;
+  _obs[_num_obs].ops         = malloc(number_of_ops*sizeof(operator));
+  va_start(ap,number_of_ops);
+  for (i=0;i<number_of_ops;i++){
+    _obs[_num_obs].ops[i] = va_arg(ap,operator);
+  }
+  va_end(ap);
+  _num_obs = _num_obs + 1;
+  return;
+}
+
+/*
+ * open_output opens the output file, writes its header and, on rank 0,
+ * starts the writer thread. The buffer holds -output_buffer_records
+ * records (default 4096) before it is handed to the writer.
+ *
+ * Inputs:
+ *      const char *filename: the output file (overwritten)
+ */
+void open_output(const char *filename){
+  int     i,j,k,num_pop;
+  int32_t length;
+
+  if (_output_is_open){
+    if (nid==0){
+      printf("ERROR! open_output was already called! Call close_output first.\n");
+      exit(0);
+    }
+  }
+  if (_num_obs==0){
+    if (nid==0){
+      printf("ERROR! No observables were added before open_output!\n");
+      exit(0);
+    }
+  }
+
+  /* Populations become one column per population */
+  num_pop      = get_num_populations();
+  _num_columns = 0;
+  for (i=0;i<_num_obs;i++){
+    _num_columns = _num_columns + (_obs[i].populations ? num_pop : 1);
+  }
+  _column_names = malloc(_num_columns*sizeof(char*));
+  k = 0;
+  for (i=0;i<_num_obs;i++){
+    if (_obs[i].populations){
+      for (j=0;j<num_pop;j++){
+        _column_names[k] = malloc(32*sizeof(char));
+        snprintf(_column_names[k],32,"pop%d",j);
+        k = k + 1;
+      }
+    } else {
+      _column_names[k] = malloc(sizeof(_obs[i].name));
+      snprintf(_column_names[k],sizeof(_obs[i].name),"%s",_obs[i].name);
+      k = k + 1;
+    }
+  }
+  _values       = malloc(_num_columns*sizeof(PetscScalar));
+  _pop_work     = malloc(num_pop*sizeof(double));
+  _weights_size = -1;
+
+  PetscOptionsGetInt(NULL,NULL,"-output_buffer_records",&_buffer_records,NULL);
+  if (_buffer_records<1) _buffer_records = 1;
+
+  if (nid==0){
+    _fp = fopen(filename,"wb");
+    if (_fp==NULL){
+      printf("ERROR! Could not open %s for output!\n",filename);
+      exit(0);
+    }
+    fwrite(OUTPUT_MAGIC,sizeof(char),8,_fp);
+    length = _num_columns + 1;
+    fwrite(&length,sizeof(int32_t),1,_fp);
+    length = 4;
+    fwrite(&length,sizeof(int32_t),1,_fp);
+    fwrite("time",sizeof(char),4,_fp);
+    for (i=0;i<_num_columns;i++){
+      length = strlen(_column_names[i]);
+      fwrite(&length,sizeof(int32_t),1,_fp);
+      fwrite(_column_names[i],sizeof(char),length,_fp);
+    }
+
+    _buffers[0]      = malloc(_buffer_records*(_num_columns+1)*sizeof(double));
+    _buffers[1]      = malloc(_buffer_records*(_num_columns+1)*sizeof(double));
+    _current_buffer  = 0;
+    _num_in_buffer   = 0;
+    _pending_buffer  = -1;
+    _writer_done     = 0;
+    pthread_create(&_writer,NULL,_output_writer,NULL);
+  }
+  _output_is_open = 1;
+  return;
+}
+
+/*
+ * record_output evaluates all of the observables and buffers them.
+ * It must be called on all processors.
+ *
+ * Inputs:
+ *      PetscReal time: the time of rho
+ *      Vec       rho:  the density matrix (or wavefunction)
+ */
+void record_output(PetscReal time,Vec rho){
+  PetscInt          size,start,end,e;
+  int               i,j,k,num_pop;
+  double            *record;
+  const PetscScalar *rho_array;
+
+  if (!_output_is_open){
+    if (nid==0){
+      printf("ERROR! open_output must be called before record_output!\n");
+      exit(0);
+    }
+  }
+  VecGetSize(rho,&size);
+  if (size==_basis_dim*_basis_dim){
+    VecGetOwnershipRange(rho,&start,&end);
+    if (size!=_weights_size||start!=_weights_start){
+      _output_build_weights(rho);
+    }
+    for (i=0;i<_num_columns;i++){
+      _values[i] = 0.0;
+    }
+    VecGetArrayRead(rho,&rho_array);
+    for (e=0;e<_num_weights;e++){
+      _values[_weight_col[e]] += _weight_val[e]*rho_array[_weight_loc[e]];
+    }
+    VecRestoreArrayRead(rho,&rho_array);
+    MPI_Allreduce(MPI_IN_PLACE,_values,_num_columns,MPIU_SCALAR,MPI_SUM,PetscObjectComm((PetscObject)rho));
+  } else {
+    /* <psi|O|psi> is not linear in psi; evaluate each observable */
+    num_pop = get_num_populations();
+    k = 0;
+    for (i=0;i<_num_obs;i++){
+      if (_obs[i].populations){
+        get_populations(rho,&_pop_work);
+        for (j=0;j<num_pop;j++){
+          _values[k] = _pop_work[j];
+          k = k + 1;
+        }
+      } else {
+        get_expectation_values(rho,1,&_obs[i].num_ops,&_obs[i].ops,NULL,&_values[k]);
+        k = k + 1;
+      }
+    }
+  }
+
+  if (nid==0){
+    record = _buffers[_current_buffer] + _num_in_buffer*(_num_columns+1);
+    record[0] = time;
+    for (i=0;i<_num_columns;i++){
+      record[i+1] = PetscRealPart(_values[i]);
+    }
+    _num_in_buffer = _num_in_buffer + 1;
+    if (_num_in_buffer==_buffer_records){
+      _output_hand_off();
+    }
+  }
+  return;
+}
+
+/*
+ * ts_monitor_output is a ts_monitor that calls record_output; use it with
+ * set_ts_monitor (and set_output_times, to record at fixed times).
+ */
+PetscErrorCode ts_monitor_output(TS ts,PetscInt step,PetscReal time,Vec rho,void *ctx){
+  record_output(time,rho);
+  PetscFunctionReturn(0);
+}
+
+/*
+ * close_output writes what is left in the buffer, waits for the writer
+ * thread and closes the file. The observables stay registered, so
+ * open_output can be called again.
+ */
+void close_output(){
+  int i;
+
+  if (!_output_is_open) return;
+  if (nid==0){
+    if (_num_in_buffer>0){
+      _output_hand_off();
+    }
+    pthread_mutex_lock(&_writer_lock);
+    _writer_done = 1;
+    pthread_cond_broadcast(&_writer_cond);
+    pthread_mutex_unlock(&_writer_lock);
+    pthread_join(_writer,NULL);
+    fclose(_fp);
+    free(_buffers[0]);
+    free(_buffers[1]);
+  }
+
+  for (i=0;i<_num_columns;i++){
+    free(_column_names[i]);
+  }
+  free(_column_names);
+  free(_values);
+  free(_pop_work);
+  _output_free_weights();
+  _output_is_open = 0;
+  return;
+}
+
+/*
+ * _output_clear closes the output, if it is open, and forgets the
+ * observables (their operators may be destroyed next)
+ */
+void _output_clear(){
+  int i;
+
+  close_output();
+  for (i=0;i<_num_obs;i++){
+    free(_obs[i].ops);
+  }
+  free(_obs);
+  _obs     = NULL;
+  _num_obs = 0;
+  return;
+}
+
+/*
+ * _output_build_weights lists the local elements of rho that each column
+ * depends on, with their weights, so that column k is the sum of
+ * w rho_loc over its entries. For products of operators, this is the same
+ * sweep over the local columns of rho as get_expectation_values; for
+ * populations, only the diagonal of rho contributes.
+ */
+static void _output_build_weights(Vec rho){
+  PetscInt    i,c,q,dim,my_start,my_end,my_j_start,my_j_end,this_i,this_loc,diag_index,state;
+  PetscInt    my_levels,n_after,cur_state;
+  PetscScalar op_val;
+  int         k,col,num_pop;
+  int         *i_sub_to_i_pop;
+
+  _output_free_weights();
+  VecGetSize(rho,&_weights_size);
+  VecGetOwnershipRange(rho,&my_start,&my_end);
+  _weights_start = my_start;
+  dim = _basis_dim;
+
+  /* Where each subsystem's populations start, as in get_populations */
+  i_sub_to_i_pop = malloc(num_subsystems*sizeof(int));
+  num_pop = 0;
+  for (q=0;q<num_subsystems;q++){
+    i_sub_to_i_pop[q] = num_pop;
+    if (subsystem_list[q]->my_op_type==VEC){
+      num_pop += subsystem_list[q]->my_levels;
+    } else {
+      num_pop += 1;
+    }
+  }
+
+  my_j_start = my_start/dim;
+  my_j_end   = (my_end-1)/dim + 1;
+  col = 0;
+  for (k=0;k<_num_obs;k++){
+    if (_obs[k].populations){
+      for (i=0;i<dim;i++){
+        diag_index = i*dim + i;
+        if (diag_index<my_start||diag_index>=my_end) continue;
+        state = _basis_state(i);
+        for (q=0;q<num_subsystems;q++){
+          my_levels = subsystem_list[q]->my_levels;
+          n_after   = total_levels/(my_levels*subsystem_list[q]->n_before);
+          cur_state = (state/n_after)%my_levels;
+          if (subsystem_list[q]->my_op_type==VEC){
+            _output_add_weight(diag_index-my_start,col+i_sub_to_i_pop[q]+cur_state,1.0);
+          } else {
+            _output_add_weight(diag_index-my_start,col+i_sub_to_i_pop[q],
+                               _level_excitations(subsystem_list[q],cur_state));
+          }
+        }
+      }
+      col = col + num_pop;
+    } else {
+      for (c=my_j_start;c<my_j_end;c++){
+        _get_op_product_j(_basis_state(c),_obs[k].num_ops,_obs[k].ops,&this_i,&op_val);
+        if (this_i<0) continue;
+        this_i   = _basis_rank(this_i);
+        this_loc = dim*c + this_i;
+        if (this_loc>=my_start&&this_loc<my_end){
+          _output_add_weight(this_loc-my_start,col,op_val);
+        }
+      }
+      col = col + 1;
+    }
+  }
+
+  free(i_sub_to_i_pop);
+  return;
+}
+
+/*
+ * _output_add_weight appends an entry to the list of _output_build_weights
+ */
+static void _output_add_weight(PetscInt loc,int col,PetscScalar val){
+  if (_num_weights==_max_weights){
+    _max_weights = PetscMax(2*_max_weights,64);
+    _weight_loc  = realloc(_weight_loc,_max_weights*sizeof(PetscInt));
+    _weight_col  = realloc(_weight_col,_max_weights*sizeof(int));
+    _weight_val  = realloc(_weight_val,_max_weights*sizeof(PetscScalar));
+  }
+  _weight_loc[_num_weights] = loc;
+  _weight_col[_num_weights] = col;
+  _weight_val[_num_weights] = val;
+  _num_weights = _num_weights + 1;
+  return;
+}
+
+/*
+ * _output_free_weights empties the list, so that the next record_output
+ * builds it again
+ */
+static void _output_free_weights(){
+  free(_weight_loc);
+  free(_weight_col);
+  free(_weight_val);
+  _weight_loc    = NULL;
+  _weight_col    = NULL;
+  _weight_val    = NULL;
+  _num_weights   = 0;
+  _max_weights   = 0;
+  _weights_size  = -1;
+  _weights_start = -1;
+  return;
+}
+
+/*
+ * _output_hand_off gives the current buffer to the writer thread, and
+ * goes on with the other one, once the writer is done with it
+ */
+static void _output_hand_off(){
+  pthread_mutex_lock(&_writer_lock);
+  while (_pending_buffer>=0){
+    pthread_cond_wait(&_writer_cond,&_writer_lock);
+  }
+  _pending_buffer = _current_buffer;
+  _num_pending    = _num_in_buffer;
+  pthread_cond_broadcast(&_writer_cond);
+  pthread_mutex_unlock(&_writer_lock);
+
+  _current_buffer = 1 - _current_buffer;
+  _num_in_buffer  = 0;
+  return;
+}
+
+/*
+ * _output_writer is the writer thread on rank 0. It makes no MPI or
+ * PETSc calls.
+ */
+static void *_output_writer(void *arg){
+  int      buffer;
+  PetscInt num;
+
+  while (1){
+    pthread_mutex_lock(&_writer_lock);
+    while (_pending_buffer<0&&!_writer_done){
+      pthread_cond_wait(&_writer_cond,&_writer_lock);
+    }
+    if (_pending_buffer<0){
+      pthread_mutex_unlock(&_writer_lock);
+      break;
+    }
+    buffer = _pending_buffer;
+    num    = _num_pending;
+    pthread_mutex_unlock(&_writer_lock);
+
+    fwrite(_buffers[buffer],sizeof(double),num*(_num_columns+1),_fp);
+
+    pthread_mutex_lock(&_writer_lock);
+    _pending_buffer = -1;
+    pthread_cond_broadcast(&_writer_cond);
+    pthread_mutex_unlock(&_writer_lock);
+  }
+  return NULL;
+}
@@ -0,0 +1,14 @@
+#ifndef OUTPUT_H_
+#define OUTPUT_H_
+
+#include <petscts.h>
+#include "operators.h"
+
+void add_output_populations();
+void add_output_expectation(const char*,int,...);
+void open_output(const char*);
+void record_output(PetscReal,Vec);
+void close_output();
+PetscErrorCode ts_monitor_output(TS,PetscInt,PetscReal,Vec,void*);
+
+#endif
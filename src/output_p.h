@@ -0,0 +1,19 @@
+#ifndef OUTPUT_P_H_
+#define OUTPUT_P_H_
+
+/*
+ * Format of the file written by open_output/record_output; everything is
+ * in the byte order of the machine that wrote it:
+ *     char    magic[8]            "QUACOBS1"
+ *     int32   num_columns         time, then one per observable
+ *     num_columns times:
+ *       int32 length; char name[length]   (not null terminated)
+ *     records, until the end of the file:
+ *       double values[num_columns]
+ * tools/output_to_text.c converts it to text.
+ */
+#define OUTPUT_MAGIC "QUACOBS1"
+
+void _output_clear();
+
+#endif
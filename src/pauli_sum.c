@@ -0,0 +1,370 @@
+#include "pauli_sum.h"
+#include "operators_p.h"
+#include "operators.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+static void _group_pauli_sum(pauli_sum);
+static int  _compare_pauli_terms(const void*,const void*);
+static int  _mask_parity(unsigned long long);
+
+/* Used by qsort to compare terms of the pauli sum being grouped */
+static pauli_sum _sort_sum;
+
+/*
+ * create_pauli_sum creates an empty sum of Pauli strings, which can
+ * be filled with add_pauli_term and evaluated (many times) with
+ * get_pauli_sum_expectation.
+ *
+ * Outputs:
+ *      pauli_sum *new_sum: the new, empty, pauli sum
+ */
+void create_pauli_sum(pauli_sum *new_sum){
+  pauli_sum temp;
+
+  temp = malloc(sizeof(struct pauli_sum));
+  temp->num_terms      = 0;
+  temp->max_terms      = 16;
+  temp->num_groups     = 0;
+  temp->x_masks        = malloc(temp->max_terms*sizeof(unsigned long long));
+  temp->z_masks        = malloc(temp->max_terms*sizeof(unsigned long long));
+  temp->coeffs         = malloc(temp->max_terms*sizeof(PetscScalar));
+  temp->group_start    = NULL;
+  temp->identity_coeff = 0.0;
+  temp->grouped        = 0;
+  temp->psi_scatter    = NULL;
+  temp->psi_all        = NULL;
+  temp->psi_local_size = -1;
+
+  *new_sum = temp;
+  return;
+}
+
+/*
+ * add_pauli_term adds coeff * P to the sum, where P is a tensor product
+ * of Pauli matrices on the given qubits. The qubit numbers are the
+ * global subsystem numbers; each of those subsystems must have 2 levels.
+ * A term with no Paulis (num_paulis = 0) adds coeff * I.
+ *
+ * Inputs:
+ *      pauli_sum   sum:        sum to add to
+ *      PetscScalar coeff:      coefficient of the term
+ *      PetscInt    num_paulis: number of Paulis in the string
+ *      char        paulis[]:   'X', 'Y', 'Z' (or 'I') for each qubit
+ *      PetscInt    qubits[]:   subsystem number of each Pauli
+ */
+void add_pauli_term(pauli_sum sum,PetscScalar coeff,PetscInt num_paulis,char paulis[],PetscInt qubits[]){
+  PetscInt           i,num_y;
+  unsigned long long x_mask,z_mask,bit;
+
+  x_mask = 0;
+  z_mask = 0;
+  num_y  = 0;
+  for (i=0;i<num_paulis;i++){
+    if (qubits[i]<0||qubits[i]>=num_subsystems||qubits[i]>=MAX_PAULI_QUBITS){
+      if (nid==0){
+        printf("ERROR! Qubit %d in add_pauli_term is not a valid subsystem!\n",(int)qubits[i]);
+        exit(0);
+      }
+    }
+    if (subsystem_list[qubits[i]]->my_levels!=2){
+      if (nid==0){
+        printf("ERROR! Pauli operators are only supported for 2 level subsystems!\n");
+        exit(0);
+      }
+    }
+    bit = 1ULL<<qubits[i];
+    if (paulis[i]=='X'){
+      x_mask = x_mask ^ bit;
+    } else if (paulis[i]=='Y'){
+      x_mask = x_mask ^ bit;
+      z_mask = z_mask ^ bit;
+      num_y  = num_y + 1;
+    } else if (paulis[i]=='Z'){
+      z_mask = z_mask ^ bit;
+    } else if (paulis[i]!='I'){
+      if (nid==0){
+        printf("ERROR! Pauli %c not recognized in add_pauli_term!\n",paulis[i]);
+        exit(0);
+      }
+    }
+  }
+
+  if (x_mask==0&&z_mask==0){
+    sum->identity_coeff = sum->identity_coeff + coeff;
+    return;
+  }
+
+  /* Fold the phase of the Ys, Y = i X Z, into the coefficient */
+  for (i=0;i<num_y%4;i++){
+    coeff = coeff*PETSC_i;
+  }
+
+  if (sum->num_terms==sum->max_terms){
+    sum->max_terms = 2*sum->max_terms;
+    sum->x_masks   = realloc(sum->x_masks,sum->max_terms*sizeof(unsigned long long));
+    sum->z_masks   = realloc(sum->z_masks,sum->max_terms*sizeof(unsigned long long));
+    sum->coeffs    = realloc(sum->coeffs,sum->max_terms*sizeof(PetscScalar));
+  }
+  sum->x_masks[sum->num_terms] = x_mask;
+  sum->z_masks[sum->num_terms] = z_mask;
+  sum->coeffs[sum->num_terms]  = coeff;
+  sum->num_terms = sum->num_terms + 1;
+  sum->grouped   = 0;
+  return;
+}
+
+/*
+ * get_pauli_sum_expectation calculates Tr(sum_k c_k P_k rho) (or
+ * <psi|sum_k c_k P_k|psi> for the Schrodinger solver) in one pass over
+ * the local part of rho, with a single reduction.
+ *
+ * Each Pauli string maps column c of rho to exactly one row,
+ * r = c with the bits of x_mask flipped, with value
+ * (phase) * (-1)^(number of bits of r in z_mask). So, for each local
+ * column and each group of terms sharing an x_mask, only one element
+ * of rho is read, and all terms of the group are accumulated from it.
+ *
+ * Inputs:
+ *      Vec       rho: density matrix (or wavefunction)
+ *      pauli_sum sum: the pauli sum to evaluate
+ * Outputs:
+ *      PetscScalar *trace_val: the expectation value
+ */
+void get_pauli_sum_expectation(Vec rho,pauli_sum sum,PetscScalar *trace_val){
+  PetscInt           q,c,r,g,k,my_start,my_end,c_start,c_end,loc,dim,strides[MAX_PAULI_QUBITS];
+  PetscInt           num_qubits;
+  unsigned long long used_mask,c_bits,r_bits,sign_bits,x_mask;
+  PetscScalar        rho_val,group_val;
+  const PetscScalar  *rho_array,*psi_array;
+  PetscInt           local_size;
+  int                layout_changed;
+  operator           this_op;
+
+  if (!sum->grouped){
+    _group_pauli_sum(sum);
+  }
+
+  VecGetSize(rho,&dim);
+  if (dim!=total_levels&&dim!=total_levels*total_levels){
+    if (nid==0){
+      printf("ERROR! The input vector is neither a full density matrix nor a wavefunction!\n");
+      exit(0);
+    }
+  }
+
+  /* Strides of each subsystem used by the sum */
+  used_mask = 0;
+  for (k=0;k<sum->num_terms;k++){
+    used_mask = used_mask | sum->x_masks[k] | sum->z_masks[k];
+  }
+  num_qubits = 0;
+  for (q=0;q<MAX_PAULI_QUBITS&&q<num_subsystems;q++){
+    if ((used_mask>>q)&1ULL){
+      this_op    = subsystem_list[q];
+      strides[q] = total_levels/(this_op->my_levels*this_op->n_before);
+      num_qubits = q + 1;
+    }
+  }
+
+  *trace_val = 0.0;
+  VecGetOwnershipRange(rho,&my_start,&my_end);
+
+  if (dim==total_levels*total_levels){
+    /*
+     * rho is stored column major, loc = total_levels*c + r.
+     * Loop over every column that has a local element;
+     * the element of each group is only used if it is local.
+     */
+    VecGetArrayRead(rho,&rho_array);
+    c_start = my_start/total_levels;
+    c_end   = (my_end-1)/total_levels;
+    for (c=c_start;c<=c_end&&my_end>my_start;c++){
+      c_bits = 0;
+      for (q=0;q<num_qubits;q++){
+        if ((used_mask>>q)&1ULL){
+          c_bits = c_bits | ((unsigned long long)((c/strides[q])%2)<<q);
+        }
+      }
+      for (g=0;g<sum->num_groups;g++){
+        x_mask = sum->x_masks[sum->group_start[g]];
+        r = c;
+        for (q=0;q<num_qubits;q++){
+          if ((x_mask>>q)&1ULL){
+            r = r + strides[q]*(1-2*(PetscInt)((c_bits>>q)&1ULL));
+          }
+        }
+        loc = total_levels*c + r;
+        if (loc<my_start||loc>=my_end) continue;
+        rho_val = rho_array[loc-my_start];
+
+        /* Tr(P rho) = sum_c <c|P|r> rho_rc; the signs come from r */
+        r_bits    = c_bits ^ x_mask;
+        group_val = 0.0;
+        for (k=sum->group_start[g];k<sum->group_start[g+1];k++){
+          if (_mask_parity(r_bits&sum->z_masks[k])){
+            group_val = group_val - sum->coeffs[k];
+          } else {
+            group_val = group_val + sum->coeffs[k];
+          }
+        }
+        *trace_val = *trace_val + group_val*rho_val;
+      }
+    }
+    VecRestoreArrayRead(rho,&rho_array);
+    MPI_Allreduce(MPI_IN_PLACE,trace_val,1,MPIU_SCALAR,MPI_SUM,PETSC_COMM_WORLD);
+    /* Tr(I rho) = 1 */
+    *trace_val = *trace_val + sum->identity_coeff;
+  } else {
+    /*
+     * psi: <psi|P|psi> = sum_c conj(psi_r) <r|P|c> psi_c needs psi_r from
+     * anywhere, so gather psi once and loop over the local cs. The
+     * scatter is kept with the sum, since it is evaluated many times.
+     */
+    if (sum->psi_all!=NULL){
+      /* Rebuild it if psi's layout changed on any rank */
+      VecGetLocalSize(rho,&local_size);
+      layout_changed = (sum->psi_local_size!=local_size);
+      MPI_Allreduce(MPI_IN_PLACE,&layout_changed,1,MPI_INT,MPI_MAX,PETSC_COMM_WORLD);
+      if (layout_changed){
+        VecScatterDestroy(&sum->psi_scatter);
+        VecDestroy(&sum->psi_all);
+      }
+    }
+    if (sum->psi_all==NULL){
+      VecScatterCreateToAll(rho,&sum->psi_scatter,&sum->psi_all);
+      VecGetLocalSize(rho,&sum->psi_local_size);
+    }
+    VecScatterBegin(sum->psi_scatter,rho,sum->psi_all,INSERT_VALUES,SCATTER_FORWARD);
+    VecScatterEnd(sum->psi_scatter,rho,sum->psi_all,INSERT_VALUES,SCATTER_FORWARD);
+    VecGetArrayRead(sum->psi_all,&psi_array);
+    for (c=my_start;c<my_end;c++){
+      c_bits = 0;
+      for (q=0;q<num_qubits;q++){
+        if ((used_mask>>q)&1ULL){
+          c_bits = c_bits | ((unsigned long long)((c/strides[q])%2)<<q);
+        }
+      }
+      sign_bits = c_bits;
+      for (g=0;g<sum->num_groups;g++){
+        x_mask = sum->x_masks[sum->group_start[g]];
+        r = c;
+        for (q=0;q<num_qubits;q++){
+          if ((x_mask>>q)&1ULL){
+            r = r + strides[q]*(1-2*(PetscInt)((c_bits>>q)&1ULL));
+          }
+        }
+        group_val = 0.0;
+        for (k=sum->group_start[g];k<sum->group_start[g+1];k++){
+          if (_mask_parity(sign_bits&sum->z_masks[k])){
+            group_val = group_val - sum->coeffs[k];
+          } else {
+            group_val = group_val + sum->coeffs[k];
+          }
+        }
+        *trace_val = *trace_val + group_val*PetscConjComplex(psi_array[r])*psi_array[c];
+      }
+      /* The identity term */
+      *trace_val = *trace_val + sum->identity_coeff*PetscConjComplex(psi_array[c])*psi_array[c];
+    }
+    VecRestoreArrayRead(sum->psi_all,&psi_array);
+    MPI_Allreduce(MPI_IN_PLACE,trace_val,1,MPIU_SCALAR,MPI_SUM,PETSC_COMM_WORLD);
+  }
+
+  return;
+}
+
+/*
+ * destroy_pauli_sum frees the memory of a pauli sum
+ */
+void destroy_pauli_sum(pauli_sum *sum){
+  free((*sum)->x_masks);
+  free((*sum)->z_masks);
+  free((*sum)->coeffs);
+  if ((*sum)->group_start!=NULL) free((*sum)->group_start);
+  if ((*sum)->psi_all!=NULL){
+    VecScatterDestroy(&(*sum)->psi_scatter);
+    VecDestroy(&(*sum)->psi_all);
+  }
+  free(*sum);
+  *sum = NULL;
+  return;
+}
+
+/*
+ * _group_pauli_sum sorts the terms by (x_mask,z_mask), combines
+ * duplicate terms, and records where each x_mask group starts.
+ */
+static void _group_pauli_sum(pauli_sum sum){
+  PetscInt           k,num_new,*order;
+  unsigned long long *x_masks,*z_masks;
+  PetscScalar        *coeffs;
+
+  order = malloc(sum->num_terms*sizeof(PetscInt));
+  for (k=0;k<sum->num_terms;k++){
+    order[k] = k;
+  }
+  _sort_sum = sum;
+  qsort(order,sum->num_terms,sizeof(PetscInt),_compare_pauli_terms);
+
+  x_masks = malloc(sum->max_terms*sizeof(unsigned long long));
+  z_masks = malloc(sum->max_terms*sizeof(unsigned long long));
+  coeffs  = malloc(sum->max_terms*sizeof(PetscScalar));
+  num_new = 0;
+  for (k=0;k<sum->num_terms;k++){
+    if (num_new>0&&x_masks[num_new-1]==sum->x_masks[order[k]]
+        &&z_masks[num_new-1]==sum->z_masks[order[k]]){
+      /* Same Pauli string; combine */
+      coeffs[num_new-1] = coeffs[num_new-1] + sum->coeffs[order[k]];
+    } else {
+      x_masks[num_new] = sum->x_masks[order[k]];
+      z_masks[num_new] = sum->z_masks[order[k]];
+      coeffs[num_new]  = sum->coeffs[order[k]];
+      num_new = num_new + 1;
+    }
+  }
+  free(sum->x_masks);
+  free(sum->z_masks);
+  free(sum->coeffs);
+  free(order);
+  sum->x_masks   = x_masks;
+  sum->z_masks   = z_masks;
+  sum->coeffs    = coeffs;
+  sum->num_terms = num_new;
+
+  if (sum->group_start!=NULL) free(sum->group_start);
+  sum->group_start = malloc((sum->num_terms+1)*sizeof(PetscInt));
+  sum->num_groups  = 0;
+  for (k=0;k<sum->num_terms;k++){
+    if (k==0||sum->x_masks[k]!=sum->x_masks[k-1]){
+      sum->group_start[sum->num_groups] = k;
+      sum->num_groups = sum->num_groups + 1;
+    }
+  }
+  sum->group_start[sum->num_groups] = sum->num_terms;
+  sum->grouped = 1;
+  return;
+}
+
+static int _compare_pauli_terms(const void *a,const void *b){
+  PetscInt ia = *(const PetscInt*)a,ib = *(const PetscInt*)b;
+
+  if (_sort_sum->x_masks[ia]!=_sort_sum->x_masks[ib]){
+    return (_sort_sum->x_masks[ia]<_sort_sum->x_masks[ib]) ? -1 : 1;
+  }
+  if (_sort_sum->z_masks[ia]!=_sort_sum->z_masks[ib]){
+    return (_sort_sum->z_masks[ia]<_sort_sum->z_masks[ib]) ? -1 : 1;
+  }
+  return 0;
+}
+
+/* Parity of the number of set bits */
+static int _mask_parity(unsigned long long mask){
+  int parity = 0;
+
+  while (mask){
+    parity = !parity;
+    mask   = mask & (mask-1);
+  }
+  return parity;
+}
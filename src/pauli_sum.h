@@ -0,0 +1,34 @@
+#ifndef PAULI_SUM_H_
+#define PAULI_SUM_H_
+
+#include <petsc.h>
+
+#define MAX_PAULI_QUBITS 64 // One bit per subsystem in the masks
+
+/*
+ * A sum of Pauli strings, sum_k c_k P_k, stored with bit-packed masks.
+ * Bit q of x_masks[k] (z_masks[k]) is set if P_k has an X or Y (Z or Y)
+ * on subsystem q. The i^(number of Ys) phase is folded into coeffs.
+ * Terms are sorted by x_mask so that terms that map a row to the same
+ * column form one group, [group_start[g],group_start[g+1]).
+ * For wavefunctions, the scatter that gathers psi (of local size
+ * psi_local_size) is kept in psi_scatter.
+ */
+typedef struct pauli_sum{
+  PetscInt           num_terms,max_terms,num_groups;
+  unsigned long long *x_masks,*z_masks;
+  PetscScalar        *coeffs;
+  PetscScalar        identity_coeff;
+  PetscInt           *group_start;
+  int                grouped;
+  VecScatter         psi_scatter;
+  Vec                psi_all;
+  PetscInt           psi_local_size;
+} *pauli_sum;
+
+void create_pauli_sum(pauli_sum*);
+void add_pauli_term(pauli_sum,PetscScalar,PetscInt,char[],PetscInt[]);
+void get_pauli_sum_expectation(Vec,pauli_sum,PetscScalar*);
+void destroy_pauli_sum(pauli_sum*);
+
+#endif
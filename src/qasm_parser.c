@@ -5,9 +5,13 @@
 #include <petsc.h>
 #include <stdarg.h>
 #include "qasm_parser.h"
+#include "pauli_sum.h"
 #include "error_correction.h"
 #include "dm_utilities.h"
 #include <ctype.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
 
 void quil_read(char filename[],PetscInt *num_qubits,circuit *circ){
   FILE *fp;
@@ -309,69 +313,121 @@ void _projectq_qasm_add_gate(char *line,circuit *circ,PetscReal time){
   }
 }
 
+/*
+ * A Hamiltonian file parsed into a pauli_sum, kept between calls to the
+ * *_vqe_get_expectation routines. It is reparsed if a different file
+ * is passed in, or if the file has been modified since it was read.
+ */
+typedef struct pauli_sum_cache{
+  pauli_sum ham;
+  char      filename[PETSC_MAX_PATH_LEN];
+  time_t    mtime;
+} pauli_sum_cache;
+
+static pauli_sum_cache _projectq_cache = {NULL,"",0};
+static pauli_sum_cache _qiskit_cache   = {NULL,"",0};
+
+static void _get_cached_pauli_sum(char filename[],pauli_sum_cache *cache,
+                                  void (*read_pauli_sum)(char[],pauli_sum*)){
+  struct stat file_stat;
+  time_t      mtime=0;
+
+  if (stat(filename,&file_stat)==0) mtime = file_stat.st_mtime;
+  if (cache->ham==NULL||strcmp(filename,cache->filename)!=0||mtime!=cache->mtime){
+    if (cache->ham!=NULL) destroy_pauli_sum(&cache->ham);
+    read_pauli_sum(filename,&cache->ham);
+    strncpy(cache->filename,filename,PETSC_MAX_PATH_LEN-1);
+    cache->mtime = mtime;
+  }
+  return;
+}
+
+/*
+ * _qasm_parser_clear frees the cached Hamiltonians. The cached sums refer
+ * to the current subsystems, so this is called from QuaC_clear and
+ * QuaC_finalize.
+ */
+void _qasm_parser_clear(){
+  if (_projectq_cache.ham!=NULL) destroy_pauli_sum(&_projectq_cache.ham);
+  if (_qiskit_cache.ham!=NULL) destroy_pauli_sum(&_qiskit_cache.ham);
+  _projectq_cache.filename[0] = '\0';
+  _qiskit_cache.filename[0]   = '\0';
+  return;
+}
+
+/*
+ * projectq_vqe_get_expectation calculates the expectation value of the
+ * Hamiltonian in a projectq style file (lines of 'coeff [X0 Y1 Z2]').
+ * The file is parsed into a pauli_sum once, and reused as long as
+ * the same, unmodified, file is passed in.
+ */
 void projectq_vqe_get_expectation(char filename[],Vec rho,PetscScalar *trace_val){
+  _get_cached_pauli_sum(filename,&_projectq_cache,projectq_read_pauli_sum);
+  get_pauli_sum_expectation(rho,_projectq_cache.ham,trace_val);
+  return;
+}
+
+/*
+ * projectq_read_pauli_sum parses a projectq style Hamiltonian file,
+ * with lines like
+ *     0.5 [X0 Y1 Z2]
+ *     -0.1 []
+ * into a new pauli_sum. Qubit numbers are global subsystem numbers.
+ */
+void projectq_read_pauli_sum(char filename[],pauli_sum *ham){
   FILE *fp;
   char *token=NULL,*token2=NULL;
-  char *line = NULL,gate_char;
+  char *line = NULL,*line_start = NULL,gate_char,paulis[MAX_PAULI_QUBITS];
   size_t len = 0,i,j;
   ssize_t read;
   int token_number,num_ops,qubit_number;
-  operator ops[100];
+  PetscInt qubits[MAX_PAULI_QUBITS];
   PetscReal scalar_multiply;
-  PetscScalar temp_trace_val;
+
   fp = fopen(filename,"r");
-  *trace_val = 0.0;
   if (fp == NULL){
     if (nid==0){
-      printf("ERROR! File not found in projectq_vqe_get_expectation!\n");
+      printf("ERROR! File not found in projectq_read_pauli_sum!\n");
+      exit(0);
     }
   }
+  create_pauli_sum(ham);
 
-  while ((read = getline(&line, &len, fp)) != -1){
+  while ((read = getline(&line_start, &len, fp)) != -1){
+    line = line_start;
     token_number = 0;
-    while (token=strsep(&line,"[")) {
+    while ((token=strsep(&line,"["))) {
       if(token_number==0){
         //Strip whitespace
-        for (i=0, j=0; token[j]=token[i]; j+=!isspace(token[i++]));
+        for (i=0, j=0; (token[j]=token[i]); j+=!isspace(token[i++]));
         scalar_multiply = atof(token);
         token_number = 1;
       } else {
         token2=strsep(&token,"]");
         num_ops = 0;
-        while (token=strsep(&token2," ")) {
-          if (strcmp(token,"")==0){
-            *trace_val = *trace_val + scalar_multiply;
-          } else {
+        while ((token=strsep(&token2," "))) {
+          if (strcmp(token,"")!=0){
+            if (num_ops>=MAX_PAULI_QUBITS){
+              if (nid==0){
+                printf("ERROR! Too many Paulis in a term in projectq_read_pauli_sum!\n");
+                exit(0);
+              }
+            }
             //Assume qubit number in file is global system number
             //FIXME: Put logical->physical qubit mapping here
             sscanf(token,"%c%d",&gate_char,&qubit_number);
-            if (gate_char=='X'){
-              ops[num_ops] = subsystem_list[qubit_number]->sig_x;
-            } else if (gate_char=='Y'){
-              ops[num_ops] = subsystem_list[qubit_number]->sig_y;
-            } else if (gate_char=='Z'){
-              ops[num_ops] = subsystem_list[qubit_number]->sig_z;
-            }
+            paulis[num_ops] = gate_char;
+            qubits[num_ops] = qubit_number;
             num_ops = num_ops + 1;
           }
         }
-
-        if (num_ops!=0){
-          //This is a hack where I pass many ops, even though many of them
-          //may not exist or be valid; they won't be accessed, at least.
-          //Consider passing the array instead, and iterating inside?
-          get_expectation_value(rho,&temp_trace_val,num_ops,
-                                ops[0],ops[1],ops[2],ops[3],
-                                ops[4],ops[5],ops[6],ops[7],
-                                ops[8],ops[9],ops[10],ops[11],
-                                ops[12],ops[13],ops[14],ops[15],
-                                ops[16],ops[17],ops[18],ops[19]);
-          temp_trace_val = temp_trace_val * scalar_multiply;
-          *trace_val = *trace_val + temp_trace_val;
-        }
+        //An empty [] adds the identity
+        add_pauli_term(*ham,scalar_multiply,num_ops,paulis,qubits);
       }
     }
   }
+  fclose(fp);
+  if (line_start) free(line_start);
   return;
 }
 
@@ -635,67 +691,74 @@ void _qiskit_qasm_add_gate(char *line,circuit *circ,PetscReal time){
   return;
 }
 
+/*
+ * qiskit_vqe_get_expectation calculates the expectation value of the
+ * Hamiltonian in a qiskit style file (lines of 'coeff IXYZ').
+ * The file is parsed into a pauli_sum once, and reused as long as
+ * the same filename is passed in.
+ */
 void qiskit_vqe_get_expectation(char filename[],Vec rho,PetscScalar *trace_val){
+  _get_cached_pauli_sum(filename,&_qiskit_cache,qiskit_read_pauli_sum);
+  get_pauli_sum_expectation(rho,_qiskit_cache.ham,trace_val);
+  return;
+}
+
+/*
+ * qiskit_read_pauli_sum parses a qiskit style Hamiltonian file,
+ * with lines like
+ *     0.5 IXYZ
+ * into a new pauli_sum. The rightmost character acts on qubit 0.
+ */
+void qiskit_read_pauli_sum(char filename[],pauli_sum *ham){
   FILE *fp;
   char *token=NULL;
-  char *line = NULL,gate_char;
+  char *line = NULL,*line_start = NULL,paulis[MAX_PAULI_QUBITS];
   size_t len = 0,i,j;
   ssize_t read;
-  int token_number,num_ops,qubit_number;
-  operator ops[100];
+  int token_number,num_ops;
+  PetscInt qubits[MAX_PAULI_QUBITS];
   PetscReal scalar_multiply;
-  PetscScalar temp_trace_val;
+
   fp = fopen(filename,"r");
-  *trace_val = 0.0;
   if (fp == NULL){
     if (nid==0){
-      printf("ERROR! File not found in qiskit_vqe_get_expectation!\n");
+      printf("ERROR! File not found in qiskit_read_pauli_sum!\n");
+      exit(0);
     }
   }
+  create_pauli_sum(ham);
 
-  while ((read = getline(&line, &len, fp)) != -1){
+  while ((read = getline(&line_start, &len, fp)) != -1){
+    line = line_start;
     token_number = 0;
-    while (token=strsep(&line," ")) {
+    num_ops = 0;
+    while ((token=strsep(&line," "))) {
       //Strip whitespace
-      for (i=0, j=0; token[j]=token[i]; j+=!isspace(token[i++]));
+      for (i=0, j=0; (token[j]=token[i]); j+=!isspace(token[i++]));
       if(token_number==0){
         //Scalar multiply before pauli string
         scalar_multiply = atof(token);
         token_number = 1;
-      } else {
+      } else if (strlen(token)>0) {
         num_ops = strlen(token);
-        for (i=0;i<num_ops;i++){
-          qubit_number = num_ops-i-1; //Might need to be num_ops - i because qiskit has reverse order
-          gate_char = token[i];
-          if (gate_char=='I'){
-            ops[i] = subsystem_list[qubit_number]->eye;
-          } else if (gate_char=='X'){
-            ops[i] = subsystem_list[qubit_number]->sig_x;
-          } else if (gate_char=='Y'){
-            ops[i] = subsystem_list[qubit_number]->sig_y;
-          } else if (gate_char=='Z'){
-            ops[i] = subsystem_list[qubit_number]->sig_z;
+        if (num_ops>MAX_PAULI_QUBITS){
+          if (nid==0){
+            printf("ERROR! Too many qubits in qiskit_read_pauli_sum!\n");
+            exit(0);
           }
         }
+        for (i=0;i<num_ops;i++){
+          //qiskit has reverse order
+          qubits[i] = num_ops-i-1;
+          paulis[i] = token[i];
+        }
       }
     }
-    /*
-     * At this point, we have read in the scalar_multiply
-     * and the operator. Now get the value.
-     */
-    if (num_ops!=0){
-      //This is a hack where I pass many ops, even though many of them
-      //may not exist or be valid; they won't be accessed, at least.
-      //Consider passing the array instead, and iterating inside?
-      get_expectation_value(rho,&temp_trace_val,num_ops,
-                            ops[0],ops[1],ops[2],ops[3],
-                            ops[4],ops[5],ops[6],ops[7],
-                            ops[8],ops[9],ops[10],ops[11],
-                            ops[12],ops[13],ops[14],ops[15],
-                            ops[16],ops[17],ops[18],ops[19]);
-      temp_trace_val = temp_trace_val * scalar_multiply;
-      *trace_val = *trace_val + temp_trace_val;
+    if (token_number==1){
+      add_pauli_term(*ham,scalar_multiply,num_ops,paulis,qubits);
     }
   }
+  fclose(fp);
+  if (line_start) free(line_start);
   return;
 }
@@ -3,6 +3,21 @@
 #include "quac.h"
 #include "operators_p.h"
 #include "operators.h"
+#include "matrix_free_p.h"
+#include "trajectory.h"
+#include "rotating_frame_p.h"
+#include "excitation_basis_p.h"
+#include "dicke_p.h"
+#include "output_p.h"
+#include "qasm_parser.h"
+#include "dm_utilities.h"
+#include "solver_p.h"
+#include "expmv_p.h"
+#include "trotter_p.h"
+#include "symmetry_p.h"
+#include "kron_pc_p.h"
+#include "quantum_gates.h"
+#include "checkpoint_p.h"
 #include <petsc.h>
 
 int petsc_initialized = 0;
@@ -60,10 +75,37 @@ void QuaC_clear(){
   for (i=0;i<_num_time_dep;i++){
     MatDestroy(&_time_dep_list[i].mat);
   }
-  //stab_added       = 0;
-  _print_dense_ham = 0;
+  for (i=0;i<_num_time_dep_lin;i++){
+    MatDestroy(&_time_dep_list_lin[i].mat);
+  }
+  if (_matrix_free){
+    _mf_destroy();
+  }
+  _destroy_terms();
+  _frame_clear();
+  _basis_clear();
+  _dicke_clear();
+  _mcwf_clear();
+  _output_clear();
+  _qasm_parser_clear();
+  _dm_utilities_clear();
+  _solver_clear();
+  _print_dense_ham  = 0;
+  _matrix_free      = 0;
+  /* The solver modes and checkpoints (set_* or their options) are per model */
+  _krylov_expmv     = 0;
+  _trotter          = 0;
+  _symmetry_sectors = 0;
+  _circuit_segments = 0;
+  _kron_pc          = 0;
+  _num_circuits     = 0;
+  _current_circuit  = 0;
+  _checkpoint       = 0;
   _num_time_dep = 0;
+  _num_time_dep_lin = 0;
   op_initialized = 0;
+  /* So that set_excitation_cap etc. may come before the next create_op */
+  op_finalized   = 0;
 }
 
 
@@ -84,6 +126,17 @@ void QuaC_finalize(){
   for (i=0;i<_num_time_dep;i++){
     MatDestroy(&_time_dep_list[i].mat);
   }
+  for (i=0;i<_num_time_dep_lin;i++){
+    MatDestroy(&_time_dep_list_lin[i].mat);
+  }
+  if (_matrix_free){
+    _mf_destroy();
+  }
+  _destroy_terms();
+  /* Write out anything still buffered */
+  _output_clear();
+  _qasm_parser_clear();
+  _dm_utilities_clear();
   /* Finalize Petsc */
   PetscLogStagePop();
   PetscFinalize();
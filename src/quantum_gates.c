@@ -1,5 +1,6 @@
 #include "quantum_gates.h"
 #include "quac_p.h"
+#include "rotating_frame_p.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <petsc.h>
@@ -9,11 +10,12 @@
 int _num_quantum_gates = 0;
 int _current_gate = 0;
 struct quantum_gate_struct _quantum_gate_list[MAX_GATES];
-int _min_gate_enum = 5; // Minimum gate enumeration number
+int _min_gate_enum = 6; // Minimum gate enumeration number
 int _gate_array_initialized = 0;
 int _num_circuits    = 0;
 int _current_circuit = 0;
 circuit _circuit_list[MAX_GATES];
+int _circuit_segments = 0;
 void (*_get_val_j_functions_gates[MAX_GATES])(PetscInt,struct quantum_gate_struct,PetscInt*,PetscInt[],PetscScalar[],PetscInt);
 
 /* EventFunction is one step in Petsc to apply some action at a specific time.
@@ -85,8 +87,6 @@ PetscErrorCode _QC_EventFunction(TS ts,PetscReal t,Vec U,PetscScalar *fvalue,voi
 */
 PetscErrorCode _QC_PostEventFunction(TS ts,PetscInt nevents,PetscInt event_list[],
                                      PetscReal t,Vec U,PetscBool forward,void* ctx) {
-  PetscInt current_gate,num_gates;
-  PetscReal gate_time;
    /* We only have one event at the moment, so we do not need to branch.
     * If we had more than one event, we would put some logic here.
     */
@@ -94,23 +94,7 @@ PetscErrorCode _QC_PostEventFunction(TS ts,PetscInt nevents,PetscInt event_list[
   PetscLogEventBegin(_qc_postevent_function_event,0,0,0,0);
 
   if (nevents) {
-    num_gates    = _circuit_list[_current_circuit].num_gates;
-    current_gate = _circuit_list[_current_circuit].current_gate;
-    gate_time = _circuit_list[_current_circuit].gate_list[current_gate].time;
-    /* Apply all gates at a given time incrementally  */
-    while (current_gate<num_gates && _circuit_list[_current_circuit].gate_list[current_gate].time == gate_time){
-      /* apply the current gate */
-      _apply_gate(_circuit_list[_current_circuit].gate_list[current_gate],U);
-
-      /* Increment our gate counter */
-      _circuit_list[_current_circuit].current_gate = _circuit_list[_current_circuit].current_gate + 1;
-      current_gate = _circuit_list[_current_circuit].current_gate;
-    }
-    if(_circuit_list[_current_circuit].current_gate>=_circuit_list[_current_circuit].num_gates){
-      /* We've exhausted this circuit; move on to the next. */
-      _current_circuit = _current_circuit + 1;
-    }
-
+    _QC_apply_gates_at_time(U);
   }
 
   TSSetSolution(ts,U);
@@ -118,6 +102,67 @@ PetscErrorCode _QC_PostEventFunction(TS ts,PetscInt nevents,PetscInt event_list[
   return(0);
 }
 
+/*
+ * _QC_apply_gates_at_time applies all gates of the current circuit that
+ * share the time of the current gate, and moves on to the next circuit
+ * if this one is exhausted.
+ */
+void _QC_apply_gates_at_time(Vec U){
+  PetscInt current_gate,num_gates;
+  PetscReal gate_time;
+
+  num_gates    = _circuit_list[_current_circuit].num_gates;
+  current_gate = _circuit_list[_current_circuit].current_gate;
+  gate_time = _circuit_list[_current_circuit].gate_list[current_gate].time;
+  /* Apply all gates at a given time incrementally  */
+  while (current_gate<num_gates && _circuit_list[_current_circuit].gate_list[current_gate].time == gate_time){
+    /* apply the current gate; gates are given in the lab frame */
+    _frame_apply_gate(_circuit_list[_current_circuit].gate_list[current_gate],
+                      gate_time+_circuit_list[_current_circuit].start_time,U);
+
+    /* Increment our gate counter */
+    _circuit_list[_current_circuit].current_gate = _circuit_list[_current_circuit].current_gate + 1;
+    current_gate = _circuit_list[_current_circuit].current_gate;
+  }
+  if(_circuit_list[_current_circuit].current_gate>=_circuit_list[_current_circuit].num_gates){
+    /* We've exhausted this circuit; move on to the next. */
+    _current_circuit = _current_circuit + 1;
+  }
+  return;
+}
+
+/*
+ * _QC_next_gate_time returns the absolute time of the next gate to be
+ * applied, or a negative number if all circuits have been exhausted.
+ */
+PetscReal _QC_next_gate_time(){
+  PetscInt current_gate;
+
+  /* Skip circuits without (remaining) gates */
+  while (_current_circuit<_num_circuits
+         &&_circuit_list[_current_circuit].current_gate>=_circuit_list[_current_circuit].num_gates){
+    _current_circuit = _current_circuit + 1;
+  }
+  if (_current_circuit>=_num_circuits) return -1.0;
+  current_gate = _circuit_list[_current_circuit].current_gate;
+  return _circuit_list[_current_circuit].gate_list[current_gate].time
+    + _circuit_list[_current_circuit].start_time;
+}
+
+/*
+ * set_circuit_segments tells time_step to apply circuits by splitting the
+ * time integration into segments between gate times, rather than
+ * locating each gate with a TS event. Each free evolution segment is
+ * integrated to exactly the next gate time, the gates at that time are
+ * applied, and time stepping continues. If there are no Hamiltonian or
+ * Lindblad terms, the segments are skipped entirely. This can also be
+ * turned on with the command line option -circuit_segments. QuaC_clear
+ * turns it off.
+ */
+void set_circuit_segments(){
+  _circuit_segments = 1;
+}
+
 /* Add a gate to the list */
 void add_gate(PetscReal time,gate_type my_gate_type,...) {
   int num_qubits=0,qubit,i;
@@ -150,52 +195,237 @@ void add_gate(PetscReal time,gate_type my_gate_type,...) {
 }
 
 
-/* Apply a specific gate */
+/*
+ * Apply a specific gate, in place.
+ *
+ * rho -> U rho U^t (or psi -> U psi) is applied directly to the local
+ * array of rho, without building a matrix. With rho(row,col) stored at
+ * N*col + row, U acts on the row index with the qubit stride(s) n_after,
+ * and U* acts on the column index with stride(s) N*n_after.
+ */
 void _apply_gate(struct quantum_gate_struct this_gate,Vec rho){
-  PetscScalar op_vals[total_levels*2];
-  Mat gate_mat; //FIXME Consider having only one static Mat for all gates, rather than creating new ones every time
-  Vec tmp_answer;
-  PetscInt dim,i,Istart,Iend,num_js,these_js[total_levels*2];
-  // FIXME: maybe total_levels*2 is too much or not enough? Consider having a better bound.
+  PetscScalar U[16];
+  PetscInt    num_qubits,k,strides[2];
 
   PetscLogEventBegin(_apply_gate_event,0,0,0,0);
 
+  _get_gate_unitary(this_gate,&num_qubits,strides,U);
+
+  /* U rho, or U psi */
+  _apply_dense_gate_in_place(rho,num_qubits,strides,U,0);
+
   if (_lindblad_terms){
-    dim = total_levels*total_levels;
-  } else {
-    dim = total_levels;
+    /* (rho U^t)(row,col) = sum_c U*(col,c) rho(row,c) */
+    for (k=0;k<num_qubits;k++){
+      strides[k] = strides[k]*total_levels;
+    }
+    _apply_dense_gate_in_place(rho,num_qubits,strides,U,1);
   }
 
-  VecDuplicate(rho,&tmp_answer); //Create a new vec with the same size as rho
+  PetscLogEventEnd(_apply_gate_event,0,0,0,0);
+}
 
-  MatCreate(PETSC_COMM_WORLD,&gate_mat);
-  MatSetSizes(gate_mat,PETSC_DECIDE,PETSC_DECIDE,dim,dim);
-  MatSetFromOptions(gate_mat);
-  MatMPIAIJSetPreallocation(gate_mat,4,NULL,4,NULL); //This matrix is incredibly sparse!
-  MatSetUp(gate_mat);
-  /* Construct the gate matrix, on the fly */
-  MatGetOwnershipRange(gate_mat,&Istart,&Iend);
+/*
+ * _get_gate_unitary gets the 2x2 (or 4x4) unitary of a gate, in the
+ * basis |q0> (or |q0 q1>, with q0 the most significant bit), by
+ * evaluating the gate's _get_val_j_from_global_i on the rows where
+ * every other subsystem is in its 0 state.
+ *
+ * Inputs:
+ *      struct quantum_gate_struct gate: the gate
+ * Outputs:
+ *      PetscInt *num_qubits: 1 or 2
+ *      PetscInt strides[]:   n_after of each qubit (the stride of that qubit in psi)
+ *      PetscScalar U[]:      dense, row major unitary (at least 16 long)
+ */
+void _get_gate_unitary(struct quantum_gate_struct gate,PetscInt *num_qubits,PetscInt strides[],PetscScalar U[]){
+  PetscInt    i,j,b,b_j,q,num_js,dim_gate,js[16];
+  PetscScalar vals[16];
+  int         tmp_num_qubits;
+  operator    this_op;
+
+  _check_gate_type(gate.my_gate_type,&tmp_num_qubits);
+  *num_qubits = tmp_num_qubits;
+  for (q=0;q<*num_qubits;q++){
+    this_op = subsystem_list[gate.qubit_numbers[q]];
+    if (this_op->my_levels!=2) {
+      if (nid==0){
+        printf("ERROR! Gates can only affect 2-level systems\n");
+        exit(0);
+      }
+    }
+    strides[q] = total_levels/(this_op->my_levels*this_op->n_before);
+  }
 
+  dim_gate = 1<<*num_qubits;
+  if (gate.my_gate_type==FUSED_1Q||gate.my_gate_type==FUSED_2Q){
+    // Fused gates carry their unitary explicitly
+    for (i=0;i<dim_gate*dim_gate;i++){
+      U[i] = gate.unitary[i];
+    }
+    return;
+  }
+  for (i=0;i<dim_gate*dim_gate;i++){
+    U[i] = 0.0;
+  }
+  for (b=0;b<dim_gate;b++){
+    /* Global row with the gate's qubits in state b, everything else in 0 */
+    i = 0;
+    for (q=0;q<*num_qubits;q++){
+      i = i + ((b>>(*num_qubits-1-q))&1)*strides[q];
+    }
+    num_js = 0;
+    gate._get_val_j_from_global_i(i,gate,&num_js,js,vals,-1);
+    for (j=0;j<num_js;j++){
+      b_j = 0;
+      for (q=0;q<*num_qubits;q++){
+        b_j = b_j + ((js[j]/strides[q])%2<<(*num_qubits-1-q));
+      }
+      U[b*dim_gate+b_j] += vals[j];
+    }
+  }
+  return;
+}
+
+/*
+ * _apply_dense_gate_in_place applies a dense 2x2 or 4x4 matrix, U (or U*),
+ * to a vector, where qubit q of the gate has stride strides[q] in x.
+ * Each group of 2 (or 4) coupled entries is read, multiplied by U and
+ * written back. If some entries of a group live on another rank, they are
+ * first fetched with a VecScatter; this only happens when a stride crosses
+ * the ownership boundaries of x.
+ *
+ * Inputs:
+ *      Vec x:              vector to update, in place
+ *      PetscInt num_qubits: 1 or 2
+ *      PetscInt strides[]:  stride of each qubit in x
+ *      PetscScalar U[]:     dense, row major matrix
+ *      int conjugate:       if 1, apply U* rather than U
+ */
+void _apply_dense_gate_in_place(Vec x,PetscInt num_qubits,PetscInt strides[],PetscScalar U[],int conjugate){
+  PetscInt          i,b,b2,dim_gate,Istart,Iend,base,members[4],num_remote,i_remote,*remote;
+  PetscInt          any_remote,local_remote;
+  PetscScalar       *x_array,in[4],out[4],u_val;
+  const PetscScalar *ghost_array=NULL;
+  Vec               ghost=NULL;
+  VecScatter        ghost_scatter;
+  IS                is_from;
+
+  dim_gate = 1<<num_qubits;
+  VecGetOwnershipRange(x,&Istart,&Iend);
+
+  /*
+   * Each group is handled by its first locally owned member.
+   * First, count the members of our groups that live elsewhere.
+   */
+  num_remote = 0;
   for (i=Istart;i<Iend;i++){
-    if (_lindblad_terms){
-      // Get the corresponding j and val for the superoperator U* cross U
-      this_gate._get_val_j_from_global_i(i,this_gate,&num_js,these_js,op_vals,0);
-    } else {
-      // Get the corresponding j and val for just the matrix U
-      this_gate._get_val_j_from_global_i(i,this_gate,&num_js,these_js,op_vals,-1);
+    _get_gate_group(i,num_qubits,strides,&base,members);
+    if (_first_local_member(members,dim_gate,Istart,Iend)!=i) continue;
+    for (b=0;b<dim_gate;b++){
+      if (members[b]<Istart||members[b]>=Iend) num_remote++;
+    }
+  }
+  local_remote = num_remote;
+  MPI_Allreduce(&local_remote,&any_remote,1,MPIU_INT,MPI_MAX,PETSC_COMM_WORLD);
+
+  if (any_remote){
+    /* Halo exchange; remote entries are stored in the order they are visited */
+    PetscMalloc1(num_remote,&remote);
+    i_remote = 0;
+    for (i=Istart;i<Iend;i++){
+      _get_gate_group(i,num_qubits,strides,&base,members);
+      if (_first_local_member(members,dim_gate,Istart,Iend)!=i) continue;
+      for (b=0;b<dim_gate;b++){
+        if (members[b]<Istart||members[b]>=Iend) {
+          remote[i_remote] = members[b];
+          i_remote++;
+        }
+      }
     }
-    MatSetValues(gate_mat,1,&i,num_js,these_js,op_vals,ADD_VALUES);
+    ISCreateGeneral(PETSC_COMM_SELF,num_remote,remote,PETSC_OWN_POINTER,&is_from);
+    VecCreateSeq(PETSC_COMM_SELF,num_remote,&ghost);
+    VecScatterCreate(x,is_from,ghost,NULL,&ghost_scatter);
+    VecScatterBegin(ghost_scatter,x,ghost,INSERT_VALUES,SCATTER_FORWARD);
+    VecScatterEnd(ghost_scatter,x,ghost,INSERT_VALUES,SCATTER_FORWARD);
+    VecScatterDestroy(&ghost_scatter);
+    ISDestroy(&is_from);
+    VecGetArrayRead(ghost,&ghost_array);
   }
-  MatAssemblyBegin(gate_mat,MAT_FINAL_ASSEMBLY);
-  MatAssemblyEnd(gate_mat,MAT_FINAL_ASSEMBLY);
-  /* MatView(gate_mat,PETSC_VIEWER_STDOUT_SELF); */
-  MatMult(gate_mat,rho,tmp_answer);
-  VecCopy(tmp_answer,rho); //Copy our tmp_answer array into rho
 
-  VecDestroy(&tmp_answer); //Destroy the temp answer
-  MatDestroy(&gate_mat);
+  VecGetArray(x,&x_array);
+  i_remote = 0;
+  for (i=Istart;i<Iend;i++){
+    _get_gate_group(i,num_qubits,strides,&base,members);
+    if (_first_local_member(members,dim_gate,Istart,Iend)!=i) continue;
 
-  PetscLogEventEnd(_apply_gate_event,0,0,0,0);
+    /* Gather */
+    for (b=0;b<dim_gate;b++){
+      if (members[b]>=Istart&&members[b]<Iend){
+        in[b] = x_array[members[b]-Istart];
+      } else {
+        in[b] = ghost_array[i_remote];
+        i_remote++;
+      }
+    }
+    /* Multiply */
+    for (b=0;b<dim_gate;b++){
+      out[b] = 0.0;
+      for (b2=0;b2<dim_gate;b2++){
+        u_val = U[b*dim_gate+b2];
+        if (conjugate) u_val = PetscConjComplex(u_val);
+        out[b] = out[b] + u_val*in[b2];
+      }
+    }
+    /* Scatter back; the owners of the other members update them */
+    for (b=0;b<dim_gate;b++){
+      if (members[b]>=Istart&&members[b]<Iend){
+        x_array[members[b]-Istart] = out[b];
+      }
+    }
+  }
+  VecRestoreArray(x,&x_array);
+
+  if (any_remote){
+    VecRestoreArrayRead(ghost,&ghost_array);
+    VecDestroy(&ghost);
+  }
+  return;
+}
+
+/*
+ * _get_gate_group gets the 2 (or 4) indices coupled to i by a gate
+ * acting on qubits with the given strides. members[b] has the gate's
+ * qubits in state b (q0 the most significant bit).
+ */
+void _get_gate_group(PetscInt i,PetscInt num_qubits,PetscInt strides[],PetscInt *base,PetscInt members[]){
+  PetscInt b,q;
+
+  *base = i;
+  for (q=0;q<num_qubits;q++){
+    *base = *base - ((i/strides[q])%2)*strides[q];
+  }
+  for (b=0;b<(1<<num_qubits);b++){
+    members[b] = *base;
+    for (q=0;q<num_qubits;q++){
+      members[b] = members[b] + ((b>>(num_qubits-1-q))&1)*strides[q];
+    }
+  }
+  return;
+}
+
+/*
+ * _first_local_member returns the smallest member of a group in [Istart,Iend)
+ */
+PetscInt _first_local_member(PetscInt members[],PetscInt num_members,PetscInt Istart,PetscInt Iend){
+  PetscInt b,first=-1;
+
+  for (b=0;b<num_members;b++){
+    if (members[b]>=Istart&&members[b]<Iend&&(first==-1||members[b]<first)){
+      first = members[b];
+    }
+  }
+  return first;
 }
 
 /*z
@@ -640,6 +870,12 @@ void add_gate_to_circuit(circuit *circ,PetscReal time,gate_type my_gate_type,...
   }
 
   _check_gate_type(my_gate_type,&num_qubits);
+  if (my_gate_type==FUSED_1Q||my_gate_type==FUSED_2Q){
+    if (nid==0){
+      printf("ERROR! Fused gates can only be created by fuse_circuit\n");
+      exit(0);
+    }
+  }
 
   if ((*circ).num_gates==(*circ).gate_list_size){
     if (nid==0){
@@ -652,6 +888,7 @@ void add_gate_to_circuit(circuit *circ,PetscReal time,gate_type my_gate_type,...
   (*circ).gate_list[(*circ).num_gates].time = time;
   (*circ).gate_list[(*circ).num_gates].my_gate_type = my_gate_type;
   (*circ).gate_list[(*circ).num_gates]._get_val_j_from_global_i = _get_val_j_functions_gates[my_gate_type+_min_gate_enum];
+  (*circ).gate_list[(*circ).num_gates].unitary = NULL;
 
   if (my_gate_type==RX||my_gate_type==RY||my_gate_type==RZ) {
     va_start(ap,num_qubits+1);
@@ -729,6 +966,16 @@ void add_circuit_to_circuit(circuit *circ,circuit circ_to_add,PetscReal time){
     (*circ).gate_list[(*circ).num_gates].my_gate_type = circ_to_add.gate_list[i].my_gate_type;
     (*circ).gate_list[(*circ).num_gates]._get_val_j_from_global_i = circ_to_add.gate_list[i]._get_val_j_from_global_i;
     (*circ).gate_list[(*circ).num_gates].theta = circ_to_add.gate_list[i].theta;
+    (*circ).gate_list[(*circ).num_gates].phi = circ_to_add.gate_list[i].phi;
+    (*circ).gate_list[(*circ).num_gates].lambda = circ_to_add.gate_list[i].lambda;
+    (*circ).gate_list[(*circ).num_gates].unitary = NULL;
+    if (circ_to_add.gate_list[i].my_gate_type==FUSED_1Q||circ_to_add.gate_list[i].my_gate_type==FUSED_2Q){
+      // Fused gates own their unitary, so take a copy
+      (*circ).gate_list[(*circ).num_gates].unitary = malloc(16*sizeof(PetscScalar));
+      for (j=0;j<16;j++){
+        (*circ).gate_list[(*circ).num_gates].unitary[j] = circ_to_add.gate_list[i].unitary[j];
+      }
+    }
     (*circ).num_gates = (*circ).num_gates + 1;
   }
 
@@ -745,6 +992,221 @@ void start_circuit_at_time(circuit *circ,PetscReal time){
 
 }
 
+/*
+ * fuse_circuit merges the gates of a circuit into fewer, dense, gates
+ * (FUSED_1Q and FUSED_2Q), so that fewer gate events and sweeps over
+ * rho are needed. Gates on a qubit (or qubit pair) that act back-to-back,
+ * with no other gate on those qubits in between, are multiplied together:
+ *    - a 1 qubit gate is merged into the previous gate on its qubit
+ *    - a 2 qubit gate is merged into the previous gate if that gate acts
+ *      on the same pair; otherwise it absorbs the pending 1 qubit gates
+ *      on either of its qubits
+ * Gates are only fused if their times differ by at most time_window.
+ * Fusing moves a gate to the time of the gate it is merged into, so
+ * with Hamiltonian or Lindblad terms acting between gates, time_window
+ * should be 0 (only gates in the same time slot are fused). For pure
+ * circuits, any large time_window can be used.
+ *
+ * The qubits the circuit acts on must have already been created.
+ *
+ * Inputs:
+ *      circuit *circ:         circuit to fuse, in place
+ *      PetscReal time_window: maximum time difference between fused gates
+ */
+void fuse_circuit(circuit *circ,PetscReal time_window){
+  struct quantum_gate_struct *gates,this_gate;
+  PetscInt    i,j,k,q,num_new,num_qubits,strides[2],max_qubit,*last,pos,num_before;
+  PetscScalar U_gate[16],U_tmp[16],U_swap[16],U_1q[4];
+  int         *removed,gate_qubits;
+
+  if ((*circ).num_gates==0) return;
+
+  gates = (*circ).gate_list;
+  max_qubit = 0;
+  for (i=0;i<(*circ).num_gates;i++){
+    _check_gate_type(gates[i].my_gate_type,&gate_qubits);
+    for (q=0;q<gate_qubits;q++){
+      if (gates[i].qubit_numbers[q]>=num_subsystems){
+        if (nid==0){
+          printf("ERROR! The qubits must be created before calling fuse_circuit\n");
+          exit(0);
+        }
+      }
+      if (gates[i].qubit_numbers[q]>max_qubit) max_qubit = gates[i].qubit_numbers[q];
+    }
+  }
+
+  // last[q] is the (output) gate that most recently acted on qubit q
+  last    = malloc((max_qubit+1)*sizeof(PetscInt));
+  removed = malloc((*circ).num_gates*sizeof(int));
+  for (q=0;q<=max_qubit;q++){
+    last[q] = -1;
+  }
+  num_new = 0;
+  num_before = (*circ).num_gates;
+
+  /* Gates are fused into the front of the list, so gates[k] with k<num_new is an output gate */
+  for (i=0;i<(*circ).num_gates;i++){
+    this_gate = gates[i];
+    _get_gate_unitary(this_gate,&num_qubits,strides,U_gate);
+
+    if (num_qubits==1){
+      q = this_gate.qubit_numbers[0];
+      k = last[q];
+      if (k!=-1&&PetscAbsReal(this_gate.time-gates[k].time)<=time_window){
+        // Merge into gate k: U_k <- (U on q) U_k
+        _get_gate_unitary(gates[k],&num_qubits,strides,U_tmp);
+        if (num_qubits==1){
+          _dense_mult(2,U_gate,U_tmp,U_swap);
+        } else {
+          pos = (gates[k].qubit_numbers[0]==q) ? 0 : 1;
+          _expand_1q_to_2q(U_gate,pos,U_swap);
+          _dense_mult(4,U_swap,U_tmp,U_gate);
+          for (j=0;j<16;j++) U_swap[j] = U_gate[j];
+        }
+        _set_fused_gate(&gates[k],num_qubits,U_swap);
+        free(this_gate.qubit_numbers);
+        if (this_gate.unitary!=NULL) free(this_gate.unitary);
+        continue;
+      }
+    } else {
+      k = last[this_gate.qubit_numbers[0]];
+      if (k!=-1&&k==last[this_gate.qubit_numbers[1]]
+          &&PetscAbsReal(this_gate.time-gates[k].time)<=time_window){
+        // Gate k acts on the same pair; merge into it, in gate k's qubit order
+        _get_gate_unitary(gates[k],&num_qubits,strides,U_tmp);
+        if (gates[k].qubit_numbers[0]!=this_gate.qubit_numbers[0]){
+          _swap_2q(U_gate,U_swap);
+        } else {
+          for (j=0;j<16;j++) U_swap[j] = U_gate[j];
+        }
+        _dense_mult(4,U_swap,U_tmp,U_gate);
+        _set_fused_gate(&gates[k],2,U_gate);
+        free(this_gate.qubit_numbers);
+        if (this_gate.unitary!=NULL) free(this_gate.unitary);
+        continue;
+      }
+      // Absorb pending 1 qubit gates on either qubit: U <- U (U_k on q)
+      for (j=0;j<2;j++){
+        k = last[this_gate.qubit_numbers[j]];
+        if (k!=-1&&gates[k].my_gate_type>0&&!removed[k]
+            &&PetscAbsReal(this_gate.time-gates[k].time)<=time_window){
+          _get_gate_unitary(gates[k],&num_qubits,strides,U_1q);
+          _expand_1q_to_2q(U_1q,j,U_swap);
+          _dense_mult(4,U_gate,U_swap,U_tmp);
+          for (q=0;q<16;q++) U_gate[q] = U_tmp[q];
+          _set_fused_gate(&this_gate,2,U_gate);
+          removed[k] = 1;
+        }
+      }
+    }
+
+    // Keep this gate
+    gates[num_new]  = this_gate;
+    removed[num_new] = 0;
+    for (j=0;j<((this_gate.my_gate_type>0) ? 1 : 2);j++){
+      last[this_gate.qubit_numbers[j]] = num_new;
+    }
+    num_new = num_new + 1;
+  }
+
+  // Drop the 1 qubit gates that were absorbed into later 2 qubit gates
+  j = 0;
+  for (i=0;i<num_new;i++){
+    if (removed[i]){
+      free(gates[i].qubit_numbers);
+      if (gates[i].unitary!=NULL) free(gates[i].unitary);
+    } else {
+      gates[j] = gates[i];
+      j = j + 1;
+    }
+  }
+  (*circ).num_gates = j;
+
+  if (nid==0) printf("fuse_circuit: %d gates fused to %d gates\n",(int)num_before,(int)(*circ).num_gates);
+
+  free(last);
+  free(removed);
+  return;
+}
+
+/*
+ * _set_fused_gate turns gate into a fused gate with the given unitary
+ */
+void _set_fused_gate(struct quantum_gate_struct *gate,PetscInt num_qubits,PetscScalar U[]){
+  PetscInt i;
+
+  if ((*gate).unitary==NULL){
+    (*gate).unitary = malloc(16*sizeof(PetscScalar));
+  }
+  for (i=0;i<(1<<(2*num_qubits));i++){
+    (*gate).unitary[i] = U[i];
+  }
+  if (num_qubits==1){
+    (*gate).my_gate_type = FUSED_1Q;
+  } else {
+    (*gate).my_gate_type = FUSED_2Q;
+  }
+  (*gate)._get_val_j_from_global_i = _get_val_j_functions_gates[(*gate).my_gate_type+_min_gate_enum];
+  (*gate).theta  = 0;
+  (*gate).phi    = 0;
+  (*gate).lambda = 0;
+  return;
+}
+
+/*
+ * _dense_mult computes C = A B for n x n, row major, matrices
+ */
+void _dense_mult(PetscInt n,PetscScalar A[],PetscScalar B[],PetscScalar C[]){
+  PetscInt i,j,k;
+
+  for (i=0;i<n;i++){
+    for (j=0;j<n;j++){
+      C[i*n+j] = 0.0;
+      for (k=0;k<n;k++){
+        C[i*n+j] = C[i*n+j] + A[i*n+k]*B[k*n+j];
+      }
+    }
+  }
+  return;
+}
+
+/*
+ * _expand_1q_to_2q computes U cross I (pos=0) or I cross U (pos=1)
+ */
+void _expand_1q_to_2q(PetscScalar U[],PetscInt pos,PetscScalar U2[]){
+  PetscInt b,c;
+
+  for (b=0;b<4;b++){
+    for (c=0;c<4;c++){
+      if (pos==0){
+        // Second qubit untouched
+        U2[b*4+c] = ((b&1)==(c&1)) ? U[(b>>1)*2+(c>>1)] : 0.0;
+      } else {
+        // First qubit untouched
+        U2[b*4+c] = ((b>>1)==(c>>1)) ? U[(b&1)*2+(c&1)] : 0.0;
+      }
+    }
+  }
+  return;
+}
+
+/*
+ * _swap_2q reorders a 4x4 unitary on |q0 q1> to act on |q1 q0>
+ */
+void _swap_2q(PetscScalar U[],PetscScalar U_swap[]){
+  PetscInt b,c,sb,sc;
+
+  for (b=0;b<4;b++){
+    for (c=0;c<4;c++){
+      sb = ((b&1)<<1)|(b>>1);
+      sc = ((c&1)<<1)|(c>>1);
+      U_swap[b*4+c] = U[sb*4+sc];
+    }
+  }
+  return;
+}
+
 /*
  *
  * tensor_control - switch on which superoperator to compute
@@ -1494,9 +1956,9 @@ void combine_circuit_to_mat2(Mat *matrix_out,circuit circ){
 
 
 void combine_circuit_to_mat(Mat *matrix_out,circuit circ){
-  PetscScalar op_vals[2];
+  PetscScalar op_vals[4];
   PetscInt Istart,Iend,i_mat;
-  PetscInt i,these_js[2],num_js;
+  PetscInt i,these_js[4],num_js; //4 is the most js from 1 i (FUSED_2Q)
   Mat tmp_mat1,tmp_mat2,tmp_mat3;
 
   // Should this inherit its stucture from full_A?
@@ -1506,7 +1968,7 @@ void combine_circuit_to_mat(Mat *matrix_out,circuit circ){
   MatSetSizes(tmp_mat1,PETSC_DECIDE,PETSC_DECIDE,total_levels,total_levels);
   MatSetFromOptions(tmp_mat1);
 
-  MatMPIAIJSetPreallocation(tmp_mat1,2,NULL,2,NULL);
+  MatMPIAIJSetPreallocation(tmp_mat1,4,NULL,4,NULL);
 
   /* Construct the first matrix in tmp_mat1 */
   MatGetOwnershipRange(tmp_mat1,&Istart,&Iend);
@@ -1525,12 +1987,12 @@ void combine_circuit_to_mat(Mat *matrix_out,circuit circ){
     MatSetSizes(tmp_mat2,PETSC_DECIDE,PETSC_DECIDE,total_levels,total_levels);
     MatSetFromOptions(tmp_mat2);
 
-    MatMPIAIJSetPreallocation(tmp_mat2,2,NULL,2,NULL);
+    MatMPIAIJSetPreallocation(tmp_mat2,4,NULL,4,NULL);
 
     /* Construct new matrix */
     MatGetOwnershipRange(tmp_mat2,&Istart,&Iend);
     for (i=Istart;i<Iend;i++){
-      _get_val_j_from_global_i_gates(i,circ.gate_list[i_mat],&num_js,these_js,op_vals,-1); // Get the corresponding j and val
+      circ.gate_list[i_mat]._get_val_j_from_global_i(i,circ.gate_list[i_mat],&num_js,these_js,op_vals,-1); // Get the corresponding j and val
       MatSetValues(tmp_mat2,1,&i,num_js,these_js,op_vals,ADD_VALUES);
     }
 
@@ -1556,9 +2018,9 @@ void combine_circuit_to_mat(Mat *matrix_out,circuit circ){
 
 
 void combine_circuit_to_super_mat(Mat *matrix_out,circuit circ){
-  PetscScalar op_vals[4];
+  PetscScalar op_vals[16];
   PetscInt Istart,Iend,i_mat,dim;
-  PetscInt i,these_js[4],num_js;
+  PetscInt i,these_js[16],num_js; //16 is the most js from 1 i (FUSED_2Q)
   Mat tmp_mat1,tmp_mat2,tmp_mat3;
 
   // Should this inherit its stucture from full_A?
@@ -1568,12 +2030,12 @@ void combine_circuit_to_super_mat(Mat *matrix_out,circuit circ){
   MatSetSizes(tmp_mat1,PETSC_DECIDE,PETSC_DECIDE,dim,dim);
   MatSetFromOptions(tmp_mat1);
 
-  MatMPIAIJSetPreallocation(tmp_mat1,8,NULL,8,NULL);
+  MatMPIAIJSetPreallocation(tmp_mat1,16,NULL,16,NULL);
 
   /* Construct the first matrix in tmp_mat1 */
   MatGetOwnershipRange(tmp_mat1,&Istart,&Iend);
   for (i=Istart;i<Iend;i++){
-    _get_val_j_from_global_i_gates(i,circ.gate_list[0],&num_js,these_js,op_vals,0); // Get the corresponding j and val
+    circ.gate_list[0]._get_val_j_from_global_i(i,circ.gate_list[0],&num_js,these_js,op_vals,0); // Get the corresponding j and val
     MatSetValues(tmp_mat1,1,&i,num_js,these_js,op_vals,ADD_VALUES);
   }
 
@@ -1587,12 +2049,12 @@ void combine_circuit_to_super_mat(Mat *matrix_out,circuit circ){
     MatSetSizes(tmp_mat2,PETSC_DECIDE,PETSC_DECIDE,dim,dim);
     MatSetFromOptions(tmp_mat2);
 
-    MatMPIAIJSetPreallocation(tmp_mat2,8,NULL,8,NULL);
+    MatMPIAIJSetPreallocation(tmp_mat2,16,NULL,16,NULL);
 
     /* Construct new matrix */
     MatGetOwnershipRange(tmp_mat2,&Istart,&Iend);
     for (i=Istart;i<Iend;i++){
-      _get_val_j_from_global_i_gates(i,circ.gate_list[i_mat],&num_js,these_js,op_vals,0); // Get the corresponding j and val
+      circ.gate_list[i_mat]._get_val_j_from_global_i(i,circ.gate_list[i_mat],&num_js,these_js,op_vals,0); // Get the corresponding j and val
       MatSetValues(tmp_mat2,1,&i,num_js,these_js,op_vals,ADD_VALUES);
     }
 
@@ -3003,6 +3465,76 @@ void SIGMAX_get_val_j_from_global_i(PetscInt i,struct quantum_gate_struct gate,P
   return;
 }
 
+/*
+ * FUSED gate (FUSED_1Q or FUSED_2Q)
+ *
+ * An explicit, dense 2x2 or 4x4 unitary, created by fuse_circuit.
+ * Every entry of the unitary in the row of i is returned, so
+ * there are up to 4 js (16 for U* cross U).
+ */
+void FUSED_get_val_j_from_global_i(PetscInt i,struct quantum_gate_struct gate,PetscInt *num_js,
+                                   PetscInt js[],PetscScalar vals[],PetscInt tensor_control){
+  PetscInt    i1,i2,k1,k2,q,b,b_i,num_qubits,dim_gate,extra_after,base,strides[2],members[4];
+  PetscInt    num_js_i1,num_js_i2,js_i1[4],js_i2[4];
+  PetscScalar vals_i1[4],vals_i2[4];
+  operator    this_op;
+
+  if (tensor_control!= 0) {
+    if (tensor_control==1) {
+      extra_after = total_levels;
+    } else {
+      extra_after = 1;
+    }
+    if (gate.my_gate_type==FUSED_1Q){
+      num_qubits = 1;
+    } else {
+      num_qubits = 2;
+    }
+    dim_gate = 1<<num_qubits;
+    for (q=0;q<num_qubits;q++){
+      this_op    = subsystem_list[gate.qubit_numbers[q]];
+      strides[q] = total_levels/(this_op->my_levels*this_op->n_before)*extra_after;
+    }
+    _get_gate_group(i,num_qubits,strides,&base,members);
+    // Which member of the group is i?
+    b_i = 0;
+    for (q=0;q<num_qubits;q++){
+      b_i = b_i + ((i/strides[q])%2<<(num_qubits-1-q));
+    }
+    *num_js = 0;
+    for (b=0;b<dim_gate;b++){
+      if (gate.unitary[b_i*dim_gate+b]!=0.0){
+        js[*num_js]   = members[b];
+        vals[*num_js] = gate.unitary[b_i*dim_gate+b];
+        *num_js = *num_js + 1;
+      }
+    }
+  } else {
+    /*
+     * U* cross U
+     * As in the other gates, get the js of U* (i1) and U (i2)
+     * separately and combine them with the standard tensor product.
+     */
+    i1 = i/total_levels;
+    i2 = i%total_levels;
+
+    FUSED_get_val_j_from_global_i(i1,gate,&num_js_i1,js_i1,vals_i1,-1);
+    FUSED_get_val_j_from_global_i(i2,gate,&num_js_i2,js_i2,vals_i2,-1);
+
+    *num_js = 0;
+    for(k1=0;k1<num_js_i1;k1++){
+      for(k2=0;k2<num_js_i2;k2++){
+        js[*num_js] = total_levels * js_i1[k1] + js_i2[k2];
+        //Need to take complex conjugate to get true U*
+        vals[*num_js] = PetscConjComplex(vals_i1[k1])*vals_i2[k2];
+
+        *num_js = *num_js + 1;
+      }
+    }
+  }
+  return;
+}
+
 void _get_n_after_2qbit(PetscInt *i,int qubit_numbers[],PetscInt tensor_control,PetscInt *n_after, PetscInt *control, PetscInt *moved_system, PetscInt *i_sub){
   operator this_op1,this_op2;
   PetscInt n_before1,n_before2,extra_after,my_levels=4,j1; //4 is hardcoded because 2 qbits
@@ -3082,9 +3614,10 @@ void _get_n_after_1qbit(PetscInt i,int qubit_number,PetscInt tensor_control,Pets
 void _check_gate_type(gate_type my_gate_type,int *num_qubits){
 
   if (my_gate_type==HADAMARD||my_gate_type==SIGMAX||my_gate_type==SIGMAY||my_gate_type==SIGMAZ||my_gate_type==EYE||
-      my_gate_type==RZ||my_gate_type==RX||my_gate_type==RY||my_gate_type==U3) {
+      my_gate_type==RZ||my_gate_type==RX||my_gate_type==RY||my_gate_type==U3||my_gate_type==FUSED_1Q) {
     *num_qubits = 1;
-  } else if (my_gate_type==CNOT||my_gate_type==CXZ||my_gate_type==CZ||my_gate_type==CmZ||my_gate_type==CZX){
+  } else if (my_gate_type==CNOT||my_gate_type==CXZ||my_gate_type==CZ||my_gate_type==CmZ||my_gate_type==CZX||
+             my_gate_type==FUSED_2Q){
     *num_qubits = 2;
   } else {
     if (nid==0){
@@ -3112,4 +3645,6 @@ void _initialize_gate_function_array(){
   _get_val_j_functions_gates[RY+_min_gate_enum] = RY_get_val_j_from_global_i;
   _get_val_j_functions_gates[RZ+_min_gate_enum] = RZ_get_val_j_from_global_i;
   _get_val_j_functions_gates[U3+_min_gate_enum] = U3_get_val_j_from_global_i;
+  _get_val_j_functions_gates[FUSED_1Q+_min_gate_enum] = FUSED_get_val_j_from_global_i;
+  _get_val_j_functions_gates[FUSED_2Q+_min_gate_enum] = FUSED_get_val_j_from_global_i;
 }
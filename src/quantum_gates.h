@@ -9,6 +9,7 @@
 
 typedef enum {
   NULL_GATE = -1000,
+  FUSED_2Q = -6,
   CZX  = -5,
   CmZ  = -4,
   CZ   = -3,
@@ -22,7 +23,8 @@ typedef enum {
   RX     = 6,
   RY     = 7,
   RZ     = 8,
-  U3     = 9
+  U3     = 9,
+  FUSED_1Q = 10
 } gate_type;
 
 struct quantum_gate_struct{
@@ -31,6 +33,7 @@ struct quantum_gate_struct{
   int *qubit_numbers;
   void (*_get_val_j_from_global_i)(PetscInt,struct quantum_gate_struct,PetscInt*,PetscInt[],PetscScalar[],PetscInt);
   PetscReal theta,lambda,phi; //Only used for rotation gates
+  PetscScalar *unitary; //Only used for fused gates; row major 2x2 or 4x4
 };
 
 typedef struct circuit{
@@ -44,6 +47,10 @@ PetscScalar _get_val_in_subspace_gate(PetscInt,gate_type,PetscInt,PetscInt*,Pets
 void add_gate(PetscReal,gate_type,...);
 void _construct_gate_mat(gate_type,int*,Mat);
 void _apply_gate(struct quantum_gate_struct,Vec);
+void _get_gate_unitary(struct quantum_gate_struct,PetscInt*,PetscInt[],PetscScalar[]);
+void _apply_dense_gate_in_place(Vec,PetscInt,PetscInt[],PetscScalar[],int);
+void _get_gate_group(PetscInt,PetscInt,PetscInt[],PetscInt*,PetscInt[]);
+PetscInt _first_local_member(PetscInt[],PetscInt,PetscInt,PetscInt);
 void _change_basis_ij_pair(PetscInt*,PetscInt*,PetscInt,PetscInt);
 PetscErrorCode _QG_EventFunction(TS,PetscReal,Vec,PetscScalar*,void*);
 PetscErrorCode _QG_PostEventFunction(TS,PetscInt,PetscInt [],PetscReal,Vec,PetscBool,void*);
@@ -55,6 +62,14 @@ void create_circuit(circuit*,PetscInt);
 void add_gate_to_circuit(circuit*,PetscReal,gate_type,...);
 void add_circuit_to_circuit(circuit*,circuit,PetscReal);
 void start_circuit_at_time(circuit*,PetscReal);
+void set_circuit_segments();
+void _QC_apply_gates_at_time(Vec);
+PetscReal _QC_next_gate_time();
+void fuse_circuit(circuit*,PetscReal);
+void _set_fused_gate(struct quantum_gate_struct*,PetscInt,PetscScalar[]);
+void _dense_mult(PetscInt,PetscScalar[],PetscScalar[],PetscScalar[]);
+void _expand_1q_to_2q(PetscScalar[],PetscInt,PetscScalar[]);
+void _swap_2q(PetscScalar[],PetscScalar[]);
 
 void _get_val_j_from_global_i_gates(PetscInt,struct quantum_gate_struct,PetscInt*,PetscInt[],PetscScalar[],PetscInt);
 void combine_circuit_to_mat(Mat*,circuit);
@@ -77,6 +92,7 @@ void RX_get_val_j_from_global_i(PetscInt,struct quantum_gate_struct,PetscInt*,Pe
 void RY_get_val_j_from_global_i(PetscInt,struct quantum_gate_struct,PetscInt*,PetscInt[],PetscScalar[],PetscInt);
 void RZ_get_val_j_from_global_i(PetscInt,struct quantum_gate_struct,PetscInt*,PetscInt[],PetscScalar[],PetscInt);
 void U3_get_val_j_from_global_i(PetscInt,struct quantum_gate_struct,PetscInt*,PetscInt[],PetscScalar[],PetscInt);
+void FUSED_get_val_j_from_global_i(PetscInt,struct quantum_gate_struct,PetscInt*,PetscInt[],PetscScalar[],PetscInt);
 
 #define MAX_GATES 100 // Consider not making this a define
 
@@ -87,5 +103,8 @@ extern int _gate_array_initialized;
 void (*_get_val_j_functions_gates[MAX_GATES])(PetscInt,struct quantum_gate_struct,PetscInt*,PetscInt[],PetscScalar[],PetscInt);
 circuit _circuit_list[MAX_GATES];
 extern int _num_circuits;
+extern int _current_circuit;
+extern int _current_gate;
+extern int _circuit_segments;
 
 #endif
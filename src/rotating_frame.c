@@ -0,0 +1,466 @@
+#include "rotating_frame.h"
+#include "rotating_frame_p.h"
+#include "operators_p.h"
+#include "operators.h"
+#include "excitation_basis_p.h"
+#include "dicke_p.h"
+#include "quantum_gates.h"
+#include "error_correction.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+ * Rotating frame (interaction picture) of H0 = sum_q omega_q N_q, with
+ * N_q the number of excitations of subsystem q. With U = exp(-i H0 t),
+ * the model is solved for rho' = U^t rho U, whose Hamiltonian is
+ * U^t H U - H0. Each term a G of H, with G a product of ops, only picks
+ * up a phase, U^t G U = exp(i delta t) G, where delta is the frame energy
+ * G adds (+omega_q for a raising op, -omega_q for a lowering op, 0 for
+ * number and sig_z ops). Terms with delta = 0 stay as they are; the others
+ * become time dependent terms, a exp(i delta t) G, in _time_dep_list, or
+ * are dropped (rotating wave approximation) if |delta| is above the RWA
+ * cutoff. Lindblad terms with a single delta are unchanged by the frame,
+ * as C rho C^t picks up exp(i delta t) exp(-i delta t); a Lindblad term
+ * mixing several deltas (sig_x, or a matrix that does) would pick up
+ * cross terms at exp(+-2 i delta t), so it is refused.
+ *
+ * time_step transforms the initial state into the frame and the final
+ * state back, and the ts_monitor is given the lab frame state. Gates are
+ * given in the lab frame; those that commute with H0 are applied to the
+ * rotating frame state directly, the others to the state moved back to
+ * the lab frame for the gate. steady_state returns the rotating frame
+ * steady state, so it needs a frame in which no term rotates.
+ */
+
+int _rotating_frame = 0;
+
+static PetscReal _frame_omega[MAX_SUB];
+static PetscReal _frame_rwa_cutoff = -1.0;
+static int       _frame_num_terms    = 0;
+static int       _frame_num_time_dep = 0;
+static int       _frame_num_time_dep_lin = 0;
+static int       _frame_num_moved    = 0;
+static int       _frame_h0_added     = 0;
+static Vec       _frame_x            = NULL;
+static PetscErrorCode (*_frame_user_monitor)(TS,PetscInt,PetscReal,Vec,void*) = NULL;
+
+static int  _frame_subsystem(operator);
+static int  _frame_detuning(int,operator*,PetscReal*);
+static void _frame_check_detuning(int,operator*,PetscReal*);
+static void _frame_check_mat(Mat);
+static PetscReal _frame_energy(PetscInt);
+static void _frame_add_time_dep(PetscScalar,PetscReal,int,operator*);
+
+/*
+ * add_to_rotating_frame adds omega * N to the frame H0, where N is the
+ * number operator (sum_l l |l><l|) of op's subsystem. Any operator of the
+ * subsystem (a, a->dag, a->n, or a vec op) may be passed. The frame must
+ * be set before the first time_step or steady_state.
+ *
+ * Inputs:
+ *      PetscReal omega: frame frequency of the subsystem
+ *      operator  op:    an operator of the subsystem
+ */
+void add_to_rotating_frame(PetscReal omega,operator op){
+  int q;
+
+  _check_initialized_A();
+  if (_matrix_free){
+    if (nid==0){
+      printf("ERROR! The rotating frame is not supported with set_matrix_free!\n");
+      exit(0);
+    }
+  }
+  if (_frame_h0_added){
+    if (nid==0){
+      printf("ERROR! The rotating frame must be set before the first time_step or steady_state!\n");
+      exit(0);
+    }
+  }
+  q = _frame_subsystem(op);
+  _frame_omega[q] = _frame_omega[q] + omega;
+  _rotating_frame = 1;
+  return;
+}
+
+/*
+ * set_rotating_frame_rwa drops (rather than making time dependent) the
+ * terms that rotate faster than cutoff in the rotating frame. This can
+ * also be set with the command line option -rotating_frame_rwa <cutoff>.
+ *
+ * Inputs:
+ *      PetscReal cutoff: largest |delta| that is kept
+ */
+void set_rotating_frame_rwa(PetscReal cutoff){
+  _frame_rwa_cutoff = cutoff;
+  return;
+}
+
+/*
+ * _apply_rotating_frame moves the recorded terms (and time dependent
+ * terms) that were added since the last call into the rotating frame.
+ * It is called by _build_A, before the terms are inserted.
+ */
+void _apply_rotating_frame(){
+  int        i,k,q,num_terms,num_moved,num_dropped;
+  PetscReal  delta;
+  model_term *terms,*this_term;
+  operator   this_op,pair[2];
+
+  if (!_rotating_frame) return;
+  if (_stiff_solver){
+    if (nid==0){
+      printf("ERROR! Stiff terms are not supported in the rotating frame!\n");
+      exit(0);
+    }
+  }
+  PetscOptionsGetReal(NULL,NULL,"-rotating_frame_rwa",&_frame_rwa_cutoff,NULL);
+
+  if (!_frame_h0_added){
+    /* H -> H - H0 */
+    for (q=0;q<num_subsystems;q++){
+      if (_frame_omega[q]==0) continue;
+      this_op = subsystem_list[q];
+      if (this_op->my_op_type==VEC){
+        for (k=1;k<this_op->my_levels;k++){
+          /* |k><k| as a pair, so that it is a product of ops */
+          pair[0] = this_op->vec_op_list[k];
+          pair[1] = this_op->vec_op_list[k];
+          _record_term(TERM_HAM_P,-_frame_omega[q]*k,2,pair,NULL);
+        }
+      } else {
+        _record_term(TERM_HAM,-_frame_omega[q],1,&this_op->n,NULL);
+      }
+    }
+    _frame_h0_added = 1;
+  }
+
+  /* The user's time dependent terms just pick up the phase */
+  for (i=_frame_num_time_dep;i<_num_time_dep;i++){
+    _frame_check_detuning(_time_dep_list[i].num_ops,_time_dep_list[i].ops,&delta);
+    _time_dep_list[i].omega = _time_dep_list[i].omega + delta;
+  }
+  /* Time dependent Lindblad terms are unchanged, if they have a single delta */
+  for (i=_frame_num_time_dep_lin;i<_num_time_dep_lin;i++){
+    _frame_check_detuning(_time_dep_list_lin[i].num_ops,_time_dep_list_lin[i].ops,&delta);
+  }
+
+  num_moved   = 0;
+  num_dropped = 0;
+  _get_terms(&num_terms,&terms);
+  for (i=_frame_num_terms;i<num_terms;i++){
+    this_term = &terms[i];
+    if (this_term->a==0.0) continue;
+    if (this_term->my_term_type==TERM_LIN_MAT){
+      _frame_check_mat(this_term->mat);
+      continue;
+    }
+    /* The ensemble terms recorded by dicke.c act on one emitter at a time */
+    if (this_term->my_term_type==TERM_EXTERNAL) continue;
+    _frame_check_detuning(this_term->num_ops,this_term->ops,&delta);
+    if (this_term->my_term_type>TERM_HAM_P||delta==0) continue;
+    if (_frame_rwa_cutoff>=0&&PetscAbsReal(delta)>_frame_rwa_cutoff){
+      num_dropped = num_dropped + 1;
+    } else {
+      _frame_add_time_dep(this_term->a,delta,this_term->num_ops,this_term->ops);
+      num_moved = num_moved + 1;
+    }
+    /* The term no longer contributes to the constant part */
+    this_term->a = 0.0;
+  }
+  _frame_num_terms        = num_terms;
+  _frame_num_time_dep     = _num_time_dep;
+  _frame_num_time_dep_lin = _num_time_dep_lin;
+  _frame_num_moved        = _frame_num_moved + num_moved;
+
+  if (nid==0&&num_moved+num_dropped>0){
+    printf("Rotating frame: %d terms made time dependent, %d dropped by the RWA\n",num_moved,num_dropped);
+  }
+  return;
+}
+
+/*
+ * _frame_begin transforms x from the lab frame into the rotating frame
+ * at time t and makes the ts_monitor see the lab frame state. x is left
+ * as it is if transform is 0 (it is already in the rotating frame, as
+ * when restarting from a checkpoint).
+ */
+void _frame_begin(Vec x,PetscReal t,int transform){
+  if (_discrete_ec){
+    if (nid==0){
+      printf("ERROR! Discrete error correction is not supported in the rotating frame!\n");
+      exit(0);
+    }
+  }
+  if (transform) {
+    _frame_transform(x,t,0);
+  }
+  if (_ts_monitor!=NULL&&_ts_monitor!=_frame_ts_monitor){
+    _frame_user_monitor = _ts_monitor;
+    _ts_monitor         = _frame_ts_monitor;
+    VecDuplicate(x,&_frame_x);
+  }
+  return;
+}
+
+/*
+ * _frame_end transforms x back into the lab frame at time t and
+ * restores the user's ts_monitor.
+ */
+void _frame_end(Vec x,PetscReal t){
+  _frame_transform(x,t,1);
+  if (_ts_monitor==_frame_ts_monitor){
+    _ts_monitor = _frame_user_monitor;
+    VecDestroy(&_frame_x);
+  }
+  return;
+}
+
+/*
+ * _frame_ts_monitor calls the user's ts_monitor with the lab frame state
+ */
+PetscErrorCode _frame_ts_monitor(TS ts,PetscInt step,PetscReal time,Vec x,void *ctx){
+  VecCopy(x,_frame_x);
+  _frame_transform(_frame_x,time,1);
+  return _frame_user_monitor(ts,step,time,_frame_x,ctx);
+}
+
+/*
+ * _frame_time_dep_terms returns the number of terms that the rotating
+ * frame made time dependent
+ */
+int _frame_time_dep_terms(){
+  return _frame_num_moved;
+}
+
+/*
+ * _frame_apply_gate applies a (lab frame) gate at time t to the rotating
+ * frame state x. The gate commutes with H0 if U_jk (E_j - E_k) = 0 for
+ * all of its elements, with E_j the frame energy of the gate's qubits in
+ * state j; then it is the same in both frames. Otherwise x is moved to
+ * the lab frame for the gate and back.
+ */
+void _frame_apply_gate(struct quantum_gate_struct gate,PetscReal t,Vec x){
+  PetscScalar U[16];
+  PetscInt    num_qubits,strides[2],j,k,q,dim_gate;
+  PetscReal   energy[4];
+  int         commutes;
+
+  if (!_rotating_frame) {
+    _apply_gate(gate,x);
+    return;
+  }
+  _get_gate_unitary(gate,&num_qubits,strides,U);
+  dim_gate = 1<<num_qubits;
+  for (j=0;j<dim_gate;j++){
+    energy[j] = 0.0;
+    for (q=0;q<num_qubits;q++){
+      /* Qubit 0 is the most significant bit of j */
+      energy[j] = energy[j] + _frame_omega[gate.qubit_numbers[q]]
+        *_level_excitations(subsystem_list[gate.qubit_numbers[q]],(j>>(num_qubits-1-q))&1);
+    }
+  }
+  commutes = 1;
+  for (j=0;j<dim_gate;j++){
+    for (k=0;k<dim_gate;k++){
+      if (PetscAbsComplex(U[j*dim_gate+k])>1e-14&&energy[j]!=energy[k]) commutes = 0;
+    }
+  }
+  if (commutes) {
+    _apply_gate(gate,x);
+  } else {
+    _frame_transform(x,t,1);
+    _apply_gate(gate,x);
+    _frame_transform(x,t,0);
+  }
+  return;
+}
+
+/*
+ * _frame_transform multiplies psi_i by exp(-/+ i E_i t), or rho_rc by
+ * exp(-/+ i (E_r - E_c) t), with E_i the frame energy of basis state i;
+ * the minus sign (to_lab = 1) goes from the rotating frame to the lab frame.
+ *
+ * Inputs:
+ *      Vec       x:      the density matrix (or wavefunction)
+ *      PetscReal t:      time of the transformation
+ *      int       to_lab: 1 for rotating to lab, 0 for lab to rotating
+ */
+void _frame_transform(Vec x,PetscReal t,int to_lab){
+  PetscInt    i,dim,my_start,my_end;
+  PetscReal   energy,sign;
+  PetscScalar *x_array;
+
+  if (!_rotating_frame) return;
+  sign = to_lab ? -1.0 : 1.0;
+  VecGetSize(x,&dim);
+  VecGetOwnershipRange(x,&my_start,&my_end);
+  VecGetArray(x,&x_array);
+  for (i=my_start;i<my_end;i++){
+    if (dim==_basis_dim){
+      energy = _frame_energy(_basis_state(i));
+    } else {
+      energy = _frame_energy(_basis_state(i%_basis_dim)) - _frame_energy(_basis_state(i/_basis_dim));
+    }
+    x_array[i-my_start] = x_array[i-my_start]*PetscExpComplex(sign*PETSC_i*energy*t);
+  }
+  VecRestoreArray(x,&x_array);
+  return;
+}
+
+/*
+ * _frame_energy gives the frame energy of the tensor product state i
+ */
+static PetscReal _frame_energy(PetscInt i){
+  PetscInt  q,stride;
+  PetscReal energy;
+  operator  this_op;
+
+  energy = 0.0;
+  for (q=0;q<num_subsystems;q++){
+    if (_frame_omega[q]==0) continue;
+    this_op = subsystem_list[q];
+    stride  = total_levels/(this_op->my_levels*this_op->n_before);
+    energy  = energy + _frame_omega[q]*_level_excitations(this_op,(i/stride)%this_op->my_levels);
+  }
+  return energy;
+}
+
+/*
+ * _frame_clear removes the rotating frame, for QuaC_clear
+ */
+void _frame_clear(){
+  int q;
+
+  for (q=0;q<MAX_SUB;q++){
+    _frame_omega[q] = 0.0;
+  }
+  _rotating_frame     = 0;
+  _frame_rwa_cutoff   = -1.0;
+  _frame_num_terms    = 0;
+  _frame_num_time_dep = 0;
+  _frame_num_time_dep_lin = 0;
+  _frame_num_moved    = 0;
+  _frame_h0_added     = 0;
+  return;
+}
+
+/*
+ * _frame_subsystem finds the subsystem an operator belongs to
+ */
+static int _frame_subsystem(operator op){
+  int q;
+
+  for (q=0;q<num_subsystems;q++){
+    if (subsystem_list[q]->n_before==op->n_before) return q;
+  }
+  if (nid==0){
+    printf("ERROR! Operator not found in the subsystem list!\n");
+    exit(0);
+  }
+  return -1;
+}
+
+/*
+ * _frame_detuning sets delta to the frame energy added by the product
+ * of ops. Returns 0 if some op does not have a single delta
+ * (sig_x or sig_y on a subsystem in the frame).
+ */
+static int _frame_detuning(int num_ops,operator *ops,PetscReal *delta){
+  int       k;
+  PetscReal omega;
+
+  *delta = 0.0;
+  for (k=0;k<num_ops;k++){
+    omega = _frame_omega[_frame_subsystem(ops[k])];
+    if (ops[k]->my_op_type==RAISE||ops[k]->my_op_type==DICKE_RAISE){
+      *delta = *delta + omega;
+    } else if (ops[k]->my_op_type==LOWER||ops[k]->my_op_type==DICKE_LOWER){
+      *delta = *delta - omega;
+    } else if (ops[k]->my_op_type==VEC){
+      /* |p><q| adds omega (p-q); a single VEC is |p><p| */
+      if (k+1<num_ops&&ops[k+1]->my_op_type==VEC){
+        *delta = *delta + omega*(ops[k]->position - ops[k+1]->position);
+        k = k + 1;
+      }
+    } else if (ops[k]->my_op_type==SIGMA_X||ops[k]->my_op_type==SIGMA_Y){
+      if (omega!=0) return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * _frame_check_detuning sets delta as _frame_detuning does, and stops if
+ * the product of ops does not have a single delta
+ */
+static void _frame_check_detuning(int num_ops,operator *ops,PetscReal *delta){
+  if (!_frame_detuning(num_ops,ops,delta)){
+    if (nid==0){
+      printf("ERROR! sig_x and sig_y are not supported on subsystems in the rotating frame!\n");
+      printf("       Use sm + sm->dag and i(sm->dag - sm) instead.\n");
+      exit(0);
+    }
+  }
+  return;
+}
+
+/*
+ * _frame_check_mat stops if the Lindblad matrix C of add_lin_mat does not
+ * have a single delta, that is, if E_i - E_j differs between its elements
+ */
+static void _frame_check_mat(Mat C){
+  PetscInt          i,k,Istart,Iend,ncols;
+  const PetscInt    *cols;
+  const PetscScalar *vals;
+  PetscReal         delta,local[2],global[2];
+
+  /* The smallest delta and the smallest -delta */
+  local[0] = PETSC_MAX_REAL;
+  local[1] = PETSC_MAX_REAL;
+  MatGetOwnershipRange(C,&Istart,&Iend);
+  for (i=Istart;i<Iend;i++){
+    MatGetRow(C,i,&ncols,&cols,&vals);
+    for (k=0;k<ncols;k++){
+      if (PetscAbsComplex(vals[k])==0) continue;
+      delta    = _frame_energy(i) - _frame_energy(cols[k]);
+      local[0] = PetscMin(local[0],delta);
+      local[1] = PetscMin(local[1],-delta);
+    }
+    MatRestoreRow(C,i,&ncols,&cols,&vals);
+  }
+  MPI_Allreduce(local,global,2,MPIU_REAL,MPI_MIN,PETSC_COMM_WORLD);
+  if (global[0]<PETSC_MAX_REAL&&global[0]+global[1]<-1e-12*PetscMax(1.0,PetscAbsReal(global[0]))){
+    if (nid==0){
+      printf("ERROR! Matrices of add_lin_mat must add a single frame energy in the rotating frame!\n");
+      printf("       Add each part (such as sm and sm->dag) as its own Lindblad term instead.\n");
+      exit(0);
+    }
+  }
+  return;
+}
+
+/*
+ * _frame_add_time_dep adds a exp(i delta t) G to _time_dep_list
+ */
+static void _frame_add_time_dep(PetscScalar a,PetscReal delta,int num_ops,operator *ops){
+  int i;
+
+  if (_num_time_dep==MAX_SUB){
+    if (nid==0){
+      printf("ERROR! Too many time dependent terms in the rotating frame for this MAX_SUB!\n");
+      exit(0);
+    }
+  }
+  _time_dep_list[_num_time_dep].time_dep_func = NULL;
+  _time_dep_list[_num_time_dep].num_ops       = num_ops;
+  _time_dep_list[_num_time_dep].a             = a;
+  _time_dep_list[_num_time_dep].omega         = delta;
+  _time_dep_list[_num_time_dep].mat           = NULL;
+  _time_dep_list[_num_time_dep].ops           = malloc(num_ops*sizeof(operator));
+  for (i=0;i<num_ops;i++){
+    _time_dep_list[_num_time_dep].ops[i] = ops[i];
+  }
+  _num_time_dep = _num_time_dep + 1;
+  return;
+}
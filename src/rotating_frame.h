@@ -0,0 +1,10 @@
+#ifndef ROTATING_FRAME_H_
+#define ROTATING_FRAME_H_
+
+#include <petsc.h>
+#include "operators.h"
+
+void add_to_rotating_frame(PetscReal,operator);
+void set_rotating_frame_rwa(PetscReal);
+
+#endif
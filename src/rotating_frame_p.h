@@ -0,0 +1,19 @@
+#ifndef ROTATING_FRAME_P_H_
+#define ROTATING_FRAME_P_H_
+
+#include <petscts.h>
+#include "quantum_gates.h"
+
+void _apply_rotating_frame();
+void _frame_begin(Vec,PetscReal,int);
+void _frame_end(Vec,PetscReal);
+void _frame_transform(Vec,PetscReal,int);
+void _frame_clear();
+int  _frame_time_dep_terms();
+void _frame_apply_gate(struct quantum_gate_struct,PetscReal,Vec);
+PetscErrorCode _frame_ts_monitor(TS,PetscInt,PetscReal,Vec,void*);
+
+extern int _rotating_frame;
+extern PetscErrorCode (*_ts_monitor)(TS,PetscInt,PetscReal,Vec,void*);
+
+#endif
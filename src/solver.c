@@ -7,22 +7,89 @@
 #include "dm_utilities.h"
 #include "quantum_gates.h"
 #include "error_correction.h"
+#include "matrix_free_p.h"
+#include "expmv_p.h"
+#include "trotter_p.h"
+#include "rotating_frame_p.h"
+#include "symmetry_p.h"
+#include "excitation_basis_p.h"
+#include "solver_p.h"
+#include "kron_pc_p.h"
+#include "checkpoint_p.h"
+#include <petscblaslapack.h>
 #include <stdlib.h>
 #include <stdio.h>
 
 static PetscReal default_rtol     = 1e-11;
 static PetscInt  default_restart  = 100;
 static int       stab_added       = 0;
+static PetscInt  pinned_state     = -1;
 static int       matrix_assembled = 0;
+static Mat       stiff_J;
+static PetscReal stiff_shift;
+static PetscInt  next_output;
+static PetscReal output_time_max;
+static Vec       output_x;
 
 
 PetscErrorCode _RHS_time_dep_ham(TS,PetscReal,Vec,Mat,Mat,void*); // Move to header?
 PetscErrorCode _RHS_time_dep_ham_p(TS,PetscReal,Vec,Mat,Mat,void*); // Move to header?
+PetscErrorCode _IFunction_stiff(TS,PetscReal,Vec,Vec,Vec,void*);
+PetscErrorCode _IJacobian_stiff(TS,PetscReal,Vec,Vec,PetscReal,Mat,Mat,void*);
+static void _build_time_dep_mats(Mat);
+static void _time_step_circuit_segments(TS,Vec,Mat,PetscReal,PetscReal,int);
+static void _time_step_krylov(TS,Vec,Mat,PetscReal,PetscReal,PetscReal,int);
+static void _pin_row(Mat,PetscInt,PetscInt*,PetscInt**,PetscScalar**);
+static void _unpin_row(Mat,PetscInt,PetscInt,PetscInt*,PetscScalar*);
+static PetscInt _steady_state_setup(int,int);
+static void _remove_stabilization();
+static void _corr_rk4(Mat,Mat,Mat,Mat,Mat,PetscReal,PetscReal,PetscInt);
+static void _corr_step(Mat,Mat,Mat,Mat,Mat,Mat,Mat,PetscReal,PetscReal,PetscInt*,PetscReal,int);
+static void _sandwich_mat(Mat*,PetscInt,operator[],PetscInt,operator[]);
+static void _trace_vec(Vec,PetscInt,operator[]);
+static operator _g2_dagger(operator);
+static void _steady_state_ksp(KSP*,Mat);
 
 PetscErrorCode (*_ts_monitor)(TS,PetscInt,PetscReal,Vec,void*) = NULL;
 void          *_tsctx;
+PetscInt       _num_output_times = 0;
+PetscReal      *_output_times    = NULL;
+PetscErrorCode _output_ts_monitor(TS,PetscInt,PetscReal,Vec,void*);
 PetscErrorCode _Normalize_EventFunction(TS,PetscReal,Vec,PetscScalar*,void*);
 PetscErrorCode _Normalize_PostEventFunction(TS,PetscInt,PetscInt[],PetscReal,Vec,void*);
+/*
+ * set_steady_state_pinned tells steady_state to fix the trace of rho by
+ * replacing the equation for the diagonal element rho_{state,state} with
+ * rho_{state,state} = 1, and normalizing the solution afterwards, rather
+ * than by adding the (dense) trace row to row 0 of the matrix. The dense
+ * row couples row 0 to every diagonal element, which becomes a hot spot on
+ * many processors. state should be well populated in the steady state.
+ * This can also be set with the command line option
+ * -steady_state_pinned <state>.
+ *
+ * Inputs:
+ *      PetscInt state: the basis state whose population is pinned
+ */
+void set_steady_state_pinned(PetscInt state){
+  if (state<0){
+    if (nid==0){
+      printf("ERROR! The pinned state must be non-negative!\n");
+      exit(0);
+    }
+  }
+  pinned_state = state;
+  return;
+}
+
+/*
+ * _steady_state_pin gives the pinned state of steady_state,
+ * or -1 if the trace row is used
+ */
+PetscInt _steady_state_pin(){
+  PetscOptionsGetInt(NULL,NULL,"-steady_state_pinned",&pinned_state,NULL);
+  return pinned_state;
+}
+
 /*
  * steady_state solves for the steady_state of the system
  * that was previously setup using the add_to_ham and add_lin
@@ -30,20 +97,313 @@ PetscErrorCode _Normalize_PostEventFunction(TS,PetscInt,PetscInt[],PetscReal,Vec
  * command line options.
  */
 void steady_state(Vec x){
-  PetscViewer    mat_view;
-  PC             pc;
   Vec            b;
   KSP            ksp; /* linear solver context */
-  PetscInt       row,col,its,j,i,Istart,Iend;
-  PetscScalar    mat_tmp;
-  long           dim;
+  PetscInt       row,its,i,pin_ncols=0;
+  PetscInt       *pin_cols=NULL;
+  PetscScalar    mat_tmp,trace,*pin_vals=NULL;
+  PetscLogDouble solve_start,solve_end;
   int            num_pop;
   double         *populations;
   Mat            solve_A;
+  Vec            solve_x,solve_b;
+  int            sector_solve,sector_rows;
+
+  /* The sector matrix is built from the terms, with the pinned row; see _sector_begin */
+  sector_rows = _sector_rowwise(0);
+  row = _steady_state_setup(0,sector_rows);
+  if (row>=0&&!_matrix_free&&!sector_rows){
+    if (nid==0) printf("Pinning the population of state %d...\n",(int)(row/(_basis_dim+1)));
+    _pin_row(full_A,row,&pin_ncols,&pin_cols,&pin_vals);
+  }
+  /*
+   * Create parallel vectors.
+   * - When using VecCreate(), VecSetSizes() and VecSetFromOptions(),
+   * we specify only the vector's global
+   * dimension; the parallel partitioning is determined at runtime.
+   * - Note: We form 1 vector from scratch and then duplicate as needed.
+   */
+  VecDuplicate(x,&b); /* Same layout as x, which need not be PETSc's default */
+
+  //  VecDuplicate(b,&x); Assume x is passed in
+
+  /*
+   * Set rhs, b, and solution, x to 1.0 in the first
+   * element (or the pinned element), 0.0 elsewhere.
+   */
+  VecSet(b,0.0);
+  VecSet(x,0.0);
+
+  if(nid==0) {
+    mat_tmp = 1.0 + 0.0*PETSC_i;
+    VecSetValue(x,PetscMax(row,0),mat_tmp,INSERT_VALUES);
+    VecSetValue(b,PetscMax(row,0),mat_tmp,INSERT_VALUES);
+  }
+
+  /* Assemble x and b */
+  VecAssemblyBegin(x);
+  VecAssemblyEnd(x);
+
+  VecAssemblyBegin(b);
+  VecAssemblyEnd(b);
+
+  /* The steady state is in the zero excitation difference sector */
+  solve_A = full_A;
+  solve_x = x;
+  solve_b = b;
+  sector_solve = 0;
+  if (!_matrix_free) {
+    sector_solve = _sector_begin(x,full_A,1,&solve_x,&solve_A);
+  }
+  if (sector_solve) {
+    VecDuplicate(solve_x,&solve_b);
+    _sector_restrict(b,solve_b);
+  }
+
+    /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -*
+     *           Create the linear solver and set various options         *
+     *- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+  _steady_state_ksp(&ksp,solve_A);
+
+  /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+                      Solve the linear system
+     - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+  if (nid==0) printf("KSP set. Solving for steady state...\n");
+  PetscTime(&solve_start);
+  KSPSolve(ksp,solve_b,solve_x);
+  PetscTime(&solve_end);
+  if (sector_solve) {
+    VecDestroy(&solve_b);
+    _sector_end(x,&solve_x);
+  }
+  if (row>=0){
+    /* Restore the equation of the pinned element, and fix the trace */
+    if (!_matrix_free&&!sector_rows){
+      _unpin_row(full_A,row,pin_ncols,pin_cols,pin_vals);
+    }
+    trace_dm(&trace,x);
+    VecScale(x,1.0/trace);
+  }
+
+  num_pop = get_num_populations();
+  populations = malloc(num_pop*sizeof(double));
+  get_populations(x,&populations);
+  if(nid==0){
+    printf("Final populations: ");
+    for(i=0;i<num_pop;i++){
+      printf(" %e ",populations[i]);
+    }
+    printf("\n");
+  }
+
+  KSPGetIterationNumber(ksp,&its);
+
+  PetscPrintf(PETSC_COMM_WORLD,"Iterations %D\n",its);
+  PetscPrintf(PETSC_COMM_WORLD,"Solve time %f s\n",(double)(solve_end-solve_start));
+
+  /* Free work space */
+  KSPDestroy(&ksp);
+  //  VecDestroy(&x);
+  VecDestroy(&b);
+
+  return;
+}
+
+/*
+ * steady_state_sweep solves for the steady state at each value of a
+ * parameter, such as a pump strength or a detuning. The coefficient
+ * functions of the time dependent terms (add_to_ham_time_dep,
+ * add_to_ham_time_dep_p, add_lin_time_dep_p) are evaluated at the
+ * parameter rather than at a time; the other terms are fixed.
+ *
+ * Between points, only the terms whose coefficient changed are updated
+ * in the matrix, and each solve starts from the previous steady state.
+ * The preconditioner is kept from point to point until a solve takes more
+ * than -sweep_pc_lag_factor (default 2) times the iterations it took
+ * when the preconditioner was last built, or fails to converge.
+ *
+ * Inputs:
+ *      Vec       x:          density matrix; holds the last steady state on return
+ *      PetscInt  num_params: number of parameter values
+ *      PetscReal params[]:   parameter values, in the order to solve them
+ *      monitor:              called as monitor(k,params[k],x,ctx) after each
+ *                            point, or NULL
+ *      void      *ctx:       context for monitor
+ */
+void steady_state_sweep(Vec x,PetscInt num_params,PetscReal params[],
+                        PetscErrorCode (*monitor)(PetscInt,PetscReal,Vec,void*),void *ctx){
+  Vec                b,x_prev;
+  KSP                ksp;
+  Mat                AA;
+  PetscInt           k,i,row,its,pc_its=1;
+  PetscScalar        mat_tmp,coeff,trace=1.0,*coeffs;
+  PetscReal          lag_factor=2.0;
+  PetscLogDouble     solve_start,solve_end;
+  KSPConvergedReason reason;
+  int                changed,rebuild_pc,rebuilt;
+
+  PetscOptionsGetReal(NULL,NULL,"-sweep_pc_lag_factor",&lag_factor,NULL);
+  if (num_params<1){
+    if (nid==0){
+      printf("ERROR! steady_state_sweep needs at least one parameter value!\n");
+      exit(0);
+    }
+  }
+  if (_num_time_dep+_num_time_dep_lin==0){
+    if (nid==0){
+      printf("Warning! No time dependent terms to sweep. Every point has the same steady state.\n");
+    }
+  }
+  for (i=0;i<_num_time_dep;i++){
+    if (_time_dep_list[i].omega!=0){
+      if (nid==0){
+        printf("ERROR! Time dependent terms in the rotating frame cannot be swept!\n");
+        exit(0);
+      }
+    }
+  }
+
+  row = _steady_state_setup(1,0);
+  if (_matrix_free){
+    AA = full_A;
+  } else {
+    /* One matrix per swept term, on the pattern of full_A; see _build_time_dep_mats */
+    _build_time_dep_mats(full_A);
+    MatDuplicate(full_A,MAT_COPY_VALUES,&AA);
+    if (row>=0){
+      _pin_row(AA,row,NULL,NULL,NULL);
+    }
+  }
+  /* Coefficients of the swept terms currently in AA */
+  coeffs = calloc(_num_time_dep+_num_time_dep_lin+1,sizeof(PetscScalar));
+
+  VecDuplicate(x,&b);
+  VecDuplicate(x,&x_prev);
+  VecSet(b,0.0);
+  VecSet(x,0.0);
+  if(nid==0) {
+    mat_tmp = 1.0 + 0.0*PETSC_i;
+    VecSetValue(x,PetscMax(row,0),mat_tmp,INSERT_VALUES);
+    VecSetValue(b,PetscMax(row,0),mat_tmp,INSERT_VALUES);
+  }
+  VecAssemblyBegin(x);
+  VecAssemblyEnd(x);
+  VecAssemblyBegin(b);
+  VecAssemblyEnd(b);
+
+  _steady_state_ksp(&ksp,AA);
+  /* Warm start from the previous point */
+  KSPSetInitialGuessNonzero(ksp,PETSC_TRUE);
+
+  rebuild_pc = 1;
+  for (k=0;k<num_params;k++){
+    if (_matrix_free){
+      _RHS_time_dep_mf(NULL,params[k],NULL,NULL,NULL,NULL);
+      /* So that the Jacobi preconditioner sees the new coefficients */
+      PetscObjectStateIncrease((PetscObject)AA);
+    } else {
+      changed = 0;
+      for (i=0;i<_num_time_dep;i++){
+        coeff = _time_dep_coeff(&_time_dep_list[i],params[k]);
+        if (coeff!=coeffs[i]){
+          MatAXPY(AA,coeff-coeffs[i],_time_dep_list[i].mat,SAME_NONZERO_PATTERN);
+          coeffs[i] = coeff;
+          changed   = 1;
+        }
+      }
+      for (i=0;i<_num_time_dep_lin;i++){
+        coeff = _time_dep_coeff(&_time_dep_list_lin[i],params[k]);
+        if (coeff!=coeffs[_num_time_dep+i]){
+          MatAXPY(AA,coeff-coeffs[_num_time_dep+i],_time_dep_list_lin[i].mat,SAME_NONZERO_PATTERN);
+          coeffs[_num_time_dep+i] = coeff;
+          changed = 1;
+        }
+      }
+      if (changed&&row>=0){
+        /* The update also went into the pinned row */
+        _pin_row(AA,row,NULL,NULL,NULL);
+      }
+    }
+
+    /* The pinned solve is in units of rho_{pin,pin}; undo the last normalization */
+    if (row>=0&&k>0){
+      VecScale(x,trace);
+    }
+    VecCopy(x,x_prev);
+
+    rebuilt = rebuild_pc;
+    KSPSetReusePreconditioner(ksp,rebuild_pc?PETSC_FALSE:PETSC_TRUE);
+    PetscTime(&solve_start);
+    KSPSolve(ksp,b,x);
+    KSPGetConvergedReason(ksp,&reason);
+    if (reason<0&&!rebuild_pc){
+      /* The lagged preconditioner is too far off; build a new one and try again */
+      VecCopy(x_prev,x);
+      KSPSetReusePreconditioner(ksp,PETSC_FALSE);
+      KSPSolve(ksp,b,x);
+      rebuilt = 1;
+    }
+    PetscTime(&solve_end);
+    KSPGetIterationNumber(ksp,&its);
+
+    if (rebuilt){
+      pc_its     = PetscMax(its,1);
+      rebuild_pc = 0;
+    } else if (its>lag_factor*pc_its){
+      rebuild_pc = 1;
+    }
+
+    if (row>=0){
+      trace_dm(&trace,x);
+      VecScale(x,1.0/trace);
+    }
+
+    PetscPrintf(PETSC_COMM_WORLD,"Sweep point %D: parameter %e iterations %D solve time %f s%s\n",
+                k,(double)params[k],its,(double)(solve_end-solve_start),rebuilt?" (new preconditioner)":"");
+    if (monitor!=NULL){
+      monitor(k,params[k],x,ctx);
+    }
+  }
+
+  free(coeffs);
+  KSPDestroy(&ksp);
+  VecDestroy(&b);
+  VecDestroy(&x_prev);
+  if (!_matrix_free){
+    MatDestroy(&AA);
+  }
+  return;
+}
+
+/*
+ * _steady_state_setup inserts the terms into full_A, adds the trace row
+ * (or sets up the pinned equation, for the matrix-free solver), and
+ * assembles full_A.
+ *
+ * Inputs:
+ *      int sweep:       1 to also add the structure of the time dependent terms
+ *      int sector_rows: 1 if _sector_begin builds the matrix; full_A is untouched
+ * Outputs:
+ *      returns the row of the pinned equation, or -1 if the trace row is used
+ */
+static PetscInt _steady_state_setup(int sweep,int sector_rows){
+  PetscViewer mat_view;
+  PetscInt    row,col,i,j,Istart,Iend,pin;
+  PetscScalar mat_tmp;
+
+  /* Insert the recorded terms into the (exactly preallocated) full_A */
+  if (!sector_rows) {
+    _build_A();
+  }
+  if (_frame_time_dep_terms()>0){
+    if (nid==0){
+      printf("ERROR! %d terms rotate in the rotating frame, so there is no steady state in it!\n",_frame_time_dep_terms());
+      printf("       Choose a frame in which the Hamiltonian is constant, or drop them with set_rotating_frame_rwa.\n");
+      exit(0);
+    }
+  }
 
   if (_lindblad_terms) {
-    dim = total_levels*total_levels;
-    solve_A = full_A;
     if (nid==0) {
       printf("Lindblad terms found, using Lindblad solver.");
     }
@@ -53,10 +413,27 @@ void steady_state(Vec x){
       printf("         Defaulting to (less efficient) Lindblad Solver\n");
       exit(0);
     }
-    dim = total_levels*total_levels;
-    solve_A = ham_A;
   }
-  if (!stab_added){
+  pin = _steady_state_pin();
+  if (pin>=_basis_dim){
+    if (nid==0){
+      printf("ERROR! The pinned state must be less than the number of basis states!\n");
+      exit(0);
+    }
+  }
+  /* Row of the pinned equation, rho_{pin,pin} = 1 */
+  row = pin*(_basis_dim+1);
+  if (sector_rows) return row;
+
+  if (_matrix_free){
+    /* The stabilization is applied inside the MatShell; see _mf_mult */
+    _mf_assemble();
+    if (pin<0){
+      _mf_set_stabilization(1,0);
+    } else {
+      _mf_set_stabilization(2,row);
+    }
+  } else if (pin<0&&!stab_added){
     if (nid==0) printf("Adding stabilization...\n");
     /*
      * Add elements to the matrix to make the normalization work
@@ -64,39 +441,36 @@ void steady_state(Vec x){
      * We add 1.0 in the 0th spot and every n+1 after
      */
     if (nid==0) {
-      row = 0;
-      for (i=0;i<total_levels;i++){
-        col = i*(total_levels+1);
+      for (i=0;i<_basis_dim;i++){
+        col = i*(_basis_dim+1);
         mat_tmp = 1.0 + 0.*PETSC_i;
-        MatSetValue(full_A,row,col,mat_tmp,ADD_VALUES);
+        MatSetValue(full_A,0,col,mat_tmp,ADD_VALUES);
       }
+    }
+    stab_added = 1;
+  }
 
-      /* Print dense ham, if it was asked for */
-      if (_print_dense_ham){
-        FILE *fp_ham;
-
-        fp_ham = fopen("ham","w");
+  /* Print dense ham, if it was asked for */
+  if (!_matrix_free&&nid==0&&_print_dense_ham){
+    FILE *fp_ham;
 
-        if (nid==0){
-          for (i=0;i<total_levels;i++){
-            for (j=0;j<total_levels;j++){
-              fprintf(fp_ham,"%e %e ",PetscRealPart(_hamiltonian[i][j]),PetscImaginaryPart(_hamiltonian[i][j]));
-            }
-            fprintf(fp_ham,"\n");
-          }
-        }
-        fclose(fp_ham);
-        for (i=0;i<total_levels;i++){
-          free(_hamiltonian[i]);
-        }
-        free(_hamiltonian);
-        _print_dense_ham = 0;
+    fp_ham = fopen("ham","w");
+    for (i=0;i<total_levels;i++){
+      for (j=0;j<total_levels;j++){
+        fprintf(fp_ham,"%e %e ",PetscRealPart(_hamiltonian[i][j]),PetscImaginaryPart(_hamiltonian[i][j]));
       }
+      fprintf(fp_ham,"\n");
     }
-    stab_added = 1;
+    fclose(fp_ham);
+    for (i=0;i<total_levels;i++){
+      free(_hamiltonian[i]);
+    }
+    free(_hamiltonian);
+    _print_dense_ham = 0;
   }
 
   //  if (!matrix_assembled) {
+  if (!_matrix_free) {
     MatGetOwnershipRange(full_A,&Istart,&Iend);
     /*
      * Explicitly add 0.0 to all diagonal elements;
@@ -109,6 +483,15 @@ void steady_state(Vec x){
       MatSetValue(full_A,i,i,mat_tmp,ADD_VALUES);
     }
 
+    if (sweep){
+      /* The swept terms go on top of full_A; see steady_state_sweep */
+      for (i=0;i<_num_time_dep;i++){
+        _add_ops_to_mat_ham(0.0,full_A,_time_dep_list[i].num_ops,_time_dep_list[i].ops);
+      }
+      for (i=0;i<_num_time_dep_lin;i++){
+        _add_ops_to_mat_lin(0.0,full_A,_time_dep_list_lin[i].num_ops,_time_dep_list_lin[i].ops);
+      }
+    }
 
     /* Tell PETSc to assemble the matrix */
     MatAssemblyBegin(full_A,MAT_FINAL_ASSEMBLY);
@@ -116,49 +499,25 @@ void steady_state(Vec x){
     if (nid==0) printf("Matrix Assembled.\n");
     matrix_assembled = 1;
     //  }
+  }
   /* Print information about the matrix. */
   PetscViewerASCIIOpen(PETSC_COMM_WORLD,NULL,&mat_view);
   PetscViewerPushFormat(mat_view,PETSC_VIEWER_ASCII_INFO);
   MatView(full_A,mat_view);
   PetscViewerPopFormat(mat_view);
   PetscViewerDestroy(&mat_view);
-  /*
-   * Create parallel vectors.
-   * - When using VecCreate(), VecSetSizes() and VecSetFromOptions(),
-   * we specify only the vector's global
-   * dimension; the parallel partitioning is determined at runtime.
-   * - Note: We form 1 vector from scratch and then duplicate as needed.
-   */
-  VecCreate(PETSC_COMM_WORLD,&b);
-  VecSetSizes(b,PETSC_DECIDE,dim);
-  VecSetFromOptions(b);
-
-  //  VecDuplicate(b,&x); Assume x is passed in
-
-  /*
-   * Set rhs, b, and solution, x to 1.0 in the first
-   * element, 0.0 elsewhere.
-   */
-  VecSet(b,0.0);
-  VecSet(x,0.0);
-
-  if(nid==0) {
-    row = 0;
-    mat_tmp = 1.0 + 0.0*PETSC_i;
-    VecSetValue(x,row,mat_tmp,INSERT_VALUES);
-    VecSetValue(b,row,mat_tmp,INSERT_VALUES);
-  }
-
-  /* Assemble x and b */
-  VecAssemblyBegin(x);
-  VecAssemblyEnd(x);
-
-  VecAssemblyBegin(b);
-  VecAssemblyEnd(b);
+  if (pin<0) return -1;
+  return row;
+}
 
-    /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -*
-     *           Create the linear solver and set various options         *
-     *- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+/*
+ * _steady_state_ksp creates the linear solver of steady_state for A,
+ * with GMRES and ASM (Jacobi for the matrix-free solver, or the Kronecker
+ * preconditioner if asked for) as defaults
+ */
+static void _steady_state_ksp(KSP *ksp_out,Mat A){
+  KSP ksp;
+  PC  pc;
 
   /*
    * Create linear solver context
@@ -169,7 +528,7 @@ void steady_state(Vec x){
    * Set operators. Here the matrix that defines the linear system
    * also serves as the preconditioning matrix.
    */
-  KSPSetOperators(ksp,full_A,full_A);
+  KSPSetOperators(ksp,A,A);
 
   /*
    * Set good default options for solver
@@ -179,7 +538,14 @@ void steady_state(Vec x){
 
   /* bjacobi preconditioner */
   KSPGetPC(ksp,&pc);
-  PCSetType(pc,PCASM);
+  if (_matrix_free){
+    /* ASM needs the assembled matrix; the shell only provides its diagonal */
+    PCSetType(pc,PCJACOBI);
+  } else {
+    PCSetType(pc,PCASM);
+  }
+  /* Replaces the default, if it was asked for; see kron_pc.c */
+  _kron_pc_setup(pc,A);
 
   /* gmres solver with 100 restart*/
   KSPSetType(ksp,KSPGMRES);
@@ -190,32 +556,7 @@ void steady_state(Vec x){
    */
   KSPSetFromOptions(ksp);
 
-  /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-                      Solve the linear system
-     - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
-  if (nid==0) printf("KSP set. Solving for steady state...\n");
-  KSPSolve(ksp,b,x);
-
-  num_pop = get_num_populations();
-  populations = malloc(num_pop*sizeof(double));
-  get_populations(x,&populations);
-  if(nid==0){
-    printf("Final populations: ");
-    for(i=0;i<num_pop;i++){
-      printf(" %e ",populations[i]);
-    }
-    printf("\n");
-  }
-
-  KSPGetIterationNumber(ksp,&its);
-
-  PetscPrintf(PETSC_COMM_WORLD,"Iterations %D\n",its);
-
-  /* Free work space */
-  KSPDestroy(&ksp);
-  //  VecDestroy(&x);
-  VecDestroy(&b);
-
+  *ksp_out = ksp;
   return;
 }
 
@@ -235,28 +576,73 @@ void steady_state(Vec x){
 void time_step(Vec x, PetscReal init_time, PetscReal time_max,PetscReal dt,PetscInt steps_max){
   PetscViewer    mat_view;
   TS             ts; /* timestepping context */
-  PetscInt       i,j,Istart,Iend,steps,row,col;
+  PetscInt       i,j,Istart,Iend,steps;
   PetscScalar    mat_tmp;
   PetscReal      tmp_real;
   Mat            AA;
   PetscInt       nevents,direction;
   PetscBool      terminate;
   operator       op;
-  int            num_pop;
+  int            num_pop,mf_solve;
   double         *populations;
   Mat            solve_A,solve_stiff_A;
+  PetscBool      segments_flag,krylov_flag,trotter_flag;
+  int            krylov_solve,sector_solve,sector_rows;
+  Vec            solve_x;
+
+  /* The Trotter propagator works from the recorded terms; no matrix is built */
+  PetscOptionsHasName(NULL,NULL,"-trotter",&trotter_flag);
+  if (trotter_flag) {
+    _trotter = 1;
+  }
+  /* Move the model and x into the rotating frame, if one was set */
+  _apply_rotating_frame();
+  if (_rotating_frame) {
+    _frame_begin(x,init_time,!_restart_in_frame());
+  }
+  if (_trotter&&_trotter_supported()) {
+    _restart_apply(NULL);
+    PetscLogStagePop();
+    PetscLogStagePush(solve_stage);
+    tmp_real = _trotter_time_step(x,init_time,time_max,dt,steps_max);
+    if (_rotating_frame) {
+      _frame_end(x,tmp_real);
+    }
+    PetscLogStagePop();
+    PetscLogStagePush(post_solve_stage);
+    return;
+  }
 
+  /*
+   * Insert the recorded terms into the (exactly preallocated) full_A and
+   * ham_A, unless only the symmetry sectors are built; see _sector_begin
+   */
+  sector_rows = _sector_rowwise(!_lindblad_terms);
+  if (!sector_rows) {
+    _build_A();
+  }
 
   PetscLogStagePop();
   PetscLogStagePush(solve_stage);
+  PetscOptionsHasName(NULL,NULL,"-circuit_segments",&segments_flag);
+  if (segments_flag) {
+    _circuit_segments = 1;
+  }
+  PetscOptionsHasName(NULL,NULL,"-krylov_expmv",&krylov_flag);
+  if (krylov_flag) {
+    _krylov_expmv = 1;
+  }
+  PetscOptionsGetInt(NULL,NULL,"-krylov_dim",&_krylov_dim,NULL);
+  PetscOptionsGetReal(NULL,NULL,"-krylov_tol",&_krylov_tol,NULL);
   if (_lindblad_terms) {
     if (nid==0) {
       printf("Lindblad terms found, using Lindblad solver.\n");
     }
     solve_A = full_A;
-    if (_stiff_solver) {
-      if(nid==0) printf("ERROR! Lindblad-stiff solver untested.");
-      exit(0);
+    solve_stiff_A = full_stiff_A;
+    if (_matrix_free) {
+      _mf_assemble();
+      _mf_set_stabilization(0,0);
     }
   } else {
     if (nid==0) {
@@ -264,9 +650,17 @@ void time_step(Vec x, PetscReal init_time, PetscReal time_max,PetscReal dt,Petsc
     }
     solve_A = ham_A;
     solve_stiff_A = ham_stiff_A;
-    if (_num_time_dep&&_stiff_solver) {
-      if(nid==0) printf("ERROR! Schrodinger-stiff + timedep solver untested.");
-      exit(0);
+    /*
+     * The implicit step of the IMEX TS damps (or, for an A-stable but
+     * not L-stable tableau, distorts) the fast phase of psi itself, so
+     * psi loses its norm at the steps that the stiff terms are for
+     */
+    if (_stiff_solver){
+      if (nid==0){
+        printf("ERROR! Stiff terms are not supported in the Schrodinger solver!\n");
+        printf("       Add them with add_to_ham and remove the fast frequency with add_to_rotating_frame instead.\n");
+        exit(0);
+      }
     }
   }
 
@@ -295,21 +689,11 @@ void time_step(Vec x, PetscReal init_time, PetscReal time_max,PetscReal dt,Petsc
   }
 
 
+  /* The matrix-free full_A is a MatShell; it cannot have values set */
+  mf_solve = _matrix_free&&_lindblad_terms;
+
   /* Remove stabilization if it was previously added */
-  if (stab_added){
-    if (nid==0) printf("Removing stabilization...\n");
-    /*
-     * We add 1.0 in the 0th spot and every n+1 after
-     */
-    if (nid==0) {
-      row = 0;
-      for (i=0;i<total_levels;i++){
-        col = i*(total_levels+1);
-        mat_tmp = -1.0 + 0.*PETSC_i;
-        MatSetValue(full_A,row,col,mat_tmp,ADD_VALUES);
-      }
-    }
-  }
+  _remove_stabilization();
 
   MatGetOwnershipRange(solve_A,&Istart,&Iend);
   /*
@@ -318,7 +702,7 @@ void time_step(Vec x, PetscReal init_time, PetscReal time_max,PetscReal dt,Petsc
    * gives if the diagonal was never initialized.
    */
   //if (nid==0) printf("Adding 0 to diagonal elements...\n");
-  for (i=Istart;i<Iend;i++){
+  for (i=Istart;i<Iend&&!mf_solve&&!sector_rows;i++){
     mat_tmp = 0 + 0.*PETSC_i;
     MatSetValue(solve_A,i,i,mat_tmp,ADD_VALUES);
   }
@@ -328,9 +712,14 @@ void time_step(Vec x, PetscReal init_time, PetscReal time_max,PetscReal dt,Petsc
       mat_tmp = 0 + 0.*PETSC_i;
       MatSetValue(solve_stiff_A,i,i,mat_tmp,ADD_VALUES);
     }
-
+    MatAssemblyBegin(solve_stiff_A,MAT_FINAL_ASSEMBLY);
+    MatAssemblyEnd(solve_stiff_A,MAT_FINAL_ASSEMBLY);
   }
 
+  /* Only integrate the symmetry sectors that x occupies, if asked for */
+  solve_x = x;
+  sector_solve = _sector_begin(x,solve_A,0,&solve_x,&solve_A);
+
   /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -*
    *       Create the timestepping solver and set various options       *
    *- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
@@ -345,7 +734,13 @@ void time_step(Vec x, PetscReal init_time, PetscReal time_max,PetscReal dt,Petsc
   /*
    * Set function to get information at every timestep
    */
-  if (_ts_monitor!=NULL){
+  if (_ts_monitor!=NULL&&_num_output_times>0){
+    /* Only at the output times, interpolated; see set_output_times */
+    next_output     = _first_output_index(init_time);
+    output_time_max = time_max;
+    VecDuplicate(solve_x,&output_x);
+    TSMonitorSet(ts,_output_ts_monitor,NULL,NULL);
+  } else if (_ts_monitor!=NULL){
     TSMonitorSet(ts,_ts_monitor,_tsctx,NULL);
   }
   /*
@@ -355,19 +750,34 @@ void time_step(Vec x, PetscReal init_time, PetscReal time_max,PetscReal dt,Petsc
   TSSetRHSFunction(ts,NULL,TSComputeRHSFunctionLinear,NULL);
 
   if(_stiff_solver) {
-    /* TSSetIFunction(ts,NULL,TSComputeRHSFunctionLinear,NULL); */
-    if (nid==0) {
-      printf("Stiff solver not implemented!\n");
-      exit(0);
-    }
-    if(nid==0) printf("Using stiff solver - TSROSW\n");
+    /*
+     * IMEX: the stiff terms are the implicit part, F = udot - S u,
+     * and everything else stays in the explicit RHS below
+     */
+    MatDuplicate(solve_stiff_A,MAT_COPY_VALUES,&stiff_J);
+    stiff_shift = -1.0;
+    TSSetIFunction(ts,NULL,_IFunction_stiff,solve_stiff_A);
+    TSSetIJacobian(ts,stiff_J,stiff_J,_IJacobian_stiff,solve_stiff_A);
+    if(nid==0) printf("Using stiff solver - TSARKIMEX\n");
   }
 
-  if(_num_time_dep+_num_time_dep_lin) {
+  if(mf_solve) {
+    /* Time dependent terms only update coefficients; see _RHS_time_dep_mf */
+    if (_num_time_dep+_num_time_dep_lin) {
+      TSSetRHSJacobian(ts,solve_A,solve_A,_RHS_time_dep_mf,NULL);
+    } else {
+      TSSetRHSJacobian(ts,solve_A,solve_A,TSComputeRHSJacobianConstant,NULL);
+    }
+  } else if(_num_time_dep+_num_time_dep_lin) {
 
     for(i=0;i<_num_time_dep;i++){
       tmp_real = 0.0;
-      _add_ops_to_mat_ham(tmp_real,solve_A,_time_dep_list[i].num_ops,_time_dep_list[i].ops);
+      if (solve_A==ham_A) {
+        /* Schrodinger solver: ham_A is total_levels x total_levels */
+        _add_ops_to_mat_ham_psi(tmp_real,solve_A,_time_dep_list[i].num_ops,_time_dep_list[i].ops);
+      } else {
+        _add_ops_to_mat_ham(tmp_real,solve_A,_time_dep_list[i].num_ops,_time_dep_list[i].ops);
+      }
     }
 
     for(i=0;i<_num_time_dep_lin;i++){
@@ -380,24 +790,22 @@ void time_step(Vec x, PetscReal init_time, PetscReal time_max,PetscReal dt,Petsc
     MatAssemblyEnd(solve_A,MAT_FINAL_ASSEMBLY);
     if (nid==0) printf("Matrix Assembled.\n");
 
+    /*
+     * solve_A now holds the union of the nonzero patterns of all terms.
+     * Build the superoperator of each time dependent term once, on that same
+     * pattern, so that the RHS is just solve_A + sum_k f_k(t) L_k
+     */
+    _build_time_dep_mats(solve_A);
+
     MatDuplicate(solve_A,MAT_COPY_VALUES,&AA);
     MatAssemblyBegin(AA,MAT_FINAL_ASSEMBLY);
     MatAssemblyEnd(AA,MAT_FINAL_ASSEMBLY);
 
-    TSSetRHSJacobian(ts,AA,AA,_RHS_time_dep_ham_p,NULL);
+    TSSetRHSJacobian(ts,AA,AA,_RHS_time_dep_ham_p,solve_A);
   } else {
     /* Tell PETSc to assemble the matrix */
     MatAssemblyBegin(solve_A,MAT_FINAL_ASSEMBLY);
     MatAssemblyEnd(solve_A,MAT_FINAL_ASSEMBLY);
-    if (_stiff_solver){
-      MatAssemblyBegin(solve_stiff_A,MAT_FINAL_ASSEMBLY);
-      MatAssemblyEnd(solve_stiff_A,MAT_FINAL_ASSEMBLY);
-      /* TSSetIJacobian(ts,solve_stiff_A,solve_stiff_A,TSComputeRHSJacobianConstant,NULL); */
-      if (nid==0) {
-        printf("Stiff solver not implemented!\n");
-        exit(0);
-      }
-    }
     if (nid==0) printf("Matrix Assembled.\n");
     TSSetRHSJacobian(ts,solve_A,solve_A,TSComputeRHSJacobianConstant,NULL);
   }
@@ -438,9 +846,12 @@ void time_step(Vec x, PetscReal init_time, PetscReal time_max,PetscReal dt,Petsc
   TSSetMaxSteps(ts,steps_max);
   TSSetMaxTime(ts,time_max);
   TSSetTime(ts,init_time);
+  /* Continue the step count of a restarted run; see checkpoint.c */
+  _restart_apply(ts);
   TSSetExactFinalTime(ts,TS_EXACTFINALTIME_STEPOVER);
   if (_stiff_solver) {
-    TSSetType(ts,TSROSW);
+    TSSetType(ts,TSARKIMEX);
+    TSARKIMEXSetType(ts,TSARKIMEX3);
   } else {
     TSSetType(ts,TSRK);
     TSRKSetType(ts,TSRK3BS);
@@ -457,7 +868,7 @@ void time_step(Vec x, PetscReal init_time, PetscReal time_max,PetscReal dt,Petsc
     TSSetEventHandler(ts,nevents,&direction,&terminate,_QG_EventFunction,_QG_PostEventFunction,NULL);
   }
 
-  if (_num_circuits > 0) {
+  if (_num_circuits > 0 && !_circuit_segments) {
     nevents   =  1; //Only one event for now (did we cross a gate?)
     direction = -1; //We only want to count an event if we go from positive to negative
     terminate = PETSC_FALSE; //Keep time stepping after we passed our event
@@ -484,8 +895,36 @@ void time_step(Vec x, PetscReal init_time, PetscReal time_max,PetscReal dt,Petsc
   /*   TSSetEventHandler(ts,nevents,&direction,&terminate,_Normalize_EventFunction,_Normalize_PostEventFunction,NULL); */
   /* } */
   TSSetFromOptions(ts);
-  TSSolve(ts,x);
+
+  /* The Krylov propagator needs A to be constant between gates */
+  krylov_solve = _krylov_expmv;
+  if (_krylov_expmv&&(_num_time_dep+_num_time_dep_lin||_stiff_solver||_num_quantum_gates>0||_discrete_ec)) {
+    if (nid==0) printf("Warning! Krylov expmv only supports constant systems and circuits. Using the TS.\n");
+    krylov_solve = 0;
+  }
+
+  _checkpoint_begin(ts,x,solve_x,sector_solve,init_time,krylov_solve);
+  if (krylov_solve) {
+    _time_step_krylov(ts,solve_x,solve_A,init_time,time_max,dt,mf_solve);
+  } else if (_num_circuits > 0 && _circuit_segments) {
+    _time_step_circuit_segments(ts,x,solve_A,init_time,time_max,mf_solve);
+  } else {
+    TSSolve(ts,solve_x);
+  }
   TSGetStepNumber(ts,&steps);
+  _checkpoint_end(ts,solve_x);
+  if (sector_solve) {
+    _sector_end(x,&solve_x);
+  }
+  if (_rotating_frame) {
+    /* Back to the lab frame, at the time the solve stopped */
+    if (krylov_solve) {
+      tmp_real = time_max;
+    } else {
+      TSGetTime(ts,&tmp_real);
+    }
+    _frame_end(x,tmp_real);
+  }
 
   num_pop = get_num_populations();
   populations = malloc(num_pop*sizeof(double));
@@ -502,9 +941,15 @@ void time_step(Vec x, PetscReal init_time, PetscReal time_max,PetscReal dt,Petsc
 
   /* Free work space */
   TSDestroy(&ts);
-  if(_num_time_dep+_num_time_dep_lin){
+  if (_ts_monitor!=NULL&&_num_output_times>0){
+    VecDestroy(&output_x);
+  }
+  if(_num_time_dep+_num_time_dep_lin&&!mf_solve){
     MatDestroy(&AA);
   }
+  if(_stiff_solver){
+    MatDestroy(&stiff_J);
+  }
   free(populations);
   PetscLogStagePop();
   PetscLogStagePush(post_solve_stage);
@@ -513,6 +958,107 @@ void time_step(Vec x, PetscReal init_time, PetscReal time_max,PetscReal dt,Petsc
 }
 
 
+/*
+ * _time_step_circuit_segments integrates x from init_time to time_max,
+ * stopping at exactly each gate time to apply the circuit gates there.
+ * Since the gate times are known in advance, this avoids evaluating the
+ * gate event function at every step and the root finding needed to
+ * locate each gate. If there is nothing to integrate between gates
+ * (no Hamiltonian or Lindblad terms and no ts_monitor), the TS is
+ * skipped entirely and the gates are applied back to back. Gates added
+ * with add_gate and discrete error correction still need the TS events,
+ * so the TS is always run if either is present.
+ */
+static void _time_step_circuit_segments(TS ts,Vec x,Mat solve_A,PetscReal init_time,
+                                        PetscReal time_max,int mf_solve){
+  PetscReal t,next_time,norm;
+  PetscInt  num_segments=0,num_gate_times=0;
+  int       free_evolution;
+
+  if (mf_solve||_num_time_dep+_num_time_dep_lin||_ts_monitor!=NULL
+      ||_num_quantum_gates>0||_discrete_ec) {
+    /* add_gate gates and error correction are applied by TS events */
+    free_evolution = 1;
+  } else {
+    MatNorm(solve_A,NORM_FROBENIUS,&norm);
+    free_evolution = (norm!=0.0);
+  }
+
+  /* Each segment has to end exactly on the gate time */
+  TSSetExactFinalTime(ts,TS_EXACTFINALTIME_MATCHSTEP);
+
+  t = init_time;
+  next_time = _QC_next_gate_time();
+  while (next_time>=0 && next_time<=time_max) {
+    if (next_time>t) {
+      if (free_evolution) {
+        TSSetMaxTime(ts,next_time);
+        TSSolve(ts,x);
+        num_segments = num_segments + 1;
+      } else {
+        TSSetTime(ts,next_time);
+      }
+      t = next_time;
+    }
+    _QC_apply_gates_at_time(x);
+    num_gate_times = num_gate_times + 1;
+    next_time = _QC_next_gate_time();
+  }
+
+  /* Evolve past the last gate */
+  if (time_max>t) {
+    if (free_evolution) {
+      TSSetMaxTime(ts,time_max);
+      TSSolve(ts,x);
+      num_segments = num_segments + 1;
+    } else {
+      TSSetTime(ts,time_max);
+    }
+  }
+
+  if (nid==0) printf("Circuit scheduler: %d gate times, %d integrated segments\n",(int)num_gate_times,(int)num_segments);
+
+  return;
+}
+
+/*
+ * _time_step_krylov propagates x from init_time to time_max with the
+ * Krylov expmv propagator (see expmv.c), applying the circuit gates at
+ * their times, between which solve_A is constant. The ts_monitor is
+ * called at init_time and every dt after it (or at the times given to
+ * set_output_times); the step sizes themselves are chosen by the
+ * propagator, so steps_max is not used.
+ */
+static void _time_step_krylov(TS ts,Vec x,Mat solve_A,PetscReal init_time,
+                              PetscReal time_max,PetscReal dt,int mf_solve){
+  PetscReal t,next_time;
+
+  _expmv_setup(solve_A,x,mf_solve,init_time,dt);
+  /* With an output schedule, the propagator also handles init_time */
+  if (_ts_monitor!=NULL&&_num_output_times==0) {
+    _ts_monitor(ts,0,init_time,x,_tsctx);
+  }
+
+  t = init_time;
+  if (_num_circuits > 0) {
+    next_time = _QC_next_gate_time();
+    while (next_time>=0 && next_time<=time_max) {
+      if (next_time>t) {
+        _expmv_propagate(solve_A,x,t,next_time,ts);
+        t = next_time;
+      }
+      _QC_apply_gates_at_time(x);
+      next_time = _QC_next_gate_time();
+    }
+  }
+  if (time_max>t) {
+    _expmv_propagate(solve_A,x,t,time_max,ts);
+  }
+  _expmv_finish();
+
+  return;
+}
+
 /*
  *
  * set_ts_monitor accepts a user function which can calculate observables, print output, etc
@@ -541,6 +1087,135 @@ void set_ts_monitor_ctx(PetscErrorCode (*monitor)(TS,PetscInt,PetscReal,Vec,void
   _tsctx = tsctx;
 }
 
+/*
+ * set_output_times makes time_step call the ts_monitor only at the given
+ * times, rather than at every step. The state at each output time is
+ * interpolated from the step that contains it (TSInterpolate, the dense
+ * output of the Runge-Kutta scheme), so the adaptive integrator can take
+ * steps as large as its error control allows, and dt only sets the first
+ * step. The step number passed to the ts_monitor is the index of the
+ * output time. Times outside of [init_time,time_max] of a time_step call
+ * are skipped. The Krylov propagator evaluates the output times exactly
+ * and the Trotter propagator shortens its steps to land on them.
+ * The -ts_type must support interpolation (the default does).
+ *
+ * Inputs:
+ *      PetscInt  num_times: number of output times; 0 goes back to every step
+ *      PetscReal times[]:   the output times (copied, and sorted)
+ */
+void set_output_times(PetscInt num_times,PetscReal times[]){
+  PetscInt i;
+
+  free(_output_times);
+  _output_times     = NULL;
+  _num_output_times = num_times;
+  if (num_times<=0){
+    _num_output_times = 0;
+    return;
+  }
+  _output_times = malloc(num_times*sizeof(PetscReal));
+  for (i=0;i<num_times;i++){
+    _output_times[i] = times[i];
+  }
+  PetscSortReal(num_times,_output_times);
+  return;
+}
+
+/*
+ * set_output_grid is set_output_times for the num_times evenly spaced
+ * times t_start, t_start + dt_out, ...
+ *
+ * Inputs:
+ *      PetscReal t_start:   first output time
+ *      PetscReal dt_out:    time between outputs
+ *      PetscInt  num_times: number of output times
+ */
+void set_output_grid(PetscReal t_start,PetscReal dt_out,PetscInt num_times){
+  PetscInt  i;
+  PetscReal *times;
+
+  if (num_times<=0){
+    set_output_times(0,NULL);
+    return;
+  }
+  times = malloc(num_times*sizeof(PetscReal));
+  for (i=0;i<num_times;i++){
+    times[i] = t_start + i*dt_out;
+  }
+  set_output_times(num_times,times);
+  free(times);
+  return;
+}
+
+/*
+ * _first_output_index gives the index of the first output time at or
+ * after t (or _num_output_times, if there is none)
+ */
+PetscInt _first_output_index(PetscReal t){
+  PetscInt  k;
+  PetscReal eps;
+
+  eps = PETSC_SMALL*PetscMax(1.0,PetscAbsReal(t));
+  for (k=0;k<_num_output_times;k++){
+    if (_output_times[k]>=t-eps) break;
+  }
+  return k;
+}
+
+/*
+ * _output_ts_monitor is the TS monitor when there is an output schedule.
+ * It calls the ts_monitor for each output time inside the step that was
+ * just taken, with rho interpolated to that time.
+ */
+PetscErrorCode _output_ts_monitor(TS ts,PetscInt step,PetscReal time,Vec x,void *ctx){
+  PetscReal t_out,eps;
+
+  eps = PETSC_SMALL*PetscMax(1.0,PetscAbsReal(time));
+  while (next_output<_num_output_times){
+    t_out = _output_times[next_output];
+    if (t_out>time+eps||t_out>output_time_max+eps) break;
+    if (PetscAbsReal(t_out-time)<=eps){
+      _ts_monitor(ts,next_output,t_out,x,_tsctx);
+    } else if (step>0){
+      /* There is no step to interpolate in before the first one */
+      TSInterpolate(ts,t_out,output_x);
+      _ts_monitor(ts,next_output,t_out,output_x,_tsctx);
+    }
+    next_output = next_output + 1;
+  }
+  PetscFunctionReturn(0);
+}
+
+/*
+ * _IFunction_stiff is the implicit part of the IMEX split,
+ * F = udot - S u, with S the stiff terms (ham_stiff_A or full_stiff_A)
+ */
+PetscErrorCode _IFunction_stiff(TS ts,PetscReal t,Vec U,Vec Udot,Vec F,void *ctx){
+  Mat S = (Mat)ctx;
+
+  MatMult(S,U,F);
+  VecAYPX(F,-1.0,Udot);
+  PetscFunctionReturn(0);
+}
+
+/*
+ * _IJacobian_stiff sets J = shift I - S. S is constant and, for a fixed
+ * step, the shift only takes the value set by the (common) diagonal of
+ * the ARKIMEX tableau, so J is only rebuilt when the shift changes.
+ * Otherwise J is left untouched, and the KSP keeps its factorization
+ * or preconditioner from the previous stage.
+ */
+PetscErrorCode _IJacobian_stiff(TS ts,PetscReal t,Vec U,Vec Udot,PetscReal shift,Mat J,Mat P,void *ctx){
+  Mat S = (Mat)ctx;
+
+  if (shift==stiff_shift) PetscFunctionReturn(0);
+  stiff_shift = shift;
+  MatCopy(S,J,SAME_NONZERO_PATTERN);
+  MatScale(J,-1.0);
+  MatShift(J,shift);
+  PetscFunctionReturn(0);
+}
+
 /*
  * _RHS_time_dep_ham adds the (user created) time dependent functions
  * to the time independent hamiltonian. It is used internally by PETSc
@@ -586,38 +1261,77 @@ PetscErrorCode _RHS_time_dep_ham(TS ts,PetscReal t,Vec X,Mat AA,Mat BB,void *ctx
   PetscFunctionReturn(0);
 }
 
+/*
+ * _build_time_dep_mats creates the superoperator of each time dependent
+ * term (with a coefficient of 1) and stores it in the .mat field of
+ * _time_dep_list and _time_dep_list_lin. Each matrix is created with
+ * exactly the nonzero pattern of solve_A, which must already contain
+ * (zero valued) entries for every time dependent term, so that they
+ * can later be combined with a SAME_NONZERO_PATTERN MatAXPY.
+ * If solve_A is ham_A, the Hamiltonian terms are built as -i f(t) G
+ * (wavefunction) rather than as superoperators.
+ *
+ * Inputs:
+ *      Mat solve_A - the assembled, time independent, matrix
+ */
+static void _build_time_dep_mats(Mat solve_A){
+  int i;
+
+  for (i=0;i<_num_time_dep;i++){
+    /* time_step may be called more than once; rebuild on the current pattern */
+    MatDestroy(&_time_dep_list[i].mat);
+    MatDuplicate(solve_A,MAT_DO_NOT_COPY_VALUES,&_time_dep_list[i].mat);
+    MatSetOption(_time_dep_list[i].mat,MAT_NEW_NONZERO_LOCATION_ERR,PETSC_TRUE);
+    if (solve_A==ham_A) {
+      _add_ops_to_mat_ham_psi(1.0,_time_dep_list[i].mat,_time_dep_list[i].num_ops,_time_dep_list[i].ops);
+    } else {
+      _add_ops_to_mat_ham(1.0,_time_dep_list[i].mat,_time_dep_list[i].num_ops,_time_dep_list[i].ops);
+    }
+    MatAssemblyBegin(_time_dep_list[i].mat,MAT_FINAL_ASSEMBLY);
+    MatAssemblyEnd(_time_dep_list[i].mat,MAT_FINAL_ASSEMBLY);
+  }
+
+  for (i=0;i<_num_time_dep_lin;i++){
+    MatDestroy(&_time_dep_list_lin[i].mat);
+    MatDuplicate(solve_A,MAT_DO_NOT_COPY_VALUES,&_time_dep_list_lin[i].mat);
+    MatSetOption(_time_dep_list_lin[i].mat,MAT_NEW_NONZERO_LOCATION_ERR,PETSC_TRUE);
+    _add_ops_to_mat_lin(1.0,_time_dep_list_lin[i].mat,_time_dep_list_lin[i].num_ops,_time_dep_list_lin[i].ops);
+    MatAssemblyBegin(_time_dep_list_lin[i].mat,MAT_FINAL_ASSEMBLY);
+    MatAssemblyEnd(_time_dep_list_lin[i].mat,MAT_FINAL_ASSEMBLY);
+  }
+
+  return;
+}
+
 /*
  * _RHS_time_dep_ham_p adds the (user created) time dependent functions
  * to the time independent hamiltonian. It is used internally by PETSc
- * during time stepping.
+ * during time stepping. The per-term superoperators were precomputed in
+ * _build_time_dep_mats and share AA's nonzero pattern, so this is only
+ * a copy and a few vector-like updates; no assembly is done.
+ *
+ * ctx is the time independent matrix (full_A or ham_A).
  */
 
 PetscErrorCode _RHS_time_dep_ham_p(TS ts,PetscReal t,Vec X,Mat AA,Mat BB,void *ctx){
-  double time_dep_val;
+  Mat         solve_A = (Mat)ctx;
   PetscScalar time_dep_scalar;
-  int i,j;
-  operator op;
+  int         i;
 
-  MatZeroEntries(AA);
-
-  MatCopy(full_A,AA,SAME_NONZERO_PATTERN);
+  MatCopy(solve_A,AA,SAME_NONZERO_PATTERN);
 
   for (i=0;i<_num_time_dep;i++){
-    time_dep_val = _time_dep_list[i].time_dep_func(t);
-    _add_ops_to_mat_ham(time_dep_val,AA,_time_dep_list[i].num_ops,_time_dep_list[i].ops);
+    time_dep_scalar = _time_dep_coeff(&_time_dep_list[i],t);
+    MatAXPY(AA,time_dep_scalar,_time_dep_list[i].mat,SAME_NONZERO_PATTERN);
   }
 
   for (i=0;i<_num_time_dep_lin;i++){
-    time_dep_val = _time_dep_list_lin[i].time_dep_func(t);
-    _add_ops_to_mat_lin(time_dep_val,AA,_time_dep_list_lin[i].num_ops,_time_dep_list_lin[i].ops);
+    time_dep_scalar = _time_dep_coeff(&_time_dep_list_lin[i],t);
+    MatAXPY(AA,time_dep_scalar,_time_dep_list_lin[i].mat,SAME_NONZERO_PATTERN);
   }
 
-  MatAssemblyBegin(AA,MAT_FINAL_ASSEMBLY);
-  MatAssemblyEnd(AA,MAT_FINAL_ASSEMBLY);
-
   if(AA!=BB) {
-    MatAssemblyBegin(AA,MAT_FINAL_ASSEMBLY);
-    MatAssemblyEnd(AA,MAT_FINAL_ASSEMBLY);
+    MatCopy(AA,BB,SAME_NONZERO_PATTERN);
   }
 
   PetscFunctionReturn(0);
@@ -646,56 +1360,46 @@ PetscErrorCode _Normalize_PostEventFunction(TS ts,PetscInt nevents,PetscInt even
 
 
 
+/*
+ * g2_correlation calculates <A^dag(t) A^dag A(t+tau) A(t)>, with A the product
+ * of the given ops, at the start times t_i = i st_max/n_st (i = 1,...,n_st)
+ * and the delays tau_j = j tau_max/n_tau (j = 0,...,n_tau), with
+ * two_time_correlation. The start times are one sweep if st_max/n_st is a
+ * multiple of tau_max/n_tau, and a sweep each otherwise.
+ *
+ * Inputs:
+ *      Vec       dm0:    density matrix at time 0 (not changed)
+ *      PetscInt  n_tau:  number of delays after 0
+ *      PetscReal tau_max: largest delay
+ *      PetscInt  n_st:   number of start times
+ *      PetscReal st_max: last start time
+ *      PetscInt  number_of_ops, ...: the ops of A
+ * Outputs:
+ *      PetscScalar ***g2_values: g2_values[i][j] at (t_i,tau_j), allocated here;
+ *                                g2_values[0] is zero
+ */
 void g2_correlation(PetscScalar ***g2_values,Vec dm0,PetscInt n_tau,PetscReal tau_max,PetscInt n_st,PetscReal st_max,PetscInt number_of_ops,...){
-  TSCtx tsctx;
-  PetscReal st_dt,previous_start_time,this_start_time,dt;
-  PetscReal tau_t_max,dt_tau;
-  PetscInt i,j,dim,steps_max;
-  Mat A_star_A,tmp_mat;
-  Vec init_dm;
-  va_list ap;
-  /*Explicitly construct our jump matrix by adding up all of the operators
-   * \rho = A \rho A^\dag
-   * Vectorized:
-   * \rho = (A* \cross A) \rho
-   */
-  dim = total_levels*total_levels; //Assumes Lindblad
-
-  MatCreate(PETSC_COMM_WORLD,&tmp_mat);
-  MatSetType(tmp_mat,MATMPIAIJ);
-  MatSetSizes(tmp_mat,PETSC_DECIDE,PETSC_DECIDE,dim,dim);
-  MatSetFromOptions(tmp_mat);
-  MatMPIAIJSetPreallocation(tmp_mat,4,NULL,4,NULL);
-
-  va_start(ap,number_of_ops);
-  //Get A* \cross I
-  vadd_ops_to_mat(tmp_mat,1,number_of_ops,ap);
-  va_end(ap);
-
-
-  MatCreate(PETSC_COMM_WORLD,&tsctx.I_cross_A);
-  MatSetType(tsctx.I_cross_A,MATMPIAIJ);
-  MatSetSizes(tsctx.I_cross_A,PETSC_DECIDE,PETSC_DECIDE,dim,dim);
-  MatSetFromOptions(tsctx.I_cross_A);
-  MatMPIAIJSetPreallocation(tsctx.I_cross_A,4,NULL,4,NULL);
+  operator    *a_ops,*b_ops,*c_ops;
+  PetscScalar **corr;
+  PetscReal   st_dt,dt_tau;
+  PetscInt    i,j,ratio;
+  va_list     ap;
+
+  c_ops = malloc(number_of_ops*sizeof(operator));
+  a_ops = malloc(number_of_ops*sizeof(operator));
+  b_ops = malloc(2*number_of_ops*sizeof(operator));
   va_start(ap,number_of_ops);
-  //Get I_cross_A
-  vadd_ops_to_mat(tsctx.I_cross_A,-1,number_of_ops,ap);
+  for (i=0;i<number_of_ops;i++){
+    c_ops[i] = va_arg(ap,operator);
+  }
   va_end(ap);
+  /* A^dag is the product of the daggers, in reverse order; B = A^dag A */
+  for (i=0;i<number_of_ops;i++){
+    a_ops[i] = _g2_dagger(c_ops[number_of_ops-1-i]);
+    b_ops[i] = a_ops[i];
+    b_ops[number_of_ops+i] = c_ops[i];
+  }
 
-
-  //Get (A* \cross I) (I \cross A)
-  MatMatMult(tmp_mat,tsctx.I_cross_A,MAT_INITIAL_MATRIX,PETSC_DEFAULT,&A_star_A);
-  MatDestroy(&tmp_mat);
-  VecDuplicate(dm0,&(tsctx.tmp_dm));
-  VecDuplicate(dm0,&(tsctx.tmp_dm2));
-  VecDuplicate(dm0,&init_dm);
-
-  //Arbitrary, set this better
-  steps_max = 51000;
-  dt        = 0.025;
-
-  //Allocate memory for g2
   (*g2_values) = (PetscScalar **)malloc((n_st+1)*sizeof(PetscScalar *));
   for (i=0;i<n_st+1;i++){
     (*g2_values)[i] = (PetscScalar *)malloc((n_tau+1)*sizeof(PetscScalar));
@@ -703,54 +1407,727 @@ void g2_correlation(PetscScalar ***g2_values,Vec dm0,PetscInt n_tau,PetscReal ta
       (*g2_values)[i][j] = 0.0;
     }
   }
-  tsctx.g2_values = (*g2_values);
 
-  set_ts_monitor_ctx(_g2_ts_monitor,&tsctx);
-  st_dt = st_max/n_st;
-  previous_start_time = 0;
-  tsctx.i_st = 0;
-  tsctx.i_st = tsctx.i_st + 1; //Why?
+  st_dt  = st_max/n_st;
+  dt_tau = tau_max/n_tau;
+  ratio  = (PetscInt)(st_dt/dt_tau + 0.5);
+  if (ratio>=1&&PetscAbsReal(ratio*dt_tau-st_dt)<=1e-8*st_dt){
+    two_time_correlation(&corr,dm0,0.0,n_st,st_dt,st_dt,n_tau+1,dt_tau,number_of_ops,a_ops,
+                         2*number_of_ops,b_ops,number_of_ops,c_ops);
+    for (i=0;i<n_st;i++){
+      for (j=0;j<n_tau+1;j++){
+        (*g2_values)[i+1][j] = corr[i][j];
+      }
+      free(corr[i]);
+    }
+    free(corr);
+  } else {
+    for (i=1;i<=n_st;i++){
+      two_time_correlation(&corr,dm0,0.0,1,i*st_dt,st_dt,n_tau+1,dt_tau,number_of_ops,a_ops,
+                           2*number_of_ops,b_ops,number_of_ops,c_ops);
+      for (j=0;j<n_tau+1;j++){
+        (*g2_values)[i][j] = corr[0][j];
+      }
+      free(corr[0]);
+      free(corr);
+    }
+  }
+
+  free(a_ops);
+  free(b_ops);
+  free(c_ops);
+  return;
+}
+
+/* The dagger of an op of g2_correlation */
+static operator _g2_dagger(operator op){
+  if (op->my_op_type==LOWER||op->my_op_type==RAISE||
+      op->my_op_type==DICKE_LOWER||op->my_op_type==DICKE_RAISE){
+    return op->dag;
+  }
+  if (op->my_op_type==VEC){
+    if (nid==0){
+      printf("ERROR! g2_correlation does not support vec ops!\n");
+      exit(0);
+    }
+  }
+  /* Number, Pauli, identity and Dicke number and sig_z ops are Hermitian */
+  return op;
+}
+
+/*
+ * two_time_correlation calculates <A(t) B(t+tau) C(t)> with the quantum
+ * regression theorem, Tr[B exp(L tau)(C rho(t) A)], on the grid
+ *     t_k = t_start + k t_step, k = 0,...,n_t-1
+ *     tau_j = j tau_step,       j = 0,...,n_tau-1
+ * A, B and C are products of operators (num_* = 0 is the identity), e.g.
+ * A = {a->dag}, B = {a->dag,a}, C = {a} for the (unnormalized) g2.
+ *
+ * Rather than a time_step per start time, rho and the tau sweeps of all
+ * start times that overlap are propagated together, in absolute time, as
+ * the columns of one dense block: every Runge-Kutta stage is one product
+ * of the block with L(t), so time dependent terms are handled exactly.
+ * A new column C rho(t_k) A starts at each t_k and is retired after its
+ * last tau. This needs t_step to be a multiple of tau_step. The RK4 step
+ * is tau_step divided into substeps, at first just enough to be stable
+ * for the norm of L. Step doubling then checks the error of a tau_step
+ * against -corr_rtol <rtol> (default 1e-7, relative to the block) and
+ * doubles the substeps until it passes: on the first step, at every new
+ * start time, and on every step if L is time dependent. -corr_substeps <n>
+ * fixes the substeps instead, without the check.
+ *
+ * The RK4 is stepped here rather than by a TS, as a TS integrates a single
+ * Vec: the block would have to be reshaped into one Vec for every stage,
+ * and the columns that start and retire at each t_k would restart the TS.
+ *
+ * Inputs:
+ *      Vec       rho0:     density matrix at time t0 (not changed)
+ *      PetscReal t0:       time of rho0 (t0 <= t_start)
+ *      PetscInt  n_t:      number of start times
+ *      PetscReal t_start:  first start time
+ *      PetscReal t_step:   spacing of the start times
+ *      PetscInt  n_tau:    number of delays
+ *      PetscReal tau_step: spacing of the delays
+ *      PetscInt  num_a,operator a_ops[]: the ops of A
+ *      PetscInt  num_b,operator b_ops[]: the ops of B
+ *      PetscInt  num_c,operator c_ops[]: the ops of C
+ * Outputs:
+ *      PetscScalar ***corr: corr[k][j] at (t_k,tau_j), allocated here, on all processors
+ */
+void two_time_correlation(PetscScalar ***corr,Vec rho0,PetscReal t0,PetscInt n_t,PetscReal t_start,
+                          PetscReal t_step,PetscInt n_tau,PetscReal tau_step,PetscInt num_a,operator a_ops[],
+                          PetscInt num_b,operator b_ops[],PetscInt num_c,operator c_ops[]){
+  Mat               AA,S,Y,K,tmp,acc,Y0,Y1;
+  Vec               w,col,rho_col,out,out_all;
+  VecScatter        ctx_out;
+  PetscInt          i,j,k,m,m_local,Istart,Iend,dim,ratio,num_slots,slot,num_steps,substeps;
+  PetscBool         fixed_substeps;
+  PetscInt          *slot_start;
+  PetscScalar       mat_tmp;
+  const PetscScalar *out_array;
+  PetscReal         norm,coeff_norm,max_coeff,dt,rtol;
+
+  if (n_t<1||n_tau<1||tau_step<=0||t_start<t0){
+    if (nid==0){
+      printf("ERROR! two_time_correlation needs n_t, n_tau, tau_step > 0 and t_start >= t0!\n");
+      exit(0);
+    }
+  }
+  if (_matrix_free||_stiff_solver||_num_quantum_gates>0||_num_circuits>0){
+    if (nid==0){
+      printf("ERROR! two_time_correlation does not support set_matrix_free, stiff terms or gates!\n");
+      exit(0);
+    }
+  }
+  ratio = n_tau;
+  if (n_t>1){
+    ratio = (PetscInt)(t_step/tau_step + 0.5);
+    if (ratio<1||PetscAbsReal(ratio*tau_step-t_step)>1e-8*t_step){
+      if (nid==0){
+        printf("ERROR! t_step must be a multiple of tau_step in two_time_correlation!\n");
+        exit(0);
+      }
+    }
+  }
+  /* Columns needed at once: every start time whose tau sweep is not done */
+  num_slots = PetscMin(n_t,(n_tau-1)/ratio+1);
+
+  /* L, as time_step sets it up */
+  _build_A();
+  _remove_stabilization();
+  MatGetOwnershipRange(full_A,&Istart,&Iend);
+  for (i=Istart;i<Iend;i++){
+    mat_tmp = 0.0;
+    MatSetValue(full_A,i,i,mat_tmp,ADD_VALUES);
+  }
+  for (i=0;i<_num_time_dep;i++){
+    _add_ops_to_mat_ham(0.0,full_A,_time_dep_list[i].num_ops,_time_dep_list[i].ops);
+  }
+  for (i=0;i<_num_time_dep_lin;i++){
+    _add_ops_to_mat_lin(0.0,full_A,_time_dep_list_lin[i].num_ops,_time_dep_list_lin[i].ops);
+  }
+  MatAssemblyBegin(full_A,MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(full_A,MAT_FINAL_ASSEMBLY);
+
+  /* Bound the norm of L(t) over the grid, for the RK4 step */
+  MatNorm(full_A,NORM_INFINITY,&norm);
+  AA = full_A;
+  if (_num_time_dep+_num_time_dep_lin){
+    _build_time_dep_mats(full_A);
+    MatDuplicate(full_A,MAT_COPY_VALUES,&AA);
+    num_steps = (n_t-1)*ratio + n_tau;
+    for (i=0;i<_num_time_dep+_num_time_dep_lin;i++){
+      max_coeff = 0;
+      for (m=0;m<num_steps;m++){
+        if (i<_num_time_dep){
+          max_coeff = PetscMax(max_coeff,PetscAbsComplex(_time_dep_coeff(&_time_dep_list[i],t_start+m*tau_step)));
+        } else {
+          max_coeff = PetscMax(max_coeff,PetscAbsComplex(_time_dep_coeff(&_time_dep_list_lin[i-_num_time_dep],t_start+m*tau_step)));
+        }
+      }
+      if (i<_num_time_dep){
+        MatNorm(_time_dep_list[i].mat,NORM_INFINITY,&coeff_norm);
+      } else {
+        MatNorm(_time_dep_list_lin[i-_num_time_dep].mat,NORM_INFINITY,&coeff_norm);
+      }
+      norm = norm + max_coeff*coeff_norm;
+    }
+  }
+  /* RK4 is stable for |dt lambda| up to about 2.8 */
+  substeps = PetscMax(1,(PetscInt)PetscCeilReal(tau_step*norm/2.5));
+  PetscOptionsGetInt(NULL,NULL,"-corr_substeps",&substeps,&fixed_substeps);
+  rtol = 1e-7;
+  PetscOptionsGetReal(NULL,NULL,"-corr_rtol",&rtol,NULL);
+
+  /* S rho = C rho A and Tr[B X] = w^T X */
+  _sandwich_mat(&S,num_a,a_ops,num_c,c_ops);
+  VecDuplicate(rho0,&w);
+  _trace_vec(w,num_b,b_ops);
+
+  /* Column 0 is rho; columns 1...num_slots hold the tau sweeps */
+  dim = _basis_dim*_basis_dim;
+  MatGetLocalSize(full_A,&m_local,NULL);
+  MatCreateDense(PETSC_COMM_WORLD,m_local,PETSC_DECIDE,dim,num_slots+1,NULL,&Y);
+  MatZeroEntries(Y);
+  MatDenseGetColumnVec(Y,0,&col);
+  VecCopy(rho0,col);
+  MatDenseRestoreColumnVec(Y,0,&col);
+  MatDuplicate(Y,MAT_DO_NOT_COPY_VALUES,&tmp);
+  MatDuplicate(Y,MAT_DO_NOT_COPY_VALUES,&acc);
+  MatDuplicate(Y,MAT_DO_NOT_COPY_VALUES,&Y0);
+  MatDuplicate(Y,MAT_DO_NOT_COPY_VALUES,&Y1);
+  MatMatMult(AA,tmp,MAT_INITIAL_MATRIX,PETSC_DEFAULT,&K);
+  MatCreateVecs(Y,&out,NULL);
+  VecScatterCreateToAll(out,&ctx_out,&out_all);
+  VecDuplicate(rho0,&rho_col);
+
+  (*corr) = malloc(n_t*sizeof(PetscScalar*));
+  for (k=0;k<n_t;k++){
+    (*corr)[k] = calloc(n_tau,sizeof(PetscScalar));
+  }
+  slot_start = malloc((num_slots+1)*sizeof(PetscInt));
+  for (slot=0;slot<=num_slots;slot++){
+    slot_start[slot] = -1;
+  }
+
+  /* Evolve rho from t0 to t_start, in steps of at most tau_step */
+  if (t_start>t0){
+    num_steps = (PetscInt)PetscCeilReal((t_start-t0)/tau_step - 1e-8);
+    dt = (t_start-t0)/num_steps;
+    for (m=0;m<num_steps;m++){
+      _corr_step(AA,Y,K,tmp,acc,Y0,Y1,t0+m*dt,dt,&substeps,rtol,
+                 !fixed_substeps&&(m==0||AA!=full_A));
+    }
+  }
+
+  num_steps = (n_t-1)*ratio + n_tau - 1;
+  for (m=0;m<=num_steps;m++){
+    if (m%ratio==0&&m/ratio<n_t){
+      /* Start the tau sweep of t_k in the slot of the finished t_(k-num_slots) */
+      k    = m/ratio;
+      slot = 1 + k%num_slots;
+      slot_start[slot] = k;
+      MatDenseGetColumnVec(Y,0,&col);
+      VecCopy(col,rho_col);
+      MatDenseRestoreColumnVec(Y,0,&col);
+      MatDenseGetColumnVec(Y,slot,&col);
+      MatMult(S,rho_col,col);
+      MatDenseRestoreColumnVec(Y,slot,&col);
+    }
+
+    /* out_s = Tr[B X_s] for every column */
+    MatMultTranspose(Y,w,out);
+    VecScatterBegin(ctx_out,out,out_all,INSERT_VALUES,SCATTER_FORWARD);
+    VecScatterEnd(ctx_out,out,out_all,INSERT_VALUES,SCATTER_FORWARD);
+    VecGetArrayRead(out_all,&out_array);
+    for (slot=1;slot<=num_slots;slot++){
+      k = slot_start[slot];
+      if (k<0) continue;
+      j = m - k*ratio;
+      if (j<n_tau){
+        (*corr)[k][j] = out_array[slot];
+      }
+    }
+    VecRestoreArrayRead(out_all,&out_array);
+
+    if (m<num_steps){
+      _corr_step(AA,Y,K,tmp,acc,Y0,Y1,t_start+m*tau_step,tau_step,&substeps,rtol,
+                 !fixed_substeps&&(m%ratio==0||AA!=full_A));
+    }
+  }
+
+  free(slot_start);
+  VecScatterDestroy(&ctx_out);
+  VecDestroy(&out);
+  VecDestroy(&out_all);
+  VecDestroy(&rho_col);
+  VecDestroy(&w);
+  MatDestroy(&S);
+  MatDestroy(&Y);
+  MatDestroy(&K);
+  MatDestroy(&tmp);
+  MatDestroy(&acc);
+  MatDestroy(&Y0);
+  MatDestroy(&Y1);
+  if (AA!=full_A){
+    MatDestroy(&AA);
+  }
+  return;
+}
+
+/*
+ * _corr_step advances Y from t to t+h with *substeps RK4 steps. If check
+ * is set, the same step is repeated with twice the substeps; while the two
+ * differ by more than rtol (relative to the Frobenius norm of Y), the
+ * substeps are doubled again. The finer result is kept, and *substeps is
+ * the number that passed, for the steps that follow. Y0 and Y1 are work
+ * blocks shaped like Y.
+ */
+static void _corr_step(Mat AA,Mat Y,Mat K,Mat tmp,Mat acc,Mat Y0,Mat Y1,PetscReal t,PetscReal h,
+                       PetscInt *substeps,PetscReal rtol,int check){
+  PetscReal err,norm;
+
+  if (!check){
+    _corr_rk4(AA,Y,K,tmp,acc,t,h/(*substeps),*substeps);
+    return;
+  }
+  MatCopy(Y,Y0,SAME_NONZERO_PATTERN);
+  _corr_rk4(AA,Y,K,tmp,acc,t,h/(*substeps),*substeps);
+  while (1){
+    MatCopy(Y,Y1,SAME_NONZERO_PATTERN);
+    MatCopy(Y0,Y,SAME_NONZERO_PATTERN);
+    _corr_rk4(AA,Y,K,tmp,acc,t,h/(2*(*substeps)),2*(*substeps));
+    MatAXPY(Y1,-1.0,Y,SAME_NONZERO_PATTERN);
+    MatNorm(Y1,NORM_FROBENIUS,&err);
+    MatNorm(Y,NORM_FROBENIUS,&norm);
+    if (err<=rtol*norm) break;
+    *substeps = 2*(*substeps);
+    if (*substeps>1048576){
+      if (nid==0){
+        printf("Warning! two_time_correlation could not reach -corr_rtol %e; the error is %e.\n",
+               (double)rtol,(double)(err/norm));
+      }
+      break;
+    }
+  }
+  return;
+}
+
+/*
+ * _corr_rk4 takes num_steps classical Runge-Kutta steps of dY/dt = L(t) Y,
+ * from time t, for all columns of Y at once. AA is L(t) (full_A plus the
+ * time dependent terms, if there are any); K, tmp and acc are work blocks
+ * shaped like Y, with K = AA tmp from MatMatMult.
+ */
+static void _corr_rk4(Mat AA,Mat Y,Mat K,Mat tmp,Mat acc,PetscReal t,PetscReal dt,PetscInt num_steps){
+  PetscInt step;
+  int      time_dep;
+
+  time_dep = (AA!=full_A);
+  for (step=0;step<num_steps;step++){
+    MatCopy(Y,acc,SAME_NONZERO_PATTERN);
+    MatCopy(Y,tmp,SAME_NONZERO_PATTERN);
+
+    if (time_dep) _RHS_time_dep_ham_p(NULL,t,NULL,AA,AA,full_A);
+    MatMatMult(AA,tmp,MAT_REUSE_MATRIX,PETSC_DEFAULT,&K);
+    MatAXPY(acc,dt/6,K,SAME_NONZERO_PATTERN);
+    MatCopy(Y,tmp,SAME_NONZERO_PATTERN);
+    MatAXPY(tmp,dt/2,K,SAME_NONZERO_PATTERN);
+
+    if (time_dep) _RHS_time_dep_ham_p(NULL,t+dt/2,NULL,AA,AA,full_A);
+    MatMatMult(AA,tmp,MAT_REUSE_MATRIX,PETSC_DEFAULT,&K);
+    MatAXPY(acc,dt/3,K,SAME_NONZERO_PATTERN);
+    MatCopy(Y,tmp,SAME_NONZERO_PATTERN);
+    MatAXPY(tmp,dt/2,K,SAME_NONZERO_PATTERN);
+
+    MatMatMult(AA,tmp,MAT_REUSE_MATRIX,PETSC_DEFAULT,&K);
+    MatAXPY(acc,dt/3,K,SAME_NONZERO_PATTERN);
+    MatCopy(Y,tmp,SAME_NONZERO_PATTERN);
+    MatAXPY(tmp,dt,K,SAME_NONZERO_PATTERN);
+
+    if (time_dep) _RHS_time_dep_ham_p(NULL,t+dt,NULL,AA,AA,full_A);
+    MatMatMult(AA,tmp,MAT_REUSE_MATRIX,PETSC_DEFAULT,&K);
+    MatAXPY(acc,dt/6,K,SAME_NONZERO_PATTERN);
+
+    MatCopy(acc,Y,SAME_NONZERO_PATTERN);
+    t = t + dt;
+  }
+  return;
+}
+
+/*
+ * correlation_spectrum calculates the (incoherent) spectrum of <B(tau) A(0)>
+ * in the steady state,
+ *     S(omega) = 2 Re int_0^inf exp(-i omega tau) <B(tau) A(0)> dtau
+ *              = -2 Re Tr[B (L - i omega)^-1 (A rho_ss - <A> rho_ss)]
+ * directly in frequency space, e.g. A = {sm}, B = {sm->dag} for the
+ * emission spectrum of sm. The coherent part, |<A>|^2 delta(omega) for
+ * B = A^t, is removed so that L - i omega is not singular at omega = 0.
+ *
+ * All of the shifted systems share one Krylov space, as
+ * K_m(L,b) = K_m(L - i omega,b): m Arnoldi steps of L (one MatMult each)
+ * are taken, and every omega is solved in the small (m+1) x m Hessenberg
+ * matrix, until all of them converge. Frequencies that have not converged
+ * after -spectrum_krylov_max steps (default 300) are finished with a
+ * GMRES solve of L - i omega each, starting from the Krylov solution and
+ * reusing one preconditioner, built from L with the trace row of
+ * steady_state (-ksp_type, -pc_type etc. apply). -spectrum_rtol sets the tolerance
+ * (default 1e-8). Note the Krylov space needs storage for m density
+ * matrices.
+ *
+ * Inputs:
+ *      Vec       rho_ss:    the steady state, e.g. from steady_state
+ *      PetscInt  num_omega: number of frequencies
+ *      PetscReal omega[]:   the frequencies
+ *      PetscInt  num_a,operator a_ops[]: the ops of A
+ *      PetscInt  num_b,operator b_ops[]: the ops of B
+ * Outputs:
+ *      PetscReal **spectrum: S(omega[k]), allocated here, on all processors
+ */
+void correlation_spectrum(PetscReal **spectrum,Vec rho_ss,PetscInt num_omega,PetscReal omega[],
+                          PetscInt num_a,operator a_ops[],PetscInt num_b,operator b_ops[]){
+  Mat            S,shift_A,pc_A;
+  Vec            b,w,x,*V;
+  KSP            ksp;
+  PetscInt       i,j,k,m,max_m,Istart,Iend,num_left,its,*last_m;
+  PetscBLASInt   n_h,one=1,info,*ipiv;
+  PetscScalar    trace,mat_tmp,*H,*H_shift,*y,*h,*h2,*wv,*last_y;
+  PetscReal      beta,h_next,rtol,res;
+  PetscLogDouble solve_start,solve_end;
+  int            *converged;
+
+  if (_num_time_dep+_num_time_dep_lin>0||_stiff_solver||_num_quantum_gates>0||_num_circuits>0){
+    if (nid==0){
+      printf("ERROR! correlation_spectrum needs a time independent L, without stiff terms or gates!\n");
+      exit(0);
+    }
+  }
+  if (!_lindblad_terms){
+    if (nid==0){
+      printf("ERROR! correlation_spectrum needs Lindblad terms; the steady state is not unique otherwise!\n");
+      exit(0);
+    }
+  }
+  max_m = 300;
+  rtol  = 1e-8;
+  PetscOptionsGetInt(NULL,NULL,"-spectrum_krylov_max",&max_m,NULL);
+  PetscOptionsGetReal(NULL,NULL,"-spectrum_rtol",&rtol,NULL);
+
+  /* L, as time_step sets it up */
+  _build_A();
+  if (_matrix_free){
+    _mf_assemble();
+    _mf_set_stabilization(0,0);
+  } else {
+    _remove_stabilization();
+    MatGetOwnershipRange(full_A,&Istart,&Iend);
+    for (i=Istart;i<Iend;i++){
+      mat_tmp = 0.0;
+      MatSetValue(full_A,i,i,mat_tmp,ADD_VALUES);
+    }
+    MatAssemblyBegin(full_A,MAT_FINAL_ASSEMBLY);
+    MatAssemblyEnd(full_A,MAT_FINAL_ASSEMBLY);
+  }
+
+  /* b = A rho_ss - <A> rho_ss, which has zero trace */
+  _sandwich_mat(&S,0,NULL,num_a,a_ops);
+  VecDuplicate(rho_ss,&b);
+  MatMult(S,rho_ss,b);
+  trace_dm(&trace,b);
+  VecAXPY(b,-trace,rho_ss);
+  VecDuplicate(rho_ss,&w);
+  _trace_vec(w,num_b,b_ops);
+
+  (*spectrum) = calloc(num_omega,sizeof(PetscReal));
+  converged   = calloc(num_omega,sizeof(int));
+  last_y      = calloc(num_omega*max_m,sizeof(PetscScalar));
+  last_m      = calloc(num_omega,sizeof(PetscInt));
+  H           = calloc((max_m+1)*max_m,sizeof(PetscScalar));
+  H_shift     = malloc(max_m*max_m*sizeof(PetscScalar));
+  y           = malloc(max_m*sizeof(PetscScalar));
+  h           = malloc((max_m+1)*sizeof(PetscScalar));
+  h2          = malloc((max_m+1)*sizeof(PetscScalar));
+  wv          = malloc((max_m+1)*sizeof(PetscScalar));
+  ipiv        = malloc(max_m*sizeof(PetscBLASInt));
+  VecDuplicateVecs(b,max_m+1,&V);
+
+  PetscTime(&solve_start);
+  VecNorm(b,NORM_2,&beta);
+  num_left = num_omega;
+  m = 0;
+  if (beta==0){
+    /* The spectrum is all coherent */
+    num_left = 0;
+  } else {
+    VecCopy(b,V[0]);
+    VecScale(V[0],1.0/beta);
+    VecTDot(V[0],w,&wv[0]);
+  }
+  while (num_left>0&&m<max_m){
+    /* Arnoldi step, with classical Gram-Schmidt done twice */
+    MatMult(full_A,V[m],V[m+1]);
+    VecMDot(V[m+1],m+1,V,h);
+    for (i=0;i<=m;i++) h[i] = -h[i];
+    VecMAXPY(V[m+1],m+1,h,V);
+    VecMDot(V[m+1],m+1,V,h2);
+    for (i=0;i<=m;i++){
+      H[m*(max_m+1)+i] = -h[i] + h2[i];
+      h2[i] = -h2[i];
+    }
+    VecMAXPY(V[m+1],m+1,h2,V);
+    VecNorm(V[m+1],NORM_2,&h_next);
+    H[m*(max_m+1)+m+1] = h_next;
+    m = m + 1;
+    if (h_next>0){
+      VecScale(V[m],1.0/h_next);
+      VecTDot(V[m],w,&wv[m]);
+    }
 
-  for (this_start_time=st_dt;this_start_time<=st_max;this_start_time+=st_dt){
-    //Go from previous start time to this_start_time
-    tsctx.tau_evolve = 0;
-    dt = (this_start_time - previous_start_time)/500; //500 is arbitrary, should be picked better
-    time_step(dm0,previous_start_time,this_start_time,dt,steps_max);
+    if (m%10!=0&&m<max_m&&h_next>0) continue;
 
-    //Timestep through taus
-    tau_t_max = this_start_time + tau_max;
-    dt_tau = (tau_t_max - this_start_time)/n_tau;
+    /*
+     * Solve (H_m - i omega) y = beta e_1 (FOM) for each remaining omega;
+     * the residual of x = V_m y is h_{m+1,m} |y_m|
+     */
+    n_h = m;
+    for (k=0;k<num_omega;k++){
+      if (converged[k]) continue;
+      for (j=0;j<m;j++){
+        for (i=0;i<m;i++){
+          H_shift[j*m+i] = H[j*(max_m+1)+i];
+        }
+        H_shift[j*m+j] = H_shift[j*m+j] - omega[k]*PETSC_i;
+        y[j] = 0.0;
+      }
+      y[0] = beta;
+      LAPACKgesv_(&n_h,&one,H_shift,&n_h,ipiv,y,&n_h,&info);
+      if (info!=0) continue;
+      for (j=0;j<m;j++){
+        last_y[k*max_m+j] = y[j];
+      }
+      last_m[k] = m;
+      res = h_next*PetscAbsComplex(y[m-1]);
+      if (res<=rtol*beta){
+        trace = 0.0;
+        for (j=0;j<m;j++){
+          trace = trace + y[j]*wv[j];
+        }
+        (*spectrum)[k] = -2*PetscRealPart(trace);
+        converged[k] = 1;
+        num_left--;
+      }
+    }
+    if (h_next==0) break;
+  }
+  if (nid==0) printf("Spectrum: %d Arnoldi steps, %d of %d frequencies converged\n",(int)m,(int)(num_omega-num_left),(int)num_omega);
 
+  if (num_left>0&&_matrix_free){
+    if (nid==0){
+      printf("Warning! %d frequencies did not converge in correlation_spectrum.\n",(int)num_left);
+      printf("         Increase -spectrum_krylov_max\n");
+    }
+  } else if (num_left>0){
     /*
-     * Force an 'emission' to get A \rho A^\dag terms
-     * We already have A* \cross A - we just do the multiplication
+     * One GMRES solve per frequency. L itself is singular (rho_ss is its
+     * null vector), so the preconditioner is built once, from L with the
+     * trace row that steady_state adds
      */
-    tsctx.tau_evolve = 1;
-    //Copy the timestepped dm into our init_dm for tau sweep
-    VecCopy(dm0,init_dm);
-    MatMult(A_star_A,dm0,init_dm); //init_dm = A * dm0
-    tsctx.i_tau = 0;
-    time_step(init_dm,this_start_time,tau_t_max,dt_tau,steps_max);
+    MatDuplicate(full_A,MAT_COPY_VALUES,&shift_A);
+    MatDuplicate(full_A,MAT_COPY_VALUES,&pc_A);
+    MatSetOption(pc_A,MAT_NEW_NONZERO_ALLOCATION_ERR,PETSC_FALSE);
+    if (nid==0) {
+      for (i=0;i<_basis_dim;i++){
+        mat_tmp = 1.0;
+        MatSetValue(pc_A,0,i*(_basis_dim+1),mat_tmp,ADD_VALUES);
+      }
+    }
+    MatAssemblyBegin(pc_A,MAT_FINAL_ASSEMBLY);
+    MatAssemblyEnd(pc_A,MAT_FINAL_ASSEMBLY);
+    _steady_state_ksp(&ksp,pc_A);
+    KSPSetOperators(ksp,shift_A,pc_A);
+    KSPSetReusePreconditioner(ksp,PETSC_TRUE);
+    KSPSetInitialGuessNonzero(ksp,PETSC_TRUE);
+    VecDuplicate(b,&x);
+    for (k=0;k<num_omega;k++){
+      if (converged[k]) continue;
+      MatCopy(full_A,shift_A,SAME_NONZERO_PATTERN);
+      MatShift(shift_A,-omega[k]*PETSC_i);
+      /* Start from the Krylov solution */
+      VecSet(x,0.0);
+      VecMAXPY(x,last_m[k],&last_y[k*max_m],V);
+      KSPSolve(ksp,b,x);
+      KSPGetIterationNumber(ksp,&its);
+      VecTDot(x,w,&trace);
+      (*spectrum)[k] = -2*PetscRealPart(trace);
+      if (nid==0) printf("Spectrum: omega = %e needed %d GMRES iterations\n",omega[k],(int)its);
+    }
+    VecDestroy(&x);
+    KSPDestroy(&ksp);
+    MatDestroy(&shift_A);
+    MatDestroy(&pc_A);
+  }
+  PetscTime(&solve_end);
+  if (nid==0) printf("Spectrum time %f s\n",solve_end-solve_start);
+
+  VecDestroyVecs(max_m+1,&V);
+  free(converged);
+  free(last_y);
+  free(last_m);
+  free(H);
+  free(H_shift);
+  free(y);
+  free(h);
+  free(h2);
+  free(wv);
+  free(ipiv);
+  VecDestroy(&b);
+  VecDestroy(&w);
+  MatDestroy(&S);
+  return;
+}
 
-    previous_start_time = this_start_time;
-    tsctx.i_st = tsctx.i_st + 1;
+/*
+ * _sandwich_mat creates S, with S rho = C rho A, in the layout of full_A.
+ * Vectorized, S = (A^T cross I)(I cross C), which has one nonzero per row.
+ *
+ * Inputs:
+ *      PetscInt num_a,operator a_ops[]: the ops of A (none is the identity)
+ *      PetscInt num_c,operator c_ops[]: the ops of C
+ * Outputs:
+ *      Mat *S: the assembled superoperator
+ */
+static void _sandwich_mat(Mat *S,PetscInt num_a,operator a_ops[],PetscInt num_c,operator c_ops[]){
+  PetscInt    i,j1,j2,m_local,n_local,Istart,Iend,dim;
+  PetscScalar val,val2;
+
+  dim = _basis_dim*_basis_dim;
+  MatGetLocalSize(full_A,&m_local,&n_local);
+  MatGetOwnershipRange(full_A,&Istart,&Iend);
+  MatCreateAIJ(PETSC_COMM_WORLD,m_local,n_local,dim,dim,1,NULL,1,NULL,S);
+  for (i=Istart;i<Iend;i++){
+    _get_ops_row_j(_basis_full_index(i),num_a,a_ops,&j1,&val,1,1);
+    if (j1==-1) continue;
+    _get_ops_row_j(j1,num_c,c_ops,&j2,&val2,-1,0);
+    if (j2==-1||_basis_index(j2)<0) continue;
+    /* With dag=1, tensor_control 1 conjugates the rows of A^H, giving A^T */
+    MatSetValue(*S,i,_basis_index(j2),val*val2,ADD_VALUES);
   }
+  MatAssemblyBegin(*S,MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(*S,MAT_FINAL_ASSEMBLY);
+  return;
+}
 
+/*
+ * _trace_vec sets w so that Tr[B X] = w^T X (no conjugation), that is,
+ * w_{rc} = B_{cr}.
+ *
+ * Inputs:
+ *      PetscInt num_b,operator b_ops[]: the ops of B
+ * Outputs:
+ *      Vec w: with the layout of the density matrix
+ */
+static void _trace_vec(Vec w,PetscInt num_b,operator b_ops[]){
+  PetscInt    i,c,j1,Istart,Iend;
+  PetscScalar val;
+
+  VecSet(w,0.0);
+  VecGetOwnershipRange(w,&Istart,&Iend);
+  for (c=0;c<_basis_dim;c++){
+    i = _basis_dim*c + c;
+    if (i<Istart||i>=Iend) continue;
+    _get_ops_row_j(_basis_full_index(i),num_b,b_ops,&j1,&val,-1,0);
+    if (j1==-1||_basis_index(j1)<0) continue;
+    VecSetValue(w,_basis_index(j1),val,ADD_VALUES);
+  }
+  VecAssemblyBegin(w);
+  VecAssemblyEnd(w);
   return;
 }
 
-PetscErrorCode _g2_ts_monitor(TS ts,PetscInt step,PetscReal time,Vec dm,void *ctx){
-  TSCtx         *tsctx = (TSCtx*) ctx;   /* user-defined application context */
-  PetscScalar ev;
+/*
+ * _solver_clear forgets the trace row of a previous steady_state, for
+ * QuaC_clear; it went with the destroyed full_A
+ */
+void _solver_clear(){
+  stab_added       = 0;
+  matrix_assembled = 0;
+  return;
+}
+
+/*
+ * _remove_stabilization subtracts the trace row that steady_state added
+ * to full_A, if it is there. full_A must be assembled afterwards.
+ */
+static void _remove_stabilization(){
+  PetscInt    i,col;
+  PetscScalar mat_tmp;
 
-  if (tsctx->tau_evolve==1){
-    MatMult(tsctx->I_cross_A,dm,tsctx->tmp_dm); // tmp = I \cross A \rho
-    MatMultHermitianTranspose(tsctx->I_cross_A,tsctx->tmp_dm,tsctx->tmp_dm2); // tmp2 = I \cross A^\dag tmp
-    trace_dm(&ev,tsctx->tmp_dm2);
-    tsctx->g2_values[tsctx->i_st][tsctx->i_tau] += ev;
-    tsctx->i_tau = tsctx->i_tau + 1;
+  if (stab_added&&!_matrix_free){
+    if (nid==0) printf("Removing stabilization...\n");
+    /*
+     * We add 1.0 in the 0th spot and every n+1 after
+     */
+    if (nid==0) {
+      for (i=0;i<_basis_dim;i++){
+        col = i*(_basis_dim+1);
+        mat_tmp = -1.0 + 0.*PETSC_i;
+        MatSetValue(full_A,0,col,mat_tmp,ADD_VALUES);
+      }
+    }
+    /* A later steady_state adds it again */
+    stab_added = 0;
   }
+  return;
+}
 
+/*
+ * _pin_row replaces row p of the assembled A with the identity row, keeping
+ * its nonzero pattern, so that the equation of x_p is x_p = b_p. The old
+ * row is saved (on the owning processor) for _unpin_row, unless ncols
+ * is NULL.
+ *
+ * Inputs:
+ *      Mat      A:     the assembled matrix
+ *      PetscInt p:     the row to pin
+ * Outputs:
+ *      PetscInt    *ncols: number of saved elements
+ *      PetscInt    **cols: saved columns (allocated here)
+ *      PetscScalar **vals: saved values (allocated here)
+ */
+static void _pin_row(Mat A,PetscInt p,PetscInt *ncols,PetscInt **cols,PetscScalar **vals){
+  PetscInt          i,Istart,Iend,n,owned;
+  const PetscInt    *row_cols;
+  const PetscScalar *row_vals;
+
+  MatGetOwnershipRange(A,&Istart,&Iend);
+  owned  = (p>=Istart&&p<Iend);
+  if (ncols!=NULL) *ncols = 0;
+  if (owned&&ncols!=NULL){
+    MatGetRow(A,p,&n,&row_cols,&row_vals);
+    *ncols = n;
+    *cols  = malloc(n*sizeof(PetscInt));
+    *vals  = malloc(n*sizeof(PetscScalar));
+    for (i=0;i<n;i++){
+      (*cols)[i] = row_cols[i];
+      (*vals)[i] = row_vals[i];
+    }
+    MatRestoreRow(A,p,&n,&row_cols,&row_vals);
+  }
+  MatSetOption(A,MAT_KEEP_NONZERO_PATTERN,PETSC_TRUE);
+  MatZeroRows(A,owned,&p,1.0,NULL,NULL);
+  return;
+}
 
-  PetscFunctionReturn(0);
+/*
+ * _unpin_row puts back row p of A, as saved by _pin_row, and frees it
+ */
+static void _unpin_row(Mat A,PetscInt p,PetscInt ncols,PetscInt *cols,PetscScalar *vals){
+  if (ncols>0){
+    MatSetValues(A,1,&p,ncols,cols,vals,INSERT_VALUES);
+    free(cols);
+    free(vals);
+  }
+  MatAssemblyBegin(A,MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(A,MAT_FINAL_ASSEMBLY);
+  return;
 }
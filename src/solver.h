@@ -3,18 +3,21 @@
 
 #include <petscksp.h>
 #include <petscts.h>
+#include "operators.h"
 
 void steady_state(Vec);
+void steady_state_sweep(Vec,PetscInt,PetscReal[],PetscErrorCode (*)(PetscInt,PetscReal,Vec,void*),void*);
 void time_step(Vec,PetscReal,PetscReal,PetscReal,PetscInt);
 void set_ts_monitor(PetscErrorCode (*monitor)(TS,PetscInt,PetscReal,Vec,void*));
 void set_ts_monitor_ctx(PetscErrorCode (*monitor)(TS,PetscInt,PetscReal,Vec,void*),void*);
+void set_output_times(PetscInt,PetscReal[]);
+void set_output_grid(PetscReal,PetscReal,PetscInt);
+void set_krylov_expmv(PetscInt,PetscReal);
+void set_trotter_propagator();
+void set_steady_state_pinned(PetscInt);
 void g2_correlation(PetscScalar ***,Vec,PetscInt,PetscReal,PetscInt,PetscReal,PetscInt,...);
-PetscErrorCode _g2_ts_monitor(TS,PetscInt,PetscReal,Vec,void*);
-typedef struct {
-  Mat I_cross_A;
-  PetscInt i_tau,i_st,tau_evolve;
-  Vec tmp_dm,tmp_dm2;
-  PetscScalar **g2_values;
-} TSCtx;
+void two_time_correlation(PetscScalar***,Vec,PetscReal,PetscInt,PetscReal,PetscReal,PetscInt,PetscReal,
+                          PetscInt,operator[],PetscInt,operator[],PetscInt,operator[]);
+void correlation_spectrum(PetscReal**,Vec,PetscInt,PetscReal[],PetscInt,operator[],PetscInt,operator[]);
 
 #endif
@@ -0,0 +1,13 @@
+#ifndef SOLVER_P_H_
+#define SOLVER_P_H_
+
+#include <petscksp.h>
+
+PetscInt _steady_state_pin();
+PetscInt _first_output_index(PetscReal);
+void     _solver_clear();
+
+extern PetscInt  _num_output_times;
+extern PetscReal *_output_times;
+
+#endif
@@ -0,0 +1,479 @@
+#include "symmetry.h"
+#include "symmetry_p.h"
+#include "quac_p.h"
+#include "operators_p.h"
+#include "operators.h"
+#include "excitation_basis_p.h"
+#include "dicke_p.h"
+#include "quantum_gates.h"
+#include "error_correction.h"
+#include "solver_p.h"
+#include "rotating_frame_p.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+ * Excitation number symmetry sectors. Q = sum_q l_q counts the
+ * excitations of a basis state, with l_q the level of subsystem q. Models
+ * such as Jaynes- and Tavis-Cummings without pumping only have terms
+ * that conserve Q (a^dag b, a^dag a, sig_z, ...) and Lindblad terms that
+ * change it by a fixed amount (a, sm), so the Liouvillian never couples
+ * rho_rc to rho_r'c' unless Q(r)-Q(c) = Q(r')-Q(c'). For psi, Q(i) itself
+ * is conserved. The label of each element is then fixed in time, and
+ * only the sectors (labels) the initial state occupies are integrated;
+ * the steady state lives in the label 0 sector.
+ *
+ * The sectors a state occupies are integrated together, as one block
+ * diagonal system, so that the ts_monitor still sees the full state at
+ * every step. When every term is a product of ops (or add_lin_local,
+ * whose rows are also generated one at a time), whether the model
+ * conserves Q is read off the op types (each Hamiltonian product must
+ * change Q by 0; a Lindblad product changes r and c alike) and the
+ * rows of the sectors are generated directly from the terms, so full_A
+ * is never built. Other terms (add_lin_mat, ...) need full_A; then the
+ * conservation is checked on it and the sectors are cut out of it.
+ *
+ * Ensembles (see dicke.c) count m + N/2 excitations in level |j,m>. The
+ * elements of rho between two different blocks j of an ensemble are
+ * always zero, so they are left out the same way, whether or not sectors
+ * were asked for.
+ */
+
+int _symmetry_sectors = 0;
+
+static IS         _sector_is      = NULL;
+static Mat        _sector_A       = NULL;
+static VecScatter _sector_scatter = NULL;
+static Vec        _sector_full_x  = NULL;
+static PetscErrorCode (*_sector_user_monitor)(TS,PetscInt,PetscReal,Vec,void*) = NULL;
+
+static PetscInt _sector_label(PetscInt,PetscInt);
+static int      _sector_conserved(Mat,PetscInt);
+static int      _sector_conserved_terms(int);
+static void     _sector_build_A(PetscInt,PetscInt,PetscInt[],int,int,Mat*);
+
+/*
+ * set_symmetry_sectors restricts time_step and steady_state to the
+ * excitation number sectors that are occupied, when the model conserves
+ * the excitation number. Models that do not are solved in full, with a
+ * warning. This can also be set with the command line option
+ * -symmetry_sectors. QuaC_clear turns it off.
+ */
+void set_symmetry_sectors(){
+  _symmetry_sectors = 1;
+  return;
+}
+
+/*
+ * _sector_rowwise returns 1 if _sector_begin will generate the sector
+ * matrix from the recorded terms, in which case time_step and
+ * steady_state skip building full_A and ham_A. psi is 1 for a
+ * Schrodinger solve.
+ */
+int _sector_rowwise(int psi){
+  int        k,num_terms,use_sectors,use_blocks;
+  model_term *terms;
+  PetscBool  flag;
+
+  PetscOptionsHasName(NULL,NULL,"-symmetry_sectors",&flag);
+  if (flag) {
+    _symmetry_sectors = 1;
+  }
+  use_sectors = _symmetry_sectors;
+  use_blocks  = (_num_dicke>0&&!psi);
+  if (!use_sectors&&!use_blocks) return 0;
+  /* Terms the rotating frame makes time dependent are not built row by row */
+  _apply_rotating_frame();
+  if (_matrix_free||_stiff_solver||_num_time_dep+_num_time_dep_lin||_num_quantum_gates>0||_num_circuits>0
+      ||_discrete_ec||_print_dense_ham) return 0;
+
+  _get_terms(&num_terms,&terms);
+  for (k=0;k<num_terms;k++){
+    if (!_term_has_rows(&terms[k])) return 0;
+  }
+  if (use_sectors&&!_sector_conserved_terms(psi)&&!use_blocks) return 0;
+  return 1;
+}
+
+/*
+ * _sector_begin restricts A and x to the sectors occupied by x (or to
+ * the label 0 sector, for the steady state), and to the elements within
+ * one block of every ensemble. The ts_monitor is wrapped so that it is
+ * given the full state. Returns 0, and does nothing, if neither applies
+ * or they cannot be used. If _sector_rowwise, A is not used (and need
+ * not have been built); the sector matrix is generated from the terms,
+ * with the diagonal set and, for the steady state, the trace row or the
+ * pinned row of _steady_state_setup.
+ *
+ * Inputs:
+ *      Vec  x:        the full density matrix (or wavefunction)
+ *      Mat  A:        the full matrix
+ *      int  steady:   1 to keep only the label 0 sector
+ * Outputs:
+ *      Vec  *sector_x: x restricted to the sectors
+ *      Mat  *sector_A: A restricted to the sectors
+ */
+int _sector_begin(Vec x,Mat A,int steady,Vec *sector_x,Mat *sector_A){
+  PetscInt          i,q,dim,max_q,num_labels,num_sectors,Istart,Iend,n_local,sector_dim,label;
+  PetscInt          *indices;
+  int               *occupied;
+  int               use_sectors,use_blocks,rowwise;
+  const PetscScalar *x_array;
+  PetscBool         flag;
+
+  PetscOptionsHasName(NULL,NULL,"-symmetry_sectors",&flag);
+  if (flag) {
+    _symmetry_sectors = 1;
+  }
+  use_sectors = _symmetry_sectors;
+  use_blocks  = (_num_dicke>0);
+  if (!use_sectors&&!use_blocks) return 0;
+  if (_matrix_free||_stiff_solver||_num_time_dep+_num_time_dep_lin||_num_quantum_gates>0||_num_circuits>0||_discrete_ec){
+    if (nid==0){
+      printf("Warning! Symmetry sectors and ensemble blocks only support constant models without gates. Using the full system.\n");
+    }
+    return 0;
+  }
+
+  VecGetSize(x,&dim);
+  if (dim==_basis_dim){
+    /* psi; every state of an ensemble is kept */
+    use_blocks = 0;
+  }
+  rowwise = _sector_rowwise(dim==_basis_dim);
+  if (!rowwise){
+    MatAssemblyBegin(A,MAT_FINAL_ASSEMBLY);
+    MatAssemblyEnd(A,MAT_FINAL_ASSEMBLY);
+  }
+  if (use_sectors&&rowwise&&!_sector_conserved_terms(dim==_basis_dim)){
+    if (nid==0){
+      printf("Warning! The model does not conserve the excitation number. Not using symmetry sectors.\n");
+    }
+    use_sectors = 0;
+  } else if (use_sectors&&!rowwise&&!_sector_conserved(A,dim)){
+    if (nid==0){
+      printf("Warning! The model does not conserve the excitation number. Not using symmetry sectors.\n");
+    }
+    use_sectors = 0;
+  }
+  if (!use_sectors&&!use_blocks) return 0;
+
+  /* Labels run from -max_q to max_q (0 to max_q for psi) */
+  max_q = 0;
+  for (q=0;q<num_subsystems;q++){
+    max_q = max_q + subsystem_list[q]->my_levels - 1;
+  }
+  num_labels = 2*max_q + 1;
+  occupied   = calloc(num_labels,sizeof(int));
+  if (!use_sectors) {
+    for (label=0;label<num_labels;label++){
+      occupied[label] = 1;
+    }
+  } else if (steady) {
+    occupied[max_q] = 1;
+  } else {
+    VecGetOwnershipRange(x,&Istart,&Iend);
+    VecGetArrayRead(x,&x_array);
+    for (i=Istart;i<Iend;i++){
+      if (x_array[i-Istart]!=0.0){
+        occupied[_sector_label(i,dim)+max_q] = 1;
+      }
+    }
+    VecRestoreArrayRead(x,&x_array);
+    MPI_Allreduce(MPI_IN_PLACE,occupied,num_labels,MPI_INT,MPI_MAX,PETSC_COMM_WORLD);
+  }
+  num_sectors = 0;
+  for (label=0;label<num_labels;label++){
+    num_sectors = num_sectors + occupied[label];
+  }
+
+  /* Keep the locally owned rows (elements of x) that are in an occupied sector */
+  VecGetOwnershipRange(x,&Istart,&Iend);
+  indices = malloc((Iend-Istart)*sizeof(PetscInt));
+  n_local = 0;
+  for (i=Istart;i<Iend;i++){
+    if (use_blocks&&!_dicke_block_diagonal(_basis_full_index(i))) continue;
+    if (occupied[_sector_label(i,dim)+max_q]){
+      indices[n_local] = i;
+      n_local = n_local + 1;
+    }
+  }
+  free(occupied);
+  ISCreateGeneral(PETSC_COMM_WORLD,n_local,indices,PETSC_OWN_POINTER,&_sector_is);
+  ISGetSize(_sector_is,&sector_dim);
+
+  if (rowwise) {
+    _sector_build_A(n_local,sector_dim,indices,dim==_basis_dim,steady,&_sector_A);
+  } else {
+    MatCreateSubMatrix(A,_sector_is,_sector_is,MAT_INITIAL_MATRIX,&_sector_A);
+  }
+  MatCreateVecs(_sector_A,sector_x,NULL);
+  VecScatterCreate(x,_sector_is,*sector_x,NULL,&_sector_scatter);
+  _sector_restrict(x,*sector_x);
+
+  _sector_full_x = x;
+  if (_ts_monitor!=NULL&&_ts_monitor!=_sector_ts_monitor){
+    _sector_user_monitor = _ts_monitor;
+    _ts_monitor          = _sector_ts_monitor;
+  }
+  *sector_A = _sector_A;
+
+  if (nid==0&&use_sectors){
+    printf("Symmetry sectors: solving %d occupied sectors, dimension %d of %d\n",
+           (int)num_sectors,(int)sector_dim,(int)dim);
+  } else if (nid==0){
+    printf("Ensemble blocks: solving dimension %d of %d\n",(int)sector_dim,(int)dim);
+  }
+  return 1;
+}
+
+/*
+ * _sector_restrict copies the sector elements of the full vector x into
+ * sector_x. Only valid between _sector_begin and _sector_end.
+ */
+void _sector_restrict(Vec x,Vec sector_x){
+  VecScatterBegin(_sector_scatter,x,sector_x,INSERT_VALUES,SCATTER_FORWARD);
+  VecScatterEnd(_sector_scatter,x,sector_x,INSERT_VALUES,SCATTER_FORWARD);
+  return;
+}
+
+/*
+ * _sector_expand copies sector_x into the sector elements of the full
+ * vector x, leaving the others as they are. Only valid between
+ * _sector_begin and _sector_end.
+ */
+void _sector_expand(Vec sector_x,Vec x){
+  VecScatterBegin(_sector_scatter,sector_x,x,INSERT_VALUES,SCATTER_REVERSE);
+  VecScatterEnd(_sector_scatter,sector_x,x,INSERT_VALUES,SCATTER_REVERSE);
+  return;
+}
+
+/*
+ * _sector_end copies sector_x back into x, destroys sector_x, and
+ * restores the user's ts_monitor. The elements of x outside of the
+ * sectors are not touched; they are zero, and stay zero.
+ */
+void _sector_end(Vec x,Vec *sector_x){
+  VecScatterBegin(_sector_scatter,*sector_x,x,INSERT_VALUES,SCATTER_REVERSE);
+  VecScatterEnd(_sector_scatter,*sector_x,x,INSERT_VALUES,SCATTER_REVERSE);
+  if (_ts_monitor==_sector_ts_monitor){
+    _ts_monitor = _sector_user_monitor;
+  }
+  VecDestroy(sector_x);
+  VecScatterDestroy(&_sector_scatter);
+  MatDestroy(&_sector_A);
+  ISDestroy(&_sector_is);
+  _sector_full_x = NULL;
+  return;
+}
+
+/*
+ * _sector_ts_monitor calls the user's ts_monitor with the full state
+ */
+PetscErrorCode _sector_ts_monitor(TS ts,PetscInt step,PetscReal time,Vec x,void *ctx){
+  VecScatterBegin(_sector_scatter,x,_sector_full_x,INSERT_VALUES,SCATTER_REVERSE);
+  VecScatterEnd(_sector_scatter,x,_sector_full_x,INSERT_VALUES,SCATTER_REVERSE);
+  return _sector_user_monitor(ts,step,time,_sector_full_x,ctx);
+}
+
+/*
+ * _sector_label gives the sector of element i: Q(i) for psi (dim is
+ * _basis_dim), and Q(r) - Q(c) for rho_rc, i = _basis_dim*c + r.
+ */
+static PetscInt _sector_label(PetscInt i,PetscInt dim){
+  PetscInt q,r,c,stride,label;
+  operator this_op;
+
+  if (dim==_basis_dim){
+    r = _basis_state(i);
+    c = -1;
+  } else {
+    r = _basis_state(i%_basis_dim);
+    c = _basis_state(i/_basis_dim);
+  }
+  label = 0;
+  for (q=0;q<num_subsystems;q++){
+    this_op = subsystem_list[q];
+    stride  = total_levels/(this_op->my_levels*this_op->n_before);
+    label   = label + _level_excitations(this_op,(r/stride)%this_op->my_levels);
+    if (c>=0) label = label - _level_excitations(this_op,(c/stride)%this_op->my_levels);
+  }
+  return label;
+}
+
+/*
+ * _sector_build_A generates the matrix of the rows indices[] (the local
+ * part of the sector) from the recorded terms. A column c of a row is
+ * mapped to its position in the sector, found by bisection in the
+ * (sorted) list of every rank's indices; the sectors are closed under the
+ * terms, so every column is found. For the steady state, the trace row
+ * (or the pinned row) of _steady_state_setup is added here, in the
+ * sector's numbering.
+ */
+static void _sector_build_A(PetscInt n_local,PetscInt sector_dim,PetscInt indices[],int psi,int steady,Mat *sector_A){
+  PetscInt    i,k,row,pin_row,num_cols,max_cols,first_row,loc,pass;
+  PetscInt    *all_indices,*cols,*d_nnz,*o_nnz;
+  PetscScalar *vals;
+  PetscMPIInt my_count,*counts,*displs;
+  int         rank;
+
+  /* Every rank needs the whole (sorted) sector, to number the columns */
+  PetscMalloc1(sector_dim,&all_indices);
+  PetscMalloc1(np,&counts);
+  PetscMalloc1(np,&displs);
+  my_count = (PetscMPIInt)n_local;
+  MPI_Allgather(&my_count,1,MPI_INT,counts,1,MPI_INT,PETSC_COMM_WORLD);
+  displs[0] = 0;
+  for (rank=1;rank<np;rank++){
+    displs[rank] = displs[rank-1] + counts[rank-1];
+  }
+  MPI_Allgatherv(indices,my_count,MPIU_INT,all_indices,counts,displs,MPIU_INT,PETSC_COMM_WORLD);
+  first_row = displs[nid];
+  PetscFree(counts);
+  PetscFree(displs);
+
+  pin_row = -1;
+  max_cols = _get_terms_row_size() + 1;
+  if (steady) {
+    pin_row = _steady_state_pin();
+    if (pin_row>=0) {
+      pin_row = pin_row*(_basis_dim+1);
+    } else {
+      /* Row 0 gets 1.0 at every diagonal element */
+      max_cols = max_cols + _basis_dim;
+    }
+  }
+  PetscMalloc1(max_cols,&cols);
+  PetscMalloc1(max_cols,&vals);
+  PetscCalloc1(n_local,&d_nnz);
+  PetscCalloc1(n_local,&o_nnz);
+
+  MatCreate(PETSC_COMM_WORLD,sector_A);
+  MatSetType(*sector_A,MATMPIAIJ);
+  MatSetSizes(*sector_A,n_local,n_local,sector_dim,sector_dim);
+  MatSetFromOptions(*sector_A);
+
+  /* The first pass counts the entries of each row, the second inserts them */
+  for (pass=0;pass<2;pass++){
+    for (i=0;i<n_local;i++){
+      row = indices[i];
+      if (row==pin_row){
+        /* rho_{pin,pin} = 1 */
+        num_cols = 1;
+        cols[0]  = row;
+        vals[0]  = 1.0;
+      } else {
+        _get_terms_row(row,psi,&num_cols,cols,vals);
+        cols[num_cols] = row;
+        vals[num_cols] = 0.0;
+        num_cols = num_cols + 1;
+        if (steady&&pin_row<0&&row==0){
+          for (k=0;k<_basis_dim;k++){
+            cols[num_cols] = k*(_basis_dim+1);
+            vals[num_cols] = 1.0;
+            num_cols = num_cols + 1;
+          }
+        }
+      }
+      /* Number the columns within the sector, and merge repeats */
+      for (k=0;k<num_cols;k++){
+        PetscFindInt(cols[k],sector_dim,all_indices,&loc);
+        if (loc<0){
+          if (nid==0){
+            printf("ERROR! A term couples an occupied sector to an empty one!\n");
+          }
+          exit(0);
+        }
+        cols[k] = loc;
+      }
+      _merge_row(&num_cols,cols,vals);
+      if (pass==0){
+        for (k=0;k<num_cols;k++){
+          if (cols[k]>=first_row&&cols[k]<first_row+n_local){
+            d_nnz[i] = d_nnz[i] + 1;
+          } else {
+            o_nnz[i] = o_nnz[i] + 1;
+          }
+        }
+      } else {
+        row = first_row + i;
+        MatSetValues(*sector_A,1,&row,num_cols,cols,vals,ADD_VALUES);
+      }
+    }
+    if (pass==0){
+      MatMPIAIJSetPreallocation(*sector_A,0,d_nnz,0,o_nnz);
+    }
+  }
+  MatAssemblyBegin(*sector_A,MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(*sector_A,MAT_FINAL_ASSEMBLY);
+
+  PetscFree(all_indices);
+  PetscFree(cols);
+  PetscFree(vals);
+  PetscFree(d_nnz);
+  PetscFree(o_nnz);
+  return;
+}
+
+/*
+ * _sector_conserved_terms checks, from the op types, that every
+ * Hamiltonian product changes Q by 0, and that every Lindblad product
+ * changes it by a fixed amount (for rho; for psi, Q(i) must be kept, and
+ * only the Hamiltonian acts). Returns 1 if so.
+ */
+static int _sector_conserved_terms(int psi){
+  int        k,m,num_terms;
+  PetscInt   delta;
+  model_term *terms,*this_term;
+  operator   this_op;
+
+  _get_terms(&num_terms,&terms);
+  for (k=0;k<num_terms;k++){
+    this_term = &terms[k];
+    if (PetscAbsComplex(this_term->a)==0) continue;
+    delta = 0;
+    for (m=0;m<this_term->num_ops;m++){
+      this_op = this_term->ops[m];
+      if (this_op->my_op_type==RAISE||this_op->my_op_type==DICKE_RAISE){
+        delta = delta + 1;
+      } else if (this_op->my_op_type==LOWER||this_op->my_op_type==DICKE_LOWER){
+        delta = delta - 1;
+      } else if (this_op->my_op_type==SIGMA_X||this_op->my_op_type==SIGMA_Y){
+        return 0;
+      } else if (this_op->my_op_type==VEC&&m+1<this_term->num_ops&&this_term->ops[m+1]->my_op_type==VEC){
+        /* |p><q| changes Q by its excitations in p less those in q */
+        delta = delta + this_op->position - this_term->ops[m+1]->position;
+        m = m + 1;
+      }
+    }
+    if (this_term->my_term_type<TERM_LIN&&delta!=0) return 0;
+  }
+  return 1;
+}
+
+/*
+ * _sector_conserved checks that A has no nonzero element coupling
+ * two different sectors. Returns 1 if it does not, on all ranks.
+ */
+static int _sector_conserved(Mat A,PetscInt dim){
+  PetscInt          i,j,ncols,Istart,Iend,label;
+  const PetscInt    *cols;
+  const PetscScalar *vals;
+  int               conserved,all_conserved;
+
+  conserved = 1;
+  MatGetOwnershipRange(A,&Istart,&Iend);
+  for (i=Istart;i<Iend&&conserved;i++){
+    label = _sector_label(i,dim);
+    MatGetRow(A,i,&ncols,&cols,&vals);
+    for (j=0;j<ncols;j++){
+      if (vals[j]!=0.0&&_sector_label(cols[j],dim)!=label){
+        conserved = 0;
+        break;
+      }
+    }
+    MatRestoreRow(A,i,&ncols,&cols,&vals);
+  }
+  MPI_Allreduce(&conserved,&all_conserved,1,MPI_INT,MPI_MIN,PETSC_COMM_WORLD);
+  return all_conserved;
+}
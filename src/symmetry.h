@@ -0,0 +1,8 @@
+#ifndef SYMMETRY_H_
+#define SYMMETRY_H_
+
+#include <petsc.h>
+
+void set_symmetry_sectors();
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef SYMMETRY_P_H_
+#define SYMMETRY_P_H_
+
+#include <petscts.h>
+
+int  _sector_rowwise(int);
+int  _sector_begin(Vec,Mat,int,Vec*,Mat*);
+void _sector_restrict(Vec,Vec);
+void _sector_expand(Vec,Vec);
+void _sector_end(Vec,Vec*);
+PetscErrorCode _sector_ts_monitor(TS,PetscInt,PetscReal,Vec,void*);
+
+extern int _symmetry_sectors;
+extern PetscErrorCode (*_ts_monitor)(TS,PetscInt,PetscReal,Vec,void*);
+
+#endif
@@ -0,0 +1,502 @@
+#include "kron_p.h" //Includes petscmat.h and operators_p.h
+#include "quac_p.h"
+#include "operators.h"
+#include "matrix_free_p.h"
+#include "trajectory.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+/*
+ * Monte Carlo wavefunction (quantum jump) solver.
+ *
+ * Rather than evolving the N^2 sized rho, num_traj state vectors of size N
+ * are evolved under the non-Hermitian effective Hamiltonian,
+ *     d psi/dt = K_L psi,  K_L = -iH - 1/2 sum_k a_k C_k^t C_k
+ * until |psi|^2 drops below a random threshold r. A jump,
+ *     psi -> C_k psi / |C_k psi|
+ * is then taken, with probability proportional to a_k |C_k psi|^2, and
+ * a new threshold is drawn. Observables are averaged over trajectories.
+ *
+ * K_L and the C_k are the N x N terms of the matrix-free Liouvillian
+ * (see matrix_free.c), so set_matrix_free must be called before the
+ * Hamiltonian and Lindblad terms are added.
+ *
+ * PETSC_COMM_WORLD is split into groups of -mcwf_ranks_per_traj ranks
+ * (default 1), each of which runs its own set of trajectories. Trajectory
+ * i always uses the random stream seeded with -mcwf_seed + i, so
+ * the results do not depend on the number of ranks.
+ */
+
+typedef struct mcwf_ctx{
+  MPI_Comm    comm;
+  PetscInt    num_left,num_jump;
+  PetscInt    *left_term,*jump_term; /* Index into _mf_ctx.terms */
+  Mat         *left,*jump;           /* Copies of the terms on comm */
+  Vec         work;
+  PetscRandom rand;
+  PetscReal   r;                     /* Current jump threshold */
+  PetscInt    num_jumps;
+} mcwf_ctx;
+
+static mcwf_obs _mcwf_obs_list[MAX_SUB];
+static int      _num_mcwf_obs = 0;
+
+static void        _mcwf_copy_to_comm(Mat,MPI_Comm,Mat*);
+static void        _mcwf_ops_to_mat(MPI_Comm,PetscInt,operator*,Mat*);
+static PetscScalar _mcwf_coeff(PetscInt,PetscReal);
+static PetscReal   _mcwf_random(mcwf_ctx*);
+PetscErrorCode _mcwf_rhs(TS,PetscReal,Vec,Vec,void*);
+PetscErrorCode _mcwf_event(TS,PetscReal,Vec,PetscScalar*,void*);
+PetscErrorCode _mcwf_postevent(TS,PetscInt,PetscInt[],PetscReal,Vec,PetscBool,void*);
+
+/*
+ * create_psi creates a (zeroed) state vector, of size total_levels,
+ * for use as the initial condition of mcwf_time_step.
+ * Outputs:
+ *       Vec *new_psi: the new state vector
+ */
+void create_psi(Vec *new_psi){
+
+  _check_initialized_A();
+  MatCreateVecs(ham_A,new_psi,NULL);
+  VecSet(*new_psi,0.0);
+  return;
+}
+
+/*
+ * set_psi_from_initial_pop sets psi to the product state described by
+ * the initial populations (see set_initial_pop). Ladder operators are put
+ * in the state initial_pop; a VEC operator is put in the superposition
+ * sum_j sqrt(pop_j) |j>.
+ * Inputs:
+ *       Vec psi: state vector, created with create_psi
+ */
+void set_psi_from_initial_pop(Vec psi){
+  PetscInt    i,j,k,Istart,Iend,n_after,i_sub;
+  PetscScalar amp;
+  PetscReal   vec_pop;
+  operator    sub;
+
+  VecGetOwnershipRange(psi,&Istart,&Iend);
+  for (i=Istart;i<Iend;i++){
+    amp = 1.0;
+    for (j=0;j<num_subsystems&&amp!=0.0;j++){
+      sub     = subsystem_list[j];
+      n_after = total_levels/(sub->my_levels*sub->n_before);
+      i_sub   = (i/n_after)%sub->my_levels;
+      if (sub->my_op_type==VEC){
+        vec_pop = 0.0;
+        for (k=0;k<sub->my_levels;k++){
+          vec_pop += sub->vec_op_list[k]->initial_pop;
+        }
+        if (vec_pop==0.0){
+          /* Default to all population in the 0th element, like set_dm_from_initial_pop */
+          if (i_sub!=0) amp = 0.0;
+        } else {
+          amp = amp*PetscSqrtReal(sub->vec_op_list[i_sub]->initial_pop/vec_pop);
+        }
+      } else {
+        if (i_sub!=(PetscInt)sub->initial_pop) amp = 0.0;
+      }
+    }
+    VecSetValue(psi,i,amp,INSERT_VALUES);
+  }
+  VecAssemblyBegin(psi);
+  VecAssemblyEnd(psi);
+  return;
+}
+
+/*
+ * add_mcwf_observable registers op1*op2*...*opn as an observable
+ * to be averaged by mcwf_time_step.
+ * Inputs:
+ *       int num_ops: number of operators in the product
+ *       operator op1...: the operators (VECs come in pairs)
+ */
+void add_mcwf_observable(int num_ops,...){
+  va_list ap;
+  int     i;
+
+  if (_num_mcwf_obs>=MAX_SUB){
+    if (nid==0){
+      printf("ERROR! Too many mcwf observables!\n");
+      printf("       Maximum is %d\n",MAX_SUB);
+      exit(0);
+    }
+  }
+  _mcwf_obs_list[_num_mcwf_obs].num_ops = num_ops;
+  _mcwf_obs_list[_num_mcwf_obs].ops     = malloc(num_ops*sizeof(struct operator));
+  va_start(ap,num_ops);
+  for (i=0;i<num_ops;i++){
+    _mcwf_obs_list[_num_mcwf_obs].ops[i] = va_arg(ap,operator);
+  }
+  va_end(ap);
+  _num_mcwf_obs = _num_mcwf_obs + 1;
+  return;
+}
+
+int get_num_mcwf_observables(){
+  return _num_mcwf_obs;
+}
+
+/*
+ * mcwf_time_step averages the registered observables over num_traj
+ * quantum trajectories. Output is at num_out evenly spaced times,
+ *     t_k = init_time + (k+1)*(time_max-init_time)/num_out,
+ * so the last output is at time_max. The TS used for each trajectory
+ * can be controlled with options prefixed by -mcwf_ (default TSRK).
+ *
+ * Inputs:
+ *       Vec psi0:           initial state, created with create_psi
+ *       PetscReal init_time: initial time
+ *       PetscReal time_max:  final time
+ *       PetscReal dt:        initial time step
+ *       PetscInt steps_max:  max number of steps per trajectory
+ *       PetscInt num_traj:   number of trajectories
+ *       PetscInt num_out:    number of output times
+ * Outputs:
+ *       PetscScalar **observables: observables[i][k] is the average of
+ *                                  observable i at t_k. Must be allocated by
+ *                                  the caller, and is set on every rank.
+ */
+void mcwf_time_step(Vec psi0,PetscReal init_time,PetscReal time_max,PetscReal dt,PetscInt steps_max,
+                    PetscInt num_traj,PetscInt num_out,PetscScalar **observables){
+  mcwf_ctx          ctx;
+  TS                ts;
+  Mat               *obs_mats;
+  Vec               psi,psi_init,psi0_all;
+  VecScatter        to_all;
+  PetscScalar       *sums,*psi_array,val;
+  const PetscScalar *psi0_array;
+  PetscReal         norm,t_out;
+  PetscInt          ranks_per_traj=1,seed=1,i,k,traj,num_groups,Istart,Iend,total_jumps;
+  PetscInt          direction=-1;
+  PetscBool         terminate=PETSC_FALSE;
+  PetscMPIInt       group_rank;
+
+  if (!_matrix_free){
+    if (nid==0){
+      printf("ERROR! mcwf_time_step needs the N x N operators of the matrix-free solver.\n");
+      printf("       Call set_matrix_free() before adding terms.\n");
+      exit(0);
+    }
+  }
+  if (_stiff_solver){
+    if (nid==0){
+      printf("ERROR! Stiff terms are not supported by mcwf_time_step.\n");
+      exit(0);
+    }
+  }
+
+  PetscLogStagePop();
+  PetscLogStagePush(solve_stage);
+
+  PetscOptionsGetInt(NULL,NULL,"-mcwf_ranks_per_traj",&ranks_per_traj,NULL);
+  PetscOptionsGetInt(NULL,NULL,"-mcwf_seed",&seed,NULL);
+  if (ranks_per_traj<1||np%ranks_per_traj!=0){
+    if (nid==0){
+      printf("ERROR! -mcwf_ranks_per_traj must evenly divide the number of ranks.\n");
+      exit(0);
+    }
+  }
+  num_groups = np/ranks_per_traj;
+  MPI_Comm_split(PETSC_COMM_WORLD,nid/ranks_per_traj,nid,&ctx.comm);
+  MPI_Comm_rank(ctx.comm,&group_rank);
+
+  /* Copy K_L (the left terms) and the jump operators onto the group */
+  _mf_assemble_ops();
+  ctx.left_term = malloc(_mf_ctx.num_terms*sizeof(PetscInt));
+  ctx.jump_term = malloc(_mf_ctx.num_terms*sizeof(PetscInt));
+  ctx.left      = malloc(_mf_ctx.num_terms*sizeof(Mat));
+  ctx.jump      = malloc(_mf_ctx.num_terms*sizeof(Mat));
+  ctx.num_left  = 0;
+  ctx.num_jump  = 0;
+  for (i=0;i<_mf_ctx.num_terms;i++){
+    if (_mf_ctx.terms[i].type==MF_LEFT){
+      ctx.left_term[ctx.num_left] = i;
+      _mcwf_copy_to_comm(_mf_ctx.terms[i].mat,ctx.comm,&ctx.left[ctx.num_left]);
+      ctx.num_left = ctx.num_left + 1;
+    } else if (_mf_ctx.terms[i].type==MF_JUMP){
+      ctx.jump_term[ctx.num_jump] = i;
+      _mcwf_copy_to_comm(_mf_ctx.terms[i].mat,ctx.comm,&ctx.jump[ctx.num_jump]);
+      ctx.num_jump = ctx.num_jump + 1;
+    }
+  }
+
+  obs_mats = malloc(_num_mcwf_obs*sizeof(Mat));
+  for (i=0;i<_num_mcwf_obs;i++){
+    _mcwf_ops_to_mat(ctx.comm,_mcwf_obs_list[i].num_ops,_mcwf_obs_list[i].ops,&obs_mats[i]);
+  }
+
+  /* Every group gets its own copy of the initial state */
+  VecScatterCreateToAll(psi0,&to_all,&psi0_all);
+  VecScatterBegin(to_all,psi0,psi0_all,INSERT_VALUES,SCATTER_FORWARD);
+  VecScatterEnd(to_all,psi0,psi0_all,INSERT_VALUES,SCATTER_FORWARD);
+  MatCreateVecs(ctx.left[0],&psi_init,NULL);
+  VecGetOwnershipRange(psi_init,&Istart,&Iend);
+  VecGetArrayRead(psi0_all,&psi0_array);
+  VecGetArray(psi_init,&psi_array);
+  for (i=Istart;i<Iend;i++){
+    psi_array[i-Istart] = psi0_array[i];
+  }
+  VecRestoreArray(psi_init,&psi_array);
+  VecRestoreArrayRead(psi0_all,&psi0_array);
+  VecScatterDestroy(&to_all);
+  VecDestroy(&psi0_all);
+
+  VecDuplicate(psi_init,&psi);
+  VecDuplicate(psi_init,&ctx.work);
+  PetscRandomCreate(ctx.comm,&ctx.rand);
+  PetscRandomSetInterval(ctx.rand,0.0,1.0);
+  ctx.num_jumps = 0;
+
+  sums = malloc(_num_mcwf_obs*num_out*sizeof(PetscScalar));
+  for (i=0;i<_num_mcwf_obs*num_out;i++){
+    sums[i] = 0.0;
+  }
+
+  for (traj=nid/ranks_per_traj;traj<num_traj;traj+=num_groups){
+    PetscRandomSetSeed(ctx.rand,(unsigned long)(seed+traj));
+    PetscRandomSeed(ctx.rand);
+    ctx.r = _mcwf_random(&ctx);
+    VecCopy(psi_init,psi);
+
+    TSCreate(ctx.comm,&ts);
+    TSSetOptionsPrefix(ts,"mcwf_");
+    TSSetRHSFunction(ts,NULL,_mcwf_rhs,&ctx);
+    TSSetTime(ts,init_time);
+    TSSetTimeStep(ts,dt);
+    TSSetMaxSteps(ts,steps_max);
+    TSSetExactFinalTime(ts,TS_EXACTFINALTIME_MATCHSTEP);
+    TSSetType(ts,TSRK);
+    TSSetEventHandler(ts,1,&direction,&terminate,_mcwf_event,_mcwf_postevent,&ctx);
+    TSSetFromOptions(ts);
+
+    for (k=0;k<num_out;k++){
+      t_out = init_time + (k+1)*(time_max-init_time)/num_out;
+      TSSetMaxTime(ts,t_out);
+      TSSolve(ts,psi);
+
+      /* <O> = <psi|O|psi>/<psi|psi>; psi is not normalized between jumps */
+      VecNorm(psi,NORM_2,&norm);
+      for (i=0;i<_num_mcwf_obs;i++){
+        MatMult(obs_mats[i],psi,ctx.work);
+        VecDot(ctx.work,psi,&val);
+        /* Every rank of the group has val; count it once */
+        if (group_rank==0){
+          sums[i*num_out+k] += val/(norm*norm);
+        }
+      }
+    }
+    TSDestroy(&ts);
+  }
+
+  /* Average over all trajectories */
+  MPI_Allreduce(MPI_IN_PLACE,sums,_num_mcwf_obs*num_out,MPIU_SCALAR,MPIU_SUM,PETSC_COMM_WORLD);
+  for (i=0;i<_num_mcwf_obs;i++){
+    for (k=0;k<num_out;k++){
+      observables[i][k] = sums[i*num_out+k]/num_traj;
+    }
+  }
+  if (group_rank!=0) ctx.num_jumps = 0;
+  MPI_Allreduce(&ctx.num_jumps,&total_jumps,1,MPIU_INT,MPI_SUM,PETSC_COMM_WORLD);
+  if (nid==0) printf("MCWF: %d trajectories, %d jumps\n",(int)num_traj,(int)total_jumps);
+
+  /* Free work space */
+  free(sums);
+  for (i=0;i<_num_mcwf_obs;i++){
+    MatDestroy(&obs_mats[i]);
+  }
+  free(obs_mats);
+  for (i=0;i<ctx.num_left;i++){
+    MatDestroy(&ctx.left[i]);
+  }
+  for (i=0;i<ctx.num_jump;i++){
+    MatDestroy(&ctx.jump[i]);
+  }
+  free(ctx.left);
+  free(ctx.jump);
+  free(ctx.left_term);
+  free(ctx.jump_term);
+  VecDestroy(&psi);
+  VecDestroy(&psi_init);
+  VecDestroy(&ctx.work);
+  PetscRandomDestroy(&ctx.rand);
+  MPI_Comm_free(&ctx.comm);
+
+  PetscLogStagePop();
+  PetscLogStagePush(post_solve_stage);
+  return;
+}
+
+/*
+ * _mcwf_clear frees the registered observables; called from QuaC_clear
+ */
+void _mcwf_clear(){
+  int i;
+
+  for (i=0;i<_num_mcwf_obs;i++){
+    free(_mcwf_obs_list[i].ops);
+  }
+  _num_mcwf_obs = 0;
+  return;
+}
+
+/*
+ * _mcwf_rhs computes F = K_L(t) psi, where K_L(t) is the sum of the
+ * (possibly time dependent) left terms
+ */
+PetscErrorCode _mcwf_rhs(TS ts,PetscReal t,Vec X,Vec F,void *ctx_p){
+  mcwf_ctx    *ctx = (mcwf_ctx*)ctx_p;
+  PetscScalar coeff;
+  PetscInt    i;
+
+  VecSet(F,0.0);
+  for (i=0;i<ctx->num_left;i++){
+    coeff = _mcwf_coeff(ctx->left_term[i],t);
+    if (PetscAbsComplex(coeff)!=0){
+      MatMult(ctx->left[i],X,ctx->work);
+      VecAXPY(F,coeff,ctx->work);
+    }
+  }
+  PetscFunctionReturn(0);
+}
+
+/*
+ * _mcwf_event triggers when |psi|^2 crosses the jump threshold r
+ */
+PetscErrorCode _mcwf_event(TS ts,PetscReal t,Vec U,PetscScalar *fvalue,void *ctx_p){
+  mcwf_ctx  *ctx = (mcwf_ctx*)ctx_p;
+  PetscReal norm;
+
+  VecNorm(U,NORM_2,&norm);
+  fvalue[0] = norm*norm - ctx->r;
+  return(0);
+}
+
+/*
+ * _mcwf_postevent applies a randomly chosen jump to psi, renormalizes
+ * it and draws a new threshold
+ */
+PetscErrorCode _mcwf_postevent(TS ts,PetscInt nevents,PetscInt event_list[],PetscReal t,Vec U,PetscBool forward,void *ctx_p){
+  mcwf_ctx    *ctx = (mcwf_ctx*)ctx_p;
+  PetscReal   *rates,total_rate,norm,u;
+  PetscInt    k;
+
+  rates      = malloc(ctx->num_jump*sizeof(PetscReal));
+  total_rate = 0.0;
+  for (k=0;k<ctx->num_jump;k++){
+    MatMult(ctx->jump[k],U,ctx->work);
+    VecNorm(ctx->work,NORM_2,&norm);
+    rates[k]   = PetscRealPart(_mcwf_coeff(ctx->jump_term[k],t))*norm*norm;
+    total_rate = total_rate + rates[k];
+  }
+
+  if (total_rate>0){
+    /* Pick jump k with probability rates[k]/total_rate */
+    u = _mcwf_random(ctx)*total_rate;
+    for (k=0;k<ctx->num_jump-1&&u>rates[k];k++){
+      u = u - rates[k];
+    }
+    MatMult(ctx->jump[k],U,ctx->work);
+    VecCopy(ctx->work,U);
+    ctx->num_jumps = ctx->num_jumps + 1;
+  }
+  VecNormalize(U,NULL);
+  free(rates);
+
+  ctx->r = _mcwf_random(ctx);
+  TSSetSolution(ts,U);
+  return(0);
+}
+
+/*
+ * _mcwf_coeff returns the coefficient of term i of the matrix-free
+ * Liouvillian at time t
+ */
+static PetscScalar _mcwf_coeff(PetscInt i,PetscReal t){
+  if (_mf_ctx.terms[i].time_dep_func!=NULL){
+    return _mf_ctx.terms[i].time_dep_func(t);
+  }
+  return _mf_ctx.terms[i].coeff;
+}
+
+/*
+ * _mcwf_random returns a uniform random number in [0,1) that is
+ * the same on every rank of the group
+ */
+static PetscReal _mcwf_random(mcwf_ctx *ctx){
+  PetscScalar u;
+  PetscReal   u_real;
+
+  PetscRandomGetValue(ctx->rand,&u);
+  u_real = PetscRealPart(u);
+  MPI_Bcast(&u_real,1,MPIU_REAL,0,ctx->comm);
+  return u_real;
+}
+
+/*
+ * _mcwf_copy_to_comm copies a sequential N x N matrix, which every rank
+ * holds in full, into a parallel matrix on comm
+ */
+static void _mcwf_copy_to_comm(Mat M_seq,MPI_Comm comm,Mat *M){
+  PetscInt          i,j,Istart,Iend,local_size,ncols,*d_nnz,*o_nnz;
+  const PetscInt    *cols;
+  const PetscScalar *vals;
+
+  local_size = PETSC_DECIDE;
+  PetscSplitOwnership(comm,&local_size,&total_levels);
+  MPI_Scan(&local_size,&Iend,1,MPIU_INT,MPI_SUM,comm);
+  Istart = Iend - local_size;
+
+  /* Exact preallocation from the sequential copy */
+  PetscMalloc1(local_size,&d_nnz);
+  PetscMalloc1(local_size,&o_nnz);
+  for (i=Istart;i<Iend;i++){
+    d_nnz[i-Istart] = 0;
+    o_nnz[i-Istart] = 0;
+    MatGetRow(M_seq,i,&ncols,&cols,NULL);
+    for (j=0;j<ncols;j++){
+      if (cols[j]>=Istart&&cols[j]<Iend){
+        d_nnz[i-Istart]++;
+      } else {
+        o_nnz[i-Istart]++;
+      }
+    }
+    MatRestoreRow(M_seq,i,&ncols,&cols,NULL);
+  }
+  MatCreateAIJ(comm,local_size,local_size,total_levels,total_levels,0,d_nnz,0,o_nnz,M);
+  PetscFree(d_nnz);
+  PetscFree(o_nnz);
+
+  for (i=Istart;i<Iend;i++){
+    MatGetRow(M_seq,i,&ncols,&cols,&vals);
+    MatSetValues(*M,1,&i,ncols,cols,vals,INSERT_VALUES);
+    MatRestoreRow(M_seq,i,&ncols,&cols,&vals);
+  }
+  MatAssemblyBegin(*M,MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(*M,MAT_FINAL_ASSEMBLY);
+  return;
+}
+
+/*
+ * _mcwf_ops_to_mat builds op1*op2*...*opn as an N x N parallel
+ * matrix on comm
+ */
+static void _mcwf_ops_to_mat(MPI_Comm comm,PetscInt num_ops,operator *ops,Mat *M){
+  PetscInt    i,j,Istart,Iend;
+  PetscScalar val;
+
+  MatCreateAIJ(comm,PETSC_DECIDE,PETSC_DECIDE,total_levels,total_levels,1,NULL,1,NULL,M);
+  MatGetOwnershipRange(*M,&Istart,&Iend);
+  for (i=Istart;i<Iend;i++){
+    _mf_get_val_j_product(i,num_ops,ops,&j,&val);
+    if (j!=-1){
+      MatSetValue(*M,i,j,val,ADD_VALUES);
+    }
+  }
+  MatAssemblyBegin(*M,MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(*M,MAT_FINAL_ASSEMBLY);
+  return;
+}
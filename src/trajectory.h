@@ -0,0 +1,19 @@
+#ifndef TRAJECTORY_H_
+#define TRAJECTORY_H_
+
+#include "operators.h"
+#include <petscts.h>
+
+typedef struct mcwf_obs{
+  operator *ops;
+  int      num_ops;
+} mcwf_obs;
+
+void create_psi(Vec*);
+void set_psi_from_initial_pop(Vec);
+void add_mcwf_observable(int,...);
+int  get_num_mcwf_observables();
+void mcwf_time_step(Vec,PetscReal,PetscReal,PetscReal,PetscInt,PetscInt,PetscInt,PetscScalar**);
+void _mcwf_clear();
+
+#endif
@@ -0,0 +1,579 @@
+#include "trotter_p.h"
+#include "expmv_p.h"
+#include "solver_p.h"
+#include "kron_p.h"
+#include "quac_p.h"
+#include "operators_p.h"
+#include "operators.h"
+#include "excitation_basis_p.h"
+#include "quantum_gates.h"
+#include "error_correction.h"
+#include "checkpoint_p.h"
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+ * Split-operator (Strang) propagation of time independent models built
+ * from products of operators, such as the Jaynes- and Tavis-Cummings
+ * models. The generator is split as A + B_1 + ... + B_n, where A is the
+ * diagonal part of H (number operators, sig_z, |e><e|, and their products)
+ * and B_b is the sum of the other terms acting on one set of subsystems.
+ * One step of size tau is
+ *
+ *   exp(A tau/2) exp(B_1 tau/2) ... exp(B_n tau) ... exp(B_1 tau/2) exp(A tau/2),
+ *
+ * which has an O(tau^3) local error (see doc/trotter_propagation.tex).
+ * exp(A tau/2) is applied elementwise, and each exp(B_b tau) is a small
+ * dense matrix applied to the subspace of its subsystems, for every
+ * value of the other subsystems, so no sparse matrix is ever built.
+ */
+
+int _trotter = 0;
+
+static trotter_ctx _trotter_ctx;
+
+static int            _trotter_setup(int);
+static int            _term_subsystems(model_term*,int[]);
+static int            _init_block(trotter_block*,int,int,int[]);
+static trotter_block* _find_block(trotter_block*);
+static void           _block_op_matrix(trotter_block*,model_term*,PetscScalar*);
+static PetscInt       _block_index(trotter_block*,PetscInt);
+static void           _trotter_set_step(PetscReal);
+static void           _trotter_step(Vec);
+static void           _apply_phase(PetscScalar*);
+static void           _apply_block(trotter_block*,PetscScalar*,PetscScalar*);
+static void           _apply_block_digits(PetscScalar*,PetscInt,PetscInt[],PetscInt[],PetscInt,PetscScalar*,int);
+static void           _trotter_destroy();
+
+/*
+ * set_trotter_propagator tells time_step to propagate with fixed steps
+ * of dt of the symmetric split-operator method, instead of with a TS.
+ * Every term must be a product of operators (add_to_ham, add_to_ham_mult2,
+ * add_lin, ...) and nothing may be time dependent; otherwise time_step
+ * falls back to the TS, as it does on more than one rank or to write
+ * checkpoints. Circuits are applied between steps. The error is O(dt^2),
+ * set by the commutators of the split pieces, so dt should be checked by
+ * halving it. This can also be turned on with the command line option
+ * -trotter. QuaC_clear turns it off.
+ */
+void set_trotter_propagator(){
+  _trotter = 1;
+  return;
+}
+
+/*
+ * _trotter_supported checks that the model can be split and, if so,
+ * sets up the split pieces. Returns 1 if the Trotter propagator can be used.
+ */
+int _trotter_supported(){
+  int        i,num_terms;
+  model_term *terms;
+
+  if (_matrix_free||_stiff_solver||_num_time_dep+_num_time_dep_lin||_num_quantum_gates>0||_discrete_ec||_excitation_cap>=0) {
+    if (nid==0) printf("Warning! The Trotter propagator only supports constant systems and circuits. Using the TS.\n");
+    return 0;
+  }
+  if (_checkpoint_requested()) {
+    if (nid==0) printf("Warning! The Trotter propagator does not write checkpoints. Using the TS.\n");
+    return 0;
+  }
+  if (np>1) {
+    /* The blocks couple entries of x that live on different ranks */
+    if (nid==0) printf("Warning! The Trotter propagator only runs on a single rank. Using the TS.\n");
+    return 0;
+  }
+  _get_terms(&num_terms,&terms);
+  for (i=0;i<num_terms;i++){
+    if (!_term_is_op_product(&terms[i])){
+      if (nid==0) printf("Warning! The Trotter propagator only supports products of operators. Using the TS.\n");
+      return 0;
+    }
+  }
+  return _trotter_setup(_lindblad_terms);
+}
+
+/*
+ * _trotter_time_step propagates x from init_time to time_max in steps
+ * of dt (shorter to stop on gate times and on time_max), calling the
+ * ts_monitor after each step, as the TS would. Returns the time reached,
+ * which is less than time_max if steps_max was hit.
+ *
+ * Inputs:
+ *      Vec       x:         the density matrix (or wavefunction)
+ *      PetscReal init_time: starting time
+ *      PetscReal time_max:  time to propagate to
+ *      PetscReal dt:        step size
+ *      PetscInt  steps_max: maximum number of steps
+ */
+PetscReal _trotter_time_step(Vec x,PetscReal init_time,PetscReal time_max,PetscReal dt,PetscInt steps_max){
+  TS        ts;
+  PetscReal t,t_next,next_gate,eps;
+  PetscInt  step,next_out;
+
+  /* The TS is only there for the ts_monitor */
+  TSCreate(PETSC_COMM_WORLD,&ts);
+  TSSetTime(ts,init_time);
+  if (nid==0) {
+    printf("Using the Trotter propagator: %d diagonal terms, %d blocks\n",
+           (int)_trotter_ctx.num_diag_terms,_trotter_ctx.num_blocks);
+  }
+
+  eps = 1e-12*PetscMax(1.0,PetscAbsReal(time_max));
+  next_gate = -1;
+  if (_num_circuits > 0) {
+    next_gate = _QC_next_gate_time();
+  }
+  /* With an output schedule, steps are shortened to land on the output times */
+  next_out = _first_output_index(init_time);
+  if (_ts_monitor!=NULL&&_num_output_times==0) {
+    _ts_monitor(ts,0,init_time,x,_tsctx);
+  } else if (_ts_monitor!=NULL&&next_out<_num_output_times&&_output_times[next_out]<=init_time+eps) {
+    _ts_monitor(ts,next_out,init_time,x,_tsctx);
+    next_out = next_out + 1;
+  }
+
+  t    = init_time;
+  step = 0;
+  while (1) {
+    while (next_gate>=0 && next_gate<=t+eps && next_gate<=time_max) {
+      _QC_apply_gates_at_time(x);
+      next_gate = _QC_next_gate_time();
+    }
+    if (t>=time_max-eps||step>=steps_max) break;
+
+    t_next = PetscMin(t+dt,time_max);
+    if (next_gate>=0 && next_gate<t_next) t_next = next_gate;
+    if (_ts_monitor!=NULL&&next_out<_num_output_times&&_output_times[next_out]>t+eps&&_output_times[next_out]<t_next) {
+      t_next = _output_times[next_out];
+    }
+    _trotter_set_step(t_next-t);
+    _trotter_step(x);
+    t    = t_next;
+    step = step + 1;
+    if (_ts_monitor!=NULL&&_num_output_times==0) {
+      TSSetTime(ts,t);
+      TSSetStepNumber(ts,step);
+      _ts_monitor(ts,step,t,x,_tsctx);
+    } else if (_ts_monitor!=NULL&&next_out<_num_output_times&&_output_times[next_out]<=t+eps) {
+      TSSetTime(ts,t);
+      TSSetStepNumber(ts,step);
+      while (next_out<_num_output_times&&_output_times[next_out]<=t+eps) {
+        _ts_monitor(ts,next_out,t,x,_tsctx);
+        next_out = next_out + 1;
+      }
+    }
+  }
+
+  if (nid==0) printf("Trotter propagator: %d steps, %d block exponentials\n",(int)step,(int)_trotter_ctx.num_exps);
+  TSDestroy(&ts);
+  _trotter_destroy();
+  return t;
+}
+
+/*
+ * _trotter_setup sorts the recorded terms into the diagonal of H and
+ * the generators of the blocks. Returns 0 (having freed everything)
+ * if some term acts on too many levels to be exponentiated densely.
+ */
+static int _trotter_setup(int rho){
+  int           i,num_terms,num_subs,subs[TROTTER_MAX_BLOCK_SUBS],lin,is_diag;
+  PetscInt      k,l,m,r,c,rp,cp,s,dim,size,max_size;
+  PetscScalar   *G,*GdG,a;
+  model_term    *terms,*this_term;
+  trotter_block new_block,*block;
+
+  _trotter_ctx.rho            = rho;
+  _trotter_ctx.length         = rho ? total_levels*total_levels : total_levels;
+  _trotter_ctx.num_blocks     = 0;
+  _trotter_ctx.max_blocks     = 8;
+  _trotter_ctx.blocks         = malloc(_trotter_ctx.max_blocks*sizeof(trotter_block));
+  _trotter_ctx.diag           = calloc(total_levels,sizeof(PetscScalar));
+  _trotter_ctx.phase          = malloc(total_levels*sizeof(PetscScalar));
+  _trotter_ctx.tau            = -1.0;
+  _trotter_ctx.num_steps      = 0;
+  _trotter_ctx.num_diag_terms = 0;
+  _trotter_ctx.num_exps       = 0;
+  _trotter_ctx.work           = NULL;
+  _trotter_ctx.offsets        = NULL;
+
+  _get_terms(&num_terms,&terms);
+  for (i=0;i<num_terms;i++){
+    this_term = &terms[i];
+    a   = this_term->a;
+    lin = (this_term->my_term_type>=TERM_LIN);
+    if (PetscAbsComplex(a)==0) continue;
+    num_subs = _term_subsystems(this_term,subs);
+    if (num_subs<0||!_init_block(&new_block,lin,num_subs,subs)){
+      if (nid==0) printf("Warning! A term acts on too many levels for the Trotter propagator. Using the TS.\n");
+      _trotter_destroy();
+      return 0;
+    }
+    dim = new_block.dim;
+    G   = calloc(dim*dim,sizeof(PetscScalar));
+    _block_op_matrix(&new_block,this_term,G);
+
+    if (!lin){
+      is_diag = 1;
+      for (r=0;r<dim;r++){
+        for (c=0;c<dim;c++){
+          if (r!=c&&G[r*dim+c]!=0.0) is_diag = 0;
+        }
+      }
+      if (is_diag){
+        /* Diagonal terms go into exp(A tau/2), whatever subsystems they act on */
+        for (k=0;k<total_levels;k++){
+          s = _block_index(&new_block,k);
+          _trotter_ctx.diag[k] = _trotter_ctx.diag[k] + a*G[s*dim+s];
+        }
+        _trotter_ctx.num_diag_terms = _trotter_ctx.num_diag_terms + 1;
+      } else {
+        block = _find_block(&new_block);
+        for (k=0;k<dim*dim;k++){
+          block->gen[k] = block->gen[k] - PETSC_i*a*G[k];
+        }
+      }
+    } else {
+      /*
+       * a (C rho C^t - 1/2 C^t C rho - 1/2 rho C^t C) on the (row,column)
+       * pairs of the block, with block index r + dim*c
+       */
+      block = _find_block(&new_block);
+      size  = block->size;
+      GdG   = calloc(dim*dim,sizeof(PetscScalar));
+      for (r=0;r<dim;r++){
+        for (c=0;c<dim;c++){
+          for (m=0;m<dim;m++){
+            GdG[r*dim+c] = GdG[r*dim+c] + PetscConjComplex(G[m*dim+r])*G[m*dim+c];
+          }
+        }
+      }
+      for (r=0;r<dim;r++){
+        for (c=0;c<dim;c++){
+          k = r + dim*c;
+          for (rp=0;rp<dim;rp++){
+            for (cp=0;cp<dim;cp++){
+              l = rp + dim*cp;
+              block->gen[k*size+l] = block->gen[k*size+l] + a*G[r*dim+rp]*PetscConjComplex(G[c*dim+cp]);
+              if (c==cp) block->gen[k*size+l] = block->gen[k*size+l] - 0.5*a*GdG[r*dim+rp];
+              if (r==rp) block->gen[k*size+l] = block->gen[k*size+l] - 0.5*a*GdG[cp*dim+c];
+            }
+          }
+        }
+      }
+      free(GdG);
+    }
+    free(G);
+  }
+
+  max_size = 1;
+  for (i=0;i<_trotter_ctx.num_blocks;i++){
+    block = &_trotter_ctx.blocks[i];
+    max_size    = PetscMax(max_size,block->size);
+    block->half = malloc(block->size*block->size*sizeof(PetscScalar));
+    block->full = malloc(block->size*block->size*sizeof(PetscScalar));
+  }
+  _trotter_ctx.work    = malloc(2*max_size*sizeof(PetscScalar));
+  _trotter_ctx.offsets = malloc(max_size*sizeof(PetscInt));
+  return 1;
+}
+
+/*
+ * _term_subsystems lists, in increasing order, the subsystems the ops
+ * of a term act on. Returns the number of subsystems, or -1 if there
+ * are more than TROTTER_MAX_BLOCK_SUBS.
+ */
+static int _term_subsystems(model_term *this_term,int subs[]){
+  int k,q,l,num_subs,found;
+
+  num_subs = 0;
+  for (k=0;k<this_term->num_ops;k++){
+    for (q=0;q<num_subsystems;q++){
+      if (subsystem_list[q]->n_before==this_term->ops[k]->n_before) break;
+    }
+    found = 0;
+    for (l=0;l<num_subs;l++){
+      if (subs[l]==q) found = 1;
+    }
+    if (found) continue;
+    if (num_subs==TROTTER_MAX_BLOCK_SUBS) return -1;
+    for (l=num_subs;l>0&&subs[l-1]>q;l--){
+      subs[l] = subs[l-1];
+    }
+    subs[l]  = q;
+    num_subs = num_subs + 1;
+  }
+  return num_subs;
+}
+
+/*
+ * _init_block sets the layout of a block on the given subsystems.
+ * The first num_subs digits are the row indices of the subsystems;
+ * Lindblad blocks have the column indices as the next num_subs digits.
+ * Returns 0 if the block is larger than TROTTER_MAX_BLOCK_DIM.
+ */
+static int _init_block(trotter_block *block,int lin,int num_subs,int subs[]){
+  int      k;
+  operator this_op;
+
+  block->lin      = lin;
+  block->num_subs = num_subs;
+  block->dim      = 1;
+  for (k=0;k<num_subs;k++){
+    this_op            = subsystem_list[subs[k]];
+    block->subs[k]     = subs[k];
+    block->dims[k]     = this_op->my_levels;
+    block->strides[k]  = total_levels/(this_op->my_levels*this_op->n_before);
+    block->dim         = block->dim*this_op->my_levels;
+    if (block->dim>TROTTER_MAX_BLOCK_DIM) return 0;
+  }
+  block->num_digits = num_subs;
+  block->size       = block->dim;
+  if (lin){
+    for (k=0;k<num_subs;k++){
+      block->dims[num_subs+k]    = block->dims[k];
+      block->strides[num_subs+k] = total_levels*block->strides[k];
+    }
+    block->num_digits = 2*num_subs;
+    block->size       = block->dim*block->dim;
+    if (block->size>TROTTER_MAX_BLOCK_DIM) return 0;
+  }
+  block->gen  = NULL;
+  block->half = NULL;
+  block->full = NULL;
+  return 1;
+}
+
+/*
+ * _find_block returns the block of the same kind on the same subsystems
+ * as new_block, adding new_block (with a zero generator) if there is none.
+ */
+static trotter_block* _find_block(trotter_block *new_block){
+  int           i,k,same;
+  trotter_block *block;
+
+  for (i=0;i<_trotter_ctx.num_blocks;i++){
+    block = &_trotter_ctx.blocks[i];
+    same  = (block->lin==new_block->lin&&block->num_subs==new_block->num_subs);
+    for (k=0;k<block->num_subs&&same;k++){
+      if (block->subs[k]!=new_block->subs[k]) same = 0;
+    }
+    if (same) return block;
+  }
+  if (_trotter_ctx.num_blocks==_trotter_ctx.max_blocks){
+    _trotter_ctx.max_blocks = 2*_trotter_ctx.max_blocks;
+    _trotter_ctx.blocks     = realloc(_trotter_ctx.blocks,_trotter_ctx.max_blocks*sizeof(trotter_block));
+  }
+  block      = &_trotter_ctx.blocks[_trotter_ctx.num_blocks];
+  *block     = *new_block;
+  block->gen = calloc(block->size*block->size,sizeof(PetscScalar));
+  _trotter_ctx.num_blocks = _trotter_ctx.num_blocks + 1;
+  return block;
+}
+
+/*
+ * _block_op_matrix sets G (dim x dim, row major) to the product of ops
+ * of the term, restricted to the subsystems of the block. The rows are
+ * generated at the global index with all other subsystems in state 0.
+ */
+static void _block_op_matrix(trotter_block *block,model_term *this_term,PetscScalar *G){
+  PetscInt    s,k,rem,i,j;
+  PetscScalar val;
+
+  for (s=0;s<block->dim;s++){
+    rem = s;
+    i   = 0;
+    for (k=0;k<block->num_subs;k++){
+      i   = i + (rem%block->dims[k])*block->strides[k];
+      rem = rem/block->dims[k];
+    }
+    _get_ops_row_j(i,this_term->num_ops,this_term->ops,&j,&val,-1,0);
+    if (j!=-1){
+      G[s*block->dim+_block_index(block,j)] = val;
+    }
+  }
+  return;
+}
+
+/*
+ * _block_index gives the (row) block index of the global index i
+ */
+static PetscInt _block_index(trotter_block *block,PetscInt i){
+  PetscInt k,s,base;
+
+  s    = 0;
+  base = 1;
+  for (k=0;k<block->num_subs;k++){
+    s    = s + ((i/block->strides[k])%block->dims[k])*base;
+    base = base*block->dims[k];
+  }
+  return s;
+}
+
+/*
+ * _trotter_set_step computes the exponentials for steps of size tau,
+ * unless they are already for tau. A shorter step (to stop on a gate
+ * time or on time_max) recomputes them.
+ */
+static void _trotter_set_step(PetscReal tau){
+  PetscInt      i,b,size;
+  PetscScalar   *work;
+  trotter_block *block;
+
+  if (tau==_trotter_ctx.tau) return;
+  _trotter_ctx.tau = tau;
+
+  for (i=0;i<total_levels;i++){
+    _trotter_ctx.phase[i] = PetscExpComplex(-PETSC_i*_trotter_ctx.diag[i]*tau/2.0);
+  }
+  for (b=0;b<_trotter_ctx.num_blocks;b++){
+    block = &_trotter_ctx.blocks[b];
+    size  = block->size;
+    work  = malloc(4*size*size*sizeof(PetscScalar));
+    /* The middle (last) block takes a full step */
+    if (b==_trotter_ctx.num_blocks-1){
+      _dense_expm(size,size,block->gen,tau,block->full,work);
+    } else {
+      _dense_expm(size,size,block->gen,tau/2.0,block->half,work);
+    }
+    _trotter_ctx.num_exps = _trotter_ctx.num_exps + 1;
+    free(work);
+  }
+  return;
+}
+
+/*
+ * _trotter_step takes one symmetric step of x, in place
+ */
+static void _trotter_step(Vec x){
+  PetscInt    b,num_blocks;
+  PetscScalar *x_array;
+
+  num_blocks = _trotter_ctx.num_blocks;
+  VecGetArray(x,&x_array);
+  _apply_phase(x_array);
+  for (b=0;b<num_blocks-1;b++){
+    _apply_block(&_trotter_ctx.blocks[b],_trotter_ctx.blocks[b].half,x_array);
+  }
+  if (num_blocks>0){
+    _apply_block(&_trotter_ctx.blocks[num_blocks-1],_trotter_ctx.blocks[num_blocks-1].full,x_array);
+  }
+  for (b=num_blocks-2;b>=0;b--){
+    _apply_block(&_trotter_ctx.blocks[b],_trotter_ctx.blocks[b].half,x_array);
+  }
+  _apply_phase(x_array);
+  VecRestoreArray(x,&x_array);
+  _trotter_ctx.num_steps = _trotter_ctx.num_steps + 1;
+  return;
+}
+
+/*
+ * _apply_phase applies exp(A tau/2): psi_i -> p_i psi_i, or
+ * rho_rc -> p_r rho_rc conj(p_c), with p = exp(-i diag tau/2)
+ */
+static void _apply_phase(PetscScalar *x_array){
+  PetscInt    r,c;
+  PetscScalar *phase = _trotter_ctx.phase;
+
+  if (_trotter_ctx.rho){
+    for (c=0;c<total_levels;c++){
+      for (r=0;r<total_levels;r++){
+        x_array[total_levels*c+r] = phase[r]*x_array[total_levels*c+r]*PetscConjComplex(phase[c]);
+      }
+    }
+  } else {
+    for (r=0;r<total_levels;r++){
+      x_array[r] = phase[r]*x_array[r];
+    }
+  }
+  return;
+}
+
+/*
+ * _apply_block applies the exponential E of a block. A Hamiltonian block
+ * acts as U psi, or as U rho U^t (E on the row digits, conj(E) on the
+ * column digits); a Lindblad block acts on the row and column digits at once.
+ */
+static void _apply_block(trotter_block *block,PetscScalar *E,PetscScalar *x_array){
+  PetscInt k,col_strides[TROTTER_MAX_BLOCK_SUBS];
+
+  _apply_block_digits(x_array,block->num_digits,block->strides,block->dims,block->size,E,0);
+  if (!block->lin&&_trotter_ctx.rho){
+    for (k=0;k<block->num_subs;k++){
+      col_strides[k] = total_levels*block->strides[k];
+    }
+    _apply_block_digits(x_array,block->num_subs,col_strides,block->dims,block->size,E,1);
+  }
+  return;
+}
+
+/*
+ * _apply_block_digits multiplies x, restricted to the given digits, by
+ * the size x size matrix E (or conj(E)), for every value of the other
+ * digits. The bases are the indices with all of the given digits 0;
+ * an index with a nonzero digit skips ahead to the next base.
+ */
+static void _apply_block_digits(PetscScalar *x_array,PetscInt num_digits,PetscInt strides[],PetscInt dims[],
+                                PetscInt size,PetscScalar *E,int conjugate){
+  PetscInt    i,k,l,d,rem,length,*offsets;
+  PetscScalar *in,sum,e;
+
+  length  = _trotter_ctx.length;
+  offsets = _trotter_ctx.offsets;
+  in      = _trotter_ctx.work;
+  for (k=0;k<size;k++){
+    rem = k;
+    offsets[k] = 0;
+    for (d=0;d<num_digits;d++){
+      offsets[k] = offsets[k] + (rem%dims[d])*strides[d];
+      rem = rem/dims[d];
+    }
+  }
+
+  i = 0;
+  while (i<length){
+    for (d=0;d<num_digits;d++){
+      if ((i/strides[d])%dims[d]!=0) break;
+    }
+    if (d<num_digits){
+      i = (i/(strides[d]*dims[d])+1)*strides[d]*dims[d];
+      continue;
+    }
+    for (k=0;k<size;k++){
+      in[k] = x_array[i+offsets[k]];
+    }
+    for (k=0;k<size;k++){
+      sum = 0.0;
+      for (l=0;l<size;l++){
+        e   = conjugate ? PetscConjComplex(E[k*size+l]) : E[k*size+l];
+        sum = sum + e*in[l];
+      }
+      x_array[i+offsets[k]] = sum;
+    }
+    i = i + 1;
+  }
+  return;
+}
+
+/*
+ * _trotter_destroy frees the split pieces
+ */
+static void _trotter_destroy(){
+  int i;
+
+  for (i=0;i<_trotter_ctx.num_blocks;i++){
+    if (_trotter_ctx.blocks[i].gen!=NULL) free(_trotter_ctx.blocks[i].gen);
+    if (_trotter_ctx.blocks[i].half!=NULL) free(_trotter_ctx.blocks[i].half);
+    if (_trotter_ctx.blocks[i].full!=NULL) free(_trotter_ctx.blocks[i].full);
+  }
+  free(_trotter_ctx.blocks);
+  free(_trotter_ctx.diag);
+  free(_trotter_ctx.phase);
+  if (_trotter_ctx.work!=NULL) free(_trotter_ctx.work);
+  if (_trotter_ctx.offsets!=NULL) free(_trotter_ctx.offsets);
+  _trotter_ctx.blocks     = NULL;
+  _trotter_ctx.work       = NULL;
+  _trotter_ctx.offsets    = NULL;
+  _trotter_ctx.num_blocks = 0;
+  return;
+}
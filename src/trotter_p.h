@@ -0,0 +1,50 @@
+#ifndef TROTTER_P_H_
+#define TROTTER_P_H_
+
+#include <petscts.h>
+#include "operators.h"
+
+#define TROTTER_MAX_BLOCK_SUBS 8    // Subsystems one term may act on
+#define TROTTER_MAX_BLOCK_DIM  1024 // Largest dense block that is exponentiated
+
+/*
+ * One exponentiated piece of the split generator. A Hamiltonian block
+ * is the sum of the non-diagonal Hamiltonian terms acting on the
+ * subsystems subs; gen = -i H_S (dim x dim) and it acts on psi, or on
+ * the rows (and, conjugated, the columns) of rho. A Lindblad block is
+ * the sum of the Lindblad terms on subs, as a dim^2 x dim^2 superoperator
+ * acting on (row,column) pairs of rho. The block index is
+ * sum_k digit_k prod_{l<k} dims[l], with the first digit fastest.
+ */
+typedef struct trotter_block{
+  int         lin,num_subs,subs[TROTTER_MAX_BLOCK_SUBS];
+  PetscInt    dim,size,num_digits;
+  PetscInt    strides[2*TROTTER_MAX_BLOCK_SUBS],dims[2*TROTTER_MAX_BLOCK_SUBS];
+  PetscScalar *gen;           // Generator, size x size, row major
+  PetscScalar *half,*full;    // exp(gen tau/2) and exp(gen tau)
+} trotter_block;
+
+/*
+ * Context of the split-operator propagator. diag holds the diagonal
+ * part of H and phase = exp(-i diag tau/2). The propagator only runs on
+ * one rank, on the array of x; work and offsets are the scratch space of
+ * one block application.
+ */
+typedef struct trotter_ctx{
+  int           rho,num_blocks,max_blocks;
+  PetscInt      length;
+  PetscScalar   *diag,*phase,*work;
+  PetscInt      *offsets;
+  trotter_block *blocks;
+  PetscReal     tau;
+  PetscInt      num_steps,num_diag_terms,num_exps;
+} trotter_ctx;
+
+int  _trotter_supported();
+PetscReal _trotter_time_step(Vec,PetscReal,PetscReal,PetscReal,PetscInt);
+
+extern int _trotter;
+extern PetscErrorCode (*_ts_monitor)(TS,PetscInt,PetscReal,Vec,void*);
+extern void *_tsctx;
+
+#endif
@@ -0,0 +1,164 @@
+#include "unity.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "checkpoint.h"
+#include "petsc.h"
+#include "tests.h"
+
+#define CP_FILE       "checkpoint_test.chk"
+#define CP_RANKS_FILE "checkpoint_test_ranks.chk"
+
+static double *pop_ref,*pop_ref_adaptive;
+
+static double pulse(double t){
+  return 0.2*sin(3.0*t);
+}
+
+/*
+ * A damped cavity with a time dependent drive (unless drive=0), coupled
+ * to a decaying qubit, started with the qubit excited and propagated to 2 from 0
+ * (restart=0) or from the checkpoint file (restart=1). checkpoint_steps
+ * > 0 writes a checkpoint every checkpoint_steps steps. steps_max stops
+ * the run early, as if it had been killed. Returns the populations at
+ * the end.
+ */
+static void cp_run_model(int drive,int restart,PetscInt checkpoint_steps,PetscInt steps_max,const char *file,double **populations){
+  operator a,q;
+  Vec      x;
+
+  jc_model(&a,&q,1);
+  if (drive) {
+    add_to_ham_time_dep(pulse,1,a);
+    add_to_ham_time_dep(pulse,1,a->dag);
+  }
+
+  create_full_dm(&x);
+  if (restart) {
+    time_step_restart(x,file,2.0,steps_max);
+  } else {
+    set_initial_pop(q,1);
+    set_dm_from_initial_pop(x);
+    if (checkpoint_steps>0) {
+      set_checkpoint(file,-1,checkpoint_steps);
+    }
+    time_step(x,0.0,2.0,0.0009765625,steps_max);
+  }
+
+  if (populations!=NULL) {
+    (*populations) = malloc(get_num_populations()*sizeof(double));
+    get_populations(x,populations);
+  }
+
+  destroy_dm(x);
+  destroy_op(&a);
+  destroy_op(&q);
+  QuaC_clear();
+}
+
+static void cp_compare(double *pop,double *pop_restart){
+  int i;
+
+  if (nid==0) {
+    TEST_ASSERT_TRUE(pop[0]>1e-2);
+    for (i=0;i<get_num_populations();i++){
+      /* Bit for bit on the same number of ranks */
+      TEST_ASSERT_TRUE(pop[i]==pop_restart[i]);
+    }
+  }
+}
+
+/*
+ * Killed after 1536 steps, with checkpoints every 512 steps; the last one
+ * (t = 1.5) is from the post step, so the restart must pick up the
+ * periodic checkpoint and end exactly where the uninterrupted run does
+ */
+void test_checkpoint_restart(void)
+{
+  double *pop_restart;
+
+  cp_run_model(1,0,512,1536,CP_FILE,NULL);
+  cp_run_model(1,1,0,100000,CP_FILE,&pop_restart);
+  cp_compare(pop_ref,pop_restart);
+  free(pop_restart);
+}
+
+/* With the adaptive step, the next step size is restored too */
+void test_checkpoint_restart_adaptive(void)
+{
+  double *pop_restart;
+
+  PetscOptionsSetValue(NULL,"-ts_adapt_type","basic");
+  cp_run_model(1,0,0,100000,NULL,&pop_ref_adaptive);
+  cp_run_model(1,0,7,10,CP_FILE,NULL);
+  cp_run_model(1,1,0,100000,CP_FILE,&pop_restart);
+  PetscOptionsSetValue(NULL,"-ts_adapt_type","none");
+  cp_compare(pop_ref_adaptive,pop_restart);
+  free(pop_restart);
+  free(pop_ref_adaptive);
+}
+
+/*
+ * The Trotter propagator does not write checkpoints, so asking for them
+ * runs the TS instead
+ */
+void test_checkpoint_trotter(void)
+{
+  double *pop_ts,*pop_trotter;
+
+  if (nid==0) remove(CP_FILE);
+  cp_run_model(0,0,0,100000,NULL,&pop_ts);
+  set_trotter_propagator();
+  cp_run_model(0,0,512,100000,CP_FILE,&pop_trotter);
+  cp_compare(pop_ts,pop_trotter);
+  free(pop_ts);
+  free(pop_trotter);
+  if (nid==0) {
+    TEST_ASSERT_EQUAL_INT(0,access(CP_FILE,R_OK));
+  }
+}
+
+/*
+ * A checkpoint written on more than one rank (by make mpi_test) must
+ * restart on one (by make test, after it). The reductions are summed in
+ * another order, so the restart agrees to rounding, not bit for bit.
+ */
+void test_checkpoint_restart_ranks(void)
+{
+  double *pop_restart;
+  int    i;
+
+  if (np>1) {
+    cp_run_model(1,0,512,1536,CP_RANKS_FILE,NULL);
+    return;
+  }
+  if (access(CP_RANKS_FILE,R_OK)!=0) {
+    TEST_IGNORE_MESSAGE("No checkpoint from more than one rank; run make mpi_test first");
+  }
+  cp_run_model(1,1,0,100000,CP_RANKS_FILE,&pop_restart);
+  for (i=0;i<get_num_populations();i++){
+    TEST_ASSERT_FLOAT_WITHIN(1e-10,pop_ref[i],pop_restart[i]);
+  }
+  free(pop_restart);
+  remove(CP_RANKS_FILE);
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  cp_run_model(1,0,0,100000,NULL,&pop_ref);
+  RUN_TEST(test_checkpoint_restart);
+  RUN_TEST(test_checkpoint_restart_adaptive);
+  RUN_TEST(test_checkpoint_trotter);
+  RUN_TEST(test_checkpoint_restart_ranks);
+  free(pop_ref);
+  if (nid==0) remove(CP_FILE);
+  QuaC_finalize();
+  return UNITY_END();
+}
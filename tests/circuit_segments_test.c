@@ -0,0 +1,122 @@
+#include "unity.h"
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "quantum_gates.h"
+#include "petsc.h"
+
+/*
+ * Runs a small circuit on two coupled, decaying qubits, with the gates
+ * applied either by TS events (segments=0) or by the segment scheduler.
+ */
+void cs_run_model(int segments,double **populations,int *num_pop){
+  operator       q0,q1;
+  circuit        circ;
+  Vec            rho;
+  PetscLogDouble t0,t1;
+
+  create_op(2,&q0);
+  create_op(2,&q1);
+  add_to_ham(1.0,q0->n);
+  add_to_ham(1.1,q1->n);
+  add_to_ham_mult2(0.2,q0,q1->dag);
+  add_to_ham_mult2(0.2,q0->dag,q1);
+  add_lin(0.1,q0);
+  add_lin(0.1,q1);
+
+  create_circuit(&circ,5);
+  add_gate_to_circuit(&circ,0.5,HADAMARD,0);
+  add_gate_to_circuit(&circ,1.0,CNOT,0,1);
+  add_gate_to_circuit(&circ,1.0,RX,0,0.4);
+  add_gate_to_circuit(&circ,1.5,SIGMAX,1);
+  start_circuit_at_time(&circ,0.0);
+  if (segments) {
+    set_circuit_segments();
+  }
+
+  create_full_dm(&rho);
+  set_dm_from_initial_pop(rho);
+
+  PetscTime(&t0);
+  time_step(rho,0.0,2.0,0.01,1000);
+  PetscTime(&t1);
+  if (nid==0) printf("%s: %f s\n",segments ? "segments" : "events",t1-t0);
+
+  *num_pop = get_num_populations();
+  (*populations) = malloc((*num_pop)*sizeof(double));
+  get_populations(rho,populations);
+
+  destroy_dm(rho);
+  destroy_op(&q0);
+  destroy_op(&q1);
+  QuaC_clear();
+}
+
+void test_segments_match_events(void)
+{
+  double *pop_events,*pop_segments;
+  int    num_pop,i;
+
+  cs_run_model(0,&pop_events,&num_pop);
+  cs_run_model(1,&pop_segments,&num_pop);
+  if (nid==0) {
+    for (i=0;i<num_pop;i++){
+      TEST_ASSERT_FLOAT_WITHIN(1e-4,pop_events[i],pop_segments[i]);
+    }
+  }
+  free(pop_events);
+  free(pop_segments);
+}
+
+/*
+ * A pure circuit (no terms) skips the TS entirely; an empty circuit
+ * before it must simply be passed over.
+ */
+void test_segments_pure_circuit(void)
+{
+  operator q0,q1;
+  circuit  empty,circ;
+  Vec      psi;
+  double   *pop;
+
+  create_op(2,&q0);
+  create_op(2,&q1);
+
+  create_circuit(&empty,1);
+  start_circuit_at_time(&empty,0.0);
+  create_circuit(&circ,2);
+  add_gate_to_circuit(&circ,0.5,SIGMAX,0);
+  add_gate_to_circuit(&circ,1.0,CNOT,0,1);
+  start_circuit_at_time(&circ,0.0);
+  set_circuit_segments();
+
+  create_full_dm(&psi);
+  set_dm_from_initial_pop(psi);
+  time_step(psi,0.0,2.0,0.01,1000);
+
+  pop = malloc(get_num_populations()*sizeof(double));
+  get_populations(psi,&pop);
+  if (nid==0) {
+    TEST_ASSERT_FLOAT_WITHIN(1e-12,1.0,pop[0]);
+    TEST_ASSERT_FLOAT_WITHIN(1e-12,1.0,pop[1]);
+  }
+
+  free(pop);
+  destroy_dm(psi);
+  destroy_op(&q0);
+  destroy_op(&q1);
+  QuaC_clear();
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_segments_match_events);
+  RUN_TEST(test_segments_pure_circuit);
+  QuaC_finalize();
+  return UNITY_END();
+}
@@ -0,0 +1,123 @@
+#include "unity.h"
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "petsc.h"
+
+#define NUM_OMEGA 9
+
+static PetscReal omega[NUM_OMEGA] = {-3.0,-1.5,0.0,0.5,0.9,1.0,1.1,1.5,3.0};
+
+static double cs_w0    = 1.0;
+static double cs_gamma = 0.2;
+static double cs_pump  = 0.1;
+
+/*
+ * The emission spectrum of a qubit of frequency cs_w0 that decays at rate
+ * cs_gamma and is pumped at rate cs_pump, next to a driven and damped
+ * cavity, coupled with strength g
+ */
+static void cs_run_model(int matrix_free,double g,PetscReal **spectrum){
+  operator  a,q;
+  Vec       x;
+
+  create_op(2,&q);
+  create_op(5,&a);
+  if (matrix_free) {
+    set_matrix_free();
+  }
+  add_to_ham(cs_w0,q->n);
+  add_lin(cs_gamma,q);
+  add_lin(cs_pump,q->dag);
+  add_to_ham(0.7,a->n);
+  add_to_ham(0.2,a);
+  add_to_ham(0.2,a->dag);
+  add_lin(0.3,a);
+  if (g!=0) {
+    add_to_ham_mult2(g,q,a->dag);
+    add_to_ham_mult2(g,q->dag,a);
+  }
+
+  create_full_dm(&x);
+  steady_state(x);
+  correlation_spectrum(spectrum,x,NUM_OMEGA,omega,1,&q,1,&q->dag);
+
+  destroy_dm(x);
+  destroy_op(&a);
+  destroy_op(&q);
+  QuaC_clear();
+}
+
+/*
+ * Uncoupled, <sm^t(tau) sm(0)> = n exp((i w0 - G/2) tau), with n = pump/G
+ * and G = gamma + pump, so the spectrum is the Lorentzian
+ *     S(omega) = n G / ((G/2)^2 + (omega - w0)^2)
+ */
+static double cs_lorentzian_error(PetscReal *spectrum){
+  double G,n,exact,max_err;
+  int    k;
+
+  G = cs_gamma + cs_pump;
+  n = cs_pump/G;
+  max_err = 0;
+  for (k=0;k<NUM_OMEGA;k++){
+    exact   = n*G/(G*G/4 + (omega[k]-cs_w0)*(omega[k]-cs_w0));
+    max_err = PetscMax(max_err,fabs(spectrum[k]-exact)/exact);
+  }
+  return max_err;
+}
+
+void test_correlation_spectrum_lorentzian(void)
+{
+  PetscReal *spectrum;
+
+  cs_run_model(0,0.0,&spectrum);
+  TEST_ASSERT_TRUE(spectrum[5]>1.0);
+  TEST_ASSERT_TRUE(cs_lorentzian_error(spectrum)<1e-6);
+  free(spectrum);
+}
+
+void test_correlation_spectrum_lorentzian_matrix_free(void)
+{
+  PetscReal *spectrum;
+
+  cs_run_model(1,0.0,&spectrum);
+  TEST_ASSERT_TRUE(cs_lorentzian_error(spectrum)<1e-6);
+  free(spectrum);
+}
+
+/*
+ * Coupled, with too few Arnoldi steps, the GMRES solves of L - i omega
+ * must finish with the spectrum of the shared Krylov space
+ */
+void test_correlation_spectrum_gmres(void)
+{
+  PetscReal *spectrum_krylov,*spectrum_gmres;
+  int       k;
+
+  cs_run_model(0,0.15,&spectrum_krylov);
+  PetscOptionsSetValue(NULL,"-spectrum_krylov_max","3");
+  cs_run_model(0,0.15,&spectrum_gmres);
+  PetscOptionsClearValue(NULL,"-spectrum_krylov_max");
+  /* The coupling moves the spectrum away from the Lorentzian */
+  TEST_ASSERT_TRUE(cs_lorentzian_error(spectrum_krylov)>1e-2);
+  for (k=0;k<NUM_OMEGA;k++){
+    TEST_ASSERT_FLOAT_WITHIN(1e-6*spectrum_krylov[k],spectrum_krylov[k],spectrum_gmres[k]);
+  }
+  free(spectrum_krylov);
+  free(spectrum_gmres);
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_correlation_spectrum_lorentzian);
+  RUN_TEST(test_correlation_spectrum_lorentzian_matrix_free);
+  RUN_TEST(test_correlation_spectrum_gmres);
+  QuaC_finalize();
+  return UNITY_END();
+}
@@ -0,0 +1,170 @@
+#include "unity.h"
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "dicke.h"
+#include "dicke_p.h"
+#include "petsc.h"
+
+#define NUM_EMITTERS 3
+
+static double pulse(double t){
+  return 0.2*sin(3.0*t);
+}
+
+/*
+ * A damped cavity coupled to three identical emitters that decay and
+ * dephase on their own (and, if pump=1, are pumped on their own),
+ * started with every emitter excited. The emitters are one ensemble
+ * (dicke=1) or three separate qubits. time_dep=1 adds a time dependent
+ * cavity frequency. Solved with time_step (steady=0) or steady_state.
+ * Returns <a^dag a> and the number of excited emitters at the end;
+ * full_A_built says whether full_A was assembled, and off_block_nz is
+ * the largest number of entries in a row of full_A between two blocks
+ * of the ensemble (if it was).
+ */
+static void db_run_model(int dicke,int pump,int time_dep,int steady,double *n_cav,double *n_em,
+                         PetscBool *full_A_built,PetscInt *off_block_nz){
+  operator          a,ens,q[NUM_EMITTERS];
+  Vec               x;
+  PetscScalar       val;
+  PetscInt          i,ncols,Istart,Iend;
+  const PetscInt    *cols;
+  const PetscScalar *vals;
+  int               k;
+
+  create_op(3,&a);
+  if (dicke) {
+    create_dicke(NUM_EMITTERS,&ens);
+  } else {
+    for (k=0;k<NUM_EMITTERS;k++){
+      create_op(2,&q[k]);
+    }
+  }
+  add_to_ham(1.0,a->n);
+  add_lin(0.2,a);
+  if (time_dep) {
+    add_to_ham_time_dep(pulse,1,a->n);
+  }
+  if (dicke) {
+    add_to_ham(1.0,ens->n);
+    add_to_ham_p(0.3,2,a->dag,ens);
+    add_to_ham_p(0.3,2,a,ens->dag);
+    add_lin_local(0.1,ens);
+    add_lin_local(0.05,ens->sig_z);
+    if (pump) {
+      add_lin_local(0.15,ens->dag);
+    }
+  } else {
+    for (k=0;k<NUM_EMITTERS;k++){
+      add_to_ham(1.0,q[k]->n);
+      add_to_ham_mult2(0.3,a->dag,q[k]);
+      add_to_ham_mult2(0.3,a,q[k]->dag);
+      add_lin(0.1,q[k]);
+      add_lin(0.05,q[k]->sig_z);
+      if (pump) {
+        add_lin(0.15,q[k]->dag);
+      }
+    }
+  }
+
+  create_full_dm(&x);
+  if (dicke) {
+    set_initial_pop(ens,NUM_EMITTERS);
+  } else {
+    for (k=0;k<NUM_EMITTERS;k++){
+      set_initial_pop(q[k],1);
+    }
+  }
+  set_dm_from_initial_pop(x);
+
+  if (steady) {
+    steady_state(x);
+  } else {
+    time_step(x,0.0,2.0,0.0009765625,100000);
+  }
+
+  get_expectation_value(x,&val,1,a->n);
+  *n_cav = PetscRealPart(val);
+  *n_em  = 0.0;
+  if (dicke) {
+    get_expectation_value(x,&val,1,ens->n);
+    *n_em = PetscRealPart(val);
+  } else {
+    for (k=0;k<NUM_EMITTERS;k++){
+      get_expectation_value(x,&val,1,q[k]->n);
+      *n_em = *n_em + PetscRealPart(val);
+    }
+  }
+
+  MatAssembled(full_A,full_A_built);
+  *off_block_nz = 0;
+  if (dicke&&*full_A_built) {
+    MatGetOwnershipRange(full_A,&Istart,&Iend);
+    for (i=Istart;i<Iend;i++){
+      if (_dicke_block_diagonal(i)) continue;
+      MatGetRow(full_A,i,&ncols,&cols,&vals);
+      if (ncols>*off_block_nz) *off_block_nz = ncols;
+      MatRestoreRow(full_A,i,&ncols,&cols,&vals);
+    }
+  }
+
+  destroy_dm(x);
+  destroy_op(&a);
+  if (dicke) {
+    destroy_op(&ens);
+  } else {
+    for (k=0;k<NUM_EMITTERS;k++){
+      destroy_op(&q[k]);
+    }
+  }
+  QuaC_clear();
+}
+
+static void db_compare(int pump,int time_dep,int steady,PetscBool full_A_expected){
+  double    n_cav_qubits,n_em_qubits,n_cav_dicke,n_em_dicke;
+  PetscBool full_A_built;
+  PetscInt  off_block_nz;
+
+  db_run_model(0,pump,time_dep,steady,&n_cav_qubits,&n_em_qubits,&full_A_built,&off_block_nz);
+  db_run_model(1,pump,time_dep,steady,&n_cav_dicke,&n_em_dicke,&full_A_built,&off_block_nz);
+  TEST_ASSERT_EQUAL_INT(full_A_expected,full_A_built);
+  /* At most the (zero) diagonal between blocks */
+  TEST_ASSERT_TRUE(off_block_nz<=1);
+  if (nid==0) {
+    TEST_ASSERT_TRUE(n_em_qubits>1e-2);
+    TEST_ASSERT_FLOAT_WITHIN(1e-8,n_cav_qubits,n_cav_dicke);
+    TEST_ASSERT_FLOAT_WITHIN(1e-8,n_em_qubits,n_em_dicke);
+  }
+}
+
+/* The blocks are generated from the terms; full_A is never assembled */
+void test_dicke_blocks_time_step(void)
+{
+  db_compare(0,0,0,PETSC_FALSE);
+}
+
+void test_dicke_blocks_steady_state(void)
+{
+  db_compare(1,0,1,PETSC_FALSE);
+}
+
+/* Time dependent terms need full_A; only its block diagonal rows are filled */
+void test_dicke_blocks_time_dep(void)
+{
+  db_compare(0,1,0,PETSC_TRUE);
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_dicke_blocks_time_step);
+  RUN_TEST(test_dicke_blocks_steady_state);
+  RUN_TEST(test_dicke_blocks_time_dep);
+  QuaC_finalize();
+  return UNITY_END();
+}
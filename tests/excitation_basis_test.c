@@ -0,0 +1,118 @@
+#include "unity.h"
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "excitation_basis.h"
+#include "excitation_basis_p.h"
+#include "petsc.h"
+
+/*
+ * Two damped cavity modes and a qubit exchanging one excitation
+ * (lindblad=1; lindblad=0 without the damping), solved in the full
+ * tensor product space (cap<0) or with an excitation cap of cap. The
+ * dynamics never leave the states with at most one excitation, so a cap
+ * of 1 must give the same results. Returns the populations, <a^dag b>,
+ * and the reduced density matrix of the qubit (lindblad=1 only).
+ */
+static void eb_run_model(int cap,int lindblad,double pops[],PetscScalar *coherence,PetscScalar qubit_dm[],
+                         PetscInt *basis_dim){
+  operator    a,b,q;
+  Vec         x,rho_q;
+  double      *populations;
+  PetscInt    i;
+  PetscScalar val;
+
+  create_op(4,&a);
+  create_op(3,&b);
+  create_op(2,&q);
+  if (cap>=0) {
+    set_excitation_cap(cap);
+  }
+  add_to_ham(1.0,a->n);
+  add_to_ham(1.1,b->n);
+  add_to_ham(1.2,q->n);
+  add_to_ham_mult2(0.3,q,a->dag);
+  add_to_ham_mult2(0.3,q->dag,a);
+  add_to_ham_mult2(0.2,a,b->dag);
+  add_to_ham_mult2(0.2,a->dag,b);
+  if (lindblad) {
+    add_lin(0.1,a);
+    add_lin(0.05,b);
+  }
+
+  create_full_dm(&x);
+  set_initial_pop(q,1);
+  set_dm_from_initial_pop(x);
+  time_step(x,0.0,2.0,0.0009765625,100000);
+
+  *basis_dim  = _basis_dim;
+  populations = malloc(get_num_populations()*sizeof(double));
+  get_populations(x,&populations);
+  for (i=0;i<3;i++){
+    pops[i] = populations[i];
+  }
+  free(populations);
+  get_expectation_value(x,coherence,2,a->dag,b);
+
+  if (lindblad) {
+    create_dm(&rho_q,2);
+    partial_trace_over(x,rho_q,2,a,b);
+    for (i=0;i<4;i++){
+      VecGetValues(rho_q,1,&i,&val);
+      qubit_dm[i] = val;
+    }
+    destroy_dm(rho_q);
+  }
+
+  destroy_dm(x);
+  destroy_op(&a);
+  destroy_op(&b);
+  destroy_op(&q);
+  QuaC_clear();
+}
+
+static void eb_compare(int lindblad){
+  double      pops_full[3],pops_cap[3];
+  PetscScalar coh_full,coh_cap,dm_full[4],dm_cap[4];
+  PetscInt    dim_full,dim_cap,i;
+
+  eb_run_model(-1,lindblad,pops_full,&coh_full,dm_full,&dim_full);
+  eb_run_model(1,lindblad,pops_cap,&coh_cap,dm_cap,&dim_cap);
+  TEST_ASSERT_EQUAL_INT(24,dim_full);
+  TEST_ASSERT_EQUAL_INT(4,dim_cap);
+  if (nid==0) {
+    for (i=0;i<3;i++){
+      TEST_ASSERT_FLOAT_WITHIN(1e-10,pops_full[i],pops_cap[i]);
+    }
+    TEST_ASSERT_TRUE(PetscAbsComplex(coh_full)>1e-3);
+    TEST_ASSERT_FLOAT_WITHIN(1e-10,0.0,PetscAbsComplex(coh_full-coh_cap));
+    if (lindblad) {
+      for (i=0;i<4;i++){
+        TEST_ASSERT_FLOAT_WITHIN(1e-10,0.0,PetscAbsComplex(dm_full[i]-dm_cap[i]));
+      }
+    }
+  }
+}
+
+void test_excitation_cap_dm(void)
+{
+  eb_compare(1);
+}
+
+void test_excitation_cap_psi(void)
+{
+  eb_compare(0);
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_excitation_cap_dm);
+  RUN_TEST(test_excitation_cap_psi);
+  QuaC_finalize();
+  return UNITY_END();
+}
@@ -0,0 +1,84 @@
+#include "unity.h"
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "trajectory.h"
+#include "petsc.h"
+
+/*
+ * Sets psi to an arbitrary (unnormalized) state, different for each seed
+ */
+static void ev_set_psi(Vec psi,int seed){
+  PetscInt i,Istart,Iend;
+
+  VecGetOwnershipRange(psi,&Istart,&Iend);
+  for (i=Istart;i<Iend;i++){
+    VecSetValue(psi,i,sin(seed+1.0+i)+PETSC_i*cos(seed+2.0*i),INSERT_VALUES);
+  }
+  VecAssemblyBegin(psi);
+  VecAssemblyEnd(psi);
+}
+
+/*
+ * Compares get_expectation_values, which keeps its psi scatter between
+ * calls, against _get_expectation_value_psi for several states of a
+ * cavity (of num_levels levels) and a qubit
+ */
+static void ev_compare_psi(int num_levels){
+  operator    a,q;
+  Vec         psi;
+  PetscScalar values[3],expected;
+  int         seed,k;
+
+  create_op(num_levels,&a);
+  create_op(2,&q);
+  add_to_ham(1.0,a->n);
+  create_psi(&psi);
+
+  {
+    operator ops0[1] = {a->n};
+    operator ops1[2] = {a->dag,q};
+    operator ops2[2] = {a,q->dag};
+    operator *ops[3] = {ops0,ops1,ops2};
+    int      num_ops[3] = {1,2,2};
+
+    for (seed=0;seed<3;seed++){
+      ev_set_psi(psi,seed);
+      get_expectation_values(psi,3,num_ops,ops,NULL,values);
+      for (k=0;k<3;k++){
+        _get_expectation_value_psi(psi,&expected,num_ops[k],ops[k]);
+        TEST_ASSERT_FLOAT_WITHIN(1e-12,PetscRealPart(expected),PetscRealPart(values[k]));
+        TEST_ASSERT_FLOAT_WITHIN(1e-12,PetscImaginaryPart(expected),PetscImaginaryPart(values[k]));
+      }
+    }
+  }
+
+  VecDestroy(&psi);
+  destroy_op(&a);
+  destroy_op(&q);
+  QuaC_clear();
+}
+
+void test_expectation_values_psi(void)
+{
+  ev_compare_psi(3);
+}
+
+/* A second model, with a different psi size, must not reuse the old scatter */
+void test_expectation_values_psi_resized(void)
+{
+  ev_compare_psi(6);
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_expectation_values_psi);
+  RUN_TEST(test_expectation_values_psi_resized);
+  QuaC_finalize();
+  return UNITY_END();
+}
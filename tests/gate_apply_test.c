@@ -0,0 +1,126 @@
+#include "unity.h"
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "quantum_gates.h"
+#include "petsc.h"
+
+/*
+ * Applies a gate by building its full (superoperator) matrix and
+ * multiplying, as _apply_gate used to; the reference for the in-place kernel.
+ */
+void ga_apply_gate_mat(struct quantum_gate_struct this_gate,Vec rho){
+  PetscScalar op_vals[64];
+  Mat         gate_mat;
+  Vec         tmp_answer;
+  PetscInt    dim,i,Istart,Iend,num_js,these_js[64];
+
+  VecGetSize(rho,&dim);
+  VecDuplicate(rho,&tmp_answer);
+  MatCreate(PETSC_COMM_WORLD,&gate_mat);
+  MatSetSizes(gate_mat,PETSC_DECIDE,PETSC_DECIDE,dim,dim);
+  MatSetFromOptions(gate_mat);
+  MatMPIAIJSetPreallocation(gate_mat,16,NULL,16,NULL);
+  MatSeqAIJSetPreallocation(gate_mat,16,NULL);
+  MatSetUp(gate_mat);
+  MatGetOwnershipRange(gate_mat,&Istart,&Iend);
+  for (i=Istart;i<Iend;i++){
+    if (_lindblad_terms){
+      this_gate._get_val_j_from_global_i(i,this_gate,&num_js,these_js,op_vals,0);
+    } else {
+      this_gate._get_val_j_from_global_i(i,this_gate,&num_js,these_js,op_vals,-1);
+    }
+    MatSetValues(gate_mat,1,&i,num_js,these_js,op_vals,ADD_VALUES);
+  }
+  MatAssemblyBegin(gate_mat,MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(gate_mat,MAT_FINAL_ASSEMBLY);
+  MatMult(gate_mat,rho,tmp_answer);
+  VecCopy(tmp_answer,rho);
+  VecDestroy(&tmp_answer);
+  MatDestroy(&gate_mat);
+}
+
+/*
+ * Four qubits and a 3 level spectator; applies a set of 1 and 2 qubit
+ * gates, on adjacent and non adjacent qubits, both in place and through
+ * the matrix, to the same (arbitrary) state, and returns the largest
+ * difference. The spectator is last because the matrix elements of the
+ * 2 qubit gates assume only qubits lie between the gate's qubits.
+ */
+double ga_compare_gates(int lindblad){
+  operator  q0,q1,q2,q3,s;
+  circuit   circ;
+  Vec       x,x_ref;
+  PetscInt  i,Istart,Iend,g;
+  PetscReal diff,max_diff=0.0;
+
+  create_op(2,&q0);
+  create_op(2,&q1);
+  create_op(2,&q2);
+  create_op(2,&q3);
+  create_op(3,&s);
+  if (lindblad) {
+    add_lin(0.1,q0);
+  }
+
+  create_circuit(&circ,10);
+  add_gate_to_circuit(&circ,1.0,HADAMARD,3);
+  add_gate_to_circuit(&circ,1.0,SIGMAY,0);
+  add_gate_to_circuit(&circ,1.0,RX,2,0.3);
+  add_gate_to_circuit(&circ,1.0,U3,0,0.4,0.5,0.6);
+  add_gate_to_circuit(&circ,1.0,CNOT,0,3);
+  add_gate_to_circuit(&circ,1.0,CNOT,3,2);
+  add_gate_to_circuit(&circ,1.0,CZ,2,0);
+  add_gate_to_circuit(&circ,1.0,CXZ,0,2);
+
+  create_full_dm(&x);
+  VecGetOwnershipRange(x,&Istart,&Iend);
+  for (i=Istart;i<Iend;i++){
+    VecSetValue(x,i,sin(1.0+i)+PETSC_i*cos(2.0*i),INSERT_VALUES);
+  }
+  VecAssemblyBegin(x);
+  VecAssemblyEnd(x);
+  VecDuplicate(x,&x_ref);
+
+  for (g=0;g<circ.num_gates;g++){
+    VecCopy(x,x_ref);
+    _apply_gate(circ.gate_list[g],x);
+    ga_apply_gate_mat(circ.gate_list[g],x_ref);
+    VecAXPY(x_ref,-1.0,x);
+    VecNorm(x_ref,NORM_INFINITY,&diff);
+    if (diff>max_diff) max_diff = diff;
+  }
+
+  VecDestroy(&x);
+  VecDestroy(&x_ref);
+  destroy_op(&q0);
+  destroy_op(&q1);
+  destroy_op(&q2);
+  destroy_op(&q3);
+  destroy_op(&s);
+  QuaC_clear();
+  return max_diff;
+}
+
+void test_gate_in_place_dm(void)
+{
+  TEST_ASSERT_FLOAT_WITHIN(1e-12,0.0,ga_compare_gates(1));
+}
+
+void test_gate_in_place_psi(void)
+{
+  TEST_ASSERT_FLOAT_WITHIN(1e-12,0.0,ga_compare_gates(0));
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_gate_in_place_dm);
+  RUN_TEST(test_gate_in_place_psi);
+  QuaC_finalize();
+  return UNITY_END();
+}
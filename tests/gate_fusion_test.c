@@ -0,0 +1,119 @@
+#include "unity.h"
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "quantum_gates.h"
+#include "petsc.h"
+
+/*
+ * Builds a small VQE-like layer on three qubits: rotations on every qubit,
+ * then an entangling CNOT ladder, then more rotations, at times 1,2,3.
+ */
+void gf_build_circuit(circuit *circ){
+  int q;
+
+  create_circuit(circ,30);
+  for (q=0;q<3;q++){
+    add_gate_to_circuit(circ,1.0,RY,q,0.3+0.1*q);
+    add_gate_to_circuit(circ,1.0,RZ,q,0.7-0.2*q);
+  }
+  add_gate_to_circuit(circ,1.0,HADAMARD,1);
+  add_gate_to_circuit(circ,2.0,CNOT,0,1);
+  add_gate_to_circuit(circ,2.0,CZ,1,0);
+  add_gate_to_circuit(circ,2.0,CNOT,2,1);
+  for (q=0;q<3;q++){
+    add_gate_to_circuit(circ,3.0,U3,q,0.2*q,0.5,0.1+q);
+  }
+  add_gate_to_circuit(circ,3.0,SIGMAX,2);
+}
+
+/*
+ * Applies the circuit, fused with time_window (or unfused if
+ * time_window<0), to an arbitrary state x. Returns the number of gates.
+ */
+PetscInt gf_apply(PetscReal time_window,Vec x){
+  circuit  circ;
+  PetscInt g,i,Istart,Iend;
+
+  gf_build_circuit(&circ);
+  if (time_window>=0) {
+    fuse_circuit(&circ,time_window);
+  }
+  VecGetOwnershipRange(x,&Istart,&Iend);
+  for (i=Istart;i<Iend;i++){
+    VecSetValue(x,i,sin(1.0+i)+PETSC_i*cos(2.0*i),INSERT_VALUES);
+  }
+  VecAssemblyBegin(x);
+  VecAssemblyEnd(x);
+  for (g=0;g<circ.num_gates;g++){
+    _apply_gate(circ.gate_list[g],x);
+  }
+  return circ.num_gates;
+}
+
+/*
+ * Compares the fused and unfused circuits on a density matrix
+ * (lindblad=1) or a wavefunction, for the given time window.
+ */
+void gf_compare(int lindblad,PetscReal time_window,PetscInt *num_fused,PetscReal *diff){
+  operator q0,q1,q2;
+  Vec      x,x_fused;
+  PetscInt num_gates;
+
+  create_op(2,&q0);
+  create_op(2,&q1);
+  create_op(2,&q2);
+  if (lindblad) {
+    add_lin(0.1,q0);
+  }
+  create_full_dm(&x);
+  VecDuplicate(x,&x_fused);
+
+  num_gates  = gf_apply(-1.0,x);
+  *num_fused = gf_apply(time_window,x_fused);
+  TEST_ASSERT_EQUAL_INT(14,num_gates);
+
+  VecAXPY(x_fused,-1.0,x);
+  VecNorm(x_fused,NORM_INFINITY,diff);
+
+  VecDestroy(&x);
+  VecDestroy(&x_fused);
+  destroy_op(&q0);
+  destroy_op(&q1);
+  destroy_op(&q2);
+  QuaC_clear();
+}
+
+void test_fusion_same_slot(void)
+{
+  PetscInt  num_fused;
+  PetscReal diff;
+
+  /* Fuse only within a time slot: 3 gates at t=1, 2 at t=2, 3 at t=3 */
+  gf_compare(1,0.0,&num_fused,&diff);
+  TEST_ASSERT_EQUAL_INT(8,num_fused);
+  TEST_ASSERT_FLOAT_WITHIN(1e-12,0.0,diff);
+}
+
+void test_fusion_all_slots_psi(void)
+{
+  PetscInt  num_fused;
+  PetscReal diff;
+
+  gf_compare(0,10.0,&num_fused,&diff);
+  TEST_ASSERT_TRUE(num_fused<8);
+  TEST_ASSERT_FLOAT_WITHIN(1e-12,0.0,diff);
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_fusion_same_slot);
+  RUN_TEST(test_fusion_all_slots_psi);
+  QuaC_finalize();
+  return UNITY_END();
+}
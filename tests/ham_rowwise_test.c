@@ -0,0 +1,125 @@
+#include "unity.h"
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "kron_p.h"
+#include "petsc.h"
+
+/*
+ * Returns the largest difference between full_A, built row by row from
+ * the recorded terms, and the same term added with the column-wise
+ * _add_ops_to_mat_ham used before terms were recorded.
+ */
+static PetscReal hr_compare(PetscScalar a,PetscInt num_ops,operator *ops){
+  Mat       ref;
+  PetscInt  n;
+  PetscReal norm;
+
+  build_operators();
+  MatAssemblyBegin(full_A,MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(full_A,MAT_FINAL_ASSEMBLY);
+
+  MatGetSize(full_A,&n,NULL);
+  MatCreate(PETSC_COMM_WORLD,&ref);
+  MatSetType(ref,MATMPIAIJ);
+  MatSetSizes(ref,PETSC_DECIDE,PETSC_DECIDE,n,n);
+  MatMPIAIJSetPreallocation(ref,8,NULL,8,NULL);
+  MatSetUp(ref);
+  _add_ops_to_mat_ham(a,ref,num_ops,ops);
+  MatAssemblyBegin(ref,MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(ref,MAT_FINAL_ASSEMBLY);
+
+  MatAXPY(ref,-1.0,full_A,DIFFERENT_NONZERO_PATTERN);
+  MatNorm(ref,NORM_FROBENIUS,&norm);
+  MatDestroy(&ref);
+  return norm;
+}
+
+/*
+ * sig_y alone, against -i (I cross H) + i (H^T cross I) written out by hand
+ */
+void test_rowwise_sig_y_dense(void)
+{
+  operator    q;
+  PetscScalar H[2][2] = {{0,-PETSC_i},{PETSC_i,0}},expected,val;
+  PetscInt    r,c,row,col,Istart,Iend;
+  PetscReal   max_diff=0.0;
+
+  create_op(2,&q);
+  add_to_ham_p(0.7,1,q->sig_y);
+  build_operators();
+  MatAssemblyBegin(full_A,MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(full_A,MAT_FINAL_ASSEMBLY);
+
+  /* rho(r,c) is at 2*c + r; row (r,c), column (r',c') */
+  MatGetOwnershipRange(full_A,&Istart,&Iend);
+  for (row=Istart;row<Iend;row++){
+    for (col=0;col<4;col++){
+      r = row%2; c = row/2;
+      expected = 0.0;
+      if (c==col/2) expected += -0.7*PETSC_i*H[r][col%2];
+      if (r==col%2) expected +=  0.7*PETSC_i*H[col/2][c];
+      MatGetValues(full_A,1,&row,1,&col,&val);
+      if (PetscAbsComplex(val-expected)>max_diff) max_diff = PetscAbsComplex(val-expected);
+    }
+  }
+  TEST_ASSERT_FLOAT_WITHIN(1e-14,0.0,max_diff);
+
+  destroy_op(&q);
+  QuaC_clear();
+}
+
+void test_rowwise_sig_y_products(void)
+{
+  operator  q,c,q2;
+  operator  ops[2];
+
+  create_op(2,&q);
+  create_op(3,&c);
+  create_op(2,&q2);
+  ops[0] = q->sig_y;
+  ops[1] = c->dag;
+  add_to_ham_p(0.3+0.2*PETSC_i,2,ops[0],ops[1]);
+  TEST_ASSERT_FLOAT_WITHIN(1e-14,0.0,hr_compare(0.3+0.2*PETSC_i,2,ops));
+  destroy_op(&q);
+  destroy_op(&c);
+  destroy_op(&q2);
+  QuaC_clear();
+
+  create_op(2,&q);
+  create_op(3,&c);
+  create_op(2,&q2);
+  ops[0] = q2->sig_y;
+  ops[1] = q->sig_y;
+  add_to_ham_p(1.1,2,ops[0],ops[1]);
+  TEST_ASSERT_FLOAT_WITHIN(1e-14,0.0,hr_compare(1.1,2,ops));
+  destroy_op(&q);
+  destroy_op(&c);
+  destroy_op(&q2);
+  QuaC_clear();
+
+  create_op(2,&q);
+  create_op(3,&c);
+  create_op(2,&q2);
+  ops[0] = c;
+  ops[1] = q2->sig_y;
+  add_to_ham_p(-0.4*PETSC_i,2,ops[0],ops[1]);
+  TEST_ASSERT_FLOAT_WITHIN(1e-14,0.0,hr_compare(-0.4*PETSC_i,2,ops));
+  destroy_op(&q);
+  destroy_op(&c);
+  destroy_op(&q2);
+  QuaC_clear();
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_rowwise_sig_y_dense);
+  RUN_TEST(test_rowwise_sig_y_products);
+  QuaC_finalize();
+  return UNITY_END();
+}
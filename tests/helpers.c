@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "quac.h"
+#include "operators.h"
+#include "tests.h"
+
+/*
+ * jc_model creates the cavity-qubit model shared by the tests: a cavity
+ * a (4 levels, frequency 1.0) coupled with strength 0.4 to a qubit q
+ * (frequency 1.2), with cavity loss 0.1 and qubit decay 0.05 if lindblad
+ * is 1. Drives and other terms are added by the caller.
+ */
+void jc_model(operator *a,operator *q,int lindblad){
+  create_op(4,a);
+  create_op(2,q);
+  add_to_ham(1.0,(*a)->n);
+  add_to_ham(1.2,(*q)->n);
+  add_to_ham_mult2(0.4,*q,(*a)->dag);
+  add_to_ham_mult2(0.4,(*q)->dag,*a);
+  if (lindblad) {
+    add_lin(0.1,*a);
+    add_lin(0.05,*q);
+  }
+  return;
+}
+
+/*
+ * refuses runs model in a child process and returns 1 if QuaC refused
+ * it (ERROR! and exit(0)); model returning, or crashing, is not a refusal.
+ * Only on one rank, where rank 0 alone exiting cannot hang the others.
+ */
+int refuses(void (*model)(void)){
+  pid_t pid;
+  int   status;
+
+  fflush(stdout);
+  pid = fork();
+  if (pid==0) {
+    freopen("/dev/null","w",stdout);
+    model();
+    _exit(1);
+  }
+  waitpid(pid,&status,0);
+  return WIFEXITED(status)&&WEXITSTATUS(status)==0;
+}
@@ -0,0 +1,140 @@
+#include "unity.h"
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "kron_pc.h"
+#include "kron_pc_p.h"
+#include "petsc.h"
+
+/*
+ * A driven, damped cavity and a pumped, decaying qubit, coupled with
+ * strength g (uncoupled if g = 0)
+ */
+static void kp_add_terms(double g,operator a,operator q){
+  add_to_ham(1.0,a->n);
+  add_to_ham(1.1,q->n);
+  add_to_ham(0.1,a);
+  add_to_ham(0.1,a->dag);
+  add_lin(0.2,a);
+  add_lin(0.1,q->dag);
+  add_lin(0.05,q);
+  if (g!=0) {
+    add_to_ham_mult2(g,q,a->dag);
+    add_to_ham_mult2(g,q->dag,a);
+  }
+}
+
+/*
+ * Without coupling, the Liouvillian is the separable part that the
+ * preconditioner inverts, so A P^-1 y = y for any y = A x (the null
+ * space of A is passed through by P^-1, and A removes it again)
+ */
+void test_kron_pc_inverse(void)
+{
+  operator    a,q;
+  KSP         ksp;
+  PC          pc;
+  Vec         x,y,z,w;
+  PetscInt    i,Istart,Iend;
+  PetscReal   err,norm;
+
+  if (np>1) {
+    TEST_IGNORE_MESSAGE("The Kronecker preconditioner runs on a single rank");
+  }
+  create_op(4,&a);
+  create_op(3,&q);
+  kp_add_terms(0.0,a,q);
+  build_operators();
+  MatAssemblyBegin(full_A,MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(full_A,MAT_FINAL_ASSEMBLY);
+
+  MatCreateVecs(full_A,&x,&y);
+  VecDuplicate(x,&z);
+  VecDuplicate(x,&w);
+  VecGetOwnershipRange(x,&Istart,&Iend);
+  for (i=Istart;i<Iend;i++){
+    VecSetValue(x,i,sin(1.0+i)+PETSC_i*cos(2.0*i),INSERT_VALUES);
+  }
+  VecAssemblyBegin(x);
+  VecAssemblyEnd(x);
+  MatMult(full_A,x,y);
+
+  set_kron_preconditioner();
+  KSPCreate(PETSC_COMM_WORLD,&ksp);
+  KSPSetOperators(ksp,full_A,full_A);
+  KSPGetPC(ksp,&pc);
+  TEST_ASSERT_EQUAL_INT(1,_kron_pc_setup(pc,full_A));
+  PCApply(pc,y,z);
+  MatMult(full_A,z,w);
+  VecAXPY(w,-1.0,y);
+  VecNorm(w,NORM_2,&err);
+  VecNorm(y,NORM_2,&norm);
+  TEST_ASSERT_TRUE(norm>1e-3);
+  TEST_ASSERT_TRUE(err<1e-10*norm);
+
+  KSPDestroy(&ksp);
+  VecDestroy(&x);
+  VecDestroy(&y);
+  VecDestroy(&z);
+  VecDestroy(&w);
+  destroy_op(&a);
+  destroy_op(&q);
+  QuaC_clear();
+}
+
+/*
+ * With the coupling, GMRES preconditioned by the separable part must
+ * find the same steady state as with the default ASM
+ */
+static void kp_steady_state(int kron,double **populations,int *num_pop){
+  operator a,q;
+  Vec      x;
+
+  create_op(4,&a);
+  create_op(3,&q);
+  kp_add_terms(0.3,a,q);
+  if (kron) {
+    set_kron_preconditioner();
+  }
+  create_full_dm(&x);
+  steady_state(x);
+
+  *num_pop = get_num_populations();
+  (*populations) = malloc((*num_pop)*sizeof(double));
+  get_populations(x,populations);
+
+  destroy_dm(x);
+  destroy_op(&a);
+  destroy_op(&q);
+  QuaC_clear();
+}
+
+void test_kron_pc_steady_state(void)
+{
+  double *pop_asm,*pop_kron;
+  int    num_pop,i;
+
+  kp_steady_state(0,&pop_asm,&num_pop);
+  kp_steady_state(1,&pop_kron,&num_pop);
+  if (nid==0) {
+    for (i=0;i<num_pop;i++){
+      TEST_ASSERT_TRUE(pop_asm[i]>1e-3);
+      TEST_ASSERT_FLOAT_WITHIN(1e-8,pop_asm[i],pop_kron[i]);
+    }
+  }
+  free(pop_asm);
+  free(pop_kron);
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_kron_pc_inverse);
+  RUN_TEST(test_kron_pc_steady_state);
+  QuaC_finalize();
+  return UNITY_END();
+}
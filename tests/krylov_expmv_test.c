@@ -0,0 +1,114 @@
+#include "unity.h"
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "petsc.h"
+
+#define KE_MAX_OUT 64
+
+/* Cavity population at each monitor call */
+static double ke_times[KE_MAX_OUT],ke_pops[KE_MAX_OUT];
+static int    ke_num_out;
+
+PetscErrorCode ke_monitor(TS ts,PetscInt step,PetscReal time,Vec x,void *ctx){
+  double *pop;
+
+  pop = malloc(get_num_populations()*sizeof(double));
+  get_populations(x,&pop);
+  if (ke_num_out<KE_MAX_OUT){
+    ke_times[ke_num_out] = time;
+    ke_pops[ke_num_out]  = pop[0];
+  }
+  ke_num_out = ke_num_out + 1;
+  free(pop);
+  return(0);
+}
+
+/*
+ * A driven, damped cavity coupled to a qubit (lindblad=1), or the same
+ * closed system (lindblad=0), propagated from 0 to 5 with the Krylov
+ * expmv propagator (krylov=1) or with the RK TS at dt=0.005.
+ * The monitor records the cavity population every 0.5.
+ */
+static void ke_run_model(int krylov,int lindblad,double times[],double pops[],int *num_out){
+  operator a,q;
+  Vec      x;
+  int      k;
+
+  create_op(5,&a);
+  create_op(2,&q);
+  add_to_ham(1.0,a->n);
+  add_to_ham(1.2,q->n);
+  add_to_ham_mult2(0.3,q,a->dag);
+  add_to_ham_mult2(0.3,q->dag,a);
+  add_to_ham(0.1,a);
+  add_to_ham(0.1,a->dag);
+  if (lindblad) {
+    add_lin(0.1,a);
+    add_lin(0.05,q);
+  }
+
+  create_full_dm(&x);
+  set_initial_pop(q,1);
+  set_dm_from_initial_pop(x);
+
+  ke_num_out = 0;
+  set_ts_monitor(ke_monitor);
+  if (krylov) {
+    set_krylov_expmv(30,1e-10);
+    time_step(x,0.0,5.0,0.5,100000);
+  } else {
+    set_output_times(11,(PetscReal[]){0,0.5,1.0,1.5,2.0,2.5,3.0,3.5,4.0,4.5,5.0});
+    time_step(x,0.0,5.0,0.005,100000);
+    set_output_times(0,NULL);
+  }
+  *num_out = ke_num_out;
+  for (k=0;k<ke_num_out&&k<KE_MAX_OUT;k++){
+    times[k] = ke_times[k];
+    pops[k]  = ke_pops[k];
+  }
+
+  destroy_dm(x);
+  destroy_op(&a);
+  destroy_op(&q);
+  QuaC_clear();
+}
+
+static void ke_compare(int lindblad){
+  double times_rk[KE_MAX_OUT],pops_rk[KE_MAX_OUT],times_kr[KE_MAX_OUT],pops_kr[KE_MAX_OUT];
+  int    num_rk,num_kr,k;
+
+  ke_run_model(0,lindblad,times_rk,pops_rk,&num_rk);
+  ke_run_model(1,lindblad,times_kr,pops_kr,&num_kr);
+  TEST_ASSERT_EQUAL_INT(11,num_kr);
+  TEST_ASSERT_EQUAL_INT(num_rk,num_kr);
+  if (nid==0) {
+    for (k=0;k<num_kr;k++){
+      TEST_ASSERT_FLOAT_WITHIN(1e-12,0.5*k,times_kr[k]);
+      TEST_ASSERT_FLOAT_WITHIN(1e-6,pops_rk[k],pops_kr[k]);
+    }
+  }
+}
+
+void test_krylov_expmv_dm(void)
+{
+  ke_compare(1);
+}
+
+void test_krylov_expmv_psi(void)
+{
+  ke_compare(0);
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_krylov_expmv_dm);
+  RUN_TEST(test_krylov_expmv_psi);
+  QuaC_finalize();
+  return UNITY_END();
+}
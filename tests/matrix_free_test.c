@@ -0,0 +1,106 @@
+#include "unity.h"
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "petsc.h"
+
+double mf_pulse(double);
+
+/*
+ * Builds a cavity coupled to a qubit, with cavity loss, qubit decay and
+ * dephasing and a time dependent drive, in either assembled (0) or
+ * matrix-free (1) mode, and either time steps it or finds its steady state.
+ */
+void mf_run_model(int matrix_free,int steady,double **populations,int *num_pop){
+  operator a,q;
+  Vec      rho;
+
+  create_op(4,&a);
+  create_op(2,&q);
+  if (matrix_free) {
+    set_matrix_free();
+  }
+  add_to_ham(1.0,a->n);
+  add_to_ham(1.2,q->n);
+  add_to_ham_mult2(0.3,q,a->dag);
+  add_to_ham_mult2(0.3,q->dag,a);
+  if (steady) {
+    add_to_ham(0.2,a);
+    add_to_ham(0.2,a->dag);
+  } else {
+    add_to_ham_time_dep(mf_pulse,2,a->dag,a);
+  }
+  add_lin(0.1,a);
+  add_lin(0.05,q);
+  add_lin(0.02,q->n);
+
+  create_full_dm(&rho);
+  set_initial_pop(a,1);
+  set_initial_pop(q,1);
+  set_dm_from_initial_pop(rho);
+
+  if (steady) {
+    steady_state(rho);
+  } else {
+    time_step(rho,0.0,2.0,0.01,200);
+  }
+
+  *num_pop = get_num_populations();
+  (*populations) = malloc((*num_pop)*sizeof(double));
+  get_populations(rho,populations);
+
+  destroy_dm(rho);
+  destroy_op(&a);
+  destroy_op(&q);
+  QuaC_clear();
+  return;
+}
+
+void test_matrix_free_time_step(void)
+{
+  double *pop_assembled,*pop_mf;
+  int    num_pop,i;
+
+  mf_run_model(0,0,&pop_assembled,&num_pop);
+  mf_run_model(1,0,&pop_mf,&num_pop);
+  if (nid==0) {
+    for (i=0;i<num_pop;i++){
+      TEST_ASSERT_FLOAT_WITHIN(1e-12,pop_assembled[i],pop_mf[i]);
+    }
+  }
+  free(pop_assembled);
+  free(pop_mf);
+}
+
+void test_matrix_free_steady_state(void)
+{
+  double *pop_assembled,*pop_mf;
+  int    num_pop,i;
+
+  mf_run_model(0,1,&pop_assembled,&num_pop);
+  mf_run_model(1,1,&pop_mf,&num_pop);
+  if (nid==0) {
+    for (i=0;i<num_pop;i++){
+      TEST_ASSERT_FLOAT_WITHIN(1e-5,pop_assembled[i],pop_mf[i]);
+    }
+  }
+  free(pop_assembled);
+  free(pop_mf);
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_matrix_free_time_step);
+  RUN_TEST(test_matrix_free_steady_state);
+  QuaC_finalize();
+  return UNITY_END();
+}
+
+double mf_pulse(double time){
+  return exp(-pow(time-1.0,2));
+}
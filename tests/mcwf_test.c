@@ -0,0 +1,97 @@
+#include "unity.h"
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "trajectory.h"
+#include "dm_utilities.h"
+#include "petsc.h"
+
+/*
+ * Runs num_traj trajectories of a qubit with decay rate gamma and drive
+ * strength omega, starting in the excited state, and returns <n> at
+ * num_out equally spaced times up to time_max.
+ */
+void mcwf_qubit(double omega,double gamma,PetscInt num_traj,PetscInt num_out,
+                double time_max,PetscScalar *n_out){
+  operator    q;
+  Vec         psi;
+  PetscScalar **observables;
+
+  create_op(2,&q);
+  set_matrix_free();
+  if (omega!=0) {
+    add_to_ham(omega,q);
+    add_to_ham(omega,q->dag);
+  }
+  add_lin(gamma,q);
+  add_mcwf_observable(1,q->n);
+
+  create_psi(&psi);
+  set_initial_pop(q,1);
+  set_psi_from_initial_pop(psi);
+
+  observables    = malloc(sizeof(PetscScalar*));
+  observables[0] = n_out;
+  mcwf_time_step(psi,0.0,time_max,0.01,100000,num_traj,num_out,observables);
+
+  free(observables);
+  VecDestroy(&psi);
+  destroy_op(&q);
+  QuaC_clear();
+}
+
+void test_mcwf_decay(void)
+{
+  PetscScalar n_out[4];
+  int         k;
+
+  mcwf_qubit(0.0,0.5,500,4,2.0,n_out);
+  if (nid==0) {
+    for (k=0;k<4;k++){
+      /* 500 trajectories; the statistical error is about 0.02 */
+      TEST_ASSERT_FLOAT_WITHIN(0.1,exp(-0.5*(k+1)*0.5),PetscRealPart(n_out[k]));
+    }
+  }
+}
+
+void test_mcwf_driven_vs_dm(void)
+{
+  PetscScalar n_out[1];
+  operator    q;
+  Vec         rho;
+  double      *pop;
+
+  mcwf_qubit(1.0,0.5,500,1,2.0,n_out);
+
+  /* The same model through the master equation */
+  create_op(2,&q);
+  add_to_ham(1.0,q);
+  add_to_ham(1.0,q->dag);
+  add_lin(0.5,q);
+  create_full_dm(&rho);
+  set_initial_pop(q,1);
+  set_dm_from_initial_pop(rho);
+  time_step(rho,0.0,2.0,0.01,200);
+  pop = malloc(get_num_populations()*sizeof(double));
+  get_populations(rho,&pop);
+
+  if (nid==0) {
+    TEST_ASSERT_FLOAT_WITHIN(0.1,pop[0],PetscRealPart(n_out[0]));
+  }
+  free(pop);
+  destroy_dm(rho);
+  destroy_op(&q);
+  QuaC_clear();
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_mcwf_decay);
+  RUN_TEST(test_mcwf_driven_vs_dm);
+  QuaC_finalize();
+  return UNITY_END();
+}
@@ -0,0 +1,170 @@
+#include "unity.h"
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "petsc.h"
+#include "tests.h"
+
+#define OS_MAX_OUT 2100
+#define OS_DT_REF  0.0009765625
+
+/* Out of order, off the steps of dt=0.1, and one past the end (skipped) */
+#define OS_NUM_TIMES 8
+static PetscReal os_times[OS_NUM_TIMES] = {0.8125,0.0,0.25,2.5,0.375,1.5,1.0009765625,2.0};
+
+/* Output index, time, qubit population and TS step number of each monitor call */
+static PetscInt os_steps[OS_MAX_OUT],os_ts_steps[OS_MAX_OUT];
+static double   os_out_times[OS_MAX_OUT],os_pops[OS_MAX_OUT];
+static int      os_num_out,os_propagator;
+
+PetscErrorCode os_monitor(TS ts,PetscInt step,PetscReal time,Vec x,void *ctx){
+  double *pop;
+
+  pop = malloc(get_num_populations()*sizeof(double));
+  get_populations(x,&pop);
+  if (os_num_out<OS_MAX_OUT){
+    os_steps[os_num_out]     = step;
+    os_out_times[os_num_out] = time;
+    os_pops[os_num_out]      = pop[1];
+    os_ts_steps[os_num_out]  = 0;
+    if (os_propagator==0) {
+      TSGetStepNumber(ts,&os_ts_steps[os_num_out]);
+    }
+  }
+  os_num_out = os_num_out + 1;
+  free(pop);
+  return(0);
+}
+
+/*
+ * A driven, damped cavity coupled to a decaying qubit, started with the
+ * qubit excited and propagated from 0 to 2 with time_step at step dt.
+ * propagator is 0 for the RK TS, 1 for Krylov expmv and 2 for Trotter.
+ */
+static void os_run_model(int propagator,PetscReal dt){
+  operator a,q;
+  Vec      x;
+
+  jc_model(&a,&q,1);
+  add_to_ham(0.1,a);
+  add_to_ham(0.1,a->dag);
+
+  create_full_dm(&x);
+  set_initial_pop(q,1);
+  set_dm_from_initial_pop(x);
+
+  if (propagator==1) {
+    set_krylov_expmv(30,1e-10);
+  } else if (propagator==2) {
+    set_trotter_propagator();
+  }
+  os_num_out    = 0;
+  os_propagator = propagator;
+  set_ts_monitor(os_monitor);
+  time_step(x,0.0,2.0,dt,100000);
+
+  destroy_dm(x);
+  destroy_op(&a);
+  destroy_op(&q);
+  QuaC_clear();
+}
+
+/* Reference: every step of 2^-10, so that the monitor times are exact */
+static double os_pop_ref[OS_MAX_OUT];
+
+static double os_ref(PetscReal t){
+  return os_pop_ref[(int)(t/OS_DT_REF+0.5)];
+}
+
+/*
+ * The monitor must be called once per output time in [0,2], in order,
+ * with the output index as the step, and with rho at that time
+ */
+static void os_check_outputs(double tol){
+  PetscReal sorted[OS_NUM_TIMES-1] = {0.0,0.25,0.375,0.8125,1.0009765625,1.5,2.0};
+  int       k;
+
+  TEST_ASSERT_EQUAL_INT(OS_NUM_TIMES-1,os_num_out);
+  if (nid==0) {
+    for (k=0;k<os_num_out;k++){
+      TEST_ASSERT_EQUAL_INT(k,os_steps[k]);
+      TEST_ASSERT_FLOAT_WITHIN(1e-12,sorted[k],os_out_times[k]);
+      TEST_ASSERT_FLOAT_WITHIN(tol,os_ref(sorted[k]),os_pops[k]);
+    }
+  }
+}
+
+void test_output_schedule_ts(void)
+{
+  set_output_times(OS_NUM_TIMES,os_times);
+  os_run_model(0,0.1);
+  set_output_times(0,NULL);
+  os_check_outputs(1e-5);
+}
+
+/*
+ * With the adaptive step, many more outputs than steps; the steps are not
+ * shortened to the output spacing
+ */
+void test_output_schedule_adaptive(void)
+{
+  int k;
+
+  set_output_grid(0.0,0.03125,65);
+  PetscOptionsSetValue(NULL,"-ts_adapt_type","basic");
+  PetscOptionsSetValue(NULL,"-ts_rtol","1e-6");
+  PetscOptionsSetValue(NULL,"-ts_atol","1e-6");
+  os_run_model(0,0.03125);
+  PetscOptionsSetValue(NULL,"-ts_adapt_type","none");
+  PetscOptionsClearValue(NULL,"-ts_rtol");
+  PetscOptionsClearValue(NULL,"-ts_atol");
+  set_output_times(0,NULL);
+
+  TEST_ASSERT_EQUAL_INT(65,os_num_out);
+  if (nid==0) {
+    TEST_ASSERT_TRUE(os_ts_steps[64]<32);
+    for (k=0;k<os_num_out;k++){
+      TEST_ASSERT_EQUAL_INT(k,os_steps[k]);
+      TEST_ASSERT_FLOAT_WITHIN(1e-12,0.03125*k,os_out_times[k]);
+      TEST_ASSERT_FLOAT_WITHIN(1e-5,os_ref(0.03125*k),os_pops[k]);
+    }
+  }
+}
+
+void test_output_schedule_krylov(void)
+{
+  set_output_times(OS_NUM_TIMES,os_times);
+  os_run_model(1,0.1);
+  set_output_times(0,NULL);
+  os_check_outputs(1e-6);
+}
+
+/* Trotter shortens its steps to land on the output times; O(dt^2) error */
+void test_output_schedule_trotter(void)
+{
+  set_output_times(OS_NUM_TIMES,os_times);
+  os_run_model(2,0.1);
+  set_output_times(0,NULL);
+  os_check_outputs(1e-2);
+}
+
+int main(int argc, char** argv)
+{
+  int k;
+
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  os_run_model(0,OS_DT_REF);
+  for (k=0;k<os_num_out&&k<OS_MAX_OUT;k++){
+    os_pop_ref[k] = os_pops[k];
+  }
+  RUN_TEST(test_output_schedule_ts);
+  RUN_TEST(test_output_schedule_adaptive);
+  RUN_TEST(test_output_schedule_krylov);
+  RUN_TEST(test_output_schedule_trotter);
+  QuaC_finalize();
+  return UNITY_END();
+}
@@ -0,0 +1,200 @@
+#include "unity.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "excitation_basis.h"
+#include "output.h"
+#include "output_p.h"
+#include "petsc.h"
+#include "tests.h"
+
+#define OT_NUM_RECORDS 7
+#define OT_MAX_COLUMNS 8
+#define OT_FILE        "output_test.bin"
+
+/* What the file should hold, and what was read back from it */
+static double ot_ref[OT_NUM_RECORDS][OT_MAX_COLUMNS];
+static double ot_read[OT_NUM_RECORDS+1][OT_MAX_COLUMNS];
+static char   ot_names[OT_MAX_COLUMNS][64];
+static int    ot_num_columns,ot_num_read;
+
+/*
+ * ot_read_file reads the file of open_output (see output_p.h) into
+ * ot_names and ot_read, on rank 0
+ */
+static void ot_read_file(){
+  FILE    *fp;
+  char    magic[8];
+  int32_t num_columns,length;
+  int     i;
+
+  ot_num_read = 0;
+  if (nid!=0) return;
+  fp = fopen(OT_FILE,"rb");
+  TEST_ASSERT_NOT_NULL(fp);
+  TEST_ASSERT_EQUAL_INT(8,fread(magic,sizeof(char),8,fp));
+  TEST_ASSERT_EQUAL_INT(0,strncmp(magic,OUTPUT_MAGIC,8));
+  TEST_ASSERT_EQUAL_INT(1,fread(&num_columns,sizeof(int32_t),1,fp));
+  TEST_ASSERT_EQUAL_INT(ot_num_columns,num_columns);
+  for (i=0;i<num_columns;i++){
+    TEST_ASSERT_EQUAL_INT(1,fread(&length,sizeof(int32_t),1,fp));
+    TEST_ASSERT_TRUE(length<64);
+    TEST_ASSERT_EQUAL_INT(length,fread(ot_names[i],sizeof(char),length,fp));
+    ot_names[i][length] = '\0';
+  }
+  while (ot_num_read<=OT_NUM_RECORDS&&
+         fread(ot_read[ot_num_read],sizeof(double),num_columns,fp)==num_columns){
+    ot_num_read = ot_num_read + 1;
+  }
+  fclose(fp);
+  remove(OT_FILE);
+}
+
+/*
+ * A driven, damped cavity coupled to a decaying qubit (truncated to one
+ * excitation if cap=1), with the populations, <a^dag a> and <sig_x>
+ * recorded every 0.25 by record_output, through a buffer of 3 records
+ * (so that the writer thread gets several full buffers and a partial
+ * one). The references are from get_populations and get_expectation_value.
+ */
+static void ot_run_model(int cap){
+  operator    a,q;
+  Vec         x;
+  double      *populations;
+  PetscScalar ev;
+  int         k,i,num_pop;
+
+  if (cap) {
+    set_excitation_cap(1);
+  }
+  jc_model(&a,&q,1);
+  add_to_ham(0.1,q->sig_x);
+
+  create_full_dm(&x);
+  set_initial_pop(q,1);
+  set_dm_from_initial_pop(x);
+
+  add_output_populations();
+  add_output_expectation("n_a",2,a->dag,a);
+  add_output_expectation("sig_x",1,q->sig_x);
+  PetscOptionsSetValue(NULL,"-output_buffer_records","3");
+  open_output(OT_FILE);
+  PetscOptionsClearValue(NULL,"-output_buffer_records");
+
+  num_pop = get_num_populations();
+  ot_num_columns = num_pop + 3;
+  populations = malloc(num_pop*sizeof(double));
+  for (k=0;k<OT_NUM_RECORDS;k++){
+    if (k>0) {
+      time_step(x,0.25*(k-1),0.25*k,0.0009765625,100000);
+    }
+    record_output(0.25*k,x);
+
+    ot_ref[k][0] = 0.25*k;
+    get_populations(x,&populations);
+    for (i=0;i<num_pop;i++){
+      ot_ref[k][1+i] = populations[i];
+    }
+    get_expectation_value(x,&ev,2,a->dag,a);
+    ot_ref[k][1+num_pop] = PetscRealPart(ev);
+    get_expectation_value(x,&ev,1,q->sig_x);
+    ot_ref[k][2+num_pop] = PetscRealPart(ev);
+  }
+  close_output();
+  free(populations);
+
+  destroy_dm(x);
+  destroy_op(&a);
+  destroy_op(&q);
+  QuaC_clear();
+}
+
+static void ot_compare(int cap){
+  int k,i;
+
+  ot_run_model(cap);
+  ot_read_file();
+  if (nid==0) {
+    TEST_ASSERT_EQUAL_INT(OT_NUM_RECORDS,ot_num_read);
+    TEST_ASSERT_EQUAL_STRING("time",ot_names[0]);
+    TEST_ASSERT_EQUAL_STRING("pop0",ot_names[1]);
+    TEST_ASSERT_EQUAL_STRING("n_a",ot_names[ot_num_columns-2]);
+    TEST_ASSERT_EQUAL_STRING("sig_x",ot_names[ot_num_columns-1]);
+    /* The qubit starts excited, then exchanges with the cavity */
+    TEST_ASSERT_TRUE(ot_ref[OT_NUM_RECORDS-1][1]>1e-2);
+    TEST_ASSERT_TRUE(fabs(ot_ref[OT_NUM_RECORDS-1][ot_num_columns-1])>1e-3);
+    for (k=0;k<OT_NUM_RECORDS;k++){
+      for (i=0;i<ot_num_columns;i++){
+        TEST_ASSERT_FLOAT_WITHIN(1e-12,ot_ref[k][i],ot_read[k][i]);
+      }
+    }
+  }
+}
+
+void test_output_record(void)
+{
+  ot_compare(0);
+}
+
+void test_output_excitation_cap(void)
+{
+  ot_compare(1);
+}
+
+/* As the ts_monitor, on an output grid: one record per output time */
+void test_output_ts_monitor(void)
+{
+  operator a,q;
+  Vec      x;
+  int      k;
+
+  jc_model(&a,&q,0);
+  add_lin(0.1,a);
+
+  create_full_dm(&x);
+  set_initial_pop(q,1);
+  set_dm_from_initial_pop(x);
+
+  add_output_populations();
+  open_output(OT_FILE);
+  set_output_grid(0.0,0.25,OT_NUM_RECORDS);
+  set_ts_monitor(ts_monitor_output);
+  time_step(x,0.0,0.25*(OT_NUM_RECORDS-1),0.0009765625,100000);
+  set_output_times(0,NULL);
+  set_ts_monitor(NULL);
+  close_output();
+
+  ot_num_columns = 1 + get_num_populations();
+  ot_read_file();
+  if (nid==0) {
+    TEST_ASSERT_EQUAL_INT(OT_NUM_RECORDS,ot_num_read);
+    for (k=0;k<OT_NUM_RECORDS;k++){
+      TEST_ASSERT_FLOAT_WITHIN(1e-12,0.25*k,ot_read[k][0]);
+    }
+    /* Populations are conserved without qubit decay */
+    TEST_ASSERT_FLOAT_WITHIN(1e-12,1.0,ot_read[0][2]);
+    TEST_ASSERT_TRUE(ot_read[OT_NUM_RECORDS-1][1]>1e-2);
+  }
+
+  destroy_dm(x);
+  destroy_op(&a);
+  destroy_op(&q);
+  QuaC_clear();
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_output_record);
+  RUN_TEST(test_output_excitation_cap);
+  RUN_TEST(test_output_ts_monitor);
+  QuaC_finalize();
+  return UNITY_END();
+}
@@ -0,0 +1,145 @@
+#include "unity.h"
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <utime.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "qasm_parser.h"
+#include "pauli_sum.h"
+#include "petsc.h"
+
+#define PS_N 8
+
+/* The test state, phi_i, and the test Hamiltonian as a projectq file */
+static PetscScalar ps_phi(PetscInt i){
+  return (sin(1.0+i)+PETSC_i*cos(3.0*i))/2.0;
+}
+
+static void ps_write_ham(const char filename[],double c){
+  FILE *fp;
+  fp = fopen(filename,"w");
+  fprintf(fp,"%f [X0 X1]\n",c);
+  fprintf(fp,"0.3 [Z2]\n");
+  fprintf(fp,"0.2 [Y0 Y1]\n");
+  fprintf(fp,"-0.4 [X0 Y1 Z2]\n");
+  fprintf(fp,"-0.1 []\n");
+  fclose(fp);
+}
+
+/*
+ * Dense <phi|H|phi>, with H the Hamiltonian in ps_write_ham, built from
+ * explicit Kronecker products; qubit 0 is the most significant.
+ */
+static PetscScalar ps_dense_expectation(double c){
+  PetscScalar pauli[4][2][2] = {{{1,0},{0,1}},{{0,1},{1,0}},
+                                {{0,-PETSC_i},{PETSC_i,0}},{{1,0},{0,-1}}};
+  int         strings[4][3] = {{1,1,0},{0,0,3},{2,2,0},{1,2,3}};
+  double      coeffs[4] = {c,0.3,0.2,-0.4};
+  PetscScalar val=0.0,norm=0.0,elem;
+  int         k,r,col,q;
+
+  for (r=0;r<PS_N;r++){
+    norm += PetscConjComplex(ps_phi(r))*ps_phi(r);
+    for (col=0;col<PS_N;col++){
+      for (k=0;k<4;k++){
+        elem = coeffs[k];
+        for (q=0;q<3;q++){
+          elem *= pauli[strings[k][q]][(r>>(2-q))&1][(col>>(2-q))&1];
+        }
+        val += PetscConjComplex(ps_phi(r))*elem*ps_phi(col);
+      }
+    }
+  }
+  return val/norm - 0.1;
+}
+
+/*
+ * Sets x to phi (lindblad=0) or |phi><phi| (lindblad=1), normalized
+ */
+static void ps_set_state(Vec x,int lindblad){
+  PetscInt    i,Istart,Iend;
+  PetscScalar norm=0.0;
+
+  for (i=0;i<PS_N;i++) norm += PetscConjComplex(ps_phi(i))*ps_phi(i);
+  VecGetOwnershipRange(x,&Istart,&Iend);
+  for (i=Istart;i<Iend;i++){
+    if (lindblad){
+      /* rho(r,c) at N*c + r */
+      VecSetValue(x,i,ps_phi(i%PS_N)*PetscConjComplex(ps_phi(i/PS_N))/norm,INSERT_VALUES);
+    } else {
+      VecSetValue(x,i,ps_phi(i)/PetscSqrtComplex(norm),INSERT_VALUES);
+    }
+  }
+  VecAssemblyBegin(x);
+  VecAssemblyEnd(x);
+}
+
+/*
+ * Evaluates the projectq file twice (the second time from the cache),
+ * then rewrites it with a new coefficient and a new modification time,
+ * which must be picked up.
+ */
+void ps_run(int lindblad){
+  operator      q0,q1,q2;
+  Vec           x;
+  PetscScalar   val;
+  struct utimbuf new_times;
+  const char    *filename = "pauli_sum_test_ham.dat";
+
+  create_op(2,&q0);
+  create_op(2,&q1);
+  create_op(2,&q2);
+  if (lindblad) {
+    add_lin(0.1,q0);
+  }
+  create_full_dm(&x);
+  ps_set_state(x,lindblad);
+
+  if (nid==0) ps_write_ham(filename,0.5);
+  MPI_Barrier(PETSC_COMM_WORLD);
+  projectq_vqe_get_expectation((char*)filename,x,&val);
+  TEST_ASSERT_FLOAT_WITHIN(1e-12,PetscRealPart(ps_dense_expectation(0.5)),PetscRealPart(val));
+  projectq_vqe_get_expectation((char*)filename,x,&val);
+  TEST_ASSERT_FLOAT_WITHIN(1e-12,PetscRealPart(ps_dense_expectation(0.5)),PetscRealPart(val));
+
+  if (nid==0) {
+    ps_write_ham(filename,0.9);
+    new_times.actime  = time(NULL)+10;
+    new_times.modtime = time(NULL)+10;
+    utime(filename,&new_times);
+  }
+  MPI_Barrier(PETSC_COMM_WORLD);
+  projectq_vqe_get_expectation((char*)filename,x,&val);
+  TEST_ASSERT_FLOAT_WITHIN(1e-12,PetscRealPart(ps_dense_expectation(0.9)),PetscRealPart(val));
+
+  if (nid==0) remove(filename);
+  VecDestroy(&x);
+  destroy_op(&q0);
+  destroy_op(&q1);
+  destroy_op(&q2);
+  QuaC_clear();
+}
+
+void test_pauli_sum_dm(void)
+{
+  ps_run(1);
+}
+
+void test_pauli_sum_psi(void)
+{
+  ps_run(0);
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_pauli_sum_dm);
+  RUN_TEST(test_pauli_sum_psi);
+  QuaC_finalize();
+  return UNITY_END();
+}
@@ -0,0 +1,259 @@
+#include "unity.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "quantum_gates.h"
+#include "rotating_frame.h"
+#include "rotating_frame_p.h"
+#include "petsc.h"
+#include "tests.h"
+
+/*
+ * Two coupled, decaying qubits at frequency 5, with a circuit whose
+ * Hadamards turn the lab frame phase of q0 into populations, solved in
+ * the lab frame (frame=0) or in the frame rotating at 5 (frame=1).
+ * The RZ commutes with the frame, the Hadamards and CNOT do not.
+ * Returns the (lab frame) populations at the end.
+ */
+static void rf_run_model(int frame,double **populations,int *num_pop){
+  operator q0,q1;
+  circuit  circ;
+  Vec      rho;
+
+  create_op(2,&q0);
+  create_op(2,&q1);
+  add_to_ham(5.0,q0->n);
+  add_to_ham(5.0,q1->n);
+  add_to_ham_mult2(0.3,q0,q1->dag);
+  add_to_ham_mult2(0.3,q0->dag,q1);
+  add_lin(0.1,q0);
+  add_lin(0.05,q1);
+  if (frame) {
+    add_to_rotating_frame(5.0,q0);
+    add_to_rotating_frame(5.0,q1);
+  }
+
+  create_circuit(&circ,5);
+  add_gate_to_circuit(&circ,0.5,HADAMARD,0);
+  add_gate_to_circuit(&circ,0.75,RZ,0,0.4);
+  add_gate_to_circuit(&circ,1.0,HADAMARD,0);
+  add_gate_to_circuit(&circ,1.25,CNOT,0,1);
+  start_circuit_at_time(&circ,0.0);
+
+  create_full_dm(&rho);
+  set_dm_from_initial_pop(rho);
+  time_step(rho,0.0,2.0,0.0009765625,100000);
+
+  *num_pop = get_num_populations();
+  (*populations) = malloc((*num_pop)*sizeof(double));
+  get_populations(rho,populations);
+
+  destroy_dm(rho);
+  destroy_op(&q0);
+  destroy_op(&q1);
+  QuaC_clear();
+}
+
+void test_rotating_frame_gates(void)
+{
+  double *pop_lab,*pop_frame;
+  int    num_pop,i;
+
+  rf_run_model(0,&pop_lab,&num_pop);
+  rf_run_model(1,&pop_frame,&num_pop);
+  if (nid==0) {
+    for (i=0;i<num_pop;i++){
+      TEST_ASSERT_FLOAT_WITHIN(1e-6,pop_lab[i],pop_frame[i]);
+    }
+  }
+  free(pop_lab);
+  free(pop_frame);
+}
+
+/*
+ * Two coupled, decaying qubits at 5 and 4, the first one pumped, in the
+ * frame (omega0,omega1), or in the lab frame if omega0 = 0. Returns the
+ * populations of the steady state if populations is not NULL.
+ */
+static void rf_steady_state(PetscReal omega0,PetscReal omega1,double **populations){
+  operator q0,q1;
+  Vec      rho;
+
+  create_op(2,&q0);
+  create_op(2,&q1);
+  add_to_ham(5.0,q0->n);
+  add_to_ham(4.0,q1->n);
+  add_to_ham_mult2(0.3,q0,q1->dag);
+  add_to_ham_mult2(0.3,q0->dag,q1);
+  add_lin(0.1,q0);
+  add_lin(0.05,q0->dag);
+  add_lin(0.05,q1);
+  if (omega0!=0) {
+    add_to_rotating_frame(omega0,q0);
+    add_to_rotating_frame(omega1,q1);
+  }
+  create_full_dm(&rho);
+  steady_state(rho);
+  if (populations!=NULL) {
+    (*populations) = malloc(get_num_populations()*sizeof(double));
+    get_populations(rho,populations);
+  }
+  destroy_dm(rho);
+  destroy_op(&q0);
+  destroy_op(&q1);
+  QuaC_clear();
+}
+
+/* The coupling rotates at 5 - 4 in the frame of the qubit frequencies */
+static void rf_rotating_steady_state(){
+  rf_steady_state(5.0,4.0,NULL);
+}
+
+/*
+ * A frame that does not match the qubit frequencies leaves the coupling
+ * rotating, which steady_state refuses; a frame in which nothing rotates
+ * gives the lab frame populations.
+ */
+void test_rotating_frame_steady_state(void)
+{
+  double *pop_lab,*pop_frame;
+  int    i;
+
+  if (np>1) TEST_IGNORE_MESSAGE("Refusals are only checked on one rank");
+  TEST_ASSERT_TRUE(refuses(rf_rotating_steady_state));
+
+  rf_steady_state(0.0,0.0,&pop_lab);
+  rf_steady_state(5.0,5.0,&pop_frame);
+  TEST_ASSERT_TRUE(pop_lab[1]>1e-3);
+  for (i=0;i<2;i++){
+    TEST_ASSERT_FLOAT_WITHIN(1e-8,pop_lab[i],pop_frame[i]);
+  }
+  free(pop_lab);
+  free(pop_frame);
+}
+
+/*
+ * A qubit at 5 in the frame rotating at 5, with the Lindblad term lin:
+ * 0 for sig_x, 1 for a time dependent sig_x, 2 for sig_x and 3 for sm as
+ * matrices (add_lin_mat)
+ */
+static double rf_rate(double t){
+  return 0.1;
+}
+
+static void rf_lin_model(int lin){
+  operator q0;
+  Vec      rho;
+  Mat      C;
+  PetscInt Istart,Iend;
+
+  create_op(2,&q0);
+  add_to_ham(5.0,q0->n);
+  add_to_rotating_frame(5.0,q0);
+  if (lin==0) {
+    add_lin(0.1,q0->sig_x);
+  } else if (lin==1) {
+    add_lin_time_dep_p(rf_rate,1,q0->sig_x);
+  } else {
+    MatCreate(PETSC_COMM_WORLD,&C);
+    MatSetSizes(C,PETSC_DECIDE,PETSC_DECIDE,2,2);
+    MatSetFromOptions(C);
+    MatSetUp(C);
+    MatGetOwnershipRange(C,&Istart,&Iend);
+    if (Istart==0) MatSetValue(C,0,1,1.0,INSERT_VALUES);
+    if (lin==2&&Iend==2) MatSetValue(C,1,0,1.0,INSERT_VALUES);
+    MatAssemblyBegin(C,MAT_FINAL_ASSEMBLY);
+    MatAssemblyEnd(C,MAT_FINAL_ASSEMBLY);
+    add_lin_mat(0.1,C);
+  }
+  create_full_dm(&rho);
+  time_step(rho,0.0,0.5,0.0009765625,100000);
+  destroy_dm(rho);
+  destroy_op(&q0);
+  QuaC_clear();
+}
+
+static void rf_lin_sig_x(){
+  rf_lin_model(0);
+}
+
+static void rf_lin_time_dep_sig_x(){
+  rf_lin_model(1);
+}
+
+static void rf_lin_mat_sig_x(){
+  rf_lin_model(2);
+}
+
+static void rf_lin_mat_sm(){
+  rf_lin_model(3);
+}
+
+/*
+ * In the frame, a Lindblad term of several frequencies (sig_x = sm +
+ * sm^dag) would gain cross terms at exp(+-2 i omega t); it is refused,
+ * while sm alone, which the frame leaves unchanged, is not
+ */
+void test_rotating_frame_lindblad(void)
+{
+  if (np>1) TEST_IGNORE_MESSAGE("Refusals are only checked on one rank");
+  TEST_ASSERT_TRUE(refuses(rf_lin_sig_x));
+  TEST_ASSERT_TRUE(refuses(rf_lin_time_dep_sig_x));
+  TEST_ASSERT_TRUE(refuses(rf_lin_mat_sig_x));
+  TEST_ASSERT_FALSE(refuses(rf_lin_mat_sm));
+}
+
+/*
+ * The coupling rotates in the frame of the qubit frequencies, and does
+ * not in the frame halfway between them
+ */
+void test_rotating_frame_time_dep_terms(void)
+{
+  operator q0,q1;
+
+  create_op(2,&q0);
+  create_op(2,&q1);
+  add_to_ham(5.0,q0->n);
+  add_to_ham(4.0,q1->n);
+  add_to_ham_mult2(0.3,q0,q1->dag);
+  add_to_ham_mult2(0.3,q0->dag,q1);
+  add_lin(0.1,q0);
+  add_to_rotating_frame(5.0,q0);
+  add_to_rotating_frame(4.0,q1);
+  build_operators();
+  TEST_ASSERT_EQUAL_INT(2,_frame_time_dep_terms());
+  destroy_op(&q0);
+  destroy_op(&q1);
+  QuaC_clear();
+
+  create_op(2,&q0);
+  create_op(2,&q1);
+  add_to_ham(5.0,q0->n);
+  add_to_ham(4.0,q1->n);
+  add_to_ham_mult2(0.3,q0,q1->dag);
+  add_to_ham_mult2(0.3,q0->dag,q1);
+  add_lin(0.1,q0);
+  add_to_rotating_frame(4.5,q0);
+  add_to_rotating_frame(4.5,q1);
+  build_operators();
+  TEST_ASSERT_EQUAL_INT(0,_frame_time_dep_terms());
+  destroy_op(&q0);
+  destroy_op(&q1);
+  QuaC_clear();
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_rotating_frame_gates);
+  RUN_TEST(test_rotating_frame_time_dep_terms);
+  RUN_TEST(test_rotating_frame_steady_state);
+  RUN_TEST(test_rotating_frame_lindblad);
+  QuaC_finalize();
+  return UNITY_END();
+}
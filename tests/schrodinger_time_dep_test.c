@@ -0,0 +1,81 @@
+#include "unity.h"
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "petsc.h"
+
+double sc_pulse(double);
+
+/*
+ * Builds a cavity coupled to a qubit, driven by a time dependent pulse,
+ * and time steps it. With lindblad=0 there are no Lindblad terms, so the
+ * Schrodinger solver is used; with lindblad=1 a zero rate Lindblad term
+ * forces the density matrix solver on the same (closed) dynamics.
+ */
+void sc_run_model(int lindblad,double **populations,int *num_pop){
+  operator a,q;
+  Vec      x;
+
+  create_op(3,&a);
+  create_op(2,&q);
+  add_to_ham(1.0,a->n);
+  add_to_ham(1.2,q->n);
+  add_to_ham_mult2(0.3,q,a->dag);
+  add_to_ham_mult2(0.3,q->dag,a);
+  add_to_ham_time_dep(sc_pulse,1,a);
+  add_to_ham_time_dep(sc_pulse,1,a->dag);
+  if (lindblad) {
+    add_lin(0.0,a);
+  }
+
+  create_full_dm(&x);
+  set_initial_pop(a,0);
+  set_initial_pop(q,1);
+  set_dm_from_initial_pop(x);
+
+  time_step(x,0.0,2.0,0.01,200);
+
+  *num_pop = get_num_populations();
+  (*populations) = malloc((*num_pop)*sizeof(double));
+  get_populations(x,populations);
+
+  destroy_dm(x);
+  destroy_op(&a);
+  destroy_op(&q);
+  QuaC_clear();
+  return;
+}
+
+void test_schrodinger_time_dep(void)
+{
+  double *pop_psi,*pop_dm;
+  int    num_pop,i;
+
+  sc_run_model(0,&pop_psi,&num_pop);
+  sc_run_model(1,&pop_dm,&num_pop);
+  if (nid==0) {
+    for (i=0;i<num_pop;i++){
+      TEST_ASSERT_FLOAT_WITHIN(1e-5,pop_dm[i],pop_psi[i]);
+    }
+    /* The drive must actually have moved population into the cavity */
+    TEST_ASSERT_TRUE(pop_psi[0]>1e-2);
+  }
+  free(pop_psi);
+  free(pop_dm);
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_schrodinger_time_dep);
+  QuaC_finalize();
+  return UNITY_END();
+}
+
+double sc_pulse(double time){
+  return 0.5*exp(-pow(time-1.0,2));
+}
@@ -0,0 +1,136 @@
+#include "unity.h"
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "excitation_basis_p.h"
+#include "petsc.h"
+
+static double *pop_trace_row;
+
+/*
+ * A driven, damped cavity coupled to a pumped qubit, solved with
+ * steady_state. If evolve=1, the steady state is then time stepped,
+ * which must leave it where it is. Returns the populations of the steady
+ * state (and after the time step), and the number of nonzeros in row 0
+ * of full_A after steady_state.
+ */
+static void sp_run_model(int matrix_free,int evolve,double **populations,double **populations_evolved,
+                         int *num_pop,PetscInt *row0_nz){
+  operator          a,q;
+  Vec               x;
+  PetscInt          row=0;
+  const PetscInt    *cols;
+  const PetscScalar *vals;
+
+  create_op(4,&a);
+  create_op(2,&q);
+  if (matrix_free) {
+    set_matrix_free();
+  }
+  add_to_ham(1.0,a->n);
+  add_to_ham(1.1,q->n);
+  add_to_ham_mult2(0.3,q,a->dag);
+  add_to_ham_mult2(0.3,q->dag,a);
+  add_to_ham(0.1,a);
+  add_to_ham(0.1,a->dag);
+  add_lin(0.2,a);
+  add_lin(0.1,q->dag);
+  add_lin(0.05,q);
+
+  create_full_dm(&x);
+  steady_state(x);
+
+  *num_pop = get_num_populations();
+  (*populations) = malloc((*num_pop)*sizeof(double));
+  get_populations(x,populations);
+
+  *row0_nz = 0;
+  if (!matrix_free&&nid==0) {
+    MatGetRow(full_A,row,row0_nz,&cols,&vals);
+    MatRestoreRow(full_A,row,row0_nz,&cols,&vals);
+  }
+
+  if (evolve) {
+    time_step(x,0.0,1.0,0.0009765625,100000);
+    (*populations_evolved) = malloc((*num_pop)*sizeof(double));
+    get_populations(x,populations_evolved);
+  }
+
+  destroy_dm(x);
+  destroy_op(&a);
+  destroy_op(&q);
+  QuaC_clear();
+}
+
+/* The trace row is the reference; it couples row 0 to every diagonal element */
+void test_steady_state_trace_row(void)
+{
+  double   *pop_evolved;
+  int      num_pop,i;
+  PetscInt row0_nz;
+
+  sp_run_model(0,1,&pop_trace_row,&pop_evolved,&num_pop,&row0_nz);
+  if (nid==0) {
+    TEST_ASSERT_TRUE(row0_nz>=_basis_dim);
+    for (i=0;i<num_pop;i++){
+      TEST_ASSERT_TRUE(pop_trace_row[i]>1e-3);
+      TEST_ASSERT_FLOAT_WITHIN(1e-6,pop_trace_row[i],pop_evolved[i]);
+    }
+  }
+  free(pop_evolved);
+}
+
+/*
+ * Pinning the ground state gives the same steady state without the
+ * dense row, and full_A is restored afterwards, so time_step still
+ * leaves the steady state where it is
+ */
+void test_steady_state_pinned(void)
+{
+  double   *pop_pinned,*pop_evolved;
+  int      num_pop,i;
+  PetscInt row0_nz;
+
+  set_steady_state_pinned(0);
+  sp_run_model(0,1,&pop_pinned,&pop_evolved,&num_pop,&row0_nz);
+  if (nid==0) {
+    TEST_ASSERT_TRUE(row0_nz<10);
+    for (i=0;i<num_pop;i++){
+      TEST_ASSERT_FLOAT_WITHIN(1e-8,pop_trace_row[i],pop_pinned[i]);
+      TEST_ASSERT_FLOAT_WITHIN(1e-6,pop_trace_row[i],pop_evolved[i]);
+    }
+  }
+  free(pop_pinned);
+  free(pop_evolved);
+}
+
+void test_steady_state_pinned_matrix_free(void)
+{
+  double   *pop_pinned;
+  int      num_pop,i;
+  PetscInt row0_nz;
+
+  sp_run_model(1,0,&pop_pinned,NULL,&num_pop,&row0_nz);
+  if (nid==0) {
+    for (i=0;i<num_pop;i++){
+      TEST_ASSERT_FLOAT_WITHIN(1e-8,pop_trace_row[i],pop_pinned[i]);
+    }
+  }
+  free(pop_pinned);
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  /* Last two in order, as the pinned state cannot be unset */
+  RUN_TEST(test_steady_state_trace_row);
+  RUN_TEST(test_steady_state_pinned);
+  RUN_TEST(test_steady_state_pinned_matrix_free);
+  free(pop_trace_row);
+  QuaC_finalize();
+  return UNITY_END();
+}
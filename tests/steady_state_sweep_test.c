@@ -0,0 +1,135 @@
+#include "unity.h"
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "petsc.h"
+
+#define NUM_PARAMS 5
+
+static PetscReal params[NUM_PARAMS] = {0.05,0.1,0.15,0.2,0.25};
+static double    pop_ref[NUM_PARAMS][2];
+static double    pop_sweep[NUM_PARAMS][2];
+static int       num_points;
+
+static double drive(double p){
+  return p;
+}
+
+static double pump(double p){
+  return 0.5*p;
+}
+
+/* Records the populations of each point of the sweep */
+static PetscErrorCode sw_monitor(PetscInt k,PetscReal p,Vec x,void *ctx){
+  double *populations;
+
+  populations = malloc(get_num_populations()*sizeof(double));
+  get_populations(x,&populations);
+  pop_sweep[k][0] = populations[0];
+  pop_sweep[k][1] = populations[1];
+  free(populations);
+  num_points = num_points + 1;
+  return 0;
+}
+
+/*
+ * A cavity coupled to a qubit, with a cavity drive of strength p and a
+ * qubit pump of rate p/2. With sweep=1, the drive and pump are time
+ * dependent terms swept over params with steady_state_sweep; otherwise
+ * (sweep=0) each point is solved on its own with steady_state, as the
+ * reference.
+ */
+static void sw_run_model(int sweep,int matrix_free){
+  operator a,q;
+  Vec      x;
+  double   *populations;
+  int      k;
+
+  for (k=0;k<(sweep?1:NUM_PARAMS);k++){
+    create_op(4,&a);
+    create_op(2,&q);
+    if (matrix_free) {
+      set_matrix_free();
+    }
+    add_to_ham(1.0,a->n);
+    add_to_ham(1.1,q->n);
+    add_to_ham_mult2(0.3,q,a->dag);
+    add_to_ham_mult2(0.3,q->dag,a);
+    add_lin(0.2,a);
+    add_lin(0.05,q);
+    if (sweep) {
+      add_to_ham_time_dep(drive,1,a);
+      add_to_ham_time_dep(drive,1,a->dag);
+      add_lin_time_dep_p(pump,1,q->dag);
+    } else {
+      add_to_ham(drive(params[k]),a);
+      add_to_ham(drive(params[k]),a->dag);
+      add_lin(pump(params[k]),q->dag);
+    }
+
+    create_full_dm(&x);
+    if (sweep) {
+      num_points = 0;
+      steady_state_sweep(x,NUM_PARAMS,params,sw_monitor,NULL);
+    } else {
+      steady_state(x);
+      populations = malloc(get_num_populations()*sizeof(double));
+      get_populations(x,&populations);
+      pop_ref[k][0] = populations[0];
+      pop_ref[k][1] = populations[1];
+      free(populations);
+    }
+
+    destroy_dm(x);
+    destroy_op(&a);
+    destroy_op(&q);
+    QuaC_clear();
+  }
+}
+
+static void sw_compare(int matrix_free){
+  int k;
+
+  sw_run_model(1,matrix_free);
+  TEST_ASSERT_EQUAL_INT(NUM_PARAMS,num_points);
+  if (nid==0) {
+    for (k=0;k<NUM_PARAMS;k++){
+      TEST_ASSERT_FLOAT_WITHIN(1e-7,pop_ref[k][0],pop_sweep[k][0]);
+      TEST_ASSERT_FLOAT_WITHIN(1e-7,pop_ref[k][1],pop_sweep[k][1]);
+    }
+    /* The points differ, so each one is really solved */
+    TEST_ASSERT_TRUE(fabs(pop_sweep[NUM_PARAMS-1][1]-pop_sweep[0][1])>1e-2);
+  }
+}
+
+void test_steady_state_sweep(void)
+{
+  sw_compare(0);
+}
+
+void test_steady_state_sweep_matrix_free(void)
+{
+  sw_compare(1);
+}
+
+/* Last, as the pinned state cannot be unset */
+void test_steady_state_sweep_pinned(void)
+{
+  set_steady_state_pinned(0);
+  sw_compare(0);
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  sw_run_model(0,0);
+  RUN_TEST(test_steady_state_sweep);
+  RUN_TEST(test_steady_state_sweep_matrix_free);
+  RUN_TEST(test_steady_state_sweep_pinned);
+  QuaC_finalize();
+  return UNITY_END();
+}
@@ -0,0 +1,125 @@
+#include "unity.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "petsc.h"
+#include "tests.h"
+
+/*
+ * A damped, driven, resonant cavity-qubit pair with a fast frequency of
+ * 40 on both. The fast terms are added as stiff terms (stiff=1),
+ * integrated implicitly by the IMEX TS, or as ordinary terms with the
+ * explicit RK TS. The steps are powers of two, so that every run ends
+ * exactly at 2. Returns the populations at the end.
+ */
+static void si_run_model(int stiff,double dt,double **populations){
+  operator a,q;
+  Vec      x;
+
+  create_op(4,&a);
+  create_op(2,&q);
+  add_to_ham(1.0,a->n);
+  add_to_ham(1.0,q->n);
+  if (stiff) {
+    add_to_ham_stiff(40.0,a->n);
+    add_to_ham_stiff(40.0,q->n);
+  } else {
+    add_to_ham(40.0,a->n);
+    add_to_ham(40.0,q->n);
+  }
+  add_to_ham_mult2(0.4,q,a->dag);
+  add_to_ham_mult2(0.4,q->dag,a);
+  add_to_ham(0.5,a);
+  add_to_ham(0.5,a->dag);
+  add_lin(0.1,a);
+  add_lin(0.05,q);
+
+  create_full_dm(&x);
+  set_initial_pop(q,1);
+  set_dm_from_initial_pop(x);
+
+  time_step(x,0.0,2.0,dt,100000);
+
+  (*populations) = malloc(get_num_populations()*sizeof(double));
+  get_populations(x,populations);
+
+  destroy_dm(x);
+  destroy_op(&a);
+  destroy_op(&q);
+  QuaC_clear();
+}
+
+/*
+ * The drive excites the coherences between excitation numbers, which
+ * rotate at the fast frequency. The explicit RK needs dt < ~0.06 for
+ * them and is unstable at dt = 0.125; the IMEX TS at dt = 0.125 matches
+ * the RK at dt = 2^-10.
+ */
+void test_stiff_imex_dm(void)
+{
+  double *pop_ref,*pop_rk,*pop_imex;
+  int    i;
+
+  si_run_model(0,0.0009765625,&pop_ref);
+  si_run_model(0,0.125,&pop_rk);
+  si_run_model(1,0.125,&pop_imex);
+  if (nid==0) {
+    TEST_ASSERT_TRUE(pop_ref[0]>1e-2);
+    TEST_ASSERT_FALSE(fabs(pop_rk[0]-pop_ref[0])<1e-1);
+    for (i=0;i<get_num_populations();i++){
+      TEST_ASSERT_FLOAT_WITHIN(1e-2,pop_ref[i],pop_imex[i]);
+    }
+  }
+  free(pop_ref);
+  free(pop_rk);
+  free(pop_imex);
+}
+
+/* The closed system, for the Schrodinger solver */
+static void si_run_psi(){
+  operator a,q;
+  Vec      x;
+
+  create_op(4,&a);
+  create_op(2,&q);
+  add_to_ham(1.0,a->n);
+  add_to_ham(1.0,q->n);
+  add_to_ham_stiff(40.0,a->n);
+  add_to_ham_stiff(40.0,q->n);
+  add_to_ham_mult2(0.4,q,a->dag);
+  add_to_ham_mult2(0.4,q->dag,a);
+
+  create_full_dm(&x);
+  set_initial_pop(q,1);
+  set_dm_from_initial_pop(x);
+  time_step(x,0.0,2.0,0.125,100000);
+  destroy_dm(x);
+  destroy_op(&a);
+  destroy_op(&q);
+  QuaC_clear();
+}
+
+/*
+ * The implicit step damps the fast phase of psi itself, so psi would
+ * lose its norm; the Schrodinger solver refuses stiff terms. Checked in
+ * a child process, on one rank, as the refusal exits.
+ */
+void test_stiff_imex_psi(void)
+{
+  if (np>1) TEST_IGNORE_MESSAGE("The refusal is only checked on one rank");
+  TEST_ASSERT_TRUE(refuses(si_run_psi));
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_stiff_imex_dm);
+  RUN_TEST(test_stiff_imex_psi);
+  QuaC_finalize();
+  return UNITY_END();
+}
@@ -0,0 +1,120 @@
+#include "unity.h"
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "symmetry.h"
+#include "petsc.h"
+
+/*
+ * A cavity and a qubit exchanging excitations, with cavity decay, qubit
+ * pumping (lindblad=1) and, if drive=1, a coherent drive that does not
+ * conserve the excitation number. Solved with time_step (steady=0) or
+ * steady_state (steady=1), with or without symmetry sectors.
+ * Returns the populations at the end; full_A_built says whether full_A
+ * was assembled.
+ */
+static void ss_run_model(int sectors,int lindblad,int drive,int steady,double **populations,int *num_pop,
+                         PetscBool *full_A_built){
+  operator a,q;
+  Vec      x;
+
+  create_op(4,&a);
+  create_op(2,&q);
+  add_to_ham(1.0,a->n);
+  add_to_ham(1.1,q->n);
+  add_to_ham_mult2(0.3,q,a->dag);
+  add_to_ham_mult2(0.3,q->dag,a);
+  if (drive) {
+    add_to_ham(0.05,a);
+    add_to_ham(0.05,a->dag);
+  }
+  if (lindblad) {
+    add_lin(0.2,a);
+    add_lin(0.1,q->dag);
+  }
+  if (sectors) {
+    set_symmetry_sectors();
+  }
+
+  create_full_dm(&x);
+  set_initial_pop(q,1);
+  set_dm_from_initial_pop(x);
+
+  if (steady) {
+    steady_state(x);
+  } else {
+    time_step(x,0.0,2.0,0.0009765625,100000);
+  }
+
+  *num_pop = get_num_populations();
+  (*populations) = malloc((*num_pop)*sizeof(double));
+  get_populations(x,populations);
+  MatAssembled(full_A,full_A_built);
+
+  destroy_dm(x);
+  destroy_op(&a);
+  destroy_op(&q);
+  QuaC_clear();
+}
+
+static void ss_compare(int lindblad,int drive,int steady,PetscBool full_A_expected){
+  double    *pop_full,*pop_sectors;
+  int       num_pop,i;
+  PetscBool full_A_built;
+
+  ss_run_model(0,lindblad,drive,steady,&pop_full,&num_pop,&full_A_built);
+  ss_run_model(1,lindblad,drive,steady,&pop_sectors,&num_pop,&full_A_built);
+  TEST_ASSERT_EQUAL_INT(full_A_expected,full_A_built);
+  if (nid==0) {
+    for (i=0;i<num_pop;i++){
+      TEST_ASSERT_FLOAT_WITHIN(1e-8,pop_full[i],pop_sectors[i]);
+    }
+  }
+  free(pop_full);
+  free(pop_sectors);
+}
+
+/* The sectors are generated from the terms; full_A is never assembled */
+void test_sectors_time_step_dm(void)
+{
+  ss_compare(1,0,0,PETSC_FALSE);
+}
+
+void test_sectors_time_step_psi(void)
+{
+  ss_compare(0,0,0,PETSC_FALSE);
+}
+
+void test_sectors_steady_state(void)
+{
+  ss_compare(1,0,1,PETSC_FALSE);
+}
+
+/* The drive breaks the symmetry, so the full system is solved */
+void test_sectors_not_conserved(void)
+{
+  ss_compare(1,1,0,PETSC_TRUE);
+}
+
+/* Last, as the pinned state cannot be unset */
+void test_sectors_steady_state_pinned(void)
+{
+  set_steady_state_pinned(0);
+  ss_compare(1,0,1,PETSC_FALSE);
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_sectors_time_step_dm);
+  RUN_TEST(test_sectors_time_step_psi);
+  RUN_TEST(test_sectors_steady_state);
+  RUN_TEST(test_sectors_not_conserved);
+  RUN_TEST(test_sectors_steady_state_pinned);
+  QuaC_finalize();
+  return UNITY_END();
+}
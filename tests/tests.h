@@ -1,10 +1,14 @@
 #ifndef TESTS_H_
 #define TESTS_H_
 
+#include "operators.h"
+
 void timedep_test(double**,int*);
 void imag_ham_dm_test(double**,int*);
 void imag_ham_psi_test(double**,int*);
 void real_ham_dm_test(double**,int*);
 void real_ham_psi_test(double**,int*);
+void jc_model(operator*,operator*,int);
+int refuses(void (*)(void));
 
 #endif
@@ -0,0 +1,85 @@
+#include "unity.h"
+#include <math.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "petsc.h"
+#include "tests.h"
+
+/*
+ * A damped cavity coupled to a qubit (lindblad=1), or the same closed
+ * system (lindblad=0), propagated from 0 to 2 with the Trotter
+ * propagator at step dt (trotter=1) or with the RK TS at dt=2^-10.
+ * The steps are powers of two, so that every run ends exactly at 2.
+ * Returns the populations at the end.
+ */
+static void tr_run_model(int trotter,int lindblad,double dt,double **populations,int *num_pop){
+  operator a,q;
+  Vec      x;
+
+  jc_model(&a,&q,lindblad);
+
+  create_full_dm(&x);
+  set_initial_pop(q,1);
+  set_dm_from_initial_pop(x);
+
+  if (trotter) {
+    set_trotter_propagator();
+  }
+  time_step(x,0.0,2.0,dt,100000);
+
+  *num_pop = get_num_populations();
+  (*populations) = malloc((*num_pop)*sizeof(double));
+  get_populations(x,populations);
+
+  destroy_dm(x);
+  destroy_op(&a);
+  destroy_op(&q);
+  QuaC_clear();
+}
+
+/*
+ * The Trotter error must be small and drop by about 4 when dt is halved
+ */
+static void tr_compare(int lindblad){
+  double *pop_rk,*pop_dt,*pop_half,err_dt=0.0,err_half=0.0;
+  int    num_pop,i;
+
+  tr_run_model(0,lindblad,0.0009765625,&pop_rk,&num_pop);
+  tr_run_model(1,lindblad,0.125,&pop_dt,&num_pop);
+  tr_run_model(1,lindblad,0.0625,&pop_half,&num_pop);
+  if (nid==0) {
+    for (i=0;i<num_pop;i++){
+      err_dt   = fmax(err_dt,fabs(pop_dt[i]-pop_rk[i]));
+      err_half = fmax(err_half,fabs(pop_half[i]-pop_rk[i]));
+    }
+    TEST_ASSERT_TRUE(err_dt<1e-4);
+    TEST_ASSERT_TRUE(err_half<0.35*err_dt);
+    TEST_ASSERT_TRUE(err_half>0.15*err_dt);
+  }
+  free(pop_rk);
+  free(pop_dt);
+  free(pop_half);
+}
+
+void test_trotter_dm(void)
+{
+  tr_compare(1);
+}
+
+void test_trotter_psi(void)
+{
+  tr_compare(0);
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_trotter_dm);
+  RUN_TEST(test_trotter_psi);
+  QuaC_finalize();
+  return UNITY_END();
+}
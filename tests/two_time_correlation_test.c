@@ -0,0 +1,226 @@
+#include "unity.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "quac.h"
+#include "operators.h"
+#include "solver.h"
+#include "dm_utilities.h"
+#include "petsc.h"
+
+/*
+ * The reference takes steps of 2^-10, so with start times and delays
+ * 2^-10 x 500 apart its steps are exact
+ */
+#define ST_DT    0.48828125
+#define N_ST     2
+#define TAU_STEP ST_DT
+#define N_TAU    9
+#define DT_REF   0.0009765625
+
+static double pulse(double t){
+  return 0.2*cos(0.5*t);
+}
+
+/*
+ * The reference for <a^dag(t) a^dag a(t+tau) a(t)>, with time_step: rho is
+ * evolved to each start time, and a rho a^dag from there over the delays
+ */
+static void tt_reference(Vec x,operator a,PetscScalar ref[N_ST][N_TAU]){
+  Vec       rho,y;
+  PetscReal t;
+  int       k,j;
+
+  VecDuplicate(x,&rho);
+  VecDuplicate(x,&y);
+  VecCopy(x,rho);
+  for (k=0;k<N_ST;k++){
+    t = (k+1)*ST_DT;
+    time_step(rho,k*ST_DT,t,DT_REF,100000);
+    VecCopy(rho,y);
+    mult_dm_left_right(y,a,a);
+    for (j=0;j<N_TAU;j++){
+      if (j>0) {
+        time_step(y,t+(j-1)*TAU_STEP,t+j*TAU_STEP,DT_REF,100000);
+      }
+      get_expectation_value(y,&ref[k][j],2,a->dag,a);
+    }
+  }
+  VecDestroy(&rho);
+  VecDestroy(&y);
+}
+
+/*
+ * A cavity with a constant and a time dependent drive, coupled to a
+ * qubit, started in the ground state. Returns <a^dag(t) a^dag a(t+tau)
+ * a(t)> from two_time_correlation (on the coarse grid of TAU_STEP, with
+ * substeps fixed to fixed_substeps if it is > 0) and from g2_correlation,
+ * and the time_step reference if ref is not NULL.
+ */
+static void tt_run_model(PetscInt fixed_substeps,PetscScalar ***corr,PetscScalar ***g2,PetscScalar ref[N_ST][N_TAU]){
+  operator a,q;
+  operator a_ops[1],b_ops[2],c_ops[1];
+  Vec      x;
+  char     substeps[16];
+
+  create_op(5,&a);
+  create_op(2,&q);
+  add_to_ham(1.0,a->n);
+  add_to_ham(1.2,q->n);
+  add_to_ham(0.3,a);
+  add_to_ham(0.3,a->dag);
+  add_to_ham_mult2(0.4,q,a->dag);
+  add_to_ham_mult2(0.4,q->dag,a);
+  add_lin(0.5,a);
+  add_lin(0.1,q);
+  add_to_ham_time_dep(pulse,1,a);
+  add_to_ham_time_dep(pulse,1,a->dag);
+
+  create_full_dm(&x);
+  set_dm_from_initial_pop(x);
+
+  a_ops[0] = a->dag;
+  b_ops[0] = a->dag;
+  b_ops[1] = a;
+  c_ops[0] = a;
+  if (fixed_substeps>0) {
+    snprintf(substeps,16,"%d",(int)fixed_substeps);
+    PetscOptionsSetValue(NULL,"-corr_substeps",substeps);
+  }
+  two_time_correlation(corr,x,0.0,N_ST,ST_DT,ST_DT,N_TAU,TAU_STEP,1,a_ops,2,b_ops,1,c_ops);
+  g2_correlation(g2,x,N_TAU-1,(N_TAU-1)*TAU_STEP,N_ST,N_ST*ST_DT,1,a);
+  if (fixed_substeps>0) {
+    PetscOptionsClearValue(NULL,"-corr_substeps");
+  }
+  if (ref!=NULL) {
+    tt_reference(x,a,ref);
+  }
+
+  destroy_dm(x);
+  destroy_op(&a);
+  destroy_op(&q);
+  QuaC_clear();
+}
+
+/* The largest difference from the reference, relative to the largest value */
+static double tt_max_error(PetscScalar **corr,PetscScalar ref[N_ST][N_TAU]){
+  double max_err,max_val;
+  int    k,j;
+
+  max_err = 0;
+  max_val = 0;
+  for (k=0;k<N_ST;k++){
+    for (j=0;j<N_TAU;j++){
+      max_err = PetscMax(max_err,PetscAbsComplex(corr[k][j]-ref[k][j]));
+      max_val = PetscMax(max_val,PetscAbsComplex(ref[k][j]));
+    }
+  }
+  return max_err/max_val;
+}
+
+/* g2_correlation is two_time_correlation on the same grid, after a row of zeros */
+static void tt_check_g2(PetscScalar **corr,PetscScalar **g2){
+  int k,j;
+
+  for (j=0;j<N_TAU;j++){
+    TEST_ASSERT_TRUE(PetscAbsComplex(g2[0][j])==0);
+  }
+  for (k=0;k<N_ST;k++){
+    for (j=0;j<N_TAU;j++){
+      TEST_ASSERT_TRUE(PetscAbsComplex(corr[k][j]-g2[k+1][j])<=1e-12*PetscAbsComplex(corr[k][j]));
+    }
+  }
+}
+
+static void tt_free(PetscScalar **corr,PetscScalar **g2){
+  int k;
+
+  for (k=0;k<N_ST;k++){
+    free(corr[k]);
+  }
+  free(corr);
+  for (k=0;k<N_ST+1;k++){
+    free(g2[k]);
+  }
+  free(g2);
+}
+
+/*
+ * One RK4 step per tau_step is stable here but not accurate; the step
+ * doubling of -corr_rtol refines it until it matches the reference
+ */
+void test_two_time_correlation_g2(void)
+{
+  PetscScalar **corr,**g2,ref[N_ST][N_TAU];
+  double      err_fixed,err_rtol;
+
+  tt_run_model(0,&corr,&g2,ref);
+  tt_check_g2(corr,g2);
+  err_rtol = tt_max_error(corr,ref);
+  TEST_ASSERT_TRUE(PetscRealPart(corr[0][0])>1e-3);
+  TEST_ASSERT_TRUE(PetscRealPart(corr[1][N_TAU-1])>1e-2);
+  tt_free(corr,g2);
+
+  tt_run_model(1,&corr,&g2,NULL);
+  tt_check_g2(corr,g2);
+  err_fixed = tt_max_error(corr,ref);
+  tt_free(corr,g2);
+
+  TEST_ASSERT_TRUE(err_fixed>1e-4);
+  TEST_ASSERT_TRUE(err_rtol<1e-6);
+}
+
+/*
+ * At tau = 0 the correlation is <A B C> at t. With sig_y in A, S rho =
+ * C rho A needs A^T, not A^H (which flips the sign).
+ */
+void test_two_time_correlation_sandwich(void)
+{
+  operator    a,q;
+  operator    a_ops[2],b_ops[1],c_ops[1];
+  Vec         x;
+  PetscScalar **corr,ev;
+
+  create_op(3,&a);
+  create_op(2,&q);
+  add_to_ham(1.0,a->n);
+  add_to_ham(1.2,q->n);
+  add_to_ham(0.3,q->sig_x);
+  add_to_ham(0.2,a);
+  add_to_ham(0.2,a->dag);
+  add_to_ham_mult2(0.4,q,a->dag);
+  add_to_ham_mult2(0.4,q->dag,a);
+  add_lin(0.5,a);
+  add_lin(0.1,q);
+
+  create_full_dm(&x);
+  set_dm_from_initial_pop(x);
+
+  a_ops[0] = q->sig_y;
+  a_ops[1] = a->dag;
+  b_ops[0] = a;
+  c_ops[0] = q->sig_x;
+  two_time_correlation(&corr,x,0.0,1,1.0,1.0,1,TAU_STEP,2,a_ops,1,b_ops,1,c_ops);
+
+  time_step(x,0.0,1.0,0.0009765625,100000);
+  get_expectation_value(x,&ev,4,q->sig_y,a->dag,a,q->sig_x);
+  TEST_ASSERT_TRUE(PetscAbsComplex(ev)>1e-3);
+  TEST_ASSERT_TRUE(PetscAbsComplex(corr[0][0]-ev)<1e-6*PetscAbsComplex(ev));
+
+  free(corr[0]);
+  free(corr);
+  destroy_dm(x);
+  destroy_op(&a);
+  destroy_op(&q);
+  QuaC_clear();
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  QuaC_initialize(argc,argv);
+  RUN_TEST(test_two_time_correlation_sandwich);
+  RUN_TEST(test_two_time_correlation_g2);
+  QuaC_finalize();
+  return UNITY_END();
+}
@@ -0,0 +1,69 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * output_to_text converts a file written by QuaC's open_output and
+ * record_output (see src/output_p.h for the format) to text: a header
+ * line with the column names, then one line per record.
+ *
+ * Usage:
+ *     ./output_to_text obs.bin > obs.dat
+ */
+
+#define OUTPUT_MAGIC "QUACOBS1"
+
+int main(int argc,char **args){
+  FILE    *fp;
+  char    magic[8],name[256];
+  int32_t num_columns,length;
+  double  *record;
+  int     i;
+
+  if (argc!=2){
+    fprintf(stderr,"Usage: %s <output file>\n",args[0]);
+    return 1;
+  }
+  fp = fopen(args[1],"rb");
+  if (fp==NULL){
+    fprintf(stderr,"ERROR! Could not open %s!\n",args[1]);
+    return 1;
+  }
+  if (fread(magic,sizeof(char),8,fp)!=8||memcmp(magic,OUTPUT_MAGIC,8)!=0){
+    fprintf(stderr,"ERROR! %s is not a QuaC output file!\n",args[1]);
+    return 1;
+  }
+  if (fread(&num_columns,sizeof(int32_t),1,fp)!=1||num_columns<1){
+    fprintf(stderr,"ERROR! Bad header in %s!\n",args[1]);
+    return 1;
+  }
+
+  printf("#");
+  for (i=0;i<num_columns;i++){
+    if (fread(&length,sizeof(int32_t),1,fp)!=1||length<0){
+      fprintf(stderr,"ERROR! Bad header in %s!\n",args[1]);
+      return 1;
+    }
+    /* Names longer than the buffer are cut */
+    if (length>=(int32_t)sizeof(name)){
+      fread(name,sizeof(char),sizeof(name)-1,fp);
+      fseek(fp,length-(sizeof(name)-1),SEEK_CUR);
+      length = sizeof(name)-1;
+    } else {
+      fread(name,sizeof(char),length,fp);
+    }
+    name[length] = '\0';
+    printf("%s%s",name,(i==num_columns-1) ? "\n" : " ");
+  }
+
+  record = malloc(num_columns*sizeof(double));
+  while (fread(record,sizeof(double),num_columns,fp)==(size_t)num_columns){
+    for (i=0;i<num_columns;i++){
+      printf("%.17g%s",record[i],(i==num_columns-1) ? "\n" : " ");
+    }
+  }
+  free(record);
+  fclose(fp);
+  return 0;
+}